@@ -0,0 +1,122 @@
+//-----------------------------------------------------------------------------
+//           Name: culling.h
+//    Description: View frustum culling of bounding spheres, four at a time
+//                 with SSE.
+//
+//                 The spheres are kept as a structure of arrays, so one load
+//                 fetches the same component of four spheres and every plane
+//                 is tested against all four with a handful of instructions.
+//                 The planes are the ones matrixFrustumPlanes() extracts, a
+//                 sphere is culled when it lies completely outside one of
+//                 them, exactly like sphereInFrustum().
+//
+// The following functions are defined here:
+//
+// void sphereBatchClear(SPHEREBATCH& batch);
+// void sphereBatchAdd(SPHEREBATCH& batch, const float center[3], float radius);
+// int cullSphereBatch(const SPHEREBATCH& batch, const float planes[6][4], unsigned char* visible);
+//-----------------------------------------------------------------------------
+
+#ifndef _CULLING_H_
+#define _CULLING_H_
+
+#include <vector>
+#include <xmmintrin.h>
+
+//-----------------------------------------------------------------------------
+// SPHEREBATCH
+//-----------------------------------------------------------------------------
+
+// Padded to a multiple of 4 so the last group can be loaded whole; the
+// padding lanes are never reported.
+struct SPHEREBATCH
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	std::vector<float> radius;
+	int                count;
+};
+
+/*
+ * Empties the batch, keeping its storage.
+ */
+inline void sphereBatchClear( SPHEREBATCH& batch )
+{
+	batch.x.clear();
+	batch.y.clear();
+	batch.z.clear();
+	batch.radius.clear();
+	batch.count = 0;
+}
+
+/*
+ * Appends one sphere.
+ */
+inline void sphereBatchAdd( SPHEREBATCH& batch, const float center[3], float radius )
+{
+	if( (batch.count & 3) == 0 )
+	{
+		size_t size = batch.count + 4;
+
+		batch.x.resize( size, 0.0f );
+		batch.y.resize( size, 0.0f );
+		batch.z.resize( size, 0.0f );
+		batch.radius.resize( size, 0.0f );
+	}
+
+	batch.x[batch.count]      = center[0];
+	batch.y[batch.count]      = center[1];
+	batch.z[batch.count]      = center[2];
+	batch.radius[batch.count] = radius;
+	++batch.count;
+}
+
+/*
+ * visible[i] = sphereInFrustum( planes, sphere i ) for every sphere of the
+ * batch. Returns how many are visible.
+ */
+inline int cullSphereBatch( const SPHEREBATCH& batch, const float planes[6][4], unsigned char* visible )
+{
+	__m128 plane[6][4];
+
+	for( int p = 0; p < 6; ++p )
+	{
+		for( int j = 0; j < 4; ++j )
+			plane[p][j] = _mm_set1_ps( planes[p][j] );
+	}
+
+	int drawn = 0;
+
+	for( int i = 0; i < batch.count; i += 4 )
+	{
+		__m128 x = _mm_loadu_ps( &batch.x[i] );
+		__m128 y = _mm_loadu_ps( &batch.y[i] );
+		__m128 z = _mm_loadu_ps( &batch.z[i] );
+		__m128 r = _mm_sub_ps( _mm_setzero_ps(), _mm_loadu_ps( &batch.radius[i] ) );
+
+		// Lanes that are completely outside at least one plane
+		__m128 outside = _mm_setzero_ps();
+
+		for( int p = 0; p < 6; ++p )
+		{
+			__m128 d = _mm_add_ps( _mm_add_ps( _mm_mul_ps( plane[p][0], x ), _mm_mul_ps( plane[p][1], y ) ),
+								   _mm_add_ps( _mm_mul_ps( plane[p][2], z ), plane[p][3] ) );
+
+			outside = _mm_or_ps( outside, _mm_cmplt_ps( d, r ) );
+		}
+
+		int mask = _mm_movemask_ps( outside );
+		int lanes = batch.count - i < 4 ? batch.count - i : 4;
+
+		for( int lane = 0; lane < lanes; ++lane )
+		{
+			visible[i + lane] = (mask & (1 << lane)) == 0;
+			drawn += visible[i + lane];
+		}
+	}
+
+	return drawn;
+}
+
+#endif // _CULLING_H_
@@ -0,0 +1,184 @@
+//-----------------------------------------------------------------------------
+//           Name: debugdraw.h
+//    Description: Debug geometry batched per frame. Lines, points and a few
+//                 shapes made of lines are queued on the CPU as x y z r g b
+//                 vertices, and the caller uploads the whole batch once and
+//                 draws it with one call per viewport, instead of a
+//                 glBegin()/glEnd() block and a lighting toggle per marker.
+//
+//                 Every vertex belongs to a layer: DEBUG_LAYER_WORLD is
+//                 drawn under each viewport's view matrix, DEBUG_LAYER_EYE
+//                 with an identity modelview, fixed to the viewport.
+//
+//                 Define DEBUG_DRAW as 0 before including this and every
+//                 function is an empty inline, so the calls compile to
+//                 nothing. At run time, DEBUGDRAW::enabled off makes each
+//                 call return straight away and debugDrawEnabled() false,
+//                 which callers check before building anything costly.
+//
+// The following functions are defined here:
+//
+// bool debugDrawEnabled(const DEBUGDRAW& draw);
+// void debugDrawClear(DEBUGDRAW& draw);
+// void debugDrawLine(DEBUGDRAW& draw, int layer, const float a[3], const float b[3], const float color[3]);
+// void debugDrawLines(DEBUGDRAW& draw, int layer, const float model[16], const float* vertices, int count);
+// void debugDrawPoint(DEBUGDRAW& draw, int layer, const float p[3], const float color[3]);
+// void debugDrawCircle(DEBUGDRAW& draw, int layer, const float center[3], const float u[3], const float v[3], const float color[3], int segments);
+// void debugDrawSphere(DEBUGDRAW& draw, int layer, const float center[3], float radius, const float color[3]);
+//-----------------------------------------------------------------------------
+
+#ifndef _DEBUGDRAW_H_
+#define _DEBUGDRAW_H_
+
+#include <math.h>
+#include <vector>
+#include "matrix.h"
+
+#ifndef DEBUG_DRAW
+#define DEBUG_DRAW 1
+#endif
+
+//-----------------------------------------------------------------------------
+// DEBUGDRAW
+//-----------------------------------------------------------------------------
+
+const int DEBUG_LAYER_WORLD   = 0;
+const int DEBUG_LAYER_EYE     = 1;
+const int DEBUG_LAYER_COUNT   = 2;
+const int DEBUG_VERTEX_FLOATS = 6;		// x, y, z, r, g, b
+
+struct DEBUGDRAW
+{
+	bool               enabled;
+	std::vector<float> lines[DEBUG_LAYER_COUNT];	// GL_LINES, two vertices each
+	std::vector<float> points[DEBUG_LAYER_COUNT];	// GL_POINTS
+};
+
+#if DEBUG_DRAW
+
+inline bool debugDrawEnabled( const DEBUGDRAW& draw )
+{
+	return draw.enabled;
+}
+
+/*
+ * Drops last frame's batch. The vectors keep their storage.
+ */
+inline void debugDrawClear( DEBUGDRAW& draw )
+{
+	for( int layer = 0; layer < DEBUG_LAYER_COUNT; ++layer )
+	{
+		draw.lines[layer].clear();
+		draw.points[layer].clear();
+	}
+}
+
+inline void debugDrawVertex( std::vector<float>& vertices, const float p[3], const float color[3] )
+{
+	vertices.push_back( p[0] );
+	vertices.push_back( p[1] );
+	vertices.push_back( p[2] );
+	vertices.push_back( color[0] );
+	vertices.push_back( color[1] );
+	vertices.push_back( color[2] );
+}
+
+inline void debugDrawLine( DEBUGDRAW& draw, int layer, const float a[3], const float b[3], const float color[3] )
+{
+	if( !draw.enabled )
+		return;
+
+	debugDrawVertex( draw.lines[layer], a, color );
+	debugDrawVertex( draw.lines[layer], b, color );
+}
+
+/*
+ * count vertices of GL_LINES, each x y z r g b, moved by model first.
+ * model may be NULL.
+ */
+inline void debugDrawLines( DEBUGDRAW& draw, int layer, const float model[16], const float* vertices, int count )
+{
+	if( !draw.enabled )
+		return;
+
+	for( int i = 0; i < count; ++i )
+	{
+		const float* vertex = vertices + i * DEBUG_VERTEX_FLOATS;
+
+		if( model != NULL )
+		{
+			float p[4];
+			matrixTransformPoint( p, model, vertex );
+			debugDrawVertex( draw.lines[layer], p, vertex + 3 );
+		}
+		else
+		{
+			debugDrawVertex( draw.lines[layer], vertex, vertex + 3 );
+		}
+	}
+}
+
+inline void debugDrawPoint( DEBUGDRAW& draw, int layer, const float p[3], const float color[3] )
+{
+	if( !draw.enabled )
+		return;
+
+	debugDrawVertex( draw.points[layer], p, color );
+}
+
+/*
+ * center + cos(a) * u + sin(a) * v as segments lines.
+ */
+inline void debugDrawCircle( DEBUGDRAW& draw, int layer, const float center[3], const float u[3], const float v[3],
+							 const float color[3], int segments )
+{
+	if( !draw.enabled )
+		return;
+
+	float previous[3] = { center[0] + u[0], center[1] + u[1], center[2] + u[2] };
+
+	for( int i = 1; i <= segments; ++i )
+	{
+		float a = 6.2831853f * i / segments;
+		float c = (float)cos( a );
+		float s = (float)sin( a );
+		float p[3] = { center[0] + c * u[0] + s * v[0], center[1] + c * u[1] + s * v[1], center[2] + c * u[2] + s * v[2] };
+
+		debugDrawLine( draw, layer, previous, p, color );
+
+		previous[0] = p[0];
+		previous[1] = p[1];
+		previous[2] = p[2];
+	}
+}
+
+/*
+ * Three great circles, one around each axis.
+ */
+inline void debugDrawSphere( DEBUGDRAW& draw, int layer, const float center[3], float radius, const float color[3] )
+{
+	if( !draw.enabled )
+		return;
+
+	const float x[3] = { radius, 0.0f, 0.0f };
+	const float y[3] = { 0.0f, radius, 0.0f };
+	const float z[3] = { 0.0f, 0.0f, radius };
+
+	debugDrawCircle( draw, layer, center, x, y, color, 16 );
+	debugDrawCircle( draw, layer, center, y, z, color, 16 );
+	debugDrawCircle( draw, layer, center, z, x, color, 16 );
+}
+
+#else // DEBUG_DRAW
+
+inline bool debugDrawEnabled( const DEBUGDRAW& ) { return false; }
+inline void debugDrawClear( DEBUGDRAW& ) {}
+inline void debugDrawLine( DEBUGDRAW&, int, const float*, const float*, const float* ) {}
+inline void debugDrawLines( DEBUGDRAW&, int, const float*, const float*, int ) {}
+inline void debugDrawPoint( DEBUGDRAW&, int, const float*, const float* ) {}
+inline void debugDrawCircle( DEBUGDRAW&, int, const float*, const float*, const float*, const float*, int ) {}
+inline void debugDrawSphere( DEBUGDRAW&, int, const float*, float, const float* ) {}
+
+#endif // DEBUG_DRAW
+
+#endif // _DEBUGDRAW_H_
@@ -0,0 +1,195 @@
+//-----------------------------------------------------------------------------
+//           Name: glstate.h
+//    Description: A CPU copy of the fixed-function state the sample toggles
+//                 most, so that calls which wouldn't change anything never
+//                 reach the driver.
+//
+//                 Every entry starts out unknown, and the first call that
+//                 sets it always goes through. After that, a call is only
+//                 issued when it changes the value. glPopAttrib() and a
+//                 switch to another rendering context (the p-buffer) change
+//                 state behind the cache's back, so statePopAttrib() and
+//                 the context check forget everything again.
+//
+//                 Caps outside the tracked set are passed straight through.
+//                 Code that changes a tracked cap with a plain glEnable() or
+//                 glDisable() has to call stateInvalidate() afterwards.
+//
+// The following functions are defined here:
+//
+// void stateInvalidate(GLSTATECACHE& cache);
+// void stateEnable(GLSTATECACHE& cache, GLenum cap);
+// void stateDisable(GLSTATECACHE& cache, GLenum cap);
+// void stateFogMode(GLSTATECACHE& cache, GLint mode);
+// void stateTexGenMode(GLSTATECACHE& cache, GLenum coord, GLint mode);
+// void statePopAttrib(GLSTATECACHE& cache);
+// void stateResetCounters(GLSTATECACHE& cache);
+//-----------------------------------------------------------------------------
+
+#ifndef _GLSTATE_H_
+#define _GLSTATE_H_
+
+#include <windows.h>
+#include <GL/gl.h>
+
+//-----------------------------------------------------------------------------
+// GLSTATECACHE
+//-----------------------------------------------------------------------------
+
+const int STATE_CAP_COUNT = 14;
+const int STATE_UNKNOWN   = -1;
+
+struct GLSTATECACHE
+{
+	HGLRC       context;					// The context the values belong to
+	bool        valid;
+	signed char enabled[STATE_CAP_COUNT];	// 0, 1 or STATE_UNKNOWN
+	GLint       fogMode;
+	GLint       texGenMode[4];				// S, T, R, Q
+	int         issued;						// Calls that reached GL since stateResetCounters()
+	int         filtered;					// Calls dropped as no-ops
+};
+
+/*
+ * Slot of a tracked cap, -1 for the rest.
+ */
+inline int stateCapIndex( GLenum cap )
+{
+	switch( cap )
+	{
+		case GL_LIGHTING:            return 0;
+		case GL_LIGHT0:              return 1;
+		case GL_TEXTURE_2D:          return 2;
+		case GL_TEXTURE_GEN_S:       return 3;
+		case GL_TEXTURE_GEN_T:       return 4;
+		case GL_TEXTURE_GEN_R:       return 5;
+		case GL_TEXTURE_GEN_Q:       return 6;
+		case GL_FOG:                 return 7;
+		case GL_BLEND:               return 8;
+		case GL_LINE_SMOOTH:         return 9;
+		case GL_DEPTH_TEST:          return 10;
+		case GL_POLYGON_OFFSET_FILL: return 11;
+		case GL_SCISSOR_TEST:        return 12;
+		case GL_CULL_FACE:           return 13;
+		default:                     return -1;
+	}
+}
+
+/*
+ * Marks every entry unknown.
+ */
+inline void stateInvalidate( GLSTATECACHE& cache )
+{
+	for( int i = 0; i < STATE_CAP_COUNT; ++i )
+		cache.enabled[i] = STATE_UNKNOWN;
+
+	cache.fogMode = STATE_UNKNOWN;
+
+	for( int i = 0; i < 4; ++i )
+		cache.texGenMode[i] = STATE_UNKNOWN;
+
+	cache.context = wglGetCurrentContext();
+	cache.valid   = true;
+}
+
+/*
+ * The values only describe the context they were recorded in.
+ */
+inline void stateCheckContext( GLSTATECACHE& cache )
+{
+	if( !cache.valid || cache.context != wglGetCurrentContext() )
+		stateInvalidate( cache );
+}
+
+/*
+ * glEnable()/glDisable(cap) unless cap already is in that state.
+ */
+inline void stateSet( GLSTATECACHE& cache, GLenum cap, bool enable )
+{
+	stateCheckContext( cache );
+
+	int slot = stateCapIndex( cap );
+
+	if( slot >= 0 )
+	{
+		if( cache.enabled[slot] == (enable ? 1 : 0) )
+		{
+			++cache.filtered;
+			return;
+		}
+
+		cache.enabled[slot] = enable ? 1 : 0;
+	}
+
+	if( enable )
+		glEnable( cap );
+	else
+		glDisable( cap );
+
+	++cache.issued;
+}
+
+inline void stateEnable( GLSTATECACHE& cache, GLenum cap )
+{
+	stateSet( cache, cap, true );
+}
+
+inline void stateDisable( GLSTATECACHE& cache, GLenum cap )
+{
+	stateSet( cache, cap, false );
+}
+
+/*
+ * glFogi( GL_FOG_MODE, mode ).
+ */
+inline void stateFogMode( GLSTATECACHE& cache, GLint mode )
+{
+	stateCheckContext( cache );
+
+	if( cache.fogMode == mode )
+	{
+		++cache.filtered;
+		return;
+	}
+
+	cache.fogMode = mode;
+	glFogi( GL_FOG_MODE, mode );
+	++cache.issued;
+}
+
+/*
+ * glTexGeni( coord, GL_TEXTURE_GEN_MODE, mode ) for coord GL_S .. GL_Q.
+ */
+inline void stateTexGenMode( GLSTATECACHE& cache, GLenum coord, GLint mode )
+{
+	stateCheckContext( cache );
+
+	int slot = coord - GL_S;
+
+	if( cache.texGenMode[slot] == mode )
+	{
+		++cache.filtered;
+		return;
+	}
+
+	cache.texGenMode[slot] = mode;
+	glTexGeni( coord, GL_TEXTURE_GEN_MODE, mode );
+	++cache.issued;
+}
+
+/*
+ * glPopAttrib(). Whatever it restores is unknown afterwards.
+ */
+inline void statePopAttrib( GLSTATECACHE& cache )
+{
+	glPopAttrib();
+	stateInvalidate( cache );
+}
+
+inline void stateResetCounters( GLSTATECACHE& cache )
+{
+	cache.issued   = 0;
+	cache.filtered = 0;
+}
+
+#endif // _GLSTATE_H_
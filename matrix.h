@@ -0,0 +1,291 @@
+//-----------------------------------------------------------------------------
+//           Name: matrix.h
+//    Description: Small 4x4 matrix helpers for the places where the sample
+//                 needs a matrix on the CPU instead of on a GL stack.
+//
+//                 Matrices are float[16] in OpenGL's column-major order, so
+//                 they can be handed to glLoadMatrixf()/glMultMatrixf() or
+//                 uploaded as uniforms without transposing. The functions
+//                 mirror the GL/GLU calls of the same name, so a frame's
+//                 matrices can be built here and loaded, instead of built
+//                 on a GL stack and read back with glGetFloatv().
+//
+//                 A column is one __m128, so products and point transforms
+//                 are four multiply-adds of broadcast scalars by columns.
+//
+// void matrixIdentity(float m[16]);
+// void matrixMultiply(float out[16], const float a[16], const float b[16]);
+// void matrixPerspective(float m[16], float fovy, float aspect, float zNear, float zFar);
+// void matrixOrtho(float m[16], float left, float right, float bottom, float top, float zNear, float zFar);
+// void matrixLookAt(float m[16], const float eye[3], const float center[3], const float up[3]);
+// void matrixTranslate(float m[16], float x, float y, float z);
+// void matrixScale(float m[16], float x, float y, float z);
+// void matrixTransformPoint(float out[4], const float m[16], const float p[3]);
+// void matrixShadowBias(float m[16]);
+// bool matrixInverse(float out[16], const float m[16]);
+// void matrixRotate(float m[16], float angle, float x, float y, float z);
+// void matrixFrustumPlanes(float planes[6][4], const float m[16]);
+// bool sphereInFrustum(const float planes[6][4], const float center[3], float radius);
+//-----------------------------------------------------------------------------
+
+#ifndef _MATRIX_H_
+#define _MATRIX_H_
+
+#include <math.h>
+#include <string.h>
+#include <xmmintrin.h>
+
+/*
+ * m = I
+ */
+inline void matrixIdentity( float m[16] )
+{
+	memset( m, 0, 16 * sizeof(float) );
+	m[0] = m[5] = m[10] = m[15] = 1.0f;
+}
+
+/*
+ * out = a * b. out may alias a or b.
+ */
+inline void matrixMultiply( float out[16], const float a[16], const float b[16] )
+{
+	__m128 a0 = _mm_loadu_ps( a + 0 );
+	__m128 a1 = _mm_loadu_ps( a + 4 );
+	__m128 a2 = _mm_loadu_ps( a + 8 );
+	__m128 a3 = _mm_loadu_ps( a + 12 );
+	__m128 r[4];
+
+	// Column col of the product is a times column col of b.
+	for( int col = 0; col < 4; ++col )
+	{
+		r[col] = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a0, _mm_set1_ps( b[col * 4 + 0] ) ),
+										 _mm_mul_ps( a1, _mm_set1_ps( b[col * 4 + 1] ) ) ),
+							 _mm_add_ps( _mm_mul_ps( a2, _mm_set1_ps( b[col * 4 + 2] ) ),
+										 _mm_mul_ps( a3, _mm_set1_ps( b[col * 4 + 3] ) ) ) );
+	}
+
+	for( int col = 0; col < 4; ++col )
+		_mm_storeu_ps( out + col * 4, r[col] );
+}
+
+/*
+ * Same matrix as gluPerspective(), fovy in degrees.
+ */
+inline void matrixPerspective( float m[16], float fovy, float aspect, float zNear, float zFar )
+{
+	float f = 1.0f / (float)tan( fovy * 3.14159265358979 / 360.0 );
+
+	memset( m, 0, 16 * sizeof(float) );
+	m[0]  = f / aspect;
+	m[5]  = f;
+	m[10] = (zFar + zNear) / (zNear - zFar);
+	m[11] = -1.0f;
+	m[14] = 2.0f * zFar * zNear / (zNear - zFar);
+}
+
+/*
+ * Same matrix as glOrtho() applied to the identity.
+ */
+inline void matrixOrtho( float m[16], float left, float right, float bottom, float top, float zNear, float zFar )
+{
+	memset( m, 0, 16 * sizeof(float) );
+	m[0]  = 2.0f / (right - left);
+	m[5]  = 2.0f / (top - bottom);
+	m[10] = -2.0f / (zFar - zNear);
+	m[12] = -(right + left) / (right - left);
+	m[13] = -(top + bottom) / (top - bottom);
+	m[14] = -(zFar + zNear) / (zFar - zNear);
+	m[15] = 1.0f;
+}
+
+/*
+ * Same matrix as gluLookAt().
+ */
+inline void matrixLookAt( float m[16], const float eye[3], const float center[3], const float up[3] )
+{
+	float f[3] = { center[0] - eye[0], center[1] - eye[1], center[2] - eye[2] };
+	float len  = (float)sqrt( f[0] * f[0] + f[1] * f[1] + f[2] * f[2] );
+	f[0] /= len; f[1] /= len; f[2] /= len;
+
+	// s = f x up
+	float s[3] = { f[1] * up[2] - f[2] * up[1],
+				   f[2] * up[0] - f[0] * up[2],
+				   f[0] * up[1] - f[1] * up[0] };
+	len = (float)sqrt( s[0] * s[0] + s[1] * s[1] + s[2] * s[2] );
+	s[0] /= len; s[1] /= len; s[2] /= len;
+
+	// u = s x f
+	float u[3] = { s[1] * f[2] - s[2] * f[1],
+				   s[2] * f[0] - s[0] * f[2],
+				   s[0] * f[1] - s[1] * f[0] };
+
+	m[0] = s[0]; m[4] = s[1]; m[8]  = s[2];
+	m[1] = u[0]; m[5] = u[1]; m[9]  = u[2];
+	m[2] =-f[0]; m[6] =-f[1]; m[10] =-f[2];
+	m[3] = 0.0f; m[7] = 0.0f; m[11] = 0.0f;
+
+	m[12] = -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]);
+	m[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+	m[14] =  (f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2]);
+	m[15] = 1.0f;
+}
+
+/*
+ * Same matrix as glTranslatef() applied to the identity.
+ */
+inline void matrixTranslate( float m[16], float x, float y, float z )
+{
+	matrixIdentity( m );
+	m[12] = x;
+	m[13] = y;
+	m[14] = z;
+}
+
+/*
+ * Same matrix as glScalef() applied to the identity.
+ */
+inline void matrixScale( float m[16], float x, float y, float z )
+{
+	matrixIdentity( m );
+	m[0]  = x;
+	m[5]  = y;
+	m[10] = z;
+}
+
+/*
+ * out = m * (p, 1)
+ */
+inline void matrixTransformPoint( float out[4], const float m[16], const float p[3] )
+{
+	__m128 r = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( m + 0 ), _mm_set1_ps( p[0] ) ),
+									   _mm_mul_ps( _mm_loadu_ps( m + 4 ), _mm_set1_ps( p[1] ) ) ),
+						   _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( m + 8 ), _mm_set1_ps( p[2] ) ),
+									   _mm_loadu_ps( m + 12 ) ) );
+
+	_mm_storeu_ps( out, r );
+}
+
+/*
+ * Clip space [-1, 1] -> texture space [0, 1]: glTranslatef(0.5, 0.5, 0.5)
+ * then glScalef(0.5, 0.5, 0.5), as one matrix.
+ */
+inline void matrixShadowBias( float m[16] )
+{
+	matrixIdentity( m );
+	m[0]  = m[5]  = m[10] = 0.5f;
+	m[12] = m[13] = m[14] = 0.5f;
+}
+
+/*
+ * out = m^-1 by cofactors, in double so it can undo a projection. Returns
+ * false and leaves out alone if m is singular. out may alias m.
+ */
+inline bool matrixInverse( float out[16], const float m[16] )
+{
+	double a[16];
+	double inv[16];
+
+	for( int i = 0; i < 16; ++i )
+		a[i] = m[i];
+
+	inv[0]  =  a[5] * a[10] * a[15] - a[5] * a[11] * a[14] - a[9] * a[6] * a[15] +
+			   a[9] * a[7] * a[14] + a[13] * a[6] * a[11] - a[13] * a[7] * a[10];
+	inv[4]  = -a[4] * a[10] * a[15] + a[4] * a[11] * a[14] + a[8] * a[6] * a[15] -
+			   a[8] * a[7] * a[14] - a[12] * a[6] * a[11] + a[12] * a[7] * a[10];
+	inv[8]  =  a[4] * a[9] * a[15] - a[4] * a[11] * a[13] - a[8] * a[5] * a[15] +
+			   a[8] * a[7] * a[13] + a[12] * a[5] * a[11] - a[12] * a[7] * a[9];
+	inv[12] = -a[4] * a[9] * a[14] + a[4] * a[10] * a[13] + a[8] * a[5] * a[14] -
+			   a[8] * a[6] * a[13] - a[12] * a[5] * a[10] + a[12] * a[6] * a[9];
+	inv[1]  = -a[1] * a[10] * a[15] + a[1] * a[11] * a[14] + a[9] * a[2] * a[15] -
+			   a[9] * a[3] * a[14] - a[13] * a[2] * a[11] + a[13] * a[3] * a[10];
+	inv[5]  =  a[0] * a[10] * a[15] - a[0] * a[11] * a[14] - a[8] * a[2] * a[15] +
+			   a[8] * a[3] * a[14] + a[12] * a[2] * a[11] - a[12] * a[3] * a[10];
+	inv[9]  = -a[0] * a[9] * a[15] + a[0] * a[11] * a[13] + a[8] * a[1] * a[15] -
+			   a[8] * a[3] * a[13] - a[12] * a[1] * a[11] + a[12] * a[3] * a[9];
+	inv[13] =  a[0] * a[9] * a[14] - a[0] * a[10] * a[13] - a[8] * a[1] * a[14] +
+			   a[8] * a[2] * a[13] + a[12] * a[1] * a[10] - a[12] * a[2] * a[9];
+	inv[2]  =  a[1] * a[6] * a[15] - a[1] * a[7] * a[14] - a[5] * a[2] * a[15] +
+			   a[5] * a[3] * a[14] + a[13] * a[2] * a[7] - a[13] * a[3] * a[6];
+	inv[6]  = -a[0] * a[6] * a[15] + a[0] * a[7] * a[14] + a[4] * a[2] * a[15] -
+			   a[4] * a[3] * a[14] - a[12] * a[2] * a[7] + a[12] * a[3] * a[6];
+	inv[10] =  a[0] * a[5] * a[15] - a[0] * a[7] * a[13] - a[4] * a[1] * a[15] +
+			   a[4] * a[3] * a[13] + a[12] * a[1] * a[7] - a[12] * a[3] * a[5];
+	inv[14] = -a[0] * a[5] * a[14] + a[0] * a[6] * a[13] + a[4] * a[1] * a[14] -
+			   a[4] * a[2] * a[13] - a[12] * a[1] * a[6] + a[12] * a[2] * a[5];
+	inv[3]  = -a[1] * a[6] * a[11] + a[1] * a[7] * a[10] + a[5] * a[2] * a[11] -
+			   a[5] * a[3] * a[10] - a[9] * a[2] * a[7] + a[9] * a[3] * a[6];
+	inv[7]  =  a[0] * a[6] * a[11] - a[0] * a[7] * a[10] - a[4] * a[2] * a[11] +
+			   a[4] * a[3] * a[10] + a[8] * a[2] * a[7] - a[8] * a[3] * a[6];
+	inv[11] = -a[0] * a[5] * a[11] + a[0] * a[7] * a[9] + a[4] * a[1] * a[11] -
+			   a[4] * a[3] * a[9] - a[8] * a[1] * a[7] + a[8] * a[3] * a[5];
+	inv[15] =  a[0] * a[5] * a[10] - a[0] * a[6] * a[9] - a[4] * a[1] * a[10] +
+			   a[4] * a[2] * a[9] + a[8] * a[1] * a[6] - a[8] * a[2] * a[5];
+
+	double det = a[0] * inv[0] + a[1] * inv[4] + a[2] * inv[8] + a[3] * inv[12];
+
+	if( det == 0.0 )
+		return false;
+
+	for( int i = 0; i < 16; ++i )
+		out[i] = (float)(inv[i] / det);
+
+	return true;
+}
+
+/*
+ * Same matrix as glRotatef() applied to the identity, angle in degrees.
+ */
+inline void matrixRotate( float m[16], float angle, float x, float y, float z )
+{
+	float len = (float)sqrt( x * x + y * y + z * z );
+	x /= len; y /= len; z /= len;
+
+	float c = (float)cos( angle * 3.14159265358979 / 180.0 );
+	float s = (float)sin( angle * 3.14159265358979 / 180.0 );
+	float t = 1.0f - c;
+
+	matrixIdentity( m );
+	m[0] = x * x * t + c;     m[4] = x * y * t - z * s; m[8]  = x * z * t + y * s;
+	m[1] = y * x * t + z * s; m[5] = y * y * t + c;     m[9]  = y * z * t - x * s;
+	m[2] = z * x * t - y * s; m[6] = z * y * t + x * s; m[10] = z * z * t + c;
+}
+
+/*
+ * Extracts the six clip planes (left, right, bottom, top, near, far) of the
+ * projection * view matrix m. Planes are normalised and point inwards, so
+ * dot(plane.xyz, p) + plane.w is the signed distance of p.
+ */
+inline void matrixFrustumPlanes( float planes[6][4], const float m[16] )
+{
+	for( int i = 0; i < 6; ++i )
+	{
+		int   row  = i / 2;
+		float sign = (i & 1) ? -1.0f : 1.0f;
+
+		for( int j = 0; j < 4; ++j )
+			planes[i][j] = m[j * 4 + 3] + sign * m[j * 4 + row];
+
+		float len = (float)sqrt( planes[i][0] * planes[i][0] +
+								 planes[i][1] * planes[i][1] +
+								 planes[i][2] * planes[i][2] );
+		for( int j = 0; j < 4; ++j )
+			planes[i][j] /= len;
+	}
+}
+
+/*
+ * False if the sphere lies completely outside one of the planes.
+ */
+inline bool sphereInFrustum( const float planes[6][4], const float center[3], float radius )
+{
+	for( int i = 0; i < 6; ++i )
+	{
+		if( planes[i][0] * center[0] + planes[i][1] * center[1] +
+			planes[i][2] * center[2] + planes[i][3] < -radius )
+			return false;
+	}
+
+	return true;
+}
+
+#endif // _MATRIX_H_
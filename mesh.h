@@ -0,0 +1,397 @@
+//-----------------------------------------------------------------------------
+//           Name: mesh.h
+//    Description: CPU-side triangle meshes of the geometry.h primitives.
+//
+//                 geometry.h draws everything in immediate mode with quads,
+//                 quad strips, fans and evaluators. Passes that need plain
+//                 triangles (geometry shaders, CPU rasterizers, ray tracers)
+//                 or want to avoid re-running the evaluators every frame use
+//                 these cached meshes instead. They are tessellated once to
+//                 match what renderSolidTeapot(), renderSolidSphere() and
+//                 renderSolidTorus() produce, including the teapot's built-in
+//                 orientation and scale.
+//
+// The following functions are defined here:
+//
+// void buildTeapotMesh(MESH& mesh, GLdouble size, GLint grid);
+// void buildSphereMesh(MESH& mesh, GLdouble radius, GLint slices, GLint stacks);
+// void buildTorusMesh(MESH& mesh, GLdouble innerRadius, GLdouble outerRadius, GLint sides, GLint rings);
+// void buildQuadMesh(MESH& mesh, const float corners[4][3], const float normal[3]);
+// void drawMesh(const MESH& mesh);
+// void drawMeshPositions(const MESH& mesh);
+//-----------------------------------------------------------------------------
+
+#ifndef _MESH_H_
+#define _MESH_H_
+
+#include <vector>
+#include "geometry.h"
+
+struct MESH
+{
+	std::vector<float>        positions; // x, y, z per vertex
+	std::vector<float>        normals;   // x, y, z per vertex
+	std::vector<unsigned int> indices;   // Triangle list
+	float                     radius;    // Bounding sphere around the object's origin
+};
+
+/*
+ * Bounding sphere about the origin, which is also the point the scenes
+ * rotate objects around, so it stays valid under any rotation.
+ */
+static void computeMeshRadius( MESH& mesh )
+{
+	float r2 = 0.0f;
+
+	for( size_t i = 0; i < mesh.positions.size(); i += 3 )
+	{
+		const float* p = &mesh.positions[i];
+		float d2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+
+		if( d2 > r2 )
+			r2 = d2;
+	}
+
+	mesh.radius = (float)sqrt( r2 );
+}
+
+/*
+ * Cubic Bernstein basis and its derivative
+ */
+static void bernstein( double t, double b[4], double d[4] )
+{
+	double s = 1.0 - t;
+
+	b[0] = s * s * s;
+	b[1] = 3.0 * t * s * s;
+	b[2] = 3.0 * t * t * s;
+	b[3] = t * t * t;
+
+	d[0] = -3.0 * s * s;
+	d[1] = 3.0 * s * s - 6.0 * t * s;
+	d[2] = 6.0 * t * s - 3.0 * t * t;
+	d[3] = 3.0 * t * t;
+}
+
+/*
+ * Evaluates a bicubic patch laid out like glMap2d() sees it in teapot():
+ * ctrl[v][u][xyz]. The normal is dP/du x dP/dv, like GL_AUTO_NORMAL.
+ */
+static void evalPatch( double ctrl[4][4][3], double u, double v, double pos[3], double nrm[3] )
+{
+	double bu[4], du[4], bv[4], dv[4];
+	double pu[3] = { 0.0, 0.0, 0.0 };
+	double pv[3] = { 0.0, 0.0, 0.0 };
+
+	bernstein( u, bu, du );
+	bernstein( v, bv, dv );
+
+	pos[0] = pos[1] = pos[2] = 0.0;
+
+	for( int j = 0; j < 4; ++j )
+	{
+		for( int k = 0; k < 4; ++k )
+		{
+			for( int l = 0; l < 3; ++l )
+			{
+				pos[l] += bu[k] * bv[j] * ctrl[j][k][l];
+				pu[l]  += du[k] * bv[j] * ctrl[j][k][l];
+				pv[l]  += bu[k] * dv[j] * ctrl[j][k][l];
+			}
+		}
+	}
+
+	nrm[0] = pu[1] * pv[2] - pu[2] * pv[1];
+	nrm[1] = pu[2] * pv[0] - pu[0] * pv[2];
+	nrm[2] = pu[0] * pv[1] - pu[1] * pv[0];
+}
+
+/*
+ * Appends one evaluated patch as a (grid + 1)^2 vertex grid, transformed the
+ * same way teapot() sets up the modelview: rotate 270 around X, scale, then
+ * translate by (0, 0, -1.5) in patch space.
+ */
+static void appendPatch( MESH& mesh, double ctrl[4][4][3], GLint grid, double scale )
+{
+	unsigned int base = (unsigned int)(mesh.positions.size() / 3);
+
+	for( int i = 0; i <= grid; ++i )
+	{
+		for( int j = 0; j <= grid; ++j )
+		{
+			double u = (double)i / grid;
+			double v = (double)j / grid;
+			double pos[3], nrm[3];
+
+			evalPatch( ctrl, u, v, pos, nrm );
+
+			// The teapot's lid tip and bottom centre are degenerate, take the
+			// normal from just inside the patch there.
+			double len = sqrt( nrm[0] * nrm[0] + nrm[1] * nrm[1] + nrm[2] * nrm[2] );
+
+			if( len < 1e-6 )
+			{
+				double tmp[3];
+				evalPatch( ctrl, u < 0.5 ? u + 1e-3 : u - 1e-3, v < 0.5 ? v + 1e-3 : v - 1e-3, tmp, nrm );
+				len = sqrt( nrm[0] * nrm[0] + nrm[1] * nrm[1] + nrm[2] * nrm[2] );
+			}
+
+			if( len > 0.0 )
+			{
+				nrm[0] /= len;
+				nrm[1] /= len;
+				nrm[2] /= len;
+			}
+
+			// Rotating 270 degrees around X maps (x, y, z) to (x, z, -y).
+			double x = (pos[0]) * scale;
+			double y = (pos[1]) * scale;
+			double z = (pos[2] - 1.5) * scale;
+
+			mesh.positions.push_back( (float)x );
+			mesh.positions.push_back( (float)z );
+			mesh.positions.push_back( (float)-y );
+
+			mesh.normals.push_back( (float)nrm[0] );
+			mesh.normals.push_back( (float)nrm[2] );
+			mesh.normals.push_back( (float)-nrm[1] );
+		}
+	}
+
+	// glEvalMesh2() emits a quad strip per u column, keep its winding.
+	for( int i = 0; i < grid; ++i )
+	{
+		for( int j = 0; j < grid; ++j )
+		{
+			unsigned int a = base + i * (grid + 1) + j;       // (i,   j)
+			unsigned int b = base + (i + 1) * (grid + 1) + j; // (i+1, j)
+			unsigned int c = b + 1;                           // (i+1, j+1)
+			unsigned int d = a + 1;                           // (i,   j+1)
+
+			mesh.indices.push_back( a );
+			mesh.indices.push_back( b );
+			mesh.indices.push_back( c );
+
+			mesh.indices.push_back( a );
+			mesh.indices.push_back( c );
+			mesh.indices.push_back( d );
+		}
+	}
+}
+
+/*
+ * Triangle version of renderSolidTeapot(), which uses grid = 7.
+ */
+void buildTeapotMesh( MESH& mesh, GLdouble size, GLint grid )
+{
+	double p[4][4][3], q[4][4][3], r[4][4][3], s[4][4][3];
+	double scale = 0.5 * size;
+
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	// Same control point mirroring as teapot()
+	for( int i = 0; i < 10; i++ )
+	{
+		for( int j = 0; j < 4; j++ )
+		{
+			for( int k = 0; k < 4; k++ )
+			{
+				for( int l = 0; l < 3; l++ )
+				{
+					p[j][k][l] = cpdata[patchdata[i][j * 4 + k]][l];
+					q[j][k][l] = cpdata[patchdata[i][j * 4 + (3 - k)]][l];
+
+					if( l == 1 )
+						q[j][k][l] *= -1.0;
+
+					if( i < 6 )
+					{
+						r[j][k][l] = cpdata[patchdata[i][j * 4 + (3 - k)]][l];
+
+						if( l == 0 )
+							r[j][k][l] *= -1.0;
+
+						s[j][k][l] = cpdata[patchdata[i][j * 4 + k]][l];
+
+						if( l == 0 || l == 1 )
+							s[j][k][l] *= -1.0;
+					}
+				}
+			}
+		}
+
+		appendPatch( mesh, p, grid, scale );
+		appendPatch( mesh, q, grid, scale );
+
+		if( i < 6 )
+		{
+			appendPatch( mesh, r, grid, scale );
+			appendPatch( mesh, s, grid, scale );
+		}
+	}
+
+	computeMeshRadius( mesh );
+}
+
+/*
+ * Triangle version of renderSolidSphere(): poles on the Z axis.
+ */
+void buildSphereMesh( MESH& mesh, GLdouble radius, GLint slices, GLint stacks )
+{
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	for( int i = 0; i <= stacks; ++i )
+	{
+		double theta = M_PI * i / stacks;
+
+		for( int j = 0; j <= slices; ++j )
+		{
+			double phi = 2.0 * M_PI * j / slices;
+			double n[3] = { sin( theta ) * cos( phi ), sin( theta ) * sin( phi ), cos( theta ) };
+
+			for( int l = 0; l < 3; ++l )
+			{
+				mesh.positions.push_back( (float)(n[l] * radius) );
+				mesh.normals.push_back( (float)n[l] );
+			}
+		}
+	}
+
+	for( int i = 0; i < stacks; ++i )
+	{
+		for( int j = 0; j < slices; ++j )
+		{
+			unsigned int a = i * (slices + 1) + j;       // (i,   j)
+			unsigned int b = (i + 1) * (slices + 1) + j; // (i+1, j)
+			unsigned int c = b + 1;                      // (i+1, j+1)
+			unsigned int d = a + 1;                      // (i,   j+1)
+
+			// The rings at the poles collapse to a point, skip the empty half.
+			if( i != 0 )
+			{
+				mesh.indices.push_back( a );
+				mesh.indices.push_back( c );
+				mesh.indices.push_back( d );
+			}
+
+			if( i != stacks - 1 )
+			{
+				mesh.indices.push_back( a );
+				mesh.indices.push_back( b );
+				mesh.indices.push_back( c );
+			}
+		}
+	}
+
+	mesh.radius = (float)radius;
+}
+
+/*
+ * Triangle version of renderSolidTorus(): the ring lies in the XY plane,
+ * around the Z axis.
+ */
+void buildTorusMesh( MESH& mesh, GLdouble innerRadius, GLdouble outerRadius, GLint sides, GLint rings )
+{
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	// One more point than surface in both directions, like renderSolidTorus().
+	for( int j = 0; j <= rings; ++j )
+	{
+		double psi = 2.0 * M_PI * j / rings;
+
+		for( int i = 0; i <= sides; ++i )
+		{
+			double phi = -2.0 * M_PI * i / sides;
+			double n[3] = { cos( psi ) * cos( phi ), sin( psi ) * cos( phi ), sin( phi ) };
+
+			mesh.positions.push_back( (float)(cos( psi ) * (outerRadius + cos( phi ) * innerRadius)) );
+			mesh.positions.push_back( (float)(sin( psi ) * (outerRadius + cos( phi ) * innerRadius)) );
+			mesh.positions.push_back( (float)(sin( phi ) * innerRadius) );
+
+			for( int l = 0; l < 3; ++l )
+				mesh.normals.push_back( (float)n[l] );
+		}
+	}
+
+	for( int j = 0; j < rings; ++j )
+	{
+		for( int i = 0; i < sides; ++i )
+		{
+			unsigned int a = j * (sides + 1) + i;       // The quad's corners in
+			unsigned int b = a + 1;                     // renderSolidTorus() order
+			unsigned int c = b + (sides + 1);
+			unsigned int d = a + (sides + 1);
+
+			mesh.indices.push_back( a );
+			mesh.indices.push_back( b );
+			mesh.indices.push_back( c );
+
+			mesh.indices.push_back( a );
+			mesh.indices.push_back( c );
+			mesh.indices.push_back( d );
+		}
+	}
+
+	mesh.radius = (float)(innerRadius + outerRadius);
+}
+
+/*
+ * A single quad as two triangles, corners in GL_QUADS order.
+ */
+void buildQuadMesh( MESH& mesh, const float corners[4][3], const float normal[3] )
+{
+	static const unsigned int quad[6] = { 0, 1, 2, 0, 2, 3 };
+
+	mesh.positions.assign( &corners[0][0], &corners[0][0] + 12 );
+	mesh.normals.clear();
+	mesh.indices.assign( quad, quad + 6 );
+
+	for( int i = 0; i < 4; ++i )
+		mesh.normals.insert( mesh.normals.end(), normal, normal + 3 );
+
+	computeMeshRadius( mesh );
+}
+
+/*
+ * Draws the mesh with plain GL 1.1 vertex arrays as GL_TRIANGLES.
+ */
+void drawMesh( const MESH& mesh )
+{
+	if( mesh.indices.empty() )
+		return;
+
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_NORMAL_ARRAY );
+
+	glVertexPointer( 3, GL_FLOAT, 0, &mesh.positions[0] );
+	glNormalPointer( GL_FLOAT, 0, &mesh.normals[0] );
+	glDrawElements( GL_TRIANGLES, (GLsizei)mesh.indices.size(), GL_UNSIGNED_INT, &mesh.indices[0] );
+
+	glDisableClientState( GL_NORMAL_ARRAY );
+	glDisableClientState( GL_VERTEX_ARRAY );
+}
+
+/*
+ * Only the positions, for depth-only passes. They go through the same
+ * vertex array as in drawMesh(), so both give the same depths.
+ */
+void drawMeshPositions( const MESH& mesh )
+{
+	if( mesh.indices.empty() )
+		return;
+
+	glEnableClientState( GL_VERTEX_ARRAY );
+
+	glVertexPointer( 3, GL_FLOAT, 0, &mesh.positions[0] );
+	glDrawElements( GL_TRIANGLES, (GLsizei)mesh.indices.size(), GL_UNSIGNED_INT, &mesh.indices[0] );
+
+	glDisableClientState( GL_VERTEX_ARRAY );
+}
+
+#endif // _MESH_H_
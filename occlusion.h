@@ -0,0 +1,404 @@
+//-----------------------------------------------------------------------------
+//           Name: occlusion.h
+//    Description: Occlusion culling against a small software depth buffer.
+//
+//                 A few large occluders are rasterized into a low-resolution
+//                 depth buffer, four pixels at a time with SSE, each pixel
+//                 with the farthest depth its triangle has inside it.
+//                 hizBuild() then erodes the occluders by a pixel, every
+//                 pixel taking the farthest depth around it, so a pixel an
+//                 occluder's silhouette only partly covers doesn't claim to
+//                 hide what shows through the rest of it, while the seams
+//                 between the triangles of one mesh stay closed. Triangles
+//                 that reach behind the near plane are left out.
+//
+//                 The eroded buffer is reduced to a pyramid that keeps the
+//                 nearest and the farthest depth of every texel. A bounding
+//                 sphere is tested at the level where its screen rectangle
+//                 spans at most 2 x 2 texels: a texel whose farthest depth is
+//                 nearer than the sphere hides its part of it, a texel whose
+//                 nearest depth is not nearer than the sphere certainly
+//                 doesn't, and only the texels in between are looked at
+//                 again one level down.
+//
+//                 Depths use the GL convention: [0, 1], 1 = far, which is
+//                 also what an unwritten pixel holds.
+//
+// The following functions are defined here:
+//
+// void hizInit(HIZBUFFER& hiz, int width, int height);
+// void hizBegin(HIZBUFFER& hiz, const float viewProjection[16]);
+// void hizAddMesh(HIZBUFFER& hiz, const MESH& mesh, const float model[16]);
+// void hizBuild(HIZBUFFER& hiz);
+// bool hizSphereVisible(const HIZBUFFER& hiz, const float center[3], float radius);
+//-----------------------------------------------------------------------------
+
+#ifndef _OCCLUSION_H_
+#define _OCCLUSION_H_
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include "mesh.h"
+#include "matrix.h"
+
+//-----------------------------------------------------------------------------
+// HIZBUFFER
+//-----------------------------------------------------------------------------
+
+// <windows.h> may have defined min() and max() as macros.
+template<class T> inline T hizMin( T a, T b ) { return a < b ? a : b; }
+template<class T> inline T hizMax( T a, T b ) { return a > b ? a : b; }
+
+struct HIZLEVEL
+{
+	int                width;
+	int                height;
+	std::vector<float> nearest;			// Per texel, bottom row first like GL
+	std::vector<float> farthest;
+};
+
+struct HIZBUFFER
+{
+	float                 matrix[16];		// World -> clip space
+	std::vector<HIZLEVEL> levels;			// 0 is the rasterized buffer
+	int                   triangles;		// Rasterized since hizBegin()
+	std::vector<float>    window;			// Scratch of hizAddMesh()
+};
+
+/*
+ * Sizes the pyramid. The width has to be a multiple of 4.
+ */
+inline void hizInit( HIZBUFFER& hiz, int width, int height )
+{
+	hiz.levels.clear();
+
+	for( ;; )
+	{
+		HIZLEVEL level;
+
+		level.width  = width;
+		level.height = height;
+		level.nearest.assign( width * height, 1.0f );
+		level.farthest.assign( width * height, 1.0f );
+
+		hiz.levels.push_back( level );
+
+		if( width == 1 && height == 1 )
+			break;
+
+		width  = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+}
+
+/*
+ * Empties the buffer for a new view.
+ */
+inline void hizBegin( HIZBUFFER& hiz, const float viewProjection[16] )
+{
+	memcpy( hiz.matrix, viewProjection, sizeof(hiz.matrix) );
+
+	std::vector<float>& depth = hiz.levels[0].farthest;
+	std::fill( depth.begin(), depth.end(), 1.0f );
+
+	hiz.triangles = 0;
+}
+
+/*
+ * Rasterizes one triangle given in window coordinates (x, y in pixels, z in
+ * [0, 1]) into level 0, the pixels whose centre it covers.
+ */
+inline void hizTriangle( HIZBUFFER& hiz, const float* v0, const float* v1, const float* v2 )
+{
+	HIZLEVEL& level = hiz.levels[0];
+
+	float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v1[1] - v0[1]) * (v2[0] - v0[0]);
+
+	if( fabs( area ) < 1e-6f )
+		return;
+
+	// Counter-clockwise, so inside is where all three edge functions are >= 0.
+	if( area < 0.0f )
+	{
+		const float* swap = v1;
+		v1   = v2;
+		v2   = swap;
+		area = -area;
+	}
+
+	const float* v[3] = { v0, v1, v2 };
+
+	int minX = (int)floor( hizMin( v0[0], hizMin( v1[0], v2[0] ) ) );
+	int minY = (int)floor( hizMin( v0[1], hizMin( v1[1], v2[1] ) ) );
+	int maxX = (int)ceil( hizMax( v0[0], hizMax( v1[0], v2[0] ) ) );
+	int maxY = (int)ceil( hizMax( v0[1], hizMax( v1[1], v2[1] ) ) );
+
+	minX = hizMax( minX, 0 ) & ~3;
+	minY = hizMax( minY, 0 );
+	maxX = hizMin( maxX, level.width - 1 );
+	maxY = hizMin( maxY, level.height - 1 );
+
+	if( minX > maxX || minY > maxY )
+		return;
+
+	// Edge i runs from v[i] to v[i + 1].
+	float edgeA[3], edgeB[3], edgeC[3];
+
+	for( int i = 0; i < 3; ++i )
+	{
+		const float* a = v[i];
+		const float* b = v[(i + 1) % 3];
+
+		edgeA[i] = a[1] - b[1];
+		edgeB[i] = b[0] - a[0];
+		edgeC[i] = a[0] * b[1] - a[1] * b[0];
+	}
+
+	// The farthest depth of the plane over a pixel is its centre's plus half
+	// the slopes.
+	float dzdx = ((v1[2] - v0[2]) * (v2[1] - v0[1]) - (v2[2] - v0[2]) * (v1[1] - v0[1])) / area;
+	float dzdy = ((v2[2] - v0[2]) * (v1[0] - v0[0]) - (v1[2] - v0[2]) * (v2[0] - v0[0])) / area;
+	float dzC  = v0[2] - dzdx * v0[0] - dzdy * v0[1] + 0.5f * (fabs( dzdx ) + fabs( dzdy ));
+
+	const __m128 laneX = _mm_set_ps( 3.5f, 2.5f, 1.5f, 0.5f );
+	const __m128 zero  = _mm_setzero_ps();
+	const __m128 one   = _mm_set1_ps( 1.0f );
+
+	__m128 a0 = _mm_set1_ps( edgeA[0] ), a1 = _mm_set1_ps( edgeA[1] ), a2 = _mm_set1_ps( edgeA[2] );
+	__m128 dx = _mm_set1_ps( dzdx );
+
+	for( int y = minY; y <= maxY; ++y )
+	{
+		float cy = y + 0.5f;
+
+		__m128 row0 = _mm_set1_ps( edgeB[0] * cy + edgeC[0] );
+		__m128 row1 = _mm_set1_ps( edgeB[1] * cy + edgeC[1] );
+		__m128 row2 = _mm_set1_ps( edgeB[2] * cy + edgeC[2] );
+		__m128 rowZ = _mm_set1_ps( dzdy * cy + dzC );
+
+		float* depth = &level.farthest[y * level.width];
+
+		for( int x = minX; x <= maxX; x += 4 )
+		{
+			__m128 cx = _mm_add_ps( _mm_set1_ps( (float)x ), laneX );
+
+			__m128 inside = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( _mm_add_ps( _mm_mul_ps( a0, cx ), row0 ), zero ),
+													_mm_cmpge_ps( _mm_add_ps( _mm_mul_ps( a1, cx ), row1 ), zero ) ),
+										_mm_cmpge_ps( _mm_add_ps( _mm_mul_ps( a2, cx ), row2 ), zero ) );
+
+			if( _mm_movemask_ps( inside ) == 0 )
+				continue;
+
+			__m128 old = _mm_loadu_ps( depth + x );
+			__m128 z   = _mm_min_ps( _mm_add_ps( _mm_mul_ps( dx, cx ), rowZ ), one );
+			__m128 nearer = _mm_min_ps( old, z );
+
+			_mm_storeu_ps( depth + x, _mm_or_ps( _mm_and_ps( inside, nearer ), _mm_andnot_ps( inside, old ) ) );
+		}
+	}
+
+	++hiz.triangles;
+}
+
+/*
+ * Adds the mesh, placed by model, as an occluder.
+ */
+inline void hizAddMesh( HIZBUFFER& hiz, const MESH& mesh, const float model[16] )
+{
+	float matrix[16];
+	matrixMultiply( matrix, hiz.matrix, model );
+
+	const HIZLEVEL& level = hiz.levels[0];
+
+	// Window coordinates per vertex, w <= 0 marking the ones to leave out
+	std::vector<float>& window = hiz.window;
+	window.resize( mesh.positions.size() / 3 * 4 );
+
+	for( size_t i = 0, j = 0; i < mesh.positions.size(); i += 3, j += 4 )
+	{
+		const float* p = &mesh.positions[i];
+
+		float clip[4];
+
+		for( int r = 0; r < 4; ++r )
+			clip[r] = matrix[r] * p[0] + matrix[4 + r] * p[1] + matrix[8 + r] * p[2] + matrix[12 + r];
+
+		if( clip[3] <= 1e-5f || clip[2] < -clip[3] )
+		{
+			window[j + 3] = 0.0f;
+			continue;
+		}
+
+		window[j]     = (clip[0] / clip[3] * 0.5f + 0.5f) * level.width;
+		window[j + 1] = (clip[1] / clip[3] * 0.5f + 0.5f) * level.height;
+		window[j + 2] = clip[2] / clip[3] * 0.5f + 0.5f;
+		window[j + 3] = 1.0f;
+	}
+
+	for( size_t i = 0; i + 2 < mesh.indices.size(); i += 3 )
+	{
+		const float* v0 = &window[4 * mesh.indices[i]];
+		const float* v1 = &window[4 * mesh.indices[i + 1]];
+		const float* v2 = &window[4 * mesh.indices[i + 2]];
+
+		if( v0[3] > 0.0f && v1[3] > 0.0f && v2[3] > 0.0f )
+			hizTriangle( hiz, v0, v1, v2 );
+	}
+}
+
+/*
+ * Erodes level 0 and reduces it into the rest of the pyramid.
+ */
+inline void hizBuild( HIZBUFFER& hiz )
+{
+	HIZLEVEL& base = hiz.levels[0];
+
+	// The farthest depth of the 3 x 3 pixels around each, in two passes.
+	// nearest is the scratch for the horizontal one.
+	for( int y = 0; y < base.height; ++y )
+	{
+		const float* row = &base.farthest[y * base.width];
+		float*       out = &base.nearest[y * base.width];
+
+		for( int x = 0; x < base.width; ++x )
+			out[x] = hizMax( row[hizMax( x - 1, 0 )], hizMax( row[x], row[hizMin( x + 1, base.width - 1 )] ) );
+	}
+
+	for( int y = 0; y < base.height; ++y )
+	{
+		const float* below = &base.nearest[hizMax( y - 1, 0 ) * base.width];
+		const float* row   = &base.nearest[y * base.width];
+		const float* above = &base.nearest[hizMin( y + 1, base.height - 1 ) * base.width];
+		float*       out   = &base.farthest[y * base.width];
+
+		for( int x = 0; x < base.width; ++x )
+			out[x] = hizMax( below[x], hizMax( row[x], above[x] ) );
+	}
+
+	base.nearest = base.farthest;
+
+	for( size_t l = 1; l < hiz.levels.size(); ++l )
+	{
+		const HIZLEVEL& fine   = hiz.levels[l - 1];
+		HIZLEVEL&       coarse = hiz.levels[l];
+
+		for( int y = 0; y < coarse.height; ++y )
+		{
+			int y0 = 2 * y;
+			int y1 = hizMin( y0 + 1, fine.height - 1 );
+
+			for( int x = 0; x < coarse.width; ++x )
+			{
+				int x0 = 2 * x;
+				int x1 = hizMin( x0 + 1, fine.width - 1 );
+
+				int t[4] = { y0 * fine.width + x0, y0 * fine.width + x1, y1 * fine.width + x0, y1 * fine.width + x1 };
+
+				float nearest  = fine.nearest[t[0]];
+				float farthest = fine.farthest[t[0]];
+
+				for( int i = 1; i < 4; ++i )
+				{
+					nearest  = hizMin( nearest, fine.nearest[t[i]] );
+					farthest = hizMax( farthest, fine.farthest[t[i]] );
+				}
+
+				coarse.nearest[y * coarse.width + x]  = nearest;
+				coarse.farthest[y * coarse.width + x] = farthest;
+			}
+		}
+	}
+}
+
+/*
+ * Whether any texel of level in [x0, x1] x [y0, y1] may show something at
+ * depth. rect is the whole screen rectangle at level 0.
+ */
+inline bool hizRegionVisible( const HIZBUFFER& hiz, int l, int x0, int y0, int x1, int y1, const int rect[4], float depth )
+{
+	const HIZLEVEL& level = hiz.levels[l];
+
+	for( int y = y0; y <= y1; ++y )
+	{
+		for( int x = x0; x <= x1; ++x )
+		{
+			int t = y * level.width + x;
+
+			// Everything there is nearer: this part is hidden.
+			if( depth > level.farthest[t] )
+				continue;
+
+			if( l == 0 || depth <= level.nearest[t] )
+				return true;
+
+			// Somewhere in between: one level down, within the rectangle.
+			int shift = l - 1;
+
+			if( hizRegionVisible( hiz, l - 1, hizMax( 2 * x, rect[0] >> shift ), hizMax( 2 * y, rect[1] >> shift ),
+								  hizMin( 2 * x + 1, rect[2] >> shift ), hizMin( 2 * y + 1, rect[3] >> shift ), rect, depth ) )
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * false if the occluders certainly hide the whole sphere. Spheres that
+ * reach behind the eye or off the buffer count as visible where they do.
+ */
+inline bool hizSphereVisible( const HIZBUFFER& hiz, const float center[3], float radius )
+{
+	const HIZLEVEL& base = hiz.levels[0];
+
+	// The projected corners of the sphere's box bound its projection.
+	float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
+	float maxX = -FLT_MAX, maxY = -FLT_MAX;
+
+	for( int corner = 0; corner < 8; ++corner )
+	{
+		float p[3] = { center[0] + ((corner & 1) ? radius : -radius),
+					   center[1] + ((corner & 2) ? radius : -radius),
+					   center[2] + ((corner & 4) ? radius : -radius) };
+
+		const float* m = hiz.matrix;
+		float x = m[0] * p[0] + m[4] * p[1] + m[8]  * p[2] + m[12];
+		float y = m[1] * p[0] + m[5] * p[1] + m[9]  * p[2] + m[13];
+		float z = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+		float w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+
+		if( w <= 1e-5f || z < -w )
+			return true;
+
+		minX = hizMin( minX, x / w );
+		maxX = hizMax( maxX, x / w );
+		minY = hizMin( minY, y / w );
+		maxY = hizMax( maxY, y / w );
+		minZ = hizMin( minZ, z / w );
+	}
+
+	int rect[4] = { (int)floor( (minX * 0.5f + 0.5f) * base.width ), (int)floor( (minY * 0.5f + 0.5f) * base.height ),
+					(int)floor( (maxX * 0.5f + 0.5f) * base.width ), (int)floor( (maxY * 0.5f + 0.5f) * base.height ) };
+
+	rect[0] = hizMax( rect[0], 0 );
+	rect[1] = hizMax( rect[1], 0 );
+	rect[2] = hizMin( rect[2], base.width - 1 );
+	rect[3] = hizMin( rect[3], base.height - 1 );
+
+	// Off the buffer altogether: that's the frustum's business.
+	if( rect[0] > rect[2] || rect[1] > rect[3] )
+		return true;
+
+	int l = 0;
+
+	while( l + 1 < (int)hiz.levels.size() && ((rect[2] >> l) - (rect[0] >> l) > 1 || (rect[3] >> l) - (rect[1] >> l) > 1) )
+		++l;
+
+	return hizRegionVisible( hiz, l, rect[0] >> l, rect[1] >> l, rect[2] >> l, rect[3] >> l, rect, minZ * 0.5f + 0.5f );
+}
+
+#endif // _OCCLUSION_H_
@@ -51,9 +51,29 @@
 //					F6 - ǷʾӾ
 //					F7 - Ƿֱ߿
 //					F8 - Ƿ
-//					F11, F12 - һ/һ
+//					F9 - лӰ㷨(ȱȽ/VSM/ESM/Դ/Դͼ/CPUդ/ҳ/׷)
+//					F10 - Ӱͼɺʱ(p-bufferԱCPUդ)
+//					F11, F12 - һ/һ(4: ʵѹ, 5: ļ)
 //					1 - Сӽ
 //					2 - ӽ
+//					3, 4 - С/Ӱģ뾶
+//					5, 6 - С/©(VSM)ָ(ESM)
+//					7, 8 - /ӴӰĹԴ(Դͼ)
+//					9 - ӦӰͼֱ(ȱȽ)
+//					0 - лӰͼȸʽ(16λ/24λ/32λ)
+//					W - ͸ӱӰͼ(TSM)
+//					I - Ӱͼ(̬/̬Ͷֲ, ȱȽ)
+//					L - ÿֻ֡һγ, ӿڻطŻб
+//					V - ύĸӿ(ӿ, ȱȽ/CPUդ)
+//					C - ӿڵӾ޳
+//					H - ڵ޳(ӿڼԴӽ, ڵ)
+//					D - Ի(Դָʾ, Ӿ, )ܿ
+//					Z - ԤȾ(ӿֻд, GL_EQUALɫһ)
+//					G - GLSLعӰ(ɺSGIXȽ, ȱȽ/CPUդ)
+//					P - лGPUͬʱ;֡(1/2/3)
+//					+, - - /ѹԳ(4)
+//					R - ѹԳ/ڷ
+//					O - 볡ļ(5, вscene.scn)
 //					PageDown, PageUP - ƶԴ
 //                  - Զ
 //-----------------------------------------------------------------------------
@@ -63,10 +83,27 @@
 
 #include <windows.h>
 #include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
 #include <gl/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "geometry.h"
+#include "mesh.h"
+#include "matrix.h"
+#include "threadpool.h"
+#include "rasterizer.h"
+#include "shadowquery.h"
+#include "shadowwarp.h"
+#include "shadowpages.h"
+#include "raytracer.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "debugdraw.h"
+#include "glstate.h"
+#include "scenegraph.h"
+#include "scenefile.h"
 #include "resource.h"
 
 //-----------------------------------------------------------------------------
@@ -85,6 +122,8 @@
 #include "wglext.h"      // Sample's header file
 //#include <GL/wglext.h> // Your local header file
 
+#include "glext_extra.h" // Extensions newer than the shipped "glext.h"
+
 // WGL_ARB_extensions_string
 PFNWGLGETEXTENSIONSSTRINGARBPROC wglGetExtensionsStringARB = NULL;
 
@@ -101,6 +140,97 @@ PFNWGLCHOOSEPIXELFORMATARBPROC   wglChoosePixelFormatARB   = NULL;
 PFNWGLBINDTEXIMAGEARBPROC        wglBindTexImageARB        = NULL;
 PFNWGLRELEASETEXIMAGEARBPROC     wglReleaseTexImageARB     = NULL;
 
+// GL_ARB_multitexture (optional)
+PFNGLACTIVETEXTUREARBPROC           glActiveTextureARB           = NULL;
+
+// GL_EXT_framebuffer_object (optional)
+PFNGLGENFRAMEBUFFERSEXTPROC         glGenFramebuffersEXT         = NULL;
+PFNGLDELETEFRAMEBUFFERSEXTPROC      glDeleteFramebuffersEXT      = NULL;
+PFNGLBINDFRAMEBUFFEREXTPROC         glBindFramebufferEXT         = NULL;
+PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC  glCheckFramebufferStatusEXT  = NULL;
+PFNGLFRAMEBUFFERTEXTURE2DEXTPROC    glFramebufferTexture2DEXT    = NULL;
+PFNGLGENRENDERBUFFERSEXTPROC        glGenRenderbuffersEXT        = NULL;
+PFNGLDELETERENDERBUFFERSEXTPROC     glDeleteRenderbuffersEXT     = NULL;
+PFNGLBINDRENDERBUFFEREXTPROC        glBindRenderbufferEXT        = NULL;
+PFNGLRENDERBUFFERSTORAGEEXTPROC     glRenderbufferStorageEXT     = NULL;
+PFNGLFRAMEBUFFERRENDERBUFFEREXTPROC glFramebufferRenderbufferEXT = NULL;
+PFNGLGENERATEMIPMAPEXTPROC          glGenerateMipmapEXT          = NULL;
+
+// GL_ARB_shader_objects (optional)
+PFNGLCREATESHADEROBJECTARBPROC      glCreateShaderObjectARB      = NULL;
+PFNGLSHADERSOURCEARBPROC            glShaderSourceARB            = NULL;
+PFNGLCOMPILESHADERARBPROC           glCompileShaderARB           = NULL;
+PFNGLCREATEPROGRAMOBJECTARBPROC     glCreateProgramObjectARB     = NULL;
+PFNGLATTACHOBJECTARBPROC            glAttachObjectARB            = NULL;
+PFNGLLINKPROGRAMARBPROC             glLinkProgramARB             = NULL;
+PFNGLUSEPROGRAMOBJECTARBPROC        glUseProgramObjectARB        = NULL;
+PFNGLDELETEOBJECTARBPROC            glDeleteObjectARB            = NULL;
+PFNGLGETOBJECTPARAMETERIVARBPROC    glGetObjectParameterivARB    = NULL;
+PFNGLGETINFOLOGARBPROC              glGetInfoLogARB              = NULL;
+PFNGLGETUNIFORMLOCATIONARBPROC      glGetUniformLocationARB      = NULL;
+PFNGLUNIFORM1IARBPROC               glUniform1iARB               = NULL;
+PFNGLUNIFORM1FARBPROC               glUniform1fARB               = NULL;
+PFNGLUNIFORM2FARBPROC               glUniform2fARB               = NULL;
+PFNGLUNIFORM4FARBPROC               glUniform4fARB               = NULL;
+PFNGLUNIFORM1FVARBPROC              glUniform1fvARB              = NULL;
+PFNGLUNIFORM1IVARBPROC              glUniform1ivARB              = NULL;
+PFNGLUNIFORMMATRIX4FVARBPROC        glUniformMatrix4fvARB        = NULL;
+
+// GL_EXT_geometry_shader4 or GL_ARB_geometry_shader4 (optional)
+PFNGLPROGRAMPARAMETERIEXTPROC       glProgramParameteriEXT       = NULL;
+PFNGLFRAMEBUFFERTEXTUREEXTPROC      glFramebufferTextureEXT      = NULL;
+
+// GL_ARB_viewport_array (optional)
+PFNGLVIEWPORTINDEXEDFPROC           glViewportIndexedf           = NULL;
+
+// GL_ARB_sync and GL_ARB_timer_query (optional)
+PFNGLFENCESYNCPROC                  glFenceSync                  = NULL;
+PFNGLDELETESYNCPROC                 glDeleteSync                 = NULL;
+PFNGLCLIENTWAITSYNCPROC             glClientWaitSync             = NULL;
+PFNGLGENQUERIESARBPROC              glGenQueriesARB              = NULL;
+PFNGLDELETEQUERIESARBPROC           glDeleteQueriesARB           = NULL;
+PFNGLQUERYCOUNTERPROC               glQueryCounter               = NULL;
+PFNGLGETQUERYOBJECTUI64VPROC        glGetQueryObjectui64v        = NULL;
+
+// GL_ARB_vertex_buffer_object and GL_ARB_buffer_storage (optional)
+PFNGLGENBUFFERSARBPROC              glGenBuffersARB              = NULL;
+PFNGLDELETEBUFFERSARBPROC           glDeleteBuffersARB           = NULL;
+PFNGLBINDBUFFERARBPROC              glBindBufferARB              = NULL;
+PFNGLBUFFERDATAARBPROC              glBufferDataARB              = NULL;
+PFNGLBUFFERSUBDATAARBPROC           glBufferSubDataARB           = NULL;
+PFNGLUNMAPBUFFERARBPROC             glUnmapBufferARB             = NULL;
+PFNGLMAPBUFFERRANGEPROC             glMapBufferRange             = NULL;
+PFNGLBUFFERSTORAGEPROC              glBufferStorage              = NULL;
+
+// GL_ARB_draw_instanced and GL_ARB_instanced_arrays (optional)
+PFNGLDRAWELEMENTSINSTANCEDARBPROC   glDrawElementsInstancedARB   = NULL;
+PFNGLVERTEXATTRIBDIVISORARBPROC     glVertexAttribDivisorARB     = NULL;
+PFNGLVERTEXATTRIBPOINTERARBPROC     glVertexAttribPointerARB     = NULL;
+PFNGLENABLEVERTEXATTRIBARRAYARBPROC glEnableVertexAttribArrayARB = NULL;
+PFNGLDISABLEVERTEXATTRIBARRAYARBPROC glDisableVertexAttribArrayARB = NULL;
+PFNGLGETATTRIBLOCATIONARBPROC       glGetAttribLocationARB       = NULL;
+PFNGLGETHANDLEARBPROC               glGetHandleARB               = NULL;
+
+// The optional extensions are only needed by the alternative shadow modes,
+// so a missing one just disables those modes instead of exiting.
+bool g_bMultitexture      = false;
+bool g_bFramebufferObject = false;
+bool g_bShaderObjects     = false;
+bool g_bTextureFloat      = false;
+bool g_bTextureRG         = false;
+bool g_bAnisotropic       = false;
+bool g_bGeometryShader    = false;
+bool g_bDepthBufferFloat  = false;
+bool g_bViewportArray     = false;
+bool g_bSync              = false;
+bool g_bTimerQuery        = false;
+bool g_bVertexBuffer      = false;
+bool g_bBufferStorage     = false;
+bool g_bInstancing        = false;
+
+// "#extension" line for the geometry shader flavour the driver exposes
+const char* g_geometryShaderExtension = NULL;
+
 //-----------------------------------------------------------------------------
 // GLOBALS
 //-----------------------------------------------------------------------------
@@ -109,12 +239,258 @@ HDC	   g_hDC  = NULL;
 HGLRC  g_hRC  = NULL;
 GLuint g_depthTexture = -1;
 
+// Every glEnable()/glDisable() of the sample goes through this, see glstate.h
+GLSTATECACHE g_glState;
+
+// Frame pacing ('P'). Each frame ends with a fence, and before building
+// frame N render() waits only for frame N - framesInFlight, so the CPU can
+// work on the next frame while the GPU still draws the last ones. GPU
+// timestamps at the start and end of every frame give the time the GPU
+// sat idle between two frames.
+const int MAX_FRAMES_IN_FLIGHT = 3;
+const GLuint64 FENCE_TIMEOUT_NS = 1000000000;		// Waits are retried each second
+
+struct FRAMESLOT
+{
+	GLsync fence;						// Signalled when the GPU is done with the frame
+	GLuint timestamps[2];				// GL_TIMESTAMP queries at its start and end
+	bool   timed;
+};
+
+struct FRAMEPACER
+{
+	FRAMESLOT slots[MAX_FRAMES_IN_FLIGHT];	// Frame n uses slots[n % MAX_FRAMES_IN_FLIGHT]
+	int       framesInFlight;
+	int       frame;					// Number of the frame being built
+	GLuint64  lastGpuEnd;				// End timestamp of the last frame read back
+	float     cpuWaitMs;				// Blocked on fences before this frame
+	float     gpuIdleMs;				// Between the last two frames read back, -1 if unknown
+};
+
+FRAMEPACER g_framePacer = { 0 };
+
+// Set by input, drawn by the message loop once the queue is empty.
+bool g_bRedraw = false;
+
+// Streaming buffer for the per-frame dynamic data. One buffer object is
+// mapped once, persistently and coherently, and split into one region per
+// frame in flight. Frame n writes only to region n % MAX_FRAMES_IN_FLIGHT,
+// which beginFrame() has already waited for, so writes need neither a
+// fence of their own nor a glBufferData() to orphan the storage.
+const GLsizeiptr STREAM_LINE_BYTES = 64 * 1024;			// Debug lines and the like
+
+struct STREAMBUFFER
+{
+	GLuint     buffer;					// 0 when streaming isn't available
+	char*      memory;					// The whole buffer, mapped
+	GLsizeiptr regionSize;
+	int        region;					// This frame's region
+	GLsizeiptr offset;					// Next free byte in it
+	int        allocations;				// Since beginStreamFrame()
+	int        overflows;				// Allocations that didn't fit
+};
+
+STREAMBUFFER g_streamBuffer = { 0 };
+
+// Debug geometry ('D'): the light marker, the frustum and the axes are
+// queued in g_debugDraw once a frame by buildDebugDraw(), copied to the
+// stream buffer in one piece and drawn by renderDebugDraw() with one
+// glDrawArrays() per viewport, see debugdraw.h.
+struct DEBUGDRAWGL
+{
+	std::vector<float> packed;			// Every layer's lines, then its points
+	int                first[DEBUG_LAYER_COUNT][2];	// Lines, points: first vertex
+	int                count[DEBUG_LAYER_COUNT][2];	// and vertices
+	int                vertices;			// 0: nothing to draw this frame
+	GLintptr           offset;				// Of packed in the stream buffer
+	bool               streamed;			// Else drawn from packed
+};
+
+DEBUGDRAW   g_debugDraw;
+DEBUGDRAWGL g_debugDrawGL;
+
+// Many placed copies of a few meshes. Every mesh of an INSTANCESET is one
+// glDrawElementsInstancedARB() of all its instances, from a buffer that is
+// only ever topped up with the instances added since the last draw. A pass
+// that culls or filters asks for each instance like for any other object,
+// and the instances that pass are streamed to a second buffer for the draw.
+// Passes that can't take the instancing shader (mesh sinks, passes with
+// their own program) get the instances one by one through renderTeapot()
+// and friends, which is the baseline the instanced draws are measured
+// against.
+const int INSTANCE_FLOATS = 8;			// x, y, z, yaw, scale, r, g, b
+
+// The buffers of one set in one context. The p-buffer's context shares
+// nothing with the window's, so the depth pass there needs its own.
+struct INSTANCEGL
+{
+	HGLRC               context;		// NULL until first drawn in
+	int                 version;		// INSTANCESET::version of the buffers
+	std::vector<GLuint> meshBuffers;	// Positions and normals, indices per mesh
+	std::vector<GLuint> instanceBuffers;	// One per mesh
+	std::vector<GLuint> visibleBuffers;	// One per mesh, refilled with the culled instances per draw
+	std::vector<int>    uploaded;		// Instances in each
+	std::vector<int>    capacity;
+};
+
+struct INSTANCESET
+{
+	std::vector<const MESH*>         meshes;
+	std::vector< std::vector<float> > instances;	// INSTANCE_FLOATS each, per mesh
+	int                              count;
+	float                            bounds[6];	// Box around every instance
+	int                              version;	// Bumped when instances are replaced rather than added
+	unsigned                         generation;	// Bumped by every change to the instances
+	INSTANCEGL                       gl[2];		// Window, p-buffer
+	std::vector< std::vector<float> > visible;	// Scratch: the instances of a draw that passed objectVisible()
+};
+
+// The instancing shader of one context
+struct INSTANCEPROGRAM
+{
+	HGLRC       context;				// NULL until compiled
+	GLhandleARB program;
+	GLint       placementLocation;		// a_placement
+	GLint       appearanceLocation;		// a_appearance
+};
+
+INSTANCEPROGRAM g_instancePrograms[2];			// Window, p-buffer
+int             g_instancedDraws = 0;			// Since the last title update
+int             g_singleDraws    = 0;
+
+// Scene 4: a stress test of up to MAX_STRESS_INSTANCES teapots, spheres and
+// tori on the floor ('+', '-', 'R').
+const int    STRESS_SCENE         = 4;
+const int    MAX_STRESS_INSTANCES = 100000;
+const int    STRESS_SHAPES        = 3;		// Teapot, sphere, torus
+const float  STRESS_FIELD_SIZE    = 10.0f;	// Covers the floor of scene 0
+const double TORUS_INNER_RADIUS   = 0.15;
+const double TORUS_OUTER_RADIUS   = 0.35;
+
+struct STRESSSCENE
+{
+	int         count;					// Objects
+	bool        random;					// Else on a grid
+	INSTANCESET set;
+};
+
+STRESSSCENE g_stressScene;
+
+// Scene 5: a scene file, the one named on the command line or scene.scn
+// ('O' reloads it). A text file is compiled to binary first, then a thread
+// of its own maps the binary file and stages its instances a chunk at a
+// time. Every frame, updateLoadedScene() moves at most
+// LOADER_INSTANCES_PER_FRAME of them into the scene's INSTANCESET, which
+// uploads just those, so the scene fills in over the first frames instead
+// of holding up the first one.
+const int LOADED_SCENE               = 5;
+const int LOADER_CHUNK               = 4096;		// Instances per read
+const int LOADER_INSTANCES_PER_FRAME = 65536;
+
+struct SCENELOADER
+{
+	std::string                    path;			// Of the .scn or .scb file
+	std::thread*                   thread;			// NULL when not loading
+	std::atomic<bool>              cancel;
+
+	// Staged by the thread, under the mutex
+	std::mutex                     mutex;
+	bool                           tablesReady;		// The meshes and materials below
+	bool                           done;
+	std::string                    error;
+	std::vector<unsigned>          stagedPrimitives;
+	std::vector<MESH>              stagedMeshes;	// Empty for the built-in ones
+	std::vector<float>             stagedMaterials;
+	std::vector<SCENEFILEINSTANCE> staged;
+	size_t                         stagedTaken;		// Of staged
+	unsigned                       stagedTotal;
+
+	// The main thread's
+	bool                           started;
+	bool                           tablesTaken;
+	bool                           errorShown;
+	std::vector<MESH>              meshes;			// set.meshes points into this
+	std::vector<float>             materials;		// r, g, b each
+	std::vector<SCENEFILEINSTANCE> incoming;		// Taken this frame
+	unsigned                       total;
+	INSTANCESET                    set;
+};
+
+SCENELOADER g_sceneLoader;
+
+// Scenes 0 - 3 as data. g_sceneObjects lists every scene's nodes, parents
+// first; buildSceneGraphs() turns them into one graph per scene, which
+// renderScene() walks instead of a hand-written block per scene.
+enum SCENEMESH		// In draw order: the graph sorts by these
+{
+	SCENE_MESH_TEAPOT,
+	SCENE_MESH_SPHERE,
+	SCENE_MESH_TORUS,
+	SCENE_MESH_FLOOR,
+};
+
+enum SCENEMATERIAL
+{
+	MATERIAL_WHITE,
+	MATERIAL_COUNT
+};
+
+const float g_sceneMaterials[MATERIAL_COUNT][4] =
+{
+	{ 1.0f, 1.0f, 1.0f, 1.0f },		// MATERIAL_WHITE
+};
+
+// SCENENODE::flags
+const unsigned SCENE_NODE_AXIS   = 1;	// drawAxis() at the node (F3)
+const unsigned SCENE_NODE_SPUN   = 2;	// Turned with the right mouse button
+const unsigned SCENE_NODE_TILTED = 4;	// Floor whose corner F5 lifts
+
+struct SCENEOBJECT
+{
+	int      scene;
+	int      parent;					// Among the scene's entries, -1 for its root
+	float    position[3];
+	int      mesh;
+	int      material;
+	unsigned flags;
+};
+
+static const SCENEOBJECT g_sceneObjects[] =
+{
+	// 0, 2: һĵ
+	{ 0, -1, { 0.0f, 0.0f, 0.0f }, SCENE_NO_MESH,     MATERIAL_WHITE, 0 },
+	{ 0,  0, { 0.0f, 2.5f, 0.0f }, SCENE_MESH_TEAPOT, MATERIAL_WHITE, SCENE_NODE_SPUN },
+	{ 0,  0, { 0.0f, 0.0f, 0.0f }, SCENE_MESH_SPHERE, MATERIAL_WHITE, 0 },	//֤ƽͶӰȷ.
+	{ 0,  0, { 0.0f, 0.0f, 0.0f }, SCENE_MESH_FLOOR,  MATERIAL_WHITE, 0 },
+
+	// 1: һı
+	{ 1, -1, { 0.0f, 0.0f, 0.0f }, SCENE_NO_MESH,     MATERIAL_WHITE, 0 },
+	{ 1,  0, { 0.0f, 0.0f, 0.0f }, SCENE_MESH_FLOOR,  MATERIAL_WHITE, SCENE_NODE_TILTED },
+
+	{ 2, -1, { 0.0f, 0.0f, 0.0f }, SCENE_NO_MESH,     MATERIAL_WHITE, 0 },
+	{ 2,  0, { 0.0f, 2.5f, 0.0f }, SCENE_MESH_TEAPOT, MATERIAL_WHITE, SCENE_NODE_SPUN },
+	{ 2,  0, { 0.0f, 0.0f, 0.0f }, SCENE_MESH_SPHERE, MATERIAL_WHITE, 0 },
+	{ 2,  0, { 0.0f, 0.0f, 0.0f }, SCENE_MESH_FLOOR,  MATERIAL_WHITE, 0 },
+
+	// 3: , 
+	{ 3, -1, {  0.0f, 0.0f,  0.0f }, SCENE_NO_MESH,     MATERIAL_WHITE, 0 },
+	{ 3,  0, { -2.5f, 0.8f, -2.5f }, SCENE_MESH_TEAPOT, MATERIAL_WHITE, SCENE_NODE_AXIS },
+	{ 3,  0, {  2.5f, 0.8f,  2.5f }, SCENE_MESH_TEAPOT, MATERIAL_WHITE, SCENE_NODE_AXIS },
+	{ 3,  0, {  0.0f, 0.0f,  0.0f }, SCENE_MESH_FLOOR,  MATERIAL_WHITE, SCENE_NODE_AXIS },
+};
+
+SCENEGRAPH       g_sceneGraphs[STRESS_SCENE];
+std::vector<int> g_sceneDraws;			// Scratch of renderSceneGraph()
+
 float g_fSpinX_L =  0.0f;
 float g_fSpinY_L = -10.0f;
 float g_fSpinX_R =  0.0f;
 float g_fSpinY_R =  0.0f;
 
 float g_lightsLookAtMatrix[16];
+float g_lightProjectionMatrix[16];		// buildLightProjection() of this frame
+float g_lightViewProjection[16];		// g_lightProjectionMatrix * g_lightsLookAtMatrix
+float g_shadowTextureMatrix[16];		// World position -> shadow map (s, t, r, q)
 float g_lightPosition[] = { 2.0f, 6.5f, 0.0f, 1.0f };
 
 bool g_bRenderDepthTexture = false;
@@ -153,6 +529,492 @@ PBUFFER g_pbuffer;
 const int PBUFFER_WIDTH  = 1024;//256;				//pBufferԽӰԽϸ.
 const int PBUFFER_HEIGHT = 1024;//256;				//2ݴҲ԰.
 
+// Depth formats for the shadow targets, cycled with '0'. Each one comes
+// with its own polygon offset: fixed-point formats get two of their own
+// steps as constant bias, float depth gets more since its step shrinks with
+// the depth of each primitive. The p-buffer can only ask for a minimum
+// number of fixed-point bits, so it stays at 24 bits for DEPTH32F, which
+// the FBO targets (adaptive resolution) and the CPU rasterizer can use.
+enum DEPTHFORMAT
+{
+	DEPTH_FORMAT_16 = 0,
+	DEPTH_FORMAT_24,
+	DEPTH_FORMAT_32F,
+	DEPTH_FORMAT_COUNT
+};
+
+struct DEPTHFORMATINFO
+{
+	const char* name;
+	GLenum      internalFormat;
+	int         pbufferBits;	// WGL_DEPTH_BITS_ARB
+	int         bytesPerTexel;	// Memory and bandwidth estimate, 24 bits are padded to 32
+	float       offsetFactor;	// glPolygonOffset( factor, units )
+	float       offsetUnits;
+	float       depthStep;		// Size of one unit near the far plane, for the CPU rasterizer
+};
+
+const DEPTHFORMATINFO g_depthFormats[DEPTH_FORMAT_COUNT] =
+{
+	{ "DEPTH16",  GL_DEPTH_COMPONENT16,  16, 2, 2.0f, 2.0f, 1.0f / 65536.0f },
+	{ "DEPTH24",  GL_DEPTH_COMPONENT24,  24, 4, 2.0f, 2.0f, 1.0f / 16777216.0f },
+	{ "DEPTH32F", GL_DEPTH_COMPONENT32F, 24, 4, 2.0f, 4.0f, 1.0f / 16777216.0f }
+};
+
+int   g_depthFormat       = DEPTH_FORMAT_24;
+GLint g_pbufferDepthBits  = 0;		// What the p-buffer really got
+
+// Trapezoidal warp ('W') of the light's projection, see shadowwarp.h. It is
+// recomputed every frame from the perspective viewport's frustum (point[8])
+// cut down to the scene's depth range, with the focus point half way into
+// that range. buildLightProjection() applies it for the depth compare, VSM,
+// ESM and CPU raster modes; the cube and atlas modes keep their own lights,
+// and the virtual map's cached pages need a light space that holds still.
+const float SHADOW_WARP_FOCUS = 0.5f;
+
+bool  g_bShadowWarp       = false;
+bool  g_bShadowWarpActive = false;	// A trapezoid was found this frame
+float g_shadowWarp[16];
+
+// The light's projection, shared by the depth pass and the texture matrix.
+const float LIGHT_FOVY   = 75.0f;
+const float LIGHT_ASPECT = 640.0f / 480.0f;
+const float LIGHT_NEAR   = 0.1f;
+const float LIGHT_FAR    = 100.0f;
+
+// Shadow techniques, cycled with F9.
+enum SHADOWMODE
+{
+	SHADOW_DEPTH_COMPARE = 0,	// p-buffer depth texture + GL_TEXTURE_COMPARE_SGIX
+	SHADOW_VSM,					// Variance shadow map
+	SHADOW_ESM,					// Exponential shadow map
+	SHADOW_CUBE,				// Omnidirectional depth cube map for the point light
+	SHADOW_ATLAS,				// Several shadowed lights packed into one depth atlas
+	SHADOW_SOFTWARE,			// Depth texture rasterized on the CPU, see rasterizer.h
+	SHADOW_VIRTUAL,				// Sparse 16k virtual map made of cached pages, see shadowpages.h
+	SHADOW_RAYTRACE,			// No map: CPU shadow rays through a BVH, see raytracer.h
+	SHADOW_MODE_COUNT
+};
+
+int g_shadowMode = SHADOW_DEPTH_COMPARE;
+
+// VSM and ESM store moments of the light-space depth in a float colour
+// target instead of a depth buffer. Since moments can be filtered linearly,
+// the map is prefiltered with a separable Gaussian and mip-mapped once per
+// frame, and the lookup is a single bilinear/trilinear fetch no matter how
+// soft the edges are.
+struct MOMENTMAP
+{
+	GLuint      fbo[2];            // [0] renders into texture[0], [1] into texture[1]
+	GLuint      depthBuffer;       // Depth renderbuffer for the moments pass
+	GLuint      texture[2];        // [0] filtered moments, [1] blur scratch
+	int         nWidth;
+	int         nHeight;
+	GLhandleARB momentsProgram[2]; // Writes moments: [0] VSM, [1] ESM
+	GLhandleARB lookupProgram[2];  // Main pass shadow test: [0] VSM, [1] ESM
+	GLhandleARB blurProgram;       // Separable Gaussian, compiled for blurRadius taps
+	int         blurRadius;
+};
+
+MOMENTMAP g_momentMap;
+
+const int MAX_BLUR_RADIUS = 8;
+
+int   g_blurRadius     = 2;         // Gaussian taps on each side of the centre, 0 = no blur
+float g_vsmMinVariance = 0.00002f;  // Lower bound of the variance, hides acne on flat receivers
+float g_vsmLightBleed  = 0.2f;      // VSM light-bleeding reduction, the part of p_max cut off
+float g_esmExponent    = 60.0f;     // ESM sharpness c in exp(c * (occluder - receiver))
+
+// Moments are stored as light-space distance divided by this range instead of
+// LIGHT_FAR, so the demo scenes use most of [0, 1] and ESM stays sharp.
+float g_momentDepthRange = 20.0f;
+
+// g_lightPosition has w = 1, so GL_LIGHT0 is a point light, but the 2D map
+// above only covers a 75 degree cone. The cube mode covers the whole sphere:
+// all six faces are rendered in a single pass, with a geometry shader that
+// routes each triangle to the faces (layers) whose frustum holds its object.
+struct CUBESHADOWMAP
+{
+	GLuint      fbo;
+	GLuint      texture;          // GL_TEXTURE_CUBE_MAP_ARB of GL_DEPTH_COMPONENT24
+	int         nSize;
+	GLhandleARB renderProgram;    // VS + GS layered depth pass
+	GLhandleARB lookupProgram;    // Main pass shadow test
+	GLint       faceVisibleLocation;
+	int         objectsDrawn;     // Objects that reached at least one face
+	int         facesDrawn;       // Sum of faces over those objects
+};
+
+CUBESHADOWMAP g_cubeShadowMap;
+
+const int CUBE_SHADOW_SIZE = 512;
+
+// Bounding spheres of the objects renderScene() visits, in visiting order,
+// filled by collectSceneBounds(). One entry per object, however many the
+// scene holds.
+struct OBJECTBOUNDS
+{
+	float sphere[4];	// x, y, z, radius
+};
+
+std::vector<OBJECTBOUNDS> g_sceneBounds;
+
+// The same objects with the model matrix they are drawn with, filled by
+// collectSceneCasters(). Comparing two frames' entries tells which casters
+// moved.
+struct SCENECASTER
+{
+	float bounds[4];	// x, y, z, radius
+	float model[16];
+};
+
+std::vector<SCENECASTER> g_sceneCasters;
+
+// Several shadowed lights share one depth texture instead of one p-buffer
+// (and one context switch) per light. Each light gets a square tile whose
+// size follows how much of the screen its light covers, the casters are
+// culled once per frame for all lights, and the main pass adds the lights
+// up one additive pass at a time.
+const int SHADOW_ATLAS_SIZE = 2048;
+const int MIN_SHADOW_TILE   = 128;
+const int MAX_SHADOW_TILE   = 1024;
+const int MAX_SHADOW_LIGHTS = 4;
+
+struct SHADOWLIGHT
+{
+	float position[4];
+	float target[3];
+	float color[4];
+	float fovy;
+
+	// Updated every frame by createShadowAtlas()
+	float view[16];
+	float projection[16];
+	float importance;
+	int   tileSize;
+	int   tileX;
+	int   tileY;
+	int   castersDrawn;
+};
+
+// Light 0 follows g_lightPosition, the others are fixed.
+SHADOWLIGHT g_shadowLights[MAX_SHADOW_LIGHTS] =
+{
+	{ {  2.0f, 6.5f,  0.0f, 1.0f }, { 0.0f, 2.5f, 0.0f }, { 1.0f,  1.0f,  1.0f,  1.0f }, LIGHT_FOVY },
+	{ { -5.0f, 5.0f,  4.0f, 1.0f }, { 0.0f, 1.0f, 0.0f }, { 0.6f,  0.35f, 0.3f,  1.0f }, 90.0f },
+	{ {  4.0f, 4.0f, -5.0f, 1.0f }, { 0.0f, 1.0f, 0.0f }, { 0.3f,  0.4f,  0.7f,  1.0f }, 90.0f },
+	{ { -3.0f, 7.0f, -4.0f, 1.0f }, { 0.0f, 0.0f, 0.0f }, { 0.35f, 0.6f,  0.35f, 1.0f }, 90.0f }
+};
+
+int g_shadowLightCount = 3;
+
+struct SHADOWATLAS
+{
+	GLuint      fbo;
+	GLuint      texture;                            // GL_DEPTH_COMPONENT24, compare mode on
+	GLhandleARB lookupProgram;
+	std::vector<unsigned> casterMask;               // Per object, bit l set: casts into light l's tile
+	int         currentLight;                       // State of atlasCasterFilter()
+	int         objectIndex;
+};
+
+SHADOWATLAS g_shadowAtlas;
+
+// SHADOW_SOFTWARE does the same depth compare as SHADOW_DEPTH_COMPARE, but
+// the map comes from the CPU rasterizer instead of the p-buffer, for machines
+// whose OpenGL is a software implementation anyway.
+THREADPOOL     g_threadPool;
+SOFTRASTERIZER g_softRasterizer;
+GLuint         g_softwareDepthTexture = 0;	// This frame's texture of the ring below
+GLuint         g_softwareDepthTextures[MAX_FRAMES_IN_FLIGHT];	// One per frame in flight, see uploadSoftwareShadowMap()
+float          g_softLightMatrix[16];		// Light projection * g_lightsLookAtMatrix
+double         g_softRasterMs = 0.0;		// Last frame's timings, for the title
+double         g_softUploadMs = 0.0;
+
+// p-buffer depth read back for queryShadowPoints()
+std::vector<float> g_shadowReadback;
+
+// The p-buffer's size is fixed at PBUFFER_WIDTH x PBUFFER_HEIGHT. With
+// adaptive resolution on ('9'), SHADOW_DEPTH_COMPARE renders into one of a
+// pool of FBO depth targets instead, all created up front so that switching
+// sizes is just binding another one. The size follows the texel density the
+// receivers need on screen, capped while the frame is over its time budget,
+// and only moves one step at a time after it has been asked for during
+// ADAPTIVE_HYSTERESIS_FRAMES frames in a row.
+const int   ADAPTIVE_MIN_SIZE          = 256;
+const int   ADAPTIVE_LEVELS            = 4;		// 256, 512, 1024, 2048
+const int   ADAPTIVE_HYSTERESIS_FRAMES = 20;
+const float ADAPTIVE_DEAD_BAND         = 0.75f;	// In powers of two around the current size
+
+struct ADAPTIVESHADOWMAP
+{
+	GLuint fbo[ADAPTIVE_LEVELS];
+	GLuint texture[ADAPTIVE_LEVELS];	// g_depthFormat, SGIX compare like g_depthTexture
+	int    levelCount;					// Levels the driver can allocate
+	int    level;						// Target in use
+	int    pendingLevel;				// Level asked for by the last frames
+	int    pendingFrames;				// How many frames in a row asked for it
+	float  wantedSize;					// Size matching the receivers' footprint
+};
+
+ADAPTIVESHADOWMAP g_adaptiveShadowMap;
+
+bool  g_bAdaptiveResolution = false;
+float g_frameBudgetMs       = 16.7f;
+float g_frameMs             = 0.0f;		// Smoothed duration of render()
+
+// Incremental updates ('I') of SHADOW_DEPTH_COMPARE's map. Casters that
+// haven't moved are kept in a cached static layer; the map the main pass
+// samples is a copy of it with the dynamic casters drawn on top. When a
+// caster moves, only the light-space rectangle under its old and new bounds
+// gets the static depth copied back and the dynamic casters redrawn, under
+// a scissor. A static caster that starts moving leaves the static layer, a
+// dynamic one that has kept still for INCREMENTAL_SETTLE_FRAMES frames
+// joins it again; both cost one full rebuild, as does a moving light.
+const int INCREMENTAL_SETTLE_FRAMES = 60;
+
+struct INCREMENTALCASTER
+{
+	SCENECASTER caster;					// As the layers were rendered with it
+	bool        dynamic;				// Drawn in the dynamic layer
+	int         stillFrames;			// Frames a dynamic caster hasn't moved
+	int         rect[4];				// Texel rectangle under the caster: x0, y0, x1, y1
+};
+
+struct INCREMENTALSHADOWMAP
+{
+	GLuint fbo[2];
+	GLuint texture[2];					// [0] static layer, [1] static + dynamic, SGIX compare
+	int    nSize;
+	bool   staticValid;
+	float  lightMatrix[16];				// Light projection * view of both layers
+	unsigned instanceGeneration;		// sceneInstanceGeneration() of the casters below
+	std::vector<INCREMENTALCASTER> casters;	// One per g_sceneCasters entry
+	int    dirty[4];					// Rectangle redrawn this frame, x0, y0, x1, y1
+	int    objectIndex;					// State of incrementalCasterFilter()
+	bool   dynamicPass;
+	int    staticRebuilds;
+};
+
+INCREMENTALSHADOWMAP g_incrementalShadowMap;
+
+bool g_bIncrementalShadow = false;
+
+// SHADOW_VIRTUAL: the light's map is a virtual 16384 x 16384 mip chain of
+// 128 x 128 pages (shadowpages.h), backed by a 2048 x 2048 pool. A depth
+// prepass from the camera finds the receivers and, from how many virtual
+// texels each of their pixels spans, the pages and levels they need. Pages
+// stay in the pool between frames and are only rendered again when the
+// light moves or a caster's bounds or model matrix change over them.
+const int VIRTUAL_PAGES_PER_SIDE = 128;		// Level 0: 128 * VIRTUAL_PAGE_SIZE = 16384 texels
+const int VIRTUAL_POOL_SIZE      = 2048;	// 16 x 16 pool pages
+const int VIRTUAL_PAGE_BUDGET    = 48;		// Pages rendered per frame at most
+const int VIRTUAL_PREPASS_SCALE  = 2;		// The prepass is this much smaller than the viewport
+
+struct VIRTUALSHADOWMAP
+{
+	GLuint      poolFbo;
+	GLuint      poolTexture;			// GL_DEPTH_COMPONENT24, compare mode on
+	GLuint      tableTexture;			// Packed page table, RGBA8
+	GLuint      prepassFbo;
+	GLuint      prepassDepth;			// Renderbuffer of the visibility prepass
+	int         prepassWidth;
+	int         prepassHeight;
+	GLhandleARB lookupProgram;
+	float       lightView[16];			// Light the resident pages were rendered from
+	unsigned    instanceGeneration;		// sceneInstanceGeneration() of the casters below
+	std::vector<SCENECASTER> casters;	// g_sceneCasters the pages were rendered with
+	std::vector<bool>        casterVisible;	// State of pageCasterFilter()
+	int         objectIndex;
+	int         pagesRendered;			// Last frame's statistics
+	int         castersMoved;
+};
+
+VIRTUALSHADOWMAP g_virtualShadowMap;
+PAGECACHE        g_pageCache;
+std::vector<float>         g_prepassDepth;
+std::vector<float>         g_prepassTexels;	// Level 0 texel (s, t) of every prepass sample, -1 if none
+std::vector<unsigned char> g_pageTable;
+
+// SHADOW_RAYTRACE: the scene's triangles are put into a SAH BVH every frame.
+// Each viewport is drawn lit, its depth is read back, and every pixel's
+// world position sends a shadow ray to g_lightPosition on the thread pool.
+// The answers are uploaded as a luminance texture that the viewport is then
+// multiplied by, which blackens shadows just like the SGIX compare does.
+const float RAY_SHADOW_BIAS = 0.02f;	// World units a shadow ray skips at the surface
+
+BVH                        g_sceneBVH;
+GLuint                     g_rayVisibilityTexture = 0;
+int                        g_rayTextureWidth      = 0;	// Power of two at least the viewport
+int                        g_rayTextureHeight     = 0;
+std::vector<float>         g_rayDepth;
+std::vector<unsigned char> g_rayVisibility;
+double                     g_bvhBuildMs = 0.0;		// Last frame's timings, for the title
+double                     g_rayTraceMs = 0.0;		// All viewports, readback and upload included
+int                        g_rayCount   = 0;
+
+// Cached triangle versions of the scene's primitives, see mesh.h
+MESH g_teapotMesh;
+MESH g_sphereMesh;
+MESH g_torusMesh;
+MESH g_floorMesh;						// Flat, for the instanced draws
+MESH g_tiltedFloorMesh;					// One corner raised (F5 in scene 0)
+
+const float FLOOR_RADIUS = 7.1f;	// Bounding sphere of the 10 x 10 floor quad
+const float FLOOR_TILT_Y = 3.0f;	// Height of the tilted floor's raised corner
+
+// Per-object hook used by renderScene(), see objectVisible().
+typedef bool (*OBJECTFILTER)( const float center[3], float radius );
+OBJECTFILTER g_pfnObjectFilter = NULL;
+
+// Set while a pass can only consume GL_TRIANGLES (e.g. through a geometry shader).
+bool g_bTriangleGeometry = false;
+
+// When set, renderScene() hands every mesh to this callback instead of
+// drawing it, with the object's model matrix on the GL modelview stack.
+typedef void (*MESHSINK)( const MESH& mesh );
+MESHSINK g_pfnMeshSink = NULL;
+
+// renderScene() walks the scene once per frame into this draw list ('L'),
+// and every later call in the frame replays it: the shadow passes, the four
+// viewports and the CPU collectors only change the matrices around it. The
+// filter and the mesh sink still see every object in the same order, with
+// the same bounds and the same model matrix, as in a walk of the scene.
+struct DRAWITEM
+{
+	const MESH* mesh;
+	float       model[16];
+	float       color[4];
+	float       center[3];				// World-space bounding sphere, as objectVisible() gets it
+	float       radius;
+};
+
+std::vector<DRAWITEM> g_drawList;
+SPHEREBATCH           g_drawBounds;		// The items' bounding spheres, for cullSphereBatch()
+bool g_bDrawList      = true;			// Record and replay instead of walking every time
+bool g_bDrawListValid = false;			// Recorded for the current frame
+
+// The object a mesh sink is being handed, as the walk or the replay knows
+// it on the CPU, so no sink has to read the GL stacks back. NULL outside a
+// walk that sets them.
+const float* g_pSinkModel = NULL;		// World matrix, for getSinkModelMatrix()
+const float* g_pSinkColor = NULL;		// RGBA, for getSinkColor()
+
+// Multi-view ('V'): instead of replaying the scene once per viewport, one
+// replay goes through a geometry shader that copies every triangle into all
+// four viewports with gl_ViewportIndex. Only the lookups that are a plain
+// depth compare (the p-buffer, adaptive, incremental and CPU raster maps)
+// have a shader version, the other modes keep the per-viewport loop.
+struct MULTIVIEW
+{
+	GLhandleARB program;
+	GLint       viewProjectionLocation;
+	GLint       viewLocation;
+	GLint       shadowMatrixLocation;
+	GLint       lightPositionLocation;
+	GLint       shadowMapLocation;
+	GLint       fogModeLocation;
+};
+
+MULTIVIEW g_multiView = { 0 };
+bool g_bMultiView = false;
+
+// View frustum culling ('C'). render() brackets each viewport's scene with
+// beginViewCulling(); a replayed draw list is then culled up front in SSE
+// batches, a walk of the scene one object at a time in objectVisible().
+// The multi-view pass culls against the union of the four frustums.
+const int MAX_CULL_VIEWS = 4;
+
+// Occlusion culling ('H') in the same brackets: beginViewCulling() also
+// rasterizes the scene's large objects into a small depth pyramid per view
+// (occlusion.h), and an object inside a frustum is still skipped when that
+// view's pyramid hides it. createDepthTexture() brackets the light's pass
+// as well, so casters hidden behind others from the light are dropped too.
+const int   OCCLUSION_WIDTH     = 128;	// Multiple of 4
+const int   OCCLUSION_HEIGHT    = 96;
+const float OCCLUDER_MIN_RADIUS = 1.0f;	// Teapots and the floor, not the spheres
+
+struct VIEWCULL
+{
+	bool                       active;
+	bool                       frustum;		// Test the planes
+	bool                       occlusion;	// Test the pyramids
+	int                        viewCount;
+	float                      planes[MAX_CULL_VIEWS][6][4];
+	HIZBUFFER                  pyramids[MAX_CULL_VIEWS];
+	int                        pyramidView;	// Being filled by occluderMeshSink()
+	std::vector<unsigned char> visible;		// Per draw item, while listCulled
+	std::vector<unsigned char> viewVisible;	// Scratch for one frustum of the union
+	bool                       listCulled;
+	int                        drawn;		// Summed over the frame's passes
+	int                        culled;		// Outside the frustums
+	int                        occluded;	// Inside, but hidden
+	int                        occluders;	// Meshes rasterized into the pyramids
+};
+
+VIEWCULL g_viewCull;
+bool g_bViewCulling = true;
+bool g_bOcclusionCulling = false;
+
+// GLSL lookup ('G'): the depth compare lookup as a vertex and fragment
+// shader. Meshes come in through a mesh sink as a_position and a_normal,
+// with the model, view-projection and world-to-shadow-map matrices as
+// uniforms, so neither the matrix stacks, the texgen planes, the texture
+// matrix nor the SGIX compare state is used, and GL_LIGHT0 is evaluated
+// per pixel. Same maps and modes as the multi-view pass.
+struct SHADERLOOKUPPROGRAM
+{
+	GLhandleARB program;
+	GLint       modelLocation;
+	GLint       viewProjectionLocation;
+	GLint       viewLocation;
+	GLint       shadowMatrixLocation;
+	GLint       positionLocation;		// a_position
+	GLint       normalLocation;			// a_normal, -1 where unused
+};
+
+struct SHADERLOOKUP
+{
+	SHADERLOOKUPPROGRAM shade;			// Lighting, shadow2DProj() and fog
+	SHADERLOOKUPPROGRAM depth;			// The same vertex shader alone, for the depth prepass
+	GLint               lightPositionLocation;
+	GLint               ambientLocation;
+	GLint               diffuseLocation;
+	GLint               shadowMapLocation;
+	GLint               fogModeLocation;
+	const SHADERLOOKUPPROGRAM* current;	// Bound by beginShaderLookupProgram(), for shaderLookupSink()
+	MESHSINK            sink;			// The sink it replaced
+	bool                pbuffer;		// Bound by beginShaderLookup(), for endShaderLookup()
+};
+
+SHADERLOOKUP g_shaderLookup = { 0 };
+bool g_bShaderLookup = false;
+
+// Depth prepass ('Z'): each viewport first lays down depth alone, drawing
+// only the positions of the cached meshes, the stream the CPU shadow passes
+// read through their mesh sinks. The shading pass then runs with GL_EQUAL,
+// so lighting, fog and the shadow lookup are done once per pixel however
+// many objects overlap it. The shading pass draws the same meshes through
+// g_bTriangleGeometry so both passes produce the same depths, which also
+// takes the instanced scenes to the per-object path. With the GLSL lookup
+// both passes go through its vertex shader instead. The multi-view pass
+// is left as it is.
+bool g_bDepthPrepass = false;
+
+// benchmarkShadowMaps() times render()'s views alone. While active, render()
+// takes GPU timestamps around the four viewports, or waits for the GPU at
+// both ends without timer queries, and doesn't swap. The shadow pass, the
+// overlays, vsync and the frame pacing are left out of the figure.
+struct VIEWPASSTIMER
+{
+	bool   active;
+	GLuint timestamps[2];				// GL_TIMESTAMP before and after the views
+	double start;						// getMilliseconds(), without timer queries
+	double ms;							// The last frame's views
+};
+
+VIEWPASSTIMER g_viewPassTimer = { 0 };
+
 //-----------------------------------------------------------------------------
 // PROTOTYPES
 //-----------------------------------------------------------------------------
@@ -163,10 +1025,154 @@ void init(void);
 void shutDown(void);
 void initExtensions(void);
 void initPbuffer(void);
+void freePbuffer(void);
 void render(void);
 void renderScene(void);
 void createDepthTexture(void);
 void displayDepthTexture(void);
+bool setShadowMode(int mode);
+void nextShadowMode(void);
+void updateWindowTitle(void);
+void appendTitle(char* title, size_t size, const char* format, ...);
+GLhandleARB compileProgram(const char* header, const char* vertexSource, const char* fragmentSource,
+						   const char* geometrySource = NULL, GLint geometryVerticesOut = 0);
+int currentFogMode(void);
+bool initMomentMap(void);
+void freeMomentMap(void);
+void createMomentMap(void);
+void blurMomentMap(void);
+void drawFullScreenQuad(void);
+bool initCubeShadowMap(void);
+void freeCubeShadowMap(void);
+void createCubeShadowMap(void);
+bool cubeFaceFilter(const float center[3], float radius);
+void beginCubeShadowLookup(void);
+void endCubeShadowLookup(void);
+bool initShadowAtlas(void);
+void freeShadowAtlas(void);
+void allocateShadowAtlas(void);
+void createShadowAtlas(void);
+bool atlasCasterFilter(const float center[3], float radius);
+void renderAtlasLights(void);
+void initSoftwareShadowMap(void);
+void freeSoftwareShadowMap(void);
+void rasterizeShadowMap(void);
+void rasterizeMeshSink(const MESH& mesh);
+void uploadSoftwareShadowMap(void);
+void benchmarkShadowMaps(void);
+double getMilliseconds(void);
+void collectSceneBounds(void);
+bool boundsCollectFilter(const float center[3], float radius);
+void buildCameraMatrix(float m[16], float projection[16]);
+bool initAdaptiveShadowMap(void);
+void freeAdaptiveShadowMap(void);
+float measureReceiverFootprint(void);
+void chooseAdaptiveLevel(void);
+void createAdaptiveDepthTexture(void);
+void renderDepthTarget(GLuint fbo, int width, int height);
+bool setDepthFormat(int format);
+void nextDepthFormat(void);
+void updateLightMatrices(void);
+bool initIncrementalShadowMap(void);
+void freeIncrementalShadowMap(void);
+void createIncrementalDepthTexture(void);
+void renderIncrementalLayer(int layer, const int rect[4]);
+bool incrementalCasterFilter(const float center[3], float radius);
+void buildLightProjection(float m[16]);
+void buildCameraView(float m[16]);
+void buildCameraInverseView(float m[16]);
+void computeFrustumCorners(void);
+void updateShadowWarp(void);
+void queryShadowPoints(const float* x, const float* y, const float* z, int count,
+					   float* visibility, int pcfRadius);
+void beginMomentLookup(void);
+void endMomentLookup(void);
+bool initVirtualShadowMap(void);
+void freeVirtualShadowMap(void);
+void createVirtualShadowMap(void);
+void invalidateMovedCasters(void);
+void invalidateCasterBounds(const float light[16], const float bounds[4]);
+void collectSceneCasters(void);
+bool casterCollectFilter(const float center[3], float radius);
+void casterCollectSink(const MESH& mesh);
+bool lightSpaceRect(const float light[16], const float bounds[4], float rect[4]);
+void findVisiblePages(void);
+void renderVirtualPages(const std::vector<int>& pages);
+bool pageCasterFilter(const float center[3], float radius);
+void beginVirtualShadowLookup(void);
+void endVirtualShadowLookup(void);
+void initRayTracedShadows(void);
+void freeRayTracedShadows(void);
+void buildSceneBVH(void);
+void bvhMeshSink(const MESH& mesh);
+void traceViewportShadows(int x, int y, const float view[16], const float projection[16]);
+void renderDepthPrepass(const float view[16], const float projection[16]);
+void beginViewPassTimer(void);
+void endViewPassTimer(void);
+void depthPrepassSink(const MESH& mesh);
+void recordDrawList(void);
+bool recordFilter(const float center[3], float radius);
+void recordMeshSink(const MESH& mesh);
+void replayDrawList(void);
+void getSinkModelMatrix(float m[16]);
+void getSinkColor(float color[4]);
+void initFramePacer(void);
+void freeFramePacer(void);
+void beginFrame(void);
+void endFrame(void);
+void waitForFrameSlot(FRAMESLOT& slot);
+bool initStreamBuffer(void);
+void freeStreamBuffer(void);
+void beginStreamFrame(void);
+void* streamAlloc(GLsizeiptr bytes, GLintptr* offset);
+void drawAxis(const float model[16], int layer);
+void buildDebugDraw(void);
+void renderDebugDraw(void);
+void renderTorus(void);
+void resetInstanceSet(INSTANCESET& set, const MESH* const* meshes, int meshCount);
+void addInstance(INSTANCESET& set, int mesh, const float position[3], float yaw, float scale, const float color[3]);
+void renderInstanceSet(INSTANCESET& set);
+unsigned sceneInstanceGeneration(void);
+void renderInstanceMesh(const MESH* mesh);
+INSTANCEPROGRAM* instancePassProgram(int* slot);
+void freeInstanceProgram(INSTANCEPROGRAM& program);
+void freeInstanceGL(INSTANCEGL& gl);
+void forgetInstanceGL(INSTANCEGL& gl);
+void syncInstanceGL(INSTANCESET& set, INSTANCEGL& gl);
+void drawInstances(INSTANCESET& set, INSTANCEGL& gl, const INSTANCEPROGRAM& program, bool culled);
+void buildStressScene(void);
+void sceneLoaderThread(SCENELOADER* loader);
+void startSceneLoader(void);
+void stopSceneLoader(void);
+void updateLoadedScene(void);
+void buildSceneGraphs(void);
+void updateSceneGraph(void);
+void renderSceneGraph(SCENEGRAPH& graph);
+void renderSceneMesh(const SCENENODE& node);
+bool sceneGroupVisible(const float center[3], float radius);
+bool initMultiView(void);
+void freeMultiView(void);
+bool multiViewActive(void);
+void buildViewMatrices(float view[4][16], float projection[4][16]);
+void renderMultiView(void);
+void beginViewCulling(const float view[][16], const float projection[][16], int count);
+void endViewCulling(void);
+bool viewCullObject(const float center[3], float radius);
+bool viewCullSphere(int view, const float center[3], float radius);
+void buildOcclusionPyramid(int view, const float viewProjection[16]);
+bool occluderFilter(const float center[3], float radius);
+void occluderMeshSink(const MESH& mesh);
+bool initShaderLookup(void);
+void freeShaderLookup(void);
+bool initShaderLookupProgram(SHADERLOOKUPPROGRAM& lookup, const char* fragmentSource);
+bool shaderLookupActive(void);
+void beginShaderLookup(const float view[16], const float projection[16]);
+void endShaderLookup(void);
+void beginShaderLookupProgram(const SHADERLOOKUPPROGRAM& lookup, const float view[16], const float projection[16]);
+void endShaderLookupProgram(void);
+void shaderLookupSink(const MESH& mesh);
+bool bindDepthCompareMap(void);
+void releaseDepthCompareMap(bool pbuffer);
 
 int nWidth;
 int nHeight;
@@ -204,8 +1210,103 @@ LRESULT CALLBACK WindowProc( HWND   hWnd,
 					fovy/=0.9;
 					break;
 				case '3':
+					if (g_blurRadius > 0)
+						--g_blurRadius;
 					break;
 				case '4':
+					if (g_blurRadius < MAX_BLUR_RADIUS)
+						++g_blurRadius;
+					break;
+				case '5':
+					if (g_shadowMode == SHADOW_ESM)
+						g_esmExponent = max(g_esmExponent - 5.0f, 5.0f);
+					else
+						g_vsmLightBleed = max(g_vsmLightBleed - 0.05f, 0.0f);
+					break;
+				case '6':
+					if (g_shadowMode == SHADOW_ESM)
+						g_esmExponent = min(g_esmExponent + 5.0f, 80.0f);		//exp(80)ѽӽfloat.
+					else
+						g_vsmLightBleed = min(g_vsmLightBleed + 0.05f, 0.95f);
+					break;
+
+				case '7':
+					if (g_shadowLightCount > 1)
+						--g_shadowLightCount;
+					break;
+				case '8':
+					if (g_shadowLightCount < MAX_SHADOW_LIGHTS)
+						++g_shadowLightCount;
+					break;
+
+				case '9':
+					if (g_bAdaptiveResolution || initAdaptiveShadowMap())
+						g_bAdaptiveResolution = !g_bAdaptiveResolution;
+					break;
+				case '0':
+					nextDepthFormat();
+					break;
+				case 'W':
+					g_bShadowWarp = !g_bShadowWarp;
+					break;
+				case 'I':
+					if (g_bIncrementalShadow || initIncrementalShadowMap())
+						g_bIncrementalShadow = !g_bIncrementalShadow;
+					break;
+				case 'L':
+					g_bDrawList = !g_bDrawList;
+					break;
+				case 'V':
+					if (g_bMultiView || initMultiView())
+						g_bMultiView = !g_bMultiView;
+					break;
+				case 'C':
+					g_bViewCulling = !g_bViewCulling;
+					break;
+				case 'H':
+					g_bOcclusionCulling = !g_bOcclusionCulling;
+					break;
+				case 'Z':
+					g_bDepthPrepass = !g_bDepthPrepass;
+					break;
+				case 'D':
+					g_debugDraw.enabled = !g_debugDraw.enabled;
+					break;
+				case 'G':
+					if (g_bShaderLookup || initShaderLookup())
+						g_bShaderLookup = !g_bShaderLookup;
+					break;
+				case 'P':
+					g_framePacer.framesInFlight = g_framePacer.framesInFlight % MAX_FRAMES_IN_FLIGHT + 1;
+					break;
+				// Only in scene 4: a rebuild changes sceneInstanceGeneration(),
+				// which would throw away the shadow caches of any other scene.
+				case VK_ADD:
+				case VK_OEM_PLUS:
+				case VK_SUBTRACT:
+				case VK_OEM_MINUS:
+					if (sceneNo == STRESS_SCENE)
+					{
+						bool more  = wParam == VK_ADD || wParam == VK_OEM_PLUS;
+						int  count = more ? min(g_stressScene.count * 2, MAX_STRESS_INSTANCES) : max(g_stressScene.count / 2, 1);
+
+						if (count != g_stressScene.count)
+						{
+							g_stressScene.count = count;
+							buildStressScene();
+						}
+					}
+					break;
+				case 'R':
+					if (sceneNo == STRESS_SCENE)
+					{
+						g_stressScene.random = !g_stressScene.random;
+						buildStressScene();
+					}
+					break;
+				case 'O':
+					sceneNo = LOADED_SCENE;
+					startSceneLoader();
 					break;
 
 				case 33:			//PageUp
@@ -257,8 +1358,10 @@ LRESULT CALLBACK WindowProc( HWND   hWnd,
 					fog =! fog;
 					break;
 				case VK_F9:
+					nextShadowMode();
 					break;
 				case VK_F10:
+					benchmarkShadowMaps();
 					break;
 				case VK_F11:
 					sceneNo-=1;
@@ -268,7 +1371,7 @@ LRESULT CALLBACK WindowProc( HWND   hWnd,
 					break;
 				default:
 					MessageBox(NULL, 
-						"F1 - ֱȾ\nF2 - ǷʾԴָʾ\nF3 - Ƿʾ\nF4 - ģʽл\nF5 - Ƿ΢(ͬ龳òͬ)\nF6 - ǷʾӾ\nF7 - Ƿֱ߿\nF8 - Ƿ\nF11, F12 - һ/һ\n1 - Сӽ\n2 - ӽ\nPageDown, PageUP - ƶԴ\n - Զ",
+						"F1 - ֱȾ\nF2 - ǷʾԴָʾ\nF3 - Ƿʾ\nF4 - ģʽл\nF5 - Ƿ΢(ͬ龳òͬ)\nF6 - ǷʾӾ\nF7 - Ƿֱ߿\nF8 - Ƿ\nF9 - лӰ㷨(ȱȽ/VSM/ESM/Դ/Դͼ/CPUդ/ҳ/׷)\nF10 - Ӱͼɺʱ(p-bufferԱCPUդ)\nF11, F12 - һ/һ(4: ʵѹ, 5: ļ)\n1 - Сӽ\n2 - ӽ\n3, 4 - С/Ӱģ뾶\n5, 6 - С/©(VSM)ָ(ESM)\n7, 8 - /ӴӰĹԴ(Դͼ)\n9 - ӦӰͼֱ(ȱȽ)\n0 - лӰͼȸʽ(16λ/24λ/32λ)\nW - ͸ӱӰͼ(TSM)\nI - Ӱͼ(̬/̬Ͷֲ, ȱȽ)\nL - ÿֻ֡һγ, ӿڻطŻб\nV - ύĸӿ(ӿ, ȱȽ/CPUդ)\nC - ӿڵӾ޳\nH - ڵ޳(ӿڼԴӽ, ڵ)\nD - Ի(Դָʾ, Ӿ, )ܿ\nZ - ԤȾ(ӿֻд, GL_EQUALɫһ)\nG - GLSLعӰ(ɺSGIXȽ, ȱȽ/CPUդ)\nP - лGPUͬʱ;֡(1/2/3)\n+, - - /ѹԳ(4)\nR - ѹԳ/ڷ\nO - 볡ļ(5, вscene.scn)\nPageDown, PageUP - ƶԴ\n - Զ",
 						"ѡȷĲ", MB_OK | MB_ICONEXCLAMATION);
 					break;
 			}
@@ -372,847 +1475,7038 @@ LRESULT CALLBACK WindowProc( HWND   hWnd,
 
 	if ( (msg == WM_KEYDOWN ) || (msg == WM_MOUSEWHEEL ) || ((msg == WM_MOUSEMOVE) && (bMousing_L || bMousing_R)) || ((msg == WM_SIZE) && (ini == false)) )
 	{
-		render();
+		g_bRedraw = true;		// ͬػ, ϢѭڴŶӵһ֡.
 	}
 
 	return 0;
 }
 
-void drawAxis()
+//-----------------------------------------------------------------------------
+// Name: drawAxis()
+// Desc: Queues the three axes for this frame's debug draw, moved by model
+//       (NULL: at the layer's origin).
+//-----------------------------------------------------------------------------
+void drawAxis( const float model[16], int layer )
 {
-	glDisable(GL_LIGHTING);
-	glBegin(GL_LINES);
-	{
-		glColor3f(1,0,0);
-		glVertex3f(0,0,adjust?-0.1:0); glVertex3f(100,0,adjust?-0.1:0);
+	float floorZ = adjust ? -0.1f : 0.0f;
 
-		glColor3f(0,1,0);
-		glVertex3f(0,0,adjust?-0.1:0); glVertex3f(0,100,adjust?-0.1:0);
+	// x y z r g b
+	const float lines[6][6] =
+	{
+		{ 0, 0, floorZ, 1, 0, 0 }, { 100, 0, floorZ, 1, 0, 0 },
+		{ 0, 0, floorZ, 0, 1, 0 }, { 0, 100, floorZ, 0, 1, 0 },
+		{ 0, 0, floorZ, 0, 0, 1 }, { 0, 0, 100,      0, 0, 1 },
+	};
 
-		glColor3f(0,0,1);
-		glVertex3f(0,0,adjust?-0.1:0); glVertex3f(0,0,100);
-	}
-	glEnd();
-	glEnable(GL_LIGHTING);
+	debugDrawLines( g_debugDraw, layer, model, &lines[0][0], 6 );
 }
 
 //-----------------------------------------------------------------------------
-// Name: renderScene()
-// Desc:
+// Name: objectVisible()
+// Desc: renderScene() asks this before drawing each object, passing its
+//       world-space bounding sphere. Draws everything inside the viewport
+//       being culled unless a pass has installed g_pfnObjectFilter.
 //-----------------------------------------------------------------------------
-void renderScene( void )
+bool objectVisible( float x, float y, float z, float radius )
 {
-	switch (sceneNo)
-	{
-		default:
-			sceneNo=0;
-			break;
-		case 2:
-		case 0:		//һĵ
-		{
-			glMatrixMode( GL_MODELVIEW );
-
-			// Render teapot...
-			glPushMatrix();
-			{
-				// Teapot's position & orientation
-				glTranslatef( 0.0f, 2.5f, 0.0f );
-				glRotatef( -g_fSpinY_R, 1.0f, 0.0f, 0.0f );
-				glRotatef( -g_fSpinX_R, 0.0f, 1.0f, 0.0f );
-
-				glColor3f( 1.0f, 1.0f , 1.0f );
-				renderSolidTeapot( 1.0);
-			}
-			glPopMatrix();
+	float center[3] = { x, y, z };
 
-			// Render floor as a single quad...
-			glPushMatrix();
-			{
-				glutSolidSphere(0.5, 32, 8);		//֤ƽͶӰȷ.
-				glBegin( GL_QUADS );
-				{
-					glNormal3f( 0.0f, 1.0f,  0.0f );		//ָйЧ. ͲԶɹ.
-					glVertex3f(-5.0f, 0.0f, -5.0f );
-					glVertex3f(-5.0f, 0.0f,  5.0f );
-					glVertex3f( 5.0f, 0.0f,  5.0f );
-					glVertex3f( 5.0f, 0.0f, -5.0f );
-				}
-				glEnd();
-			}
-			glPopMatrix();
-		}
-		break;
+	// A replayed draw list was already culled as a batch.
+	if( g_viewCull.active && !g_viewCull.listCulled && !viewCullObject( center, radius ) )
+		return false;
 
-		case 1:			//һı
-		{
-			glMatrixMode( GL_MODELVIEW );
+	if( g_pfnObjectFilter == NULL )
+		return true;
 
-			glPushMatrix();
-			{
-				glBegin( GL_QUADS );
-				{
-					glNormal3f( 0.0f, 1.0f,  0.0f );		//ָйЧ. ͲԶɹ.
-					glVertex3f(-5.0f, 0.0f, -5.0f );
-					glVertex3f(-5.0f, 0.0f,  5.0f );
-					glVertex3f( 5.0f, 0.0f,  5.0f );
-					glVertex3f( 5.0f, adjust?3.0f:0.0f, -5.0f );
-				}
-				glEnd();
-			}
-			glPopMatrix();
-		}
-		break;
+	return g_pfnObjectFilter( center, radius );
+}
 
-		case 3:
-		{
-			glMatrixMode( GL_MODELVIEW );
-			glColor3f(1,1,1);
-			
-			glPushMatrix();
-			{
-				glTranslatef( -2.5f, 0.8f, -2.5f );
-				drawAxis();
+//-----------------------------------------------------------------------------
+// Name: renderTeapot(), renderSphere(), renderTorus(), renderFloor()
+// Desc: The scene's primitives. Passes that set g_bTriangleGeometry get the
+//       cached triangle meshes instead of geometry.h's quads, strips and
+//       evaluators.
+//-----------------------------------------------------------------------------
+void renderTeapot( void )
+{
+	if( g_pfnMeshSink )
+		g_pfnMeshSink( g_teapotMesh );
+	else if( g_bTriangleGeometry )
+		drawMesh( g_teapotMesh );
+	else
+		renderSolidTeapot( 1.0);
+}
 
-				renderSolidTeapot( 1.0);
-			}
-			glPopMatrix();
+void renderSphere( void )
+{
+	if( g_pfnMeshSink )
+		g_pfnMeshSink( g_sphereMesh );
+	else if( g_bTriangleGeometry )
+		drawMesh( g_sphereMesh );
+	else
+		glutSolidSphere(0.5, 32, 8);
+}
 
-			glPushMatrix();
-			{
-				glTranslatef( 2.5f, 0.8f, 2.5f );
-				drawAxis();
+void renderTorus( void )
+{
+	if( g_pfnMeshSink )
+		g_pfnMeshSink( g_torusMesh );
+	else if( g_bTriangleGeometry )
+		drawMesh( g_torusMesh );
+	else
+		renderSolidTorus( TORUS_INNER_RADIUS, TORUS_OUTER_RADIUS, 16, 32 );
+}
 
-				renderSolidTeapot( 1.0);
-			}
-			glPopMatrix();
+void renderFloor( bool tilted )
+{
+	// The same mesh for both, so a depth prepass through a sink matches the
+	// triangle pass that shades it.
+	if( g_pfnMeshSink || g_bTriangleGeometry )
+	{
+		const MESH& floorMesh = tilted ? g_tiltedFloorMesh : g_floorMesh;
 
-			glPushMatrix();
-			{
-				drawAxis();
+		if( g_pfnMeshSink )
+			g_pfnMeshSink( floorMesh );
+		else
+			drawMesh( floorMesh );
+		return;
+	}
 
-				glBegin( GL_QUADS );
-				{
-					glNormal3f( 0.0f, 1.0f,  0.0f );		//ָйЧ. ͲԶɹ.
-					glVertex3f(-5.0f, 0.0f, -5.0f );
-					glVertex3f(-5.0f, 0.0f,  5.0f );
-					glVertex3f( 5.0f, 0.0f,  5.0f );
-					glVertex3f( 5.0f, 0.0f, -5.0f );
-				}
-				glEnd();
-			}
-			glPopMatrix();
+	float cornerY = tilted ? FLOOR_TILT_Y : 0.0f;
 
-		}
-		break;
+	glBegin( GL_QUADS );
+	{
+		glNormal3f( 0.0f, 1.0f,  0.0f );		//ָйЧ. ͲԶɹ.
+		glVertex3f(-5.0f, 0.0f, -5.0f );
+		glVertex3f(-5.0f, 0.0f,  5.0f );
+		glVertex3f( 5.0f, 0.0f,  5.0f );
+		glVertex3f( 5.0f, cornerY, -5.0f );
 	}
+	glEnd();
 }
 
 //-----------------------------------------------------------------------------
-// Name: render()
-// Desc:
+// Name: renderScene()
+// Desc: Draws the current scene: the draw list if one was recorded, the
+//       stress scene, the scene file, or the graph of scenes 0 - 3.
 //-----------------------------------------------------------------------------
-void render( void )
+void renderScene( void )
 {
-	if (fog)
+	if (g_bDrawListValid)
 	{
-		if (adjust)
+		replayDrawList();
+		return;
+	}
+
+	if (sceneNo == STRESS_SCENE)		//, ʵ
+	{
+		glMatrixMode( GL_MODELVIEW );
+		glColor3f( 1.0f, 1.0f, 1.0f );
+
+		renderInstanceSet( g_stressScene.set );
+
+		static const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+		static const float white[4]     = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+		glPushMatrix();
+		if( objectVisible( 0.0f, 0.0f, 0.0f, FLOOR_RADIUS ) )
 		{
-			glClearColor(0.5, 0.5, 0.5, 1.0);
-			glFogfv (GL_FOG_COLOR, gray);
-			glFogi (GL_FOG_MODE, GL_EXP);
-		}
-		else
-		{
-			glClearColor(0.35f, 0.53f, 0.7f, 1.0f);
-			glFogfv(GL_FOG_COLOR, blue);
-			glFogi (GL_FOG_MODE, GL_LINEAR);
+			g_pSinkModel = identity;
+			g_pSinkColor = white;
+			renderFloor( false );
+			g_pSinkModel = NULL;
+			g_pSinkColor = NULL;
 		}
-		glEnable(GL_FOG);
-	}
-	else
-	{
-		glDisable(GL_FOG);
+		glPopMatrix();
+		return;
 	}
-	if (smooth)
+
+	if (sceneNo == LOADED_SCENE)		//ļ
 	{
-		glEnable(GL_BLEND);
-		glEnable(GL_LINE_SMOOTH);
-		glHint(GL_NICEST,GL_LINE_SMOOTH_HINT);
+		glMatrixMode( GL_MODELVIEW );
+		glColor3f( 1.0f, 1.0f, 1.0f );
+
+		renderInstanceSet( g_sceneLoader.set );
+		return;
 	}
-	else
+
+	if (sceneNo > LOADED_SCENE)
 	{
-		glDisable(GL_LINE_SMOOTH);
+		sceneNo = 0;
+		updateSceneGraph();
 	}
-	// Create a look-at matrix for our light and cache it for later use...
-	glMatrixMode( GL_MODELVIEW );
-	glLoadIdentity();
 
-	gluLookAt( g_lightPosition[0], g_lightPosition[1], g_lightPosition[2], // Look from the light's position
-			   0.0f, 2.5f, 0.0f,   // Towards the teapot's position
-			   0.0f, 1.0f, 0.0f ); // Up vector
-
-	// Get the model-view matrix
-	glGetFloatv( GL_MODELVIEW_MATRIX, g_lightsLookAtMatrix );
-
-	createDepthTexture();
+	renderSceneGraph( g_sceneGraphs[sceneNo] );
+}
 
-	//ʽ
-	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
-	glFlush();
+//-----------------------------------------------------------------------------
+// Name: buildSceneGraphs()
+// Desc: One graph per scene from g_sceneObjects. The meshes must be built,
+//       their radii are the nodes' bounds.
+//-----------------------------------------------------------------------------
+void buildSceneGraphs( void )
+{
+	int first[STRESS_SCENE];		// Node of each scene's first entry
 
-	for (int i = 0; i < 4; ++i)
+	for( int scene = 0; scene < STRESS_SCENE; ++scene )
 	{
-		glViewport(nWidth * (i % 2 == 1), nHeight * (i >= 2), nWidth, nHeight);
-
-		if (i == 1)			//ͼ
-		{
-			glMatrixMode( GL_PROJECTION );
-			glLoadIdentity();
-			gluPerspective( fovy, (GLdouble)nWidth / (GLdouble)nHeight, -nearZ, -farZ);
-			// Place the view
-			glMatrixMode( GL_MODELVIEW );
-			glLoadIdentity();
-
-			for (int i=0;i<4;++i)
-			{
-				point[i][0] = rescale*nearZ*tan(fovy/180*PI/2)*((i==0||i==3)?-1:1);
-				point[i][1] = rescale*nearZ*tan(fovy/180*PI/2)*(i&2?1:-1)*(GLdouble)nHeight/(GLdouble)nWidth;
-				point[i][2] =  nearZ;
+		sceneGraphClear( g_sceneGraphs[scene] );
+		first[scene] = 0;
+	}
 
-				point[i+4][0] = (adjust?0.95:1)*rescale*farZ*tan(fovy/180*PI/2)*((i==0||i==3)?-1:1);
-				point[i+4][1] = (adjust?0.95:1)*rescale*farZ*tan(fovy/180*PI/2)*(i&2?1:-1)*(GLdouble)nHeight/(GLdouble)nWidth;
-				point[i+4][2] =  farZ;
-			}
+	for( int i = 0; i < (int)(sizeof(g_sceneObjects) / sizeof(g_sceneObjects[0])); ++i )
+	{
+		const SCENEOBJECT& object = g_sceneObjects[i];
+		SCENEGRAPH&        graph  = g_sceneGraphs[object.scene];
 
-			if (frustrum)
-			{
-				glDisable(GL_LIGHTING);
-				glColor3f(1,0,0);
-				glBegin(GL_LINES);
-				{
-					glColor3f(1,0,0);
-					for (int i=0;i<4;++i)
-					{
-						glVertex3fv(point[i]);
-						glVertex3fv(point[(i+1)&3]);
-					}
-					glColor3f(0,1,0);
-					for (int i=0;i<4;++i)
-					{
-						glVertex3fv(point[i]);
-						glVertex3fv(point[i+4]);
-					}
-					glColor3f(0,0,1);
-					for (int i=0;i<4;++i)
-					{
-						glVertex3fv(point[i+4]);
-						glVertex3fv(point[(i+1)&3+4]);
-					}
-				}
-				glEnd();
-			}
+		float local[16];
+		matrixTranslate( local, object.position[0], object.position[1], object.position[2] );
 
-			glTranslatef( 0.0f, -2.0f, -z );						//ӽǱ任, עƹӽǱ任֮ǰ. translateʹԭ仯, .
-			glRotatef( -g_fSpinY_L, 1.0f, 0.0f, 0.0f );
-			glRotatef( -g_fSpinX_L, 0.0f, 1.0f, 0.0f );
-		}
-		else
-		{
-			//ͼ
-			glMatrixMode( GL_PROJECTION );
-			glLoadIdentity();
-			glOrtho(-nWidth / 50, nWidth / 50, -nHeight / 50, nHeight / 50, -40, 40);
-			// Place the view
-			glMatrixMode( GL_MODELVIEW );
-			glLoadIdentity();
+		float radius = object.mesh == SCENE_MESH_TEAPOT ? g_teapotMesh.radius :
+					   object.mesh == SCENE_MESH_SPHERE ? g_sphereMesh.radius :
+					   object.mesh == SCENE_MESH_TORUS  ? g_torusMesh.radius :
+					   object.mesh == SCENE_MESH_FLOOR  ? FLOOR_RADIUS : 0.0f;
 
-			if (i == 2)		//ͼ
-			{
-				glRotatef(90, 1.0f, 0.0f, 0.0f );
-			}
-			else if (i == 3)		//ͼ
-			{
-				glRotatef(90, 0.0f, 1.0f, 0.0f );
-			}
-		}
+		int parent = object.parent >= 0 ? first[object.scene] + object.parent : -1;
+		int node   = sceneGraphAddNode( graph, parent, local, object.mesh, object.material, radius );
 
-		// Render the light's position as a sphere...
-		glPushMatrix();
-		{
-			glLightfv( GL_LIGHT0, GL_POSITION, g_lightPosition );
+		graph.nodes[node].flags = object.flags;
 
-			if (sphere)
-			{
-				glDisable( GL_LIGHTING );
-				glTranslatef( g_lightPosition[0], g_lightPosition[1], g_lightPosition[2] );
-				glColor3f(1.0f, 1.0f, 0.5f);
-				renderSolidSphere( 0.1, 8, 8 );
-			}
-		}
-		glPopMatrix();
+		if( object.parent < 0 )
+			first[object.scene] = node;
+	}
 
-		// Set up OpenGL's state machine for a depth comparison using the depth texture...
-		glEnable( GL_LIGHTING );
-
-		float x[] = { 1.0f, 0.0f, 0.0f, 0.0f };
-		float y[] = { 0.0f, 1.0f, 0.0f, 0.0f };
-		float z[] = { 0.0f, 0.0f, 1.0f, 0.0f };
-		//float w[] = { 0.0f, 0.0f, 0.0f, 1.0f };						//Qȫû, ûϸĵ.
-		glTexGenfv( GL_S, GL_EYE_PLANE, x );
-		glTexGenfv( GL_T, GL_EYE_PLANE, y );
-		glTexGenfv( GL_R, GL_EYE_PLANE, z );
-		//glTexGenfv( GL_Q, GL_EYE_PLANE, w );
-
-		glTexGeni( GL_S, GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR );
-		glTexGeni( GL_T, GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR );
-		glTexGeni( GL_R, GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR );
-		//glTexGeni( GL_Q, GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR );
-
-		glEnable( GL_TEXTURE_GEN_S );
-		glEnable( GL_TEXTURE_GEN_T );
-		glEnable( GL_TEXTURE_GEN_R );
-		//glEnable( GL_TEXTURE_GEN_Q );
-
-		// Set up the depth texture projection
-		glMatrixMode( GL_TEXTURE );
-		glLoadIdentity();
-		glTranslatef( 0.5f, 0.5f, 0.5f );                     // Offset
-		glScalef( 0.5f, 0.5f, 0.5f );                          // Bias
-		gluPerspective( 75.0f, 640.0f / 480.0f, 0.1f, 100.0f); // light frustum
-		glMultMatrixf( g_lightsLookAtMatrix );                 // Light matrix
-		//עGL_EYE_LINEARģʽ, OpenGLڲԶԵǰMODELVIEW_MATRIX , ֱӱ任¾, ȻҪƶ.
-
-		// Bind the depth texture so we can use it as the shadow map...
-		glEnable( GL_TEXTURE_2D );
-		glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+	for( int scene = 0; scene < STRESS_SCENE; ++scene )
+		sceneGraphUpdate( g_sceneGraphs[scene] );
+}
 
-		// wglBindTexImageARB ǽpbuffer󶨵Ļ.
-		// ڱӦֻ÷, ȫpbuffer.
-		// pbufferҲҪʽ, ܱȾ, ſΪĸʽ.
-		if( wglBindTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )		//WGL_DEPTH_COMPONENT_NVָ˱ϵPBuffer: Ȼ.
-		{
-			MessageBox(NULL, "Could not bind p-buffer to render texture!",
-					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-			exit(-1);
-		}
+//-----------------------------------------------------------------------------
+// Name: updateSceneGraph()
+// Desc: Once a frame: moves the current scene's nodes that follow the input.
+//       Only what changed is marked dirty, sceneGraphUpdate() does the rest.
+//-----------------------------------------------------------------------------
+void updateSceneGraph( void )
+{
+	if( sceneNo >= STRESS_SCENE )
+		return;
 
-		// õľg_depthTexture:
-		// glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
-		// glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
-		// ǽԶɵRͼƬP, QӦȽ, еֵ, , ӦͿ.
-		// ͿڵЧڽӦصȳ0, 1.
-		// ɫΪ, ӰԶ.
-		renderScene();
+	SCENEGRAPH& graph = g_sceneGraphs[sceneNo];
 
-		if( wglReleaseTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
-		{
-			MessageBox(NULL, "Could not release p-buffer from render texture!",
-					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-			exit(-1);
-		}
+	for( size_t i = 0; i < graph.nodes.size(); ++i )
+	{
+		const SCENENODE& node = graph.nodes[i];
 
-		if (axis)
+		if( node.flags & SCENE_NODE_SPUN )
 		{
-			if (!objectCoodinate)
-			{
-				glMatrixMode(GL_MODELVIEW);
-				glLoadIdentity();
-			}
-			drawAxis();
+			// Teapot's position & orientation
+			float translation[16];
+			float spinY[16];
+			float spinX[16];
+			float rotation[16];
+			float local[16];
+
+			matrixTranslate( translation, node.local[12], node.local[13], node.local[14] );
+			matrixRotate( spinY, -g_fSpinY_R, 1.0f, 0.0f, 0.0f );
+			matrixRotate( spinX, -g_fSpinX_R, 0.0f, 1.0f, 0.0f );
+			matrixMultiply( rotation, spinY, spinX );
+			matrixMultiply( local, translation, rotation );
+
+			if( memcmp( local, node.local, sizeof(local) ) != 0 )
+				sceneGraphSetLocal( graph, (int)i, local );
 		}
 
-		// Reset some of the states for the next go-around!
-		glDisable( GL_TEXTURE_2D );
-		glDisable( GL_TEXTURE_GEN_S );
-		glDisable( GL_TEXTURE_GEN_T );
-		glDisable( GL_TEXTURE_GEN_R );
-	}
-
-	if( g_bRenderDepthTexture == true )
-	{
-		displayDepthTexture(); // For debugging...
+		if( node.flags & SCENE_NODE_TILTED )
+			sceneGraphSetRadius( graph, (int)i, FLOOR_RADIUS + (adjust ? 0.6f : 0.0f) );
 	}
 
-	SwapBuffers( g_hDC );
-	glFlush();
+	sceneGraphUpdate( graph );
 }
 
 //-----------------------------------------------------------------------------
-// Name: initExtensions()
-// Desc: ʼչ
+// Name: renderSceneGraph()
+// Desc: The graph's nodes sorted by mesh and material, minus the subtrees
+//       outside the viewports being culled. Every object still goes through
+//       objectVisible() first, so filters and mesh sinks see the objects
+//       one by one as before.
 //-----------------------------------------------------------------------------
-void initExtensions( void )
+void renderSceneGraph( SCENEGRAPH& graph )
 {
-	// wglGetExtensionsStringARB
-	wglGetExtensionsStringARB = (PFNWGLGETEXTENSIONSSTRINGARBPROC)wglGetProcAddress("wglGetExtensionsStringARB");
-	char* wgl_ext = NULL;
+	sceneGraphCollect( graph, sceneGroupVisible, g_sceneDraws );
 
-	if( wglGetExtensionsStringARB )
-	{
-		wgl_ext = (char*)wglGetExtensionsStringARB( wglGetCurrentDC() );
-	}
-	else
-	{
-		MessageBox(NULL, "Unable to get address for wglGetExtensionsStringARB!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
+	glMatrixMode( GL_MODELVIEW );
 
-	// WGL_ARB_pbuffer
-	if( strstr( wgl_ext, "WGL_ARB_pbuffer" ) == NULL )
-	{
-		MessageBox(NULL, "WGL_ARB_pbuffer extension was not found",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
-	else
+	for( size_t i = 0; i < g_sceneDraws.size(); ++i )
 	{
-		wglCreatePbufferARB    = (PFNWGLCREATEPBUFFERARBPROC)wglGetProcAddress("wglCreatePbufferARB");
-		wglGetPbufferDCARB     = (PFNWGLGETPBUFFERDCARBPROC)wglGetProcAddress("wglGetPbufferDCARB");
-		wglReleasePbufferDCARB = (PFNWGLRELEASEPBUFFERDCARBPROC)wglGetProcAddress("wglReleasePbufferDCARB");
-		wglDestroyPbufferARB   = (PFNWGLDESTROYPBUFFERARBPROC)wglGetProcAddress("wglDestroyPbufferARB");
+		const SCENENODE& node = graph.nodes[g_sceneDraws[i]];
 
-		if( !wglCreatePbufferARB || !wglGetPbufferDCARB ||
-				!wglReleasePbufferDCARB || !wglDestroyPbufferARB )
-		{
-			MessageBox(NULL, "One or more WGL_ARB_pbuffer functions were not found",
-					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-			exit(-1);
-		}
+		if( !objectVisible( node.bounds[0], node.bounds[1], node.bounds[2], node.bounds[3] ) )
+			continue;
+
+		glPushMatrix();
+		glMultMatrixf( node.world );
+
+		glColor4fv( g_sceneMaterials[node.material] );
+
+		g_pSinkModel = node.world;
+		g_pSinkColor = g_sceneMaterials[node.material];
+		renderSceneMesh( node );
+		g_pSinkModel = NULL;
+		g_pSinkColor = NULL;
+
+		glPopMatrix();
 	}
+}
 
-	// WGL_ARB_pixel_format
-	if( strstr( wgl_ext, "WGL_ARB_pixel_format" ) == NULL )
+//-----------------------------------------------------------------------------
+// Name: renderSceneMesh()
+// Desc:
+//-----------------------------------------------------------------------------
+void renderSceneMesh( const SCENENODE& node )
+{
+	switch( node.mesh )
 	{
-		MessageBox(NULL, "WGL_ARB_pixel_format extension was not found",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		return;
+		case SCENE_MESH_TEAPOT:
+			renderTeapot();
+			break;
+		case SCENE_MESH_SPHERE:
+			renderSphere();
+			break;
+		case SCENE_MESH_TORUS:
+			renderTorus();
+			break;
+		case SCENE_MESH_FLOOR:
+			renderFloor( (node.flags & SCENE_NODE_TILTED) && adjust );
+			break;
 	}
-	else
-	{
-		wglChoosePixelFormatARB  = (PFNWGLCHOOSEPIXELFORMATARBPROC)wglGetProcAddress("wglChoosePixelFormatARB");
+}
 
-		if( !wglCreatePbufferARB || !wglGetPbufferDCARB )
-		{
-			MessageBox(NULL, "One or more WGL_ARB_pixel_format functions were not found",
-					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-			exit(-1);
-		}
-	}
+//-----------------------------------------------------------------------------
+// Name: sceneGroupVisible()
+// Desc: Hierarchical cull of renderSceneGraph(): only the viewports being
+//       culled, which, unlike objectVisible(), counts nothing and calls no
+//       filter, since a group is not an object.
+//-----------------------------------------------------------------------------
+bool sceneGroupVisible( const float center[3], float radius )
+{
+	if( !g_viewCull.active )
+		return true;
 
-	// WGL_ARB_render_texture
-	if( strstr( wgl_ext, "WGL_ARB_render_texture" ) == NULL )
+	for( int v = 0; v < g_viewCull.viewCount; ++v )
 	{
-		MessageBox(NULL, "WGL_ARB_render_texture extension was not found",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
+		if( viewCullSphere( v, center, radius ) )
+			return true;
 	}
-	else
-	{
-		wglBindTexImageARB    = (PFNWGLBINDTEXIMAGEARBPROC)wglGetProcAddress("wglBindTexImageARB");
-		wglReleaseTexImageARB = (PFNWGLRELEASETEXIMAGEARBPROC)wglGetProcAddress("wglReleaseTexImageARB");
 
-		if( !wglBindTexImageARB || !wglReleaseTexImageARB )
-		{
-			MessageBox(NULL, "One or more WGL_ARB_render_texture functions were not found",
-					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-			exit(-1);
-		}
-	}
+	return false;
 }
 
 //-----------------------------------------------------------------------------
-// Name: displayDepthTexture()
-// Desc: For debugging purposes
+// Name: recordDrawList()
+// Desc: Walks the scene with nothing filtered and records every object as a
+//       DRAWITEM, for renderScene() to replay until the end of the frame.
 //-----------------------------------------------------------------------------
-void displayDepthTexture( void )
+void recordDrawList( void )
 {
-	glDisable( GL_LIGHTING );
+	g_bDrawListValid = false;
+	g_drawList.clear();
 
-	glViewport( 0, 0, g_pbuffer.nWidth, g_pbuffer.nHeight);
+	OBJECTFILTER filter = g_pfnObjectFilter;
+	MESHSINK     sink   = g_pfnMeshSink;
 
-	glMatrixMode( GL_PROJECTION );
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
 	glLoadIdentity();
-	gluOrtho2D( -1.0, 1.0, -1.0, 1.0 );
+
+	g_pfnObjectFilter = recordFilter;
+	g_pfnMeshSink     = recordMeshSink;
+	renderScene();
+	g_pfnMeshSink     = sink;
+	g_pfnObjectFilter = filter;
 
 	glMatrixMode( GL_MODELVIEW );
-	glLoadIdentity();
+	glPopMatrix();
 
-	// reset our texture matrix
-	glMatrixMode( GL_TEXTURE );
-	glLoadIdentity();
+	sphereBatchClear( g_drawBounds );
 
-	// A depth texture can be treated as a luminance texture
-	// ʱ, Ϊ .
-	glEnable( GL_TEXTURE_2D );
-	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
-	// Disable the shadow hardware
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_FALSE );
+	for( size_t i = 0; i < g_drawList.size(); ++i )
+		sphereBatchAdd( g_drawBounds, g_drawList[i].center, g_drawList[i].radius );
 
-	if( wglBindTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
-	{
-		MessageBox(NULL, "Could not bind p-buffer to render texture!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
+	g_bDrawListValid = true;
+}
 
-	glBegin( GL_QUADS );
-	{
-		glTexCoord2f( 0.0f, 0.0f );
-		glVertex3f( -1.0f, -1.0f, 0.0f );
+//-----------------------------------------------------------------------------
+// Name: recordFilter(), recordMeshSink()
+// Desc: Filter and mesh sink of recordDrawList(). The filter starts an item
+//       with the object's bounds, the sink fills in its mesh, its model
+//       matrix and its colour.
+//-----------------------------------------------------------------------------
+bool recordFilter( const float center[3], float radius )
+{
+	DRAWITEM item;
 
-		glTexCoord2f( 0.0f, 1.0f );
-		glVertex3f( -1.0f, 1.0f, 0.0f );
+	memset( &item, 0, sizeof(item) );
+	item.center[0] = center[0];
+	item.center[1] = center[1];
+	item.center[2] = center[2];
+	item.radius    = radius;
 
-		glTexCoord2f( 1.0f, 1.0f );
-		glVertex3f( 1.0f, 1.0f, 0.0f );
+	g_drawList.push_back( item );
 
-		glTexCoord2f( 1.0f, 0.0f );
-		glVertex3f( 1.0f, -1.0f, 0.0f );
-	}
-	glEnd();
+	return true;
+}
 
-	glEnable( GL_LIGHTING );
-	glDisable( GL_TEXTURE_2D );
+void recordMeshSink( const MESH& mesh )
+{
+	if( g_drawList.empty() )
+		return;
 
-	// Enable the shadow mapping hardware
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+	DRAWITEM& item = g_drawList.back();
 
-	if( wglReleaseTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
-	{
-		MessageBox(NULL, "Could not release p-buffer from render texture!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
+	item.mesh = &mesh;
+	getSinkModelMatrix( item.model );
+	getSinkColor( item.color );
 }
 
 //-----------------------------------------------------------------------------
-// Name: WinMain()
-// Desc: The application's entry point
+// Name: replayDrawList()
+// Desc: renderScene() from the draw list: the installed filter and mesh
+//       sink are honoured item by item, everything else is drawn from the
+//       cached meshes under the current modelview.
 //-----------------------------------------------------------------------------
-int WINAPI WinMain(	HINSTANCE hInstance,
-				   HINSTANCE hPrevInstance,
-				   LPSTR     lpCmdLine,
-				   int       nCmdShow )
+void replayDrawList( void )
 {
-	WNDCLASSEX winClass;
-	MSG        uMsg;
+	glMatrixMode( GL_MODELVIEW );
 
-	memset(&uMsg, 0, sizeof(uMsg));
-
-	winClass.lpszClassName = "MY_WINDOWS_CLASS";
-	winClass.cbSize        = sizeof(WNDCLASSEX);
-	winClass.style         = CS_HREDRAW | CS_VREDRAW | CS_OWNDC;
-	winClass.lpfnWndProc   = WindowProc;
-	winClass.hInstance     = hInstance;
-	winClass.hIcon	       = LoadIcon(hInstance, (LPCTSTR)IDI_OPENGL_ICON);
-	winClass.hIconSm	   = LoadIcon(hInstance, (LPCTSTR)IDI_OPENGL_ICON);
-	winClass.hCursor       = LoadCursor(NULL, IDC_ARROW);
-	winClass.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
-	winClass.lpszMenuName  = NULL;
-	winClass.cbClsExtra    = 0;
-	winClass.cbWndExtra    = 0;
-
-	if( !RegisterClassEx(&winClass) )
+	for( size_t i = 0; i < g_drawList.size(); ++i )
 	{
-		return E_FAIL;
-	}
-
-	g_hWnd = CreateWindowEx( NULL, "MY_WINDOWS_CLASS",
-		"OpenGL - Shadow Mapping",
-		WS_OVERLAPPEDWINDOW | WS_VISIBLE,
-		0, 0, 640, 480, NULL, NULL, hInstance, NULL );
+		const DRAWITEM& item = g_drawList[i];
 
-	if( g_hWnd == NULL )
-	{
-		return E_FAIL;
-	}
+		if( g_viewCull.listCulled && !g_viewCull.visible[i] )
+			continue;
 
-	ShowWindow( g_hWnd, nCmdShow );
-	UpdateWindow( g_hWnd );
+		if( !objectVisible( item.center[0], item.center[1], item.center[2], item.radius ) || item.mesh == NULL )
+			continue;
 
-	init();
+		glPushMatrix();
+		glMultMatrixf( item.model );
 
-	render();
+		glColor4fv( item.color );
 
-	while( uMsg.message != WM_QUIT )
-	{
-		if( GetMessage( &uMsg, NULL, 0, 0))		//			if( PeekMessage( &uMsg, NULL, 0, 0, PM_REMOVE ) )			// Ӧػĵطػ, ԭһֱϹ;
+		if( g_pfnMeshSink )
 		{
-			TranslateMessage( &uMsg );
-			DispatchMessage( &uMsg );
+			g_pSinkModel = item.model;
+			g_pSinkColor = item.color;
+			g_pfnMeshSink( *item.mesh );
+			g_pSinkModel = NULL;
+			g_pSinkColor = NULL;
+		}
+		else
+		{
+			drawMesh( *item.mesh );
 		}
 
-		//else											// ϢѭЧ̫. һֱCPU, ;
-		//{
-		//	render();
-		//}
+		glPopMatrix();
 	}
+}
 
-	shutDown();
+//-----------------------------------------------------------------------------
+// Multi-view shaders
+//-----------------------------------------------------------------------------
 
-	UnregisterClass( "MY_WINDOWS_CLASS", winClass.hInstance );
+// Fixed-function diffuse lighting of GL_LIGHT0 in world space, which is what
+// the modelview holds during the pass. Rigid view transforms don't change
+// it, so every viewport can share the vertex's colour.
+static const char* g_multiViewVS =
+	"uniform vec4 u_lightPosition;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 world = gl_ModelViewMatrix * gl_Vertex;\n"
+	"	vec3 n = normalize(gl_NormalMatrix * gl_Normal);\n"
+	"	vec3 l = normalize(u_lightPosition.xyz - world.xyz);\n"
+	"	gl_FrontColor = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient +\n"
+	"		gl_FrontLightProduct[0].diffuse * max(dot(n, l), 0.0);\n"
+	"	gl_Position = world;\n"
+	"}\n";
+
+// Emits each triangle once per viewport. The shadow coordinate is the same
+// world-to-texture matrix the eye-linear texgen feeds the other passes.
+static const char* g_multiViewGS =
+	"uniform mat4 u_viewProjection[4];\n"
+	"uniform mat4 u_view[4];\n"
+	"uniform mat4 u_shadowMatrix;\n"
+	"void main()\n"
+	"{\n"
+	"	for (int view = 0; view < 4; ++view)\n"
+	"	{\n"
+	"		for (int i = 0; i < 3; ++i)\n"
+	"		{\n"
+	"			gl_ViewportIndex = view;\n"
+	"			gl_Position = u_viewProjection[view] * gl_PositionIn[i];\n"
+	"			gl_FrontColor = gl_FrontColorIn[i];\n"
+	"			gl_TexCoord[0] = u_shadowMatrix * gl_PositionIn[i];\n"
+	"			gl_FogFragCoord = abs((u_view[view] * gl_PositionIn[i]).z);\n"
+	"			EmitVertex();\n"
+	"		}\n"
+	"		EndPrimitive();\n"
+	"	}\n"
+	"}\n";
+
+// The SGIX compare of the fixed-function path, as shadow2DProj().
+static const char* g_multiViewFS =
+	"uniform sampler2DShadow u_shadowMap;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 color = gl_Color * shadow2DProj(u_shadowMap, gl_TexCoord[0]).r;\n"
+	"	color.rgb = applyFog(color.rgb);\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
 
-	return uMsg.wParam;
-}
 //-----------------------------------------------------------------------------
-// Name: initPbuffer()
-// Desc: Create a p-buffer for the off-screen rendering of the depth texture
+// Name: initMultiView()
+// Desc: Compiles the multi-view program. Returns false, leaving 'V' off,
+//       when the driver can't route primitives to four viewports.
 //-----------------------------------------------------------------------------
-void initPbuffer( void )
+bool initMultiView( void )
 {
-	g_pbuffer.hPBuffer = NULL;
-	g_pbuffer.nWidth   = PBUFFER_WIDTH;
-	g_pbuffer.nHeight  = PBUFFER_HEIGHT;
-
-	// Define the minimum pixel format requirements we will need for our
-	// p-buffer. A p-buffer is just like a frame buffer, it can have a depth
-	// buffer associated with it and it can be double buffered.
-	int pf_attr[] =
-	{
-		WGL_SUPPORT_OPENGL_ARB, TRUE,       // P-buffer will be used with OpenGL
-		WGL_DRAW_TO_PBUFFER_ARB, TRUE,      // Enable render to p-buffer				//pbuffer, Ķвͬظʽ. ҪҪʱг.
-
-		WGL_BIND_TO_TEXTURE_DEPTH_NV, TRUE, // Ask for depth texture
+	if( g_multiView.program != 0 )
+		return true;
 
-		WGL_BIND_TO_TEXTURE_RGBA_ARB, TRUE, // P-buffer will be used as a texture
-		WGL_DOUBLE_BUFFER_ARB, FALSE,       // We don't require double buffering
-		0                                   // Zero terminates the list
-	};
+	GLint maxViewports = 0;
 
-	unsigned int count = 0;
-	int pixelFormat;
+	if( g_bViewportArray )
+		glGetIntegerv( GL_MAX_VIEWPORTS, &maxViewports );
 
-	//typedef BOOL (WINAPI * PFNWGLCHOOSEPIXELFORMATARBPROC) (HDC hdc, const int *piAttribIList, const FLOAT *pfAttribFList, UINT nMaxFormats, int *piFormats, UINT *nNumFormats);
-	// DC, .. , .. , ʽ, ʽ׵ַ, øʽ
-	if( !wglChoosePixelFormatARB( g_hDC, pf_attr, NULL, 1, &pixelFormat, &count ) )
+	if( !g_bShaderObjects || !g_bGeometryShader || maxViewports < 4 )
 	{
-		MessageBox(NULL, "pbuffer creation error:  wglChoosePixelFormatARB() failed.",
+		MessageBox(NULL, "Multi-view rendering needs GL_ARB_viewport_array with at least 4 viewports and a geometry shader!",
 				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
+		return false;
 	}
 
-	if( count <= 0 )
-	{
-		MessageBox(NULL, "pbuffer creation error:  Couldn't find a suitable pixel format.",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
+	std::string header = g_geometryShaderExtension;
+	header += "#extension GL_ARB_viewport_array : enable\n";
 
-	// Set some p-buffer attributes so that we can use this p-buffer as a
-	// 2D RGBA texture target.
-	int pb_attr[] =		//pbuffer, ϱǸظʽ, Ҫ.
-	{
-		WGL_DEPTH_TEXTURE_FORMAT_NV, WGL_TEXTURE_DEPTH_COMPONENT_NV, // We need to render to a depth texture
-		WGL_TEXTURE_FORMAT_ARB, WGL_TEXTURE_RGBA_ARB,                // Our p-buffer will have a texture format of RGBA
-		WGL_TEXTURE_TARGET_ARB, WGL_TEXTURE_2D_ARB,                  // Of texture target will be GL_TEXTURE_2D
-		0                                                            // Zero terminates the list
-	};
+	// 4 viewports * 3 vertices
+	g_multiView.program = compileProgram( header.c_str(), g_multiViewVS, g_multiViewFS, g_multiViewGS, 12 );
 
-	// Create the p-buffer...
-	g_pbuffer.hPBuffer = wglCreatePbufferARB( g_hDC, pixelFormat, g_pbuffer.nWidth, g_pbuffer.nHeight, pb_attr );
-	g_pbuffer.hDC      = wglGetPbufferDCARB( g_pbuffer.hPBuffer );
-	g_pbuffer.hRC      = wglCreateContext( g_pbuffer.hDC );				//wglwindowsOpengl, wglĴľwindowsĴOpenGL.
+	if( !g_multiView.program )
+		return false;
 
-	if( !g_pbuffer.hPBuffer )
-	{
-		MessageBox(NULL, "pbuffer creation error: wglCreatePbufferARB() failed!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
+	GLhandleARB program = g_multiView.program;
+	g_multiView.viewProjectionLocation = glGetUniformLocationARB( program, "u_viewProjection" );
+	g_multiView.viewLocation           = glGetUniformLocationARB( program, "u_view" );
+	g_multiView.shadowMatrixLocation   = glGetUniformLocationARB( program, "u_shadowMatrix" );
+	g_multiView.lightPositionLocation  = glGetUniformLocationARB( program, "u_lightPosition" );
+	g_multiView.shadowMapLocation      = glGetUniformLocationARB( program, "u_shadowMap" );
+	g_multiView.fogModeLocation        = glGetUniformLocationARB( program, "u_fogMode" );
+
+	return true;
 }
 
 //-----------------------------------------------------------------------------
-// Name: init()
+// Name: freeMultiView()
 // Desc:
 //-----------------------------------------------------------------------------
-void init( void )
+void freeMultiView( void )
 {
-	MessageBox(NULL, 
-		"F1 - ֱȾ\nF2 - ǷʾԴָʾ\nF3 - Ƿʾ\nF4 - ģʽл\nF5 - Ƿ΢(ͬ龳òͬ)\nF6 - ǷʾӾ\nF7 - Ƿֱ߿\nF8 - Ƿ\nF11, F12 - һ/һ\n1 - Сӽ\n2 - ӽ\nPageDown, PageUP - ƶԴ\n - Զ",
-		"", MB_OK | MB_ICONEXCLAMATION);
-	GLuint PixelFormat;
+	if( g_multiView.program != 0 )
+		glDeleteObjectARB( g_multiView.program );
 
-	PIXELFORMATDESCRIPTOR pfd;
-	memset(&pfd, 0, sizeof(PIXELFORMATDESCRIPTOR));
+	memset( &g_multiView, 0, sizeof(g_multiView) );
+	g_bMultiView = false;
+}
 
-	pfd.nSize      = sizeof(PIXELFORMATDESCRIPTOR);
-	pfd.nVersion   = 1;
-	pfd.dwFlags    = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
-	pfd.iPixelType = PFD_TYPE_RGBA;
-	pfd.cColorBits = 32;						//3216	//-3Ҳ		//ʵд. ʵڷʱҵOpenGLֵ֧ӽһ. Բֲʹõ.
-	pfd.cDepthBits = 24;
+//-----------------------------------------------------------------------------
+// Name: multiViewActive()
+// Desc: Whether this frame's scene goes through renderMultiView().
+//-----------------------------------------------------------------------------
+bool multiViewActive( void )
+{
+	return g_bMultiView && g_multiView.program != 0 &&
+		   (g_shadowMode == SHADOW_DEPTH_COMPARE || g_shadowMode == SHADOW_SOFTWARE);
+}
 
-	g_hDC = GetDC( g_hWnd );						//dc豸, ǿԻͼĵط.
-	PixelFormat = ChoosePixelFormat( g_hDC, &pfd );		//õظʽ. ƥ, еĶܽ.	//OpenGLٷĵ˵ûչ, ԲŵwglChoosePixelFormatARB. ָ, 0Ϊ־, չ.
-	SetPixelFormat( g_hDC, PixelFormat, &pfd);				//ظʽ.
+//-----------------------------------------------------------------------------
+// Name: buildViewMatrices()
+// Desc: The view and projection matrices render() sets up on the GL stacks
+//       for each of the four viewports, on the CPU.
+//-----------------------------------------------------------------------------
+void buildViewMatrices( float view[4][16], float projection[4][16] )
+{
+	for( int i = 0; i < 4; ++i )
+	{
+		if( i == 1 )
+		{
+			matrixPerspective( projection[i], fovy, (float)nWidth / (float)nHeight, -nearZ, -farZ );
+			buildCameraView( view[i] );
+		}
+		else
+		{
+			matrixOrtho( projection[i], (float)(-nWidth / 50), (float)(nWidth / 50),
+						 (float)(-nHeight / 50), (float)(nHeight / 50), -40.0f, 40.0f );
 
-	// VC++ - OpenGLͼĻǣ
-	// OpenGLĻͼRendering Context(ΪRC)ͼãٰͨSwapBuffers()WindowĻͼDevice Context(ΪDC)
-	// ҪעǣһжDCֻһRC˵һDCͼҪͷRCԱDCҲʹá
-	g_hRC = wglCreateContext( g_hDC );
-	wglMakeCurrent( g_hDC, g_hRC );				// OpenGL֮ǰҪRCӦDCóɵǰ.
+			if( i == 2 )
+				matrixRotate( view[i], 90.0f, 1.0f, 0.0f, 0.0f );
+			else if( i == 3 )
+				matrixRotate( view[i], 90.0f, 0.0f, 1.0f, 0.0f );
+			else
+				matrixIdentity( view[i] );
+		}
+	}
+}
 
-	glClearColor( 0.35f, 0.53f, 0.7f, 1.0f );
-	glEnable( GL_LIGHTING );
-	glEnable( GL_TEXTURE_2D );
-	glEnable( GL_DEPTH_TEST );
+//-----------------------------------------------------------------------------
+// Name: renderMultiView()
+// Desc: Draws the lit, shadowed scene into all four viewports with a single
+//       replay of the draw list, after render()'s loop has drawn the
+//       per-viewport decorations.
+//-----------------------------------------------------------------------------
+void renderMultiView( void )
+{
+	float view[4][16];
+	float projection[4][16];
+	float viewProjection[4][16];
 
-	//ʼʱSIZEϢ, һǶ.
-	//glMatrixMode( GL_PROJECTION );
-	//glLoadIdentity();
-	//gluPerspective( 45.0f, 640.0f/480.0f, 0.1f, 100.0f);
+	buildViewMatrices( view, projection );
 
-	// Enable some dim, gray ambient lighting...
-	GLfloat ambient_lightModel[] = { 0.25f, 0.25f, 0.25f, 1.0f };
-	glLightModelfv( GL_LIGHT_MODEL_AMBIENT, ambient_lightModel );
+	for( int i = 0; i < 4; ++i )
+	{
+		matrixMultiply( viewProjection[i], projection[i], view[i] );
+		glViewportIndexedf( i, (float)(nWidth * (i % 2 == 1)), (float)(nHeight * (i >= 2)),
+							(float)nWidth, (float)nHeight );
+	}
 
-	// Set up a point light source...
-	glEnable( GL_LIGHT0 );
-	GLfloat diffuse_light[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-	GLfloat linearAttenuation_light[] = { 0.0f };
-	glLightfv( GL_LIGHT0, GL_DIFFUSE, diffuse_light );
-	glLightfv( GL_LIGHT0, GL_LINEAR_ATTENUATION , linearAttenuation_light );
+	bool pbuffer = bindDepthCompareMap();
 
-	// Initialize the p-buffer now that we have a valid context
-	// that we can use during the p-buffer creation process.
-	initExtensions();
-	initPbuffer();
+	GLhandleARB program = g_multiView.program;
+	glUseProgramObjectARB( program );
+	glUniformMatrix4fvARB( g_multiView.viewProjectionLocation, 4, GL_FALSE, &viewProjection[0][0] );
+	glUniformMatrix4fvARB( g_multiView.viewLocation, 4, GL_FALSE, &view[0][0] );
+	glUniformMatrix4fvARB( g_multiView.shadowMatrixLocation, 1, GL_FALSE, g_shadowTextureMatrix );
+	glUniform4fARB( g_multiView.lightPositionLocation, g_lightPosition[0], g_lightPosition[1],
+					g_lightPosition[2], 1.0f );
+	glUniform1iARB( g_multiView.shadowMapLocation, 0 );
+	glUniform1iARB( g_multiView.fogModeLocation, currentFogMode() );
 
-	// Initialize some graphics state for the p-buffer's rendering context.
-	// עǴ, ûҪڳʼ. ΪȾʱҲmakeCurrent. ʵֻΪ˰ܼǲǿʹ, ͳһ.
-	if( wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC) == FALSE )
-	{
-		MessageBox(NULL, "Could not make the p-buffer's context current!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
-	else
-	{
-		// עӦøpbufferRCָģͼӿ, Բ⼸.
-		glViewport( 0, 0, PBUFFER_WIDTH, PBUFFER_HEIGHT );					//쵽, Ⱦ, ӿڱ任ģͼ任ͶӰ任ĺ, ֻƽ任Ҫǵô.
-		glMatrixMode( GL_PROJECTION );
-		glLoadIdentity();
-		gluPerspective( 75.0f, 640.0f / 480.0f, 0.1f, 100.0f);		//CVV. ΪȾģͼ任ͶӰ任, ԿΪȾϺһ.
-	}
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
 
-	glEnable( GL_LIGHTING );
-	glEnable( GL_LIGHT0 );
-	glEnable( GL_DEPTH_TEST );
+	beginViewCulling( view, projection, 4 );
 
-	glLightModelfv( GL_LIGHT_MODEL_AMBIENT, ambient_lightModel );
+	g_bTriangleGeometry = true;
+	renderScene();
+	g_bTriangleGeometry = false;
 
-	// Initialize some state for the window's rendering context.
-	if( wglMakeCurrent( g_hDC, g_hRC ) == FALSE )
-	{
-		MessageBox(NULL, "Could not make the window's context current!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
-	}
+	endViewCulling();
 
-	// Create the depth texture
-	glGenTextures( 1, &g_depthTexture );
-	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
 
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
+	glUseProgramObjectARB( 0 );
 
-	glLineWidth(3);
+	releaseDepthCompareMap( pbuffer );
 
-	static GLint fogMode = GL_LINEAR;
+	// Leave viewport 0 where the single-viewport code expects the first one.
+	glViewport( 0, 0, nWidth, nHeight );
+}
 
-	glFogi (GL_FOG_MODE, fogMode);
-	glFogfv (GL_FOG_COLOR, blue);
-	glFogf (GL_FOG_DENSITY, 0.35);
-	glHint (GL_FOG_HINT, GL_DONT_CARE);
-	glFogf (GL_FOG_START, 1.0);
-	glFogf (GL_FOG_END, 30);
+//-----------------------------------------------------------------------------
+// Name: getSinkModelMatrix(), getSinkColor()
+// Desc: The model matrix and the colour of the object a mesh sink has been
+//       handed. The passes with a sink draw under an identity modelview, so
+//       the world matrix the walk set is the answer. Only an object drawn
+//       outside the walks that set them is read back from GL.
+//-----------------------------------------------------------------------------
+void getSinkModelMatrix( float m[16] )
+{
+	if( g_pSinkModel )
+		memcpy( m, g_pSinkModel, 16 * sizeof(float) );
+	else
+		glGetFloatv( GL_MODELVIEW_MATRIX, m );
+}
 
-	ini = false;
+void getSinkColor( float color[4] )
+{
+	if( g_pSinkColor )
+		memcpy( color, g_pSinkColor, 4 * sizeof(float) );
+	else
+		glGetFloatv( GL_CURRENT_COLOR, color );
 }
 
 //-----------------------------------------------------------------------------
-// Name: shutDown()
-// Desc:
+// Name: beginViewCulling()
+// Desc: Until endViewCulling(), renderScene() skips the objects outside all
+//       of the count frustums given by the view and projection matrices,
+//       and, with occlusion culling, the ones each view's occluders hide. A
+//       valid draw list is culled here, all items in one batch per view.
 //-----------------------------------------------------------------------------
-void shutDown( void )
+void beginViewCulling( const float view[][16], const float projection[][16], int count )
 {
-	glDeleteTextures( 1, &g_depthTexture );
+	if( !g_bViewCulling && !g_bOcclusionCulling )
+		return;
 
-	if( g_hRC != NULL )
-	{
-		wglMakeCurrent( g_hDC, NULL );
-		wglDeleteContext( g_hRC );
-		g_hRC = NULL;
-	}
+	g_viewCull.viewCount = count;
 
-	if( g_hDC != NULL )
+	for( int v = 0; v < count; ++v )
 	{
-		ReleaseDC( g_hWnd, g_hDC );
-		g_hDC = NULL;
+		float m[16];
+		matrixMultiply( m, projection[v], view[v] );
+		matrixFrustumPlanes( g_viewCull.planes[v], m );
+
+		// Walks the scene, so before the cull below is switched on
+		if( g_bOcclusionCulling )
+			buildOcclusionPyramid( v, m );
 	}
 
-	// Don't forget to clean up after our p-buffer...
-	if( g_pbuffer.hRC != NULL )
+	g_viewCull.active     = true;
+	g_viewCull.frustum    = g_bViewCulling;
+	g_viewCull.occlusion  = g_bOcclusionCulling;
+	g_viewCull.listCulled = false;
+
+	if( !g_bDrawListValid || g_drawBounds.count == 0 )
+		return;
+
+	int items = g_drawBounds.count;
+
+	// 0 outside every frustum, 2 inside one but hidden so far, 1 visible
+	g_viewCull.visible.assign( items, 0 );
+	g_viewCull.viewVisible.resize( items );
+
+	for( int v = 0; v < count; ++v )
 	{
-		wglMakeCurrent( g_pbuffer.hDC, NULL );
-		wglDeleteContext( g_pbuffer.hRC );
-		wglReleasePbufferDCARB( g_pbuffer.hPBuffer, g_pbuffer.hDC );
-		wglDestroyPbufferARB( g_pbuffer.hPBuffer );
-		g_pbuffer.hRC = NULL;
+		if( g_viewCull.frustum )
+			cullSphereBatch( g_drawBounds, g_viewCull.planes[v], &g_viewCull.viewVisible[0] );
+		else
+			std::fill( g_viewCull.viewVisible.begin(), g_viewCull.viewVisible.end(), 1 );
+
+		for( int i = 0; i < items; ++i )
+		{
+			if( !g_viewCull.viewVisible[i] || g_viewCull.visible[i] == 1 )
+				continue;
+
+			float center[3] = { g_drawBounds.x[i], g_drawBounds.y[i], g_drawBounds.z[i] };
+
+			if( !g_viewCull.occlusion || hizSphereVisible( g_viewCull.pyramids[v], center, g_drawBounds.radius[i] ) )
+				g_viewCull.visible[i] = 1;
+			else
+				g_viewCull.visible[i] = 2;
+		}
 	}
 
-	if( g_pbuffer.hDC != NULL )
+	for( int i = 0; i < items; ++i )
 	{
-		ReleaseDC( g_hWnd, g_pbuffer.hDC );
-		g_pbuffer.hDC = NULL;
+		switch( g_viewCull.visible[i] )
+		{
+			case 0: ++g_viewCull.culled;   break;
+			case 1: ++g_viewCull.drawn;    break;
+			case 2: ++g_viewCull.occluded; break;
+		}
+
+		g_viewCull.visible[i] = g_viewCull.visible[i] == 1;
 	}
+
+	g_viewCull.listCulled = true;
 }
 
 //-----------------------------------------------------------------------------
-// Name: createDepthTexture()
+// Name: endViewCulling()
 // Desc:
 //-----------------------------------------------------------------------------
-void createDepthTexture( void )
+void endViewCulling( void )
 {
-	// Make the pbuffer rendering context current
-	//makeCurrent˼ֻǰDCRC, ʵҪָǰOpenGLȾĿ.
-	if( wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC) == FALSE )
+	g_viewCull.active     = false;
+	g_viewCull.listCulled = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: viewCullObject()
+// Desc: The per-object test objectVisible() uses when the scene is walked
+//       rather than replayed.
+//-----------------------------------------------------------------------------
+bool viewCullObject( const float center[3], float radius )
+{
+	bool framed = false;
+
+	for( int v = 0; v < g_viewCull.viewCount; ++v )
 	{
-		MessageBox(NULL, "Could not make the p-buffer's context current!",
-				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
-		exit(-1);
+		if( g_viewCull.frustum && !sphereInFrustum( g_viewCull.planes[v], center, radius ) )
+			continue;
+
+		framed = true;
+
+		if( !g_viewCull.occlusion || hizSphereVisible( g_viewCull.pyramids[v], center, radius ) )
+		{
+			++g_viewCull.drawn;
+			return true;
+		}
 	}
 
-	glClear( GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT );
+	if( framed )
+		++g_viewCull.occluded;
+	else
+		++g_viewCull.culled;
 
-	glPolygonOffset( 2.0f, 2.0f );				//Ҫֵ. ڶòƾΪӰƵ.
-	glEnable( GL_POLYGON_OFFSET_FILL );					//̫, ڻƵʵͼʱöƫ, Ӱƫһ, ֹӰ.
+	return false;
+}
 
-	// ԴԭҲǷ˹۲.
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+//-----------------------------------------------------------------------------
+// Name: viewCullSphere()
+// Desc: Whether view may show the sphere, counting nothing.
+//-----------------------------------------------------------------------------
+bool viewCullSphere( int view, const float center[3], float radius )
+{
+	if( g_viewCull.frustum && !sphereInFrustum( g_viewCull.planes[view], center, radius ) )
+		return false;
 
-	float originPosition[] = { 0.0f, 0.0f, 0.0f, 1.0f };
-	glLightfv( GL_LIGHT0, GL_POSITION, originPosition );
+	return !g_viewCull.occlusion || hizSphereVisible( g_viewCull.pyramids[view], center, radius );
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildOcclusionPyramid()
+// Desc: Walks the scene with only the objects of at least
+//       OCCLUDER_MIN_RADIUS let through to occluderMeshSink(), which
+//       rasterizes them into the view's pyramid.
+//-----------------------------------------------------------------------------
+void buildOcclusionPyramid( int view, const float viewProjection[16] )
+{
+	HIZBUFFER& pyramid = g_viewCull.pyramids[view];
+
+	if( pyramid.levels.empty() )
+		hizInit( pyramid, OCCLUSION_WIDTH, OCCLUSION_HEIGHT );
+
+	hizBegin( pyramid, viewProjection );
+	g_viewCull.pyramidView = view;
 
+	OBJECTFILTER filter = g_pfnObjectFilter;
+	MESHSINK     sink   = g_pfnMeshSink;
+
+	// renderScene() still places the objects with the GL matrix stack.
 	glMatrixMode( GL_MODELVIEW );
-	glMultMatrixf( g_lightsLookAtMatrix);
+	glPushMatrix();
+	glLoadIdentity();
 
-	//úpbuffer, ֱȾͺ. ʱ{F1}, ֵõĳֵ.
+	g_pfnObjectFilter = occluderFilter;
+	g_pfnMeshSink     = occluderMeshSink;
 	renderScene();
+	g_pfnMeshSink     = sink;
+	g_pfnObjectFilter = filter;
 
-	glDisable( GL_POLYGON_OFFSET_FILL );
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
 
-	// Make the window rendering context current
-	if( wglMakeCurrent( g_hDC, g_hRC ) == FALSE )
+	hizBuild( pyramid );
+}
+
+//-----------------------------------------------------------------------------
+// Name: occluderFilter(), occluderMeshSink()
+// Desc: Filter and mesh sink of buildOcclusionPyramid()
+//-----------------------------------------------------------------------------
+bool occluderFilter( const float center[3], float radius )
+{
+	return radius >= OCCLUDER_MIN_RADIUS;
+}
+
+void occluderMeshSink( const MESH& mesh )
+{
+	float model[16];
+	getSinkModelMatrix( model );
+
+	hizAddMesh( g_viewCull.pyramids[g_viewCull.pyramidView], mesh, model );
+	++g_viewCull.occluders;
+}
+
+//-----------------------------------------------------------------------------
+// Name: bindDepthCompareMap(), releaseDepthCompareMap()
+// Desc: Bind the map the depth compare branches of render() would use, with
+//       the ARB compare mode that shadow2DProj() needs in place of SGIX's,
+//       and put it back. Returns whether it is the p-buffer, which
+//       releaseDepthCompareMap() has to release.
+//-----------------------------------------------------------------------------
+bool bindDepthCompareMap( void )
+{
+	GLuint texture = g_shadowMode == SHADOW_SOFTWARE ? g_softwareDepthTexture :
+					 g_bAdaptiveResolution ? g_adaptiveShadowMap.texture[g_adaptiveShadowMap.level] :
+					 g_bIncrementalShadow ? g_incrementalShadowMap.texture[1] : g_depthTexture;
+	bool pbuffer = texture == g_depthTexture;
+
+	glBindTexture( GL_TEXTURE_2D, texture );
+
+	if( pbuffer && wglBindTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
 	{
-		MessageBox(NULL, "Could not make the window's context current!",
+		MessageBox(NULL, "Could not bind p-buffer to render texture!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_FALSE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_COMPARE_R_TO_TEXTURE_ARB );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC_ARB, GL_LEQUAL );
+
+	return pbuffer;
+}
+
+void releaseDepthCompareMap( bool pbuffer )
+{
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_NONE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+
+	if( pbuffer && wglReleaseTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
+	{
+		MessageBox(NULL, "Could not release p-buffer from render texture!",
 				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
 		exit(-1);
 	}
 }
+
+//-----------------------------------------------------------------------------
+// GLSL lookup shaders
+//-----------------------------------------------------------------------------
+
+// Everything in world space: u_shadowMatrix takes the world position
+// straight to (s, t, r, q), the same matrix for every viewport. The depth
+// program compiles this shader alone, and gl_Position is invariant so the
+// prepass lays down exactly the depths the shading pass tests with
+// GL_EQUAL.
+static const char* g_shaderLookupVS =
+	"invariant gl_Position;\n"
+	"uniform mat4 u_model;\n"
+	"uniform mat4 u_viewProjection;\n"
+	"uniform mat4 u_view;\n"
+	"uniform mat4 u_shadowMatrix;\n"
+	"attribute vec3 a_position;\n"
+	"attribute vec3 a_normal;\n"
+	"varying vec3 v_position;\n"
+	"varying vec3 v_normal;\n"
+	"varying vec4 v_shadow;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 world = u_model * vec4(a_position, 1.0);\n"
+	"	v_position = world.xyz;\n"
+	"	v_normal = (u_model * vec4(a_normal, 0.0)).xyz;\n"
+	"	v_shadow = u_shadowMatrix * world;\n"
+	"	gl_FogFragCoord = abs((u_view * world).z);\n"
+	"	gl_Position = u_viewProjection * world;\n"
+	"}\n";
+
+// GL_LIGHT0's ambient and diffuse terms as the fixed-function path has
+// them (no attenuation, no specular), then the compare result modulates
+// the colour the way GL_MODULATE did.
+static const char* g_shaderLookupFS =
+	"uniform sampler2DShadow u_shadowMap;\n"
+	"uniform vec4 u_lightPosition;\n"
+	"uniform vec4 u_ambient;\n"
+	"uniform vec4 u_diffuse;\n"
+	"varying vec3 v_position;\n"
+	"varying vec3 v_normal;\n"
+	"varying vec4 v_shadow;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 n = normalize(v_normal);\n"
+	"	vec3 l = normalize(u_lightPosition.xyz - v_position);\n"
+	"	vec4 color = u_ambient + u_diffuse * max(dot(n, l), 0.0);\n"
+	"	color.rgb *= shadow2DProj(u_shadowMap, v_shadow).r;\n"
+	"	color.rgb = applyFog(color.rgb);\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+// Name: initShaderLookup()
+// Desc: Compiles the shading and the depth program.
+//-----------------------------------------------------------------------------
+bool initShaderLookup( void )
+{
+	if( g_shaderLookup.shade.program != 0 )
+		return true;
+
+	if( !g_bShaderObjects )
+		return false;
+
+	if( !initShaderLookupProgram( g_shaderLookup.shade, g_shaderLookupFS ) ||
+		!initShaderLookupProgram( g_shaderLookup.depth, NULL ) )
+	{
+		freeShaderLookup();
+		return false;
+	}
+
+	GLhandleARB program = g_shaderLookup.shade.program;
+	g_shaderLookup.lightPositionLocation = glGetUniformLocationARB( program, "u_lightPosition" );
+	g_shaderLookup.ambientLocation       = glGetUniformLocationARB( program, "u_ambient" );
+	g_shaderLookup.diffuseLocation       = glGetUniformLocationARB( program, "u_diffuse" );
+	g_shaderLookup.shadowMapLocation     = glGetUniformLocationARB( program, "u_shadowMap" );
+	g_shaderLookup.fogModeLocation       = glGetUniformLocationARB( program, "u_fogMode" );
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: initShaderLookupProgram()
+// Desc: g_shaderLookupVS with fragmentSource, NULL for none. GLSL 1.20 for
+//       the invariant gl_Position.
+//-----------------------------------------------------------------------------
+bool initShaderLookupProgram( SHADERLOOKUPPROGRAM& lookup, const char* fragmentSource )
+{
+	lookup.program = compileProgram( "#version 120\n", g_shaderLookupVS, fragmentSource );
+
+	if( !lookup.program )
+		return false;
+
+	GLhandleARB program = lookup.program;
+	lookup.modelLocation          = glGetUniformLocationARB( program, "u_model" );
+	lookup.viewProjectionLocation = glGetUniformLocationARB( program, "u_viewProjection" );
+	lookup.viewLocation           = glGetUniformLocationARB( program, "u_view" );
+	lookup.shadowMatrixLocation   = glGetUniformLocationARB( program, "u_shadowMatrix" );
+	lookup.positionLocation       = glGetAttribLocationARB( program, "a_position" );
+	lookup.normalLocation         = glGetAttribLocationARB( program, "a_normal" );
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeShaderLookup()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeShaderLookup( void )
+{
+	if( g_shaderLookup.shade.program != 0 )
+		glDeleteObjectARB( g_shaderLookup.shade.program );
+
+	if( g_shaderLookup.depth.program != 0 )
+		glDeleteObjectARB( g_shaderLookup.depth.program );
+
+	memset( &g_shaderLookup, 0, sizeof(g_shaderLookup) );
+	g_bShaderLookup = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: shaderLookupActive()
+// Desc: Whether render()'s loop draws the scene through the GLSL lookup.
+//-----------------------------------------------------------------------------
+bool shaderLookupActive( void )
+{
+	return g_bShaderLookup && g_shaderLookup.shade.program != 0 &&
+		   (g_shadowMode == SHADOW_DEPTH_COMPARE || g_shadowMode == SHADOW_SOFTWARE);
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginShaderLookup(), endShaderLookup()
+// Desc: Bracket one viewport's renderScene() with the GLSL lookup. view and
+//       projection are the viewport's matrices; the shadow map is looked up
+//       with g_shadowTextureMatrix.
+//-----------------------------------------------------------------------------
+void beginShaderLookup( const float view[16], const float projection[16] )
+{
+	// GL_LIGHT0 on GL's default material, as init() sets them up: the light
+	// model's 0.25 ambient times the material's 0.2, and the light's white
+	// diffuse times the material's 0.8. The light itself has no ambient.
+	const float ambient = 0.25f * 0.2f;
+	const float diffuse = 0.8f;
+
+	g_shaderLookup.pbuffer = bindDepthCompareMap();
+
+	beginShaderLookupProgram( g_shaderLookup.shade, view, projection );
+
+	glUniform4fARB( g_shaderLookup.lightPositionLocation, g_lightPosition[0], g_lightPosition[1],
+					g_lightPosition[2], 1.0f );
+	glUniform4fARB( g_shaderLookup.ambientLocation, ambient, ambient, ambient, 1.0f );
+	glUniform4fARB( g_shaderLookup.diffuseLocation, diffuse, diffuse, diffuse, 1.0f );
+	glUniform1iARB( g_shaderLookup.shadowMapLocation, 0 );
+	glUniform1iARB( g_shaderLookup.fogModeLocation, currentFogMode() );
+}
+
+void endShaderLookup( void )
+{
+	endShaderLookupProgram();
+	releaseDepthCompareMap( g_shaderLookup.pbuffer );
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginShaderLookupProgram(), endShaderLookupProgram()
+// Desc: Bind one of the lookup's programs with the viewport's matrices and
+//       route the meshes of the walk in between to shaderLookupSink(),
+//       under an identity modelview like the other sinks.
+//-----------------------------------------------------------------------------
+void beginShaderLookupProgram( const SHADERLOOKUPPROGRAM& lookup, const float view[16], const float projection[16] )
+{
+	float viewProjection[16];
+	matrixMultiply( viewProjection, projection, view );
+
+	glUseProgramObjectARB( lookup.program );
+	glUniformMatrix4fvARB( lookup.viewProjectionLocation, 1, GL_FALSE, viewProjection );
+	glUniformMatrix4fvARB( lookup.viewLocation, 1, GL_FALSE, view );
+	glUniformMatrix4fvARB( lookup.shadowMatrixLocation, 1, GL_FALSE, g_shadowTextureMatrix );
+
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	g_shaderLookup.current = &lookup;
+	g_shaderLookup.sink    = g_pfnMeshSink;
+	g_pfnMeshSink          = shaderLookupSink;
+}
+
+void endShaderLookupProgram( void )
+{
+	g_pfnMeshSink          = g_shaderLookup.sink;
+	g_shaderLookup.current = NULL;
+
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glUseProgramObjectARB( 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: shaderLookupSink()
+// Desc: Mesh sink of the GLSL lookup. The model matrix goes in as a
+//       uniform, the mesh as generic attributes.
+//-----------------------------------------------------------------------------
+void shaderLookupSink( const MESH& mesh )
+{
+	const SHADERLOOKUPPROGRAM& lookup = *g_shaderLookup.current;
+
+	if( mesh.indices.empty() )
+		return;
+
+	float model[16];
+	getSinkModelMatrix( model );
+	glUniformMatrix4fvARB( lookup.modelLocation, 1, GL_FALSE, model );
+
+	glEnableVertexAttribArrayARB( lookup.positionLocation );
+	glVertexAttribPointerARB( lookup.positionLocation, 3, GL_FLOAT, GL_FALSE, 0, &mesh.positions[0] );
+
+	if( lookup.normalLocation >= 0 )
+	{
+		glEnableVertexAttribArrayARB( lookup.normalLocation );
+		glVertexAttribPointerARB( lookup.normalLocation, 3, GL_FLOAT, GL_FALSE, 0, &mesh.normals[0] );
+	}
+
+	glDrawElements( GL_TRIANGLES, (GLsizei)mesh.indices.size(), GL_UNSIGNED_INT, &mesh.indices[0] );
+
+	if( lookup.normalLocation >= 0 )
+		glDisableVertexAttribArrayARB( lookup.normalLocation );
+
+	glDisableVertexAttribArrayARB( lookup.positionLocation );
+}
+
+//-----------------------------------------------------------------------------
+// Name: initFramePacer()
+// Desc: Two frames in flight by default. Without GL_ARB_sync render() just
+//       lets the driver queue frames as it likes, as before.
+//-----------------------------------------------------------------------------
+void initFramePacer( void )
+{
+	memset( &g_framePacer, 0, sizeof(g_framePacer) );
+	g_framePacer.framesInFlight = 2;
+	g_framePacer.gpuIdleMs      = -1.0f;
+
+	if( g_bTimerQuery )
+	{
+		for( int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i )
+			glGenQueriesARB( 2, g_framePacer.slots[i].timestamps );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeFramePacer()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeFramePacer( void )
+{
+	for( int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i )
+	{
+		FRAMESLOT& slot = g_framePacer.slots[i];
+
+		if( slot.fence )
+			glDeleteSync( slot.fence );
+
+		if( g_bTimerQuery && slot.timestamps[0] != 0 )
+			glDeleteQueriesARB( 2, slot.timestamps );
+	}
+
+	memset( &g_framePacer, 0, sizeof(g_framePacer) );
+}
+
+//-----------------------------------------------------------------------------
+// Name: waitForFrameSlot()
+// Desc: Blocks until the GPU has finished the slot's frame, then reads its
+//       timestamps. Frames are waited for oldest first, so the gap to the
+//       previous frame's end is the time the GPU had nothing to do.
+//-----------------------------------------------------------------------------
+void waitForFrameSlot( FRAMESLOT& slot )
+{
+	if( slot.fence == NULL )
+		return;
+
+	while( glClientWaitSync( slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NS ) == GL_TIMEOUT_EXPIRED )
+		;
+
+	glDeleteSync( slot.fence );
+	slot.fence = NULL;
+
+	if( !slot.timed )
+		return;
+
+	GLuint64 start;
+	GLuint64 end;
+
+	glGetQueryObjectui64v( slot.timestamps[0], GL_QUERY_RESULT, &start );
+	glGetQueryObjectui64v( slot.timestamps[1], GL_QUERY_RESULT, &end );
+
+	if( g_framePacer.lastGpuEnd != 0 )
+		g_framePacer.gpuIdleMs = start > g_framePacer.lastGpuEnd ? (float)(start - g_framePacer.lastGpuEnd) * 1e-6f : 0.0f;
+
+	g_framePacer.lastGpuEnd = end;
+	slot.timed = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginFrame()
+// Desc: Start of render(): waits for every frame older than the allowed
+//       number in flight, and timestamps the new frame's start on the GPU.
+//-----------------------------------------------------------------------------
+void beginFrame( void )
+{
+	FRAMEPACER& pacer = g_framePacer;
+
+	if( !g_bSync )
+		return;
+
+	double start = getMilliseconds();
+
+	for( int age = MAX_FRAMES_IN_FLIGHT; age >= pacer.framesInFlight; --age )
+	{
+		if( pacer.frame >= age )
+			waitForFrameSlot( pacer.slots[(pacer.frame - age) % MAX_FRAMES_IN_FLIGHT] );
+	}
+
+	pacer.cpuWaitMs = (float)(getMilliseconds() - start);
+
+	FRAMESLOT& slot = pacer.slots[pacer.frame % MAX_FRAMES_IN_FLIGHT];
+
+	if( g_bTimerQuery )
+	{
+		glQueryCounter( slot.timestamps[0], GL_TIMESTAMP );
+		slot.timed = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: endFrame()
+// Desc: After SwapBuffers(): fences the frame and moves on to the next one
+//       without waiting for it.
+//-----------------------------------------------------------------------------
+void endFrame( void )
+{
+	FRAMEPACER& pacer = g_framePacer;
+
+	if( !g_bSync )
+		return;
+
+	FRAMESLOT& slot = pacer.slots[pacer.frame % MAX_FRAMES_IN_FLIGHT];
+
+	if( slot.timed )
+		glQueryCounter( slot.timestamps[1], GL_TIMESTAMP );
+
+	slot.fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+
+	++pacer.frame;
+}
+
+//-----------------------------------------------------------------------------
+// Name: initStreamBuffer()
+// Desc: Each region holds one software shadow map plus the debug lines.
+//       The regions are only safe because of the frame fences, so there is
+//       no streaming without GL_ARB_sync either.
+//-----------------------------------------------------------------------------
+bool initStreamBuffer( void )
+{
+	STREAMBUFFER& stream = g_streamBuffer;
+
+	if( stream.buffer != 0 )
+		return true;
+
+	if( !g_bBufferStorage || !g_bSync )
+		return false;
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	stream.regionSize = PBUFFER_WIDTH * PBUFFER_HEIGHT * sizeof(float) + STREAM_LINE_BYTES;
+
+	glGenBuffersARB( 1, &stream.buffer );
+	glBindBufferARB( GL_ARRAY_BUFFER_ARB, stream.buffer );
+	glBufferStorage( GL_ARRAY_BUFFER_ARB, stream.regionSize * MAX_FRAMES_IN_FLIGHT, NULL, flags );
+	stream.memory = (char*)glMapBufferRange( GL_ARRAY_BUFFER_ARB, 0, stream.regionSize * MAX_FRAMES_IN_FLIGHT, flags );
+	glBindBufferARB( GL_ARRAY_BUFFER_ARB, 0 );
+
+	if( stream.memory == NULL )
+	{
+		freeStreamBuffer();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeStreamBuffer()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeStreamBuffer( void )
+{
+	STREAMBUFFER& stream = g_streamBuffer;
+
+	if( stream.buffer != 0 )
+	{
+		if( stream.memory != NULL )
+		{
+			glBindBufferARB( GL_ARRAY_BUFFER_ARB, stream.buffer );
+			glUnmapBufferARB( GL_ARRAY_BUFFER_ARB );
+			glBindBufferARB( GL_ARRAY_BUFFER_ARB, 0 );
+		}
+
+		glDeleteBuffersARB( 1, &stream.buffer );
+	}
+
+	memset( &stream, 0, sizeof(stream) );
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginStreamFrame()
+// Desc: After beginFrame(): the GPU is done with the frame that last used
+//       this frame's region, so it starts over empty.
+//-----------------------------------------------------------------------------
+void beginStreamFrame( void )
+{
+	STREAMBUFFER& stream = g_streamBuffer;
+
+	stream.region      = g_framePacer.frame % MAX_FRAMES_IN_FLIGHT;
+	stream.offset      = 0;
+	stream.allocations = 0;
+	stream.overflows   = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: streamAlloc()
+// Desc: bytes of this frame's region for the CPU to write, and their offset
+//       in the buffer object for GL to read them. NULL when there's no
+//       stream, when the region is full, or in the p-buffer's context,
+//       which can't see the buffer; the caller then passes its data the
+//       old way.
+//-----------------------------------------------------------------------------
+void* streamAlloc( GLsizeiptr bytes, GLintptr* offset )
+{
+	STREAMBUFFER& stream = g_streamBuffer;
+
+	if( stream.buffer == 0 || wglGetCurrentContext() != g_hRC )
+		return NULL;
+
+	GLsizeiptr start = (stream.offset + 15) & ~(GLsizeiptr)15;
+
+	if( start + bytes > stream.regionSize )
+	{
+		++stream.overflows;
+		return NULL;
+	}
+
+	stream.offset = start + bytes;
+	++stream.allocations;
+
+	*offset = stream.region * stream.regionSize + start;
+
+	return stream.memory + *offset;
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildDebugDraw()
+// Desc: Once a frame, before the viewports: queues the frame's debug
+//       geometry and puts all of it in the stream buffer at once.
+//-----------------------------------------------------------------------------
+void buildDebugDraw( void )
+{
+	DEBUGDRAWGL& gl = g_debugDrawGL;
+
+	gl.vertices = 0;
+	debugDrawClear( g_debugDraw );
+
+	if( !debugDrawEnabled( g_debugDraw ) )
+		return;
+
+	// Render the light's position as a sphere...
+	if (sphere)
+	{
+		static const float yellow[3] = { 1.0f, 1.0f, 0.5f };
+		debugDrawSphere( g_debugDraw, DEBUG_LAYER_WORLD, g_lightPosition, 0.1f, yellow );
+	}
+
+	// The perspective viewport's frustum, in the world, so the other
+	// viewports show it as well.
+	if (frustrum)
+	{
+		static const float colors[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+
+		// Near quad, the edges between near and far, far quad
+		float lines[24][6];
+
+		for (int i=0;i<4;++i)
+		{
+			const int ends[3][2] = { { i, (i+1)&3 }, { i, i+4 }, { i+4, ((i+1)&3)+4 } };
+
+			for (int e=0;e<3;++e)
+			{
+				for (int v=0;v<2;++v)
+				{
+					float* vertex = lines[e * 8 + i * 2 + v];
+
+					memcpy( vertex, point[ends[e][v]], 3 * sizeof(float) );
+					memcpy( vertex + 3, colors[e], 3 * sizeof(float) );
+				}
+			}
+		}
+
+		float inverseView[16];
+		buildCameraInverseView( inverseView );
+		debugDrawLines( g_debugDraw, DEBUG_LAYER_WORLD, inverseView, &lines[0][0], 24 );
+	}
+
+	// The objects of scene 3 carry their own axes.
+	if (sceneNo < STRESS_SCENE)
+	{
+		const SCENEGRAPH& graph = g_sceneGraphs[sceneNo];
+
+		for( size_t i = 0; i < graph.nodes.size(); ++i )
+		{
+			if( graph.nodes[i].flags & SCENE_NODE_AXIS )
+				drawAxis( graph.nodes[i].world, DEBUG_LAYER_WORLD );
+		}
+	}
+
+	if (axis)
+	{
+		drawAxis( NULL, objectCoodinate ? DEBUG_LAYER_WORLD : DEBUG_LAYER_EYE );
+	}
+
+	// One block: every layer's lines, then its points.
+	gl.packed.clear();
+
+	for( int layer = 0; layer < DEBUG_LAYER_COUNT; ++layer )
+	{
+		const std::vector<float>* sources[2] = { &g_debugDraw.lines[layer], &g_debugDraw.points[layer] };
+
+		for( int kind = 0; kind < 2; ++kind )
+		{
+			gl.first[layer][kind] = (int)gl.packed.size() / DEBUG_VERTEX_FLOATS;
+			gl.count[layer][kind] = (int)sources[kind]->size() / DEBUG_VERTEX_FLOATS;
+			gl.packed.insert( gl.packed.end(), sources[kind]->begin(), sources[kind]->end() );
+		}
+	}
+
+	gl.vertices = (int)gl.packed.size() / DEBUG_VERTEX_FLOATS;
+
+	if( gl.vertices == 0 )
+		return;
+
+	GLsizeiptr bytes  = gl.packed.size() * sizeof(float);
+	void*      memory = streamAlloc( bytes, &gl.offset );
+
+	gl.streamed = memory != NULL;
+
+	if( gl.streamed )
+		memcpy( memory, &gl.packed[0], bytes );
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderDebugDraw()
+// Desc: The batch of buildDebugDraw() into the current viewport: one
+//       glDrawArrays() per layer and primitive that has anything, from
+//       the stream buffer, or from client memory without one.
+//-----------------------------------------------------------------------------
+void renderDebugDraw( void )
+{
+	static const GLenum modes[2] = { GL_LINES, GL_POINTS };
+
+	const DEBUGDRAWGL& gl = g_debugDrawGL;
+
+	if( !debugDrawEnabled( g_debugDraw ) || gl.vertices == 0 )
+		return;
+
+	const int   STRIDE = DEBUG_VERTEX_FLOATS * sizeof(float);
+	const char* base   = gl.streamed ? (const char*)gl.offset : (const char*)&gl.packed[0];
+
+	if( gl.streamed )
+		glBindBufferARB( GL_ARRAY_BUFFER_ARB, g_streamBuffer.buffer );
+
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_COLOR_ARRAY );
+
+	glVertexPointer( 3, GL_FLOAT, STRIDE, base );
+	glColorPointer( 3, GL_FLOAT, STRIDE, base + 3 * sizeof(float) );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	glMatrixMode( GL_MODELVIEW );
+
+	for( int layer = 0; layer < DEBUG_LAYER_COUNT; ++layer )
+	{
+		if( gl.count[layer][0] + gl.count[layer][1] == 0 )
+			continue;
+
+		// Fixed to the viewport
+		if( layer == DEBUG_LAYER_EYE )
+		{
+			glPushMatrix();
+			glLoadIdentity();
+		}
+
+		for( int kind = 0; kind < 2; ++kind )
+		{
+			if( gl.count[layer][kind] > 0 )
+				glDrawArrays( modes[kind], gl.first[layer][kind], gl.count[layer][kind] );
+		}
+
+		if( layer == DEBUG_LAYER_EYE )
+			glPopMatrix();
+	}
+
+	glDisableClientState( GL_COLOR_ARRAY );
+	glDisableClientState( GL_VERTEX_ARRAY );
+
+	if( gl.streamed )
+		glBindBufferARB( GL_ARRAY_BUFFER_ARB, 0 );
+
+	// The colour is undefined after drawing with a colour array.
+	glColor3f( 1.0f, 1.0f, 1.0f );
+	stateEnable( g_glState, GL_LIGHTING );
+}
+
+//-----------------------------------------------------------------------------
+// Instancing shader
+//-----------------------------------------------------------------------------
+
+// The fixed-function vertex stage for one instance: the object is scaled,
+// turned about Y and moved by its placement, then lit by GL_LIGHT0 in the
+// instance's colour and given the eye-linear texgen of texture unit 0, so
+// the fixed-function fragment stage can do the SGIX compare and fog as for
+// every other object.
+static const char* g_instanceVS =
+	"attribute vec4 a_placement;\n"		// x, y, z, yaw
+	"attribute vec4 a_appearance;\n"	// scale, r, g, b
+	"void main()\n"
+	"{\n"
+	"	float c = cos(a_placement.w);\n"
+	"	float s = sin(a_placement.w);\n"
+	"	vec3 p = gl_Vertex.xyz * a_appearance.x;\n"
+	"	vec4 object = vec4(c * p.x + s * p.z + a_placement.x, p.y + a_placement.y, c * p.z - s * p.x + a_placement.z, 1.0);\n"
+	"	vec3 normal = vec3(c * gl_Normal.x + s * gl_Normal.z, gl_Normal.y, c * gl_Normal.z - s * gl_Normal.x);\n"
+	"	vec4 eye = gl_ModelViewMatrix * object;\n"
+	"	vec3 n = normalize(gl_NormalMatrix * normal);\n"
+	"	vec3 l = normalize(gl_LightSource[0].position.xyz - eye.xyz * gl_LightSource[0].position.w);\n"
+	"	gl_FrontColor = (gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient +\n"
+	"		gl_FrontLightProduct[0].diffuse * max(dot(n, l), 0.0)) * vec4(a_appearance.yzw, 1.0);\n"
+	"	gl_TexCoord[0] = gl_TextureMatrix[0] * vec4(dot(eye, gl_EyePlaneS[0]), dot(eye, gl_EyePlaneT[0]),\n"
+	"		dot(eye, gl_EyePlaneR[0]), 1.0);\n"
+	"	gl_FogFragCoord = abs(eye.z);\n"
+	"	gl_Position = gl_ProjectionMatrix * eye;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+// Name: resetInstanceSet()
+// Desc: Replaces the set's meshes and drops every instance.
+//-----------------------------------------------------------------------------
+void resetInstanceSet( INSTANCESET& set, const MESH* const* meshes, int meshCount )
+{
+	set.meshes.assign( meshes, meshes + meshCount );
+	set.instances.assign( meshCount, std::vector<float>() );
+	set.count = 0;
+
+	for( int c = 0; c < 3; ++c )
+	{
+		set.bounds[c]     =  FLT_MAX;
+		set.bounds[c + 3] = -FLT_MAX;
+	}
+
+	++set.version;
+	++set.generation;
+}
+
+//-----------------------------------------------------------------------------
+// Name: addInstance()
+// Desc: Appends one copy of mesh, turned yaw radians about Y.
+//-----------------------------------------------------------------------------
+void addInstance( INSTANCESET& set, int mesh, const float position[3], float yaw, float scale, const float color[3] )
+{
+	std::vector<float>& instances = set.instances[mesh];
+
+	instances.insert( instances.end(), position, position + 3 );
+	instances.push_back( yaw );
+	instances.push_back( scale );
+	instances.insert( instances.end(), color, color + 3 );
+	++set.count;
+	++set.generation;
+
+	float radius = set.meshes[mesh]->radius * scale;
+
+	for( int c = 0; c < 3; ++c )
+	{
+		set.bounds[c]     = min( set.bounds[c], position[c] - radius );
+		set.bounds[c + 3] = max( set.bounds[c + 3], position[c] + radius );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: sceneInstanceGeneration()
+// Desc: Changes whenever an instance set gains, loses or replaces instances,
+//       e.g. while scene 5 streams in. The caster tables are indexed by
+//       visiting order, which such a change shifts, so the shadow caches
+//       compare this before trusting an index to be the same object.
+//-----------------------------------------------------------------------------
+unsigned sceneInstanceGeneration( void )
+{
+	return g_stressScene.set.generation + g_sceneLoader.set.generation;
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderInstanceSet()
+// Desc: One instanced draw per mesh where the pass allows it, otherwise
+//       instance by instance. Either way every instance asks objectVisible()
+//       in the same order, so filters and sinks see the same sequence of
+//       objects in every walk, and each instance is culled on its own.
+//-----------------------------------------------------------------------------
+void renderInstanceSet( INSTANCESET& set )
+{
+	if( set.count == 0 )
+		return;
+
+	int              slot    = 0;
+	INSTANCEPROGRAM* program = (g_pfnMeshSink == NULL && !g_bTriangleGeometry) ? instancePassProgram( &slot ) : NULL;
+
+	if( program != NULL )
+	{
+		// With no filter and no culling every instance would pass, and the
+		// resident buffers are drawn as they are.
+		bool culled = g_viewCull.active || g_pfnObjectFilter != NULL;
+
+		if( culled )
+		{
+			set.visible.resize( set.meshes.size() );
+
+			for( size_t mesh = 0; mesh < set.meshes.size(); ++mesh )
+			{
+				const std::vector<float>& instances = set.instances[mesh];
+				std::vector<float>&       visible   = set.visible[mesh];
+
+				visible.clear();
+
+				for( size_t i = 0; i < instances.size(); i += INSTANCE_FLOATS )
+				{
+					const float* instance = &instances[i];
+
+					if( objectVisible( instance[0], instance[1], instance[2], set.meshes[mesh]->radius * instance[4] ) )
+						visible.insert( visible.end(), instance, instance + INSTANCE_FLOATS );
+				}
+			}
+		}
+
+		drawInstances( set, set.gl[slot], *program, culled );
+		return;
+	}
+
+	// Scaled objects need their normals renormalized by fixed-function lighting.
+	stateEnable( g_glState, GL_NORMALIZE );
+
+	for( size_t mesh = 0; mesh < set.meshes.size(); ++mesh )
+	{
+		const std::vector<float>& instances = set.instances[mesh];
+
+		for( size_t i = 0; i < instances.size(); i += INSTANCE_FLOATS )
+		{
+			const float* instance = &instances[i];
+
+			if( !objectVisible( instance[0], instance[1], instance[2], set.meshes[mesh]->radius * instance[4] ) )
+				continue;
+
+			glPushMatrix();
+			glTranslatef( instance[0], instance[1], instance[2] );
+			glRotatef( instance[3] * 180.0f / (float)M_PI, 0.0f, 1.0f, 0.0f );
+			glScalef( instance[4], instance[4], instance[4] );
+			glColor3fv( instance + 5 );
+
+			// The same matrix on the CPU for the sinks
+			float model[16];
+			float color[4] = { instance[5], instance[6], instance[7], 1.0f };
+
+			if( g_pfnMeshSink )
+			{
+				float translation[16];
+				float rotation[16];
+				float scale[16];
+				float turned[16];
+
+				matrixTranslate( translation, instance[0], instance[1], instance[2] );
+				matrixRotate( rotation, instance[3] * 180.0f / (float)M_PI, 0.0f, 1.0f, 0.0f );
+				matrixScale( scale, instance[4], instance[4], instance[4] );
+				matrixMultiply( turned, translation, rotation );
+				matrixMultiply( model, turned, scale );
+
+				g_pSinkModel = model;
+				g_pSinkColor = color;
+			}
+
+			renderInstanceMesh( set.meshes[mesh] );
+
+			g_pSinkModel = NULL;
+			g_pSinkColor = NULL;
+
+			glPopMatrix();
+			++g_singleDraws;
+		}
+	}
+
+	stateDisable( g_glState, GL_NORMALIZE );
+	glColor3f( 1.0f, 1.0f, 1.0f );
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderInstanceMesh()
+// Desc: One instance on the per-object path. The scene's own primitives go
+//       through their render functions, so they look the same as elsewhere.
+//-----------------------------------------------------------------------------
+void renderInstanceMesh( const MESH* mesh )
+{
+	if( mesh == &g_teapotMesh )
+		renderTeapot();
+	else if( mesh == &g_sphereMesh )
+		renderSphere();
+	else if( mesh == &g_torusMesh )
+		renderTorus();
+	else if( mesh == &g_floorMesh )
+		renderFloor( false );
+	else if( g_pfnMeshSink )
+		g_pfnMeshSink( *mesh );
+	else
+		drawMesh( *mesh );
+}
+
+//-----------------------------------------------------------------------------
+// Name: instancePassProgram()
+// Desc: The current context's shader, compiled on first use, and the slot
+//       of INSTANCESET::gl that goes with it. NULL if the pass can't take
+//       the instancing shader: no instancing, a context other than the
+//       window's and the p-buffer's, or a program of the pass's own already
+//       bound.
+//-----------------------------------------------------------------------------
+INSTANCEPROGRAM* instancePassProgram( int* slot )
+{
+	if( !g_bInstancing || glGetHandleARB( GL_PROGRAM_OBJECT_ARB ) != 0 )
+		return NULL;
+
+	HGLRC context = wglGetCurrentContext();
+
+	*slot = context == g_hRC ? 0 : (context == g_pbuffer.hRC ? 1 : -1);
+
+	if( *slot < 0 )
+		return NULL;
+
+	INSTANCEPROGRAM& program = g_instancePrograms[*slot];
+
+	if( program.context != context )
+	{
+		program.program = compileProgram( NULL, g_instanceVS, NULL );
+
+		// Don't retry a shader that failed to compile every frame.
+		if( !program.program )
+		{
+			g_bInstancing = false;
+			return NULL;
+		}
+
+		program.placementLocation  = glGetAttribLocationARB( program.program, "a_placement" );
+		program.appearanceLocation = glGetAttribLocationARB( program.program, "a_appearance" );
+		program.context            = context;
+	}
+
+	return &program;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeInstanceProgram()
+// Desc: Has to run in the context the program was compiled in.
+//-----------------------------------------------------------------------------
+void freeInstanceProgram( INSTANCEPROGRAM& program )
+{
+	if( program.context != NULL )
+		glDeleteObjectARB( program.program );
+
+	memset( &program, 0, sizeof(program) );
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeInstanceGL()
+// Desc: Has to run in the context the buffers were created in.
+//-----------------------------------------------------------------------------
+void freeInstanceGL( INSTANCEGL& gl )
+{
+	if( !gl.meshBuffers.empty() )
+		glDeleteBuffersARB( (GLsizei)gl.meshBuffers.size(), &gl.meshBuffers[0] );
+
+	if( !gl.instanceBuffers.empty() )
+		glDeleteBuffersARB( (GLsizei)gl.instanceBuffers.size(), &gl.instanceBuffers[0] );
+
+	if( !gl.visibleBuffers.empty() )
+		glDeleteBuffersARB( (GLsizei)gl.visibleBuffers.size(), &gl.visibleBuffers[0] );
+
+	forgetInstanceGL( gl );
+}
+
+//-----------------------------------------------------------------------------
+// Name: forgetInstanceGL()
+// Desc: For buffers that went with their context.
+//-----------------------------------------------------------------------------
+void forgetInstanceGL( INSTANCEGL& gl )
+{
+	gl.context = NULL;
+	gl.version = -1;
+	gl.meshBuffers.clear();
+	gl.instanceBuffers.clear();
+	gl.visibleBuffers.clear();
+	gl.uploaded.clear();
+	gl.capacity.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Name: syncInstanceGL()
+// Desc: Brings the current context's buffers up to date with the set: new
+//       meshes get their static buffers, and only the instances added since
+//       the last call are uploaded. A buffer that is too small is replaced
+//       by one twice the size, so a set that keeps growing is copied a
+//       logarithmic number of times.
+//-----------------------------------------------------------------------------
+void syncInstanceGL( INSTANCESET& set, INSTANCEGL& gl )
+{
+	HGLRC context = wglGetCurrentContext();
+
+	if( gl.context != context || gl.version != set.version )
+	{
+		if( gl.context == context )
+			freeInstanceGL( gl );
+
+		gl.context = context;
+		gl.version = set.version;
+	}
+
+	// Meshes are only ever added until the version changes.
+	for( size_t mesh = gl.uploaded.size(); mesh < set.meshes.size(); ++mesh )
+	{
+		const MESH& source = *set.meshes[mesh];
+
+		GLuint buffers[4];
+		glGenBuffersARB( 4, buffers );
+
+		if( !source.indices.empty() )
+		{
+			GLsizeiptrARB vertexBytes = (GLsizeiptrARB)(source.positions.size() * sizeof(float));
+
+			glBindBufferARB( GL_ARRAY_BUFFER_ARB, buffers[0] );
+			glBufferDataARB( GL_ARRAY_BUFFER_ARB, 2 * vertexBytes, NULL, GL_STATIC_DRAW_ARB );
+			glBufferSubDataARB( GL_ARRAY_BUFFER_ARB, 0, vertexBytes, &source.positions[0] );
+			glBufferSubDataARB( GL_ARRAY_BUFFER_ARB, vertexBytes, vertexBytes, &source.normals[0] );
+
+			glBindBufferARB( GL_ELEMENT_ARRAY_BUFFER_ARB, buffers[1] );
+			glBufferDataARB( GL_ELEMENT_ARRAY_BUFFER_ARB, source.indices.size() * sizeof(unsigned int),
+							 &source.indices[0], GL_STATIC_DRAW_ARB );
+		}
+
+		gl.meshBuffers.push_back( buffers[0] );
+		gl.meshBuffers.push_back( buffers[1] );
+		gl.instanceBuffers.push_back( buffers[2] );
+		gl.visibleBuffers.push_back( buffers[3] );
+		gl.uploaded.push_back( 0 );
+		gl.capacity.push_back( 0 );
+	}
+
+	const GLsizeiptrARB stride = INSTANCE_FLOATS * sizeof(float);
+
+	for( size_t mesh = 0; mesh < set.meshes.size(); ++mesh )
+	{
+		const std::vector<float>& instances = set.instances[mesh];
+
+		int count = (int)(instances.size() / INSTANCE_FLOATS);
+
+		if( count == gl.uploaded[mesh] )
+			continue;
+
+		glBindBufferARB( GL_ARRAY_BUFFER_ARB, gl.instanceBuffers[mesh] );
+
+		if( count > gl.capacity[mesh] )
+		{
+			gl.capacity[mesh] = max( count, 2 * gl.capacity[mesh] );
+			gl.uploaded[mesh] = 0;
+			glBufferDataARB( GL_ARRAY_BUFFER_ARB, gl.capacity[mesh] * stride, NULL, GL_STATIC_DRAW_ARB );
+		}
+
+		glBufferSubDataARB( GL_ARRAY_BUFFER_ARB, gl.uploaded[mesh] * stride, (count - gl.uploaded[mesh]) * stride,
+							&instances[gl.uploaded[mesh] * INSTANCE_FLOATS] );
+
+		gl.uploaded[mesh] = count;
+	}
+
+	glBindBufferARB( GL_ARRAY_BUFFER_ARB, 0 );
+	glBindBufferARB( GL_ELEMENT_ARRAY_BUFFER_ARB, 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: drawInstances()
+// Desc: One glDrawElementsInstancedARB() per mesh: of every instance, or,
+//       when culled, of the ones renderInstanceSet() left in set.visible,
+//       streamed into a buffer of their own.
+//-----------------------------------------------------------------------------
+void drawInstances( INSTANCESET& set, INSTANCEGL& gl, const INSTANCEPROGRAM& program, bool culled )
+{
+	syncInstanceGL( set, gl );
+
+	const GLsizei stride = INSTANCE_FLOATS * sizeof(float);
+
+	glUseProgramObjectARB( program.program );
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_NORMAL_ARRAY );
+	glEnableVertexAttribArrayARB( program.placementLocation );
+	glEnableVertexAttribArrayARB( program.appearanceLocation );
+	glVertexAttribDivisorARB( program.placementLocation, 1 );
+	glVertexAttribDivisorARB( program.appearanceLocation, 1 );
+
+	for( size_t mesh = 0; mesh < set.meshes.size(); ++mesh )
+	{
+		const MESH& source = *set.meshes[mesh];
+
+		int count = culled ? (int)(set.visible[mesh].size() / INSTANCE_FLOATS) : gl.uploaded[mesh];
+
+		if( count == 0 || source.indices.empty() )
+			continue;
+
+		if( culled )
+		{
+			glBindBufferARB( GL_ARRAY_BUFFER_ARB, gl.visibleBuffers[mesh] );
+			glBufferDataARB( GL_ARRAY_BUFFER_ARB, count * stride, &set.visible[mesh][0], GL_STREAM_DRAW_ARB );
+		}
+		else
+		{
+			glBindBufferARB( GL_ARRAY_BUFFER_ARB, gl.instanceBuffers[mesh] );
+		}
+		glVertexAttribPointerARB( program.placementLocation, 4, GL_FLOAT, GL_FALSE, stride, NULL );
+		glVertexAttribPointerARB( program.appearanceLocation, 4, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(4 * sizeof(float)) );
+
+		glBindBufferARB( GL_ARRAY_BUFFER_ARB, gl.meshBuffers[2 * mesh] );
+		glVertexPointer( 3, GL_FLOAT, 0, NULL );
+		glNormalPointer( GL_FLOAT, 0, (const GLvoid*)(source.positions.size() * sizeof(float)) );
+
+		glBindBufferARB( GL_ELEMENT_ARRAY_BUFFER_ARB, gl.meshBuffers[2 * mesh + 1] );
+		glDrawElementsInstancedARB( GL_TRIANGLES, (GLsizei)source.indices.size(), GL_UNSIGNED_INT, NULL, count );
+
+		++g_instancedDraws;
+	}
+
+	glVertexAttribDivisorARB( program.appearanceLocation, 0 );
+	glVertexAttribDivisorARB( program.placementLocation, 0 );
+	glDisableVertexAttribArrayARB( program.appearanceLocation );
+	glDisableVertexAttribArrayARB( program.placementLocation );
+	glDisableClientState( GL_NORMAL_ARRAY );
+	glDisableClientState( GL_VERTEX_ARRAY );
+	glUseProgramObjectARB( 0 );
+
+	glBindBufferARB( GL_ARRAY_BUFFER_ARB, 0 );
+	glBindBufferARB( GL_ELEMENT_ARRAY_BUFFER_ARB, 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildStressScene()
+// Desc: Places g_stressScene.count objects on the floor, on a square grid
+//       or at random, each shape scaled to fit one grid cell. The same seed
+//       is used every time so the benchmark is repeatable.
+//-----------------------------------------------------------------------------
+void buildStressScene( void )
+{
+	STRESSSCENE& scene = g_stressScene;
+
+	const MESH* meshes[STRESS_SHAPES] = { &g_teapotMesh, &g_sphereMesh, &g_torusMesh };
+	const float white[3] = { 1.0f, 1.0f, 1.0f };
+
+	int   side = (int)ceil( sqrt( (double)scene.count ) );
+	float cell = STRESS_FIELD_SIZE / side;
+
+	resetInstanceSet( scene.set, meshes, STRESS_SHAPES );
+
+	srand( 1 );
+
+	// Object i is shape i % 3.
+	for( int i = 0; i < scene.count; ++i )
+	{
+		int   shape = i % STRESS_SHAPES;
+		float position[3];
+		float yaw;
+
+		if( scene.random )
+		{
+			position[0] = ((float)rand() / RAND_MAX - 0.5f) * (STRESS_FIELD_SIZE - cell);
+			position[2] = ((float)rand() / RAND_MAX - 0.5f) * (STRESS_FIELD_SIZE - cell);
+			yaw         = (float)rand() / RAND_MAX * 2.0f * (float)M_PI;
+		}
+		else
+		{
+			position[0] = ((i % side) + 0.5f) * cell - 0.5f * STRESS_FIELD_SIZE;
+			position[2] = ((i / side) + 0.5f) * cell - 0.5f * STRESS_FIELD_SIZE;
+			yaw         = (float)(i % 8) * 0.25f * (float)M_PI;
+		}
+
+		position[1] = 0.45f * cell;		// Resting on the floor
+
+		addInstance( scene.set, shape, position, yaw, 0.45f * cell / meshes[shape]->radius, white );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: sceneLoaderThread()
+// Desc: The loader's thread: compiles a text file to binary next to it,
+//       maps the binary file, stages the mesh and material tables and then
+//       the instances, LOADER_CHUNK at a time, until done or cancelled.
+//-----------------------------------------------------------------------------
+void sceneLoaderThread( SCENELOADER* loader )
+{
+	char        error[512] = "";
+	std::string path = loader->path;
+	SCENEFILE   file;
+
+	size_t dot = path.find_last_of( '.' );
+
+	if( dot != std::string::npos && _stricmp( path.c_str() + dot, ".scn" ) == 0 )
+	{
+		SCENEDESCRIPTION description;
+		std::string      binary = path.substr( 0, dot ) + ".scb";
+
+		if( sceneFileParseText( description, path.c_str(), error, sizeof(error) ) &&
+			sceneFileWriteBinary( description, binary.c_str(), error, sizeof(error) ) )
+			path = binary;
+	}
+
+	if( error[0] == '\0' && sceneFileOpen( file, path.c_str(), error, sizeof(error) ) )
+	{
+		std::vector<unsigned> primitives( file.header.meshCount );
+		std::vector<MESH>     meshes( file.header.meshCount );
+
+		for( unsigned i = 0; i < file.header.meshCount; ++i )
+		{
+			primitives[i] = sceneFilePrimitive( file, i );
+
+			if( primitives[i] == SCENE_PRIMITIVE_IMPORTED )
+				sceneFileMesh( file, i, meshes[i] );
+		}
+
+		{
+			std::lock_guard<std::mutex> lock( loader->mutex );
+
+			loader->stagedPrimitives.swap( primitives );
+			loader->stagedMeshes.swap( meshes );
+			loader->stagedMaterials = file.materials;
+			loader->stagedTotal     = file.header.instanceCount;
+			loader->tablesReady     = true;
+		}
+
+		std::vector<SCENEFILEINSTANCE> chunk( LOADER_CHUNK );
+
+		for( int count; !loader->cancel && (count = sceneFileRead( file, &chunk[0], LOADER_CHUNK )) > 0; )
+		{
+			std::lock_guard<std::mutex> lock( loader->mutex );
+
+			loader->staged.insert( loader->staged.end(), chunk.begin(), chunk.begin() + count );
+		}
+
+		sceneFileClose( file );
+	}
+
+	std::lock_guard<std::mutex> lock( loader->mutex );
+
+	loader->error = error;
+	loader->done  = true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: startSceneLoader()
+// Desc: Starts loading g_sceneLoader.path from scratch.
+//-----------------------------------------------------------------------------
+void startSceneLoader( void )
+{
+	SCENELOADER& loader = g_sceneLoader;
+
+	stopSceneLoader();
+
+	loader.tablesReady = false;
+	loader.done        = false;
+	loader.error.clear();
+	loader.stagedPrimitives.clear();
+	loader.stagedMeshes.clear();
+	loader.stagedMaterials.clear();
+	loader.staged.clear();
+	loader.stagedTaken = 0;
+	loader.stagedTotal = 0;
+
+	loader.tablesTaken = false;
+	loader.errorShown  = false;
+	loader.total       = 0;
+
+	// The old meshes may still be pointed to until the new table arrives.
+	resetInstanceSet( loader.set, NULL, 0 );
+
+	loader.cancel  = false;
+	loader.started = true;
+	loader.thread  = new std::thread( sceneLoaderThread, &loader );
+}
+
+//-----------------------------------------------------------------------------
+// Name: stopSceneLoader()
+// Desc: Cancels the thread, if it is still running, and waits for it.
+//-----------------------------------------------------------------------------
+void stopSceneLoader( void )
+{
+	SCENELOADER& loader = g_sceneLoader;
+
+	if( loader.thread == NULL )
+		return;
+
+	loader.cancel = true;
+	loader.thread->join();
+
+	delete loader.thread;
+	loader.thread = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: updateLoadedScene()
+// Desc: Once a frame while scene 5 is shown: starts the loader the first
+//       time, then moves what it has staged into the scene's instance set,
+//       at most LOADER_INSTANCES_PER_FRAME instances a frame. Keeps frames
+//       coming until everything is in, since nothing else would redraw.
+//-----------------------------------------------------------------------------
+void updateLoadedScene( void )
+{
+	SCENELOADER& loader = g_sceneLoader;
+
+	if( sceneNo != LOADED_SCENE )
+		return;
+
+	if( !loader.started )
+		startSceneLoader();
+
+	bool        finished = false;
+	std::string error;
+
+	loader.incoming.clear();
+
+	{
+		std::lock_guard<std::mutex> lock( loader.mutex );
+
+		if( loader.tablesReady && !loader.tablesTaken )
+		{
+			std::vector<unsigned> primitives;
+
+			primitives.swap( loader.stagedPrimitives );
+			loader.meshes.swap( loader.stagedMeshes );
+			loader.materials.swap( loader.stagedMaterials );
+			loader.total       = loader.stagedTotal;
+			loader.tablesTaken = true;
+
+			const MESH* builtIn[SCENE_PRIMITIVE_COUNT] = { &g_teapotMesh, &g_sphereMesh, &g_torusMesh, &g_floorMesh };
+			std::vector<const MESH*> meshes( primitives.size() );
+
+			for( size_t i = 0; i < primitives.size(); ++i )
+				meshes[i] = primitives[i] < SCENE_PRIMITIVE_COUNT ? builtIn[primitives[i]] : &loader.meshes[i];
+
+			resetInstanceSet( loader.set, &meshes[0], (int)meshes.size() );
+		}
+
+		size_t count = min( loader.staged.size() - loader.stagedTaken, (size_t)LOADER_INSTANCES_PER_FRAME );
+
+		loader.incoming.assign( loader.staged.begin() + loader.stagedTaken, loader.staged.begin() + loader.stagedTaken + count );
+		loader.stagedTaken += count;
+
+		if( loader.stagedTaken == loader.staged.size() )
+		{
+			loader.staged.clear();
+			loader.stagedTaken = 0;
+			finished = loader.done;
+		}
+
+		error = loader.error;
+	}
+
+	for( size_t i = 0; i < loader.incoming.size(); ++i )
+	{
+		const SCENEFILEINSTANCE& instance = loader.incoming[i];
+
+		addInstance( loader.set, instance.mesh, instance.position, instance.yaw, instance.scale,
+					 &loader.materials[3 * instance.material] );
+	}
+
+	if( !finished )
+	{
+		g_bRedraw = true;
+		return;
+	}
+
+	stopSceneLoader();
+
+	if( !error.empty() && !loader.errorShown )
+	{
+		loader.errorShown = true;
+		MessageBox( NULL, error.c_str(), "ERROR", MB_OK | MB_ICONEXCLAMATION );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderDepthPrepass()
+// Desc: The depth of the viewport render() has set up, and nothing else: no
+//       colour writes, no lighting, texturing or fog, and every mesh drawn
+//       from its positions alone. render() then shades with GL_EQUAL. view
+//       and projection are the viewport's, for the GLSL lookup's depth
+//       program, which takes the place of fixed function while the lookup
+//       is active so both passes transform the vertices alike.
+//-----------------------------------------------------------------------------
+void renderDepthPrepass( const float view[16], const float projection[16] )
+{
+	glPushAttrib( GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT );
+
+	glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_TEXTURE_GEN_S );
+	stateDisable( g_glState, GL_TEXTURE_GEN_T );
+	stateDisable( g_glState, GL_TEXTURE_GEN_R );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+
+	if( shaderLookupActive() )
+	{
+		beginShaderLookupProgram( g_shaderLookup.depth, view, projection );
+		renderScene();
+		endShaderLookupProgram();
+	}
+	else
+	{
+		MESHSINK sink = g_pfnMeshSink;
+
+		g_pfnMeshSink = depthPrepassSink;
+		renderScene();
+		g_pfnMeshSink = sink;
+	}
+
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: depthPrepassSink()
+// Desc: Mesh sink of renderDepthPrepass(). The model matrix already is on
+//       the modelview, GL does the rest.
+//-----------------------------------------------------------------------------
+void depthPrepassSink( const MESH& mesh )
+{
+	drawMeshPositions( mesh );
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginViewPassTimer(), endViewPassTimer()
+// Desc: Bracket render()'s views for benchmarkShadowMaps(). The end waits
+//       for the result, which is fine for a benchmark, and leaves it in
+//       g_viewPassTimer.ms.
+//-----------------------------------------------------------------------------
+void beginViewPassTimer( void )
+{
+	VIEWPASSTIMER& timer = g_viewPassTimer;
+
+	if( !timer.active )
+		return;
+
+	if( g_bTimerQuery )
+	{
+		glQueryCounter( timer.timestamps[0], GL_TIMESTAMP );
+	}
+	else
+	{
+		glFinish();
+		timer.start = getMilliseconds();
+	}
+}
+
+void endViewPassTimer( void )
+{
+	VIEWPASSTIMER& timer = g_viewPassTimer;
+
+	if( !timer.active )
+		return;
+
+	if( g_bTimerQuery )
+	{
+		GLuint64 start;
+		GLuint64 end;
+
+		glQueryCounter( timer.timestamps[1], GL_TIMESTAMP );
+		glGetQueryObjectui64v( timer.timestamps[0], GL_QUERY_RESULT, &start );
+		glGetQueryObjectui64v( timer.timestamps[1], GL_QUERY_RESULT, &end );
+
+		timer.ms = (double)(end - start) * 1e-6;
+	}
+	else
+	{
+		glFinish();
+		timer.ms = getMilliseconds() - timer.start;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: render()
+// Desc:
+//-----------------------------------------------------------------------------
+void render( void )
+{
+	double frameStart = getMilliseconds();
+
+	// Waits for the GPU only as far as the frames in flight require.
+	beginFrame();
+	beginStreamFrame();
+
+	stateResetCounters( g_glState );
+
+	g_viewCull.drawn     = 0;
+	g_viewCull.culled    = 0;
+	g_viewCull.occluded  = 0;
+	g_viewCull.occluders = 0;
+
+	if (fog)
+	{
+		if (adjust)
+		{
+			glClearColor(0.5, 0.5, 0.5, 1.0);
+			glFogfv (GL_FOG_COLOR, gray);
+			stateFogMode( g_glState, GL_EXP );
+		}
+		else
+		{
+			glClearColor(0.35f, 0.53f, 0.7f, 1.0f);
+			glFogfv(GL_FOG_COLOR, blue);
+			stateFogMode( g_glState, GL_LINEAR );
+		}
+		stateEnable( g_glState, GL_FOG );
+	}
+	else
+	{
+		stateDisable( g_glState, GL_FOG );
+	}
+	if (smooth)
+	{
+		stateEnable( g_glState, GL_BLEND );
+		stateEnable( g_glState, GL_LINE_SMOOTH );
+		glHint(GL_NICEST,GL_LINE_SMOOTH_HINT);
+	}
+	else
+	{
+		stateDisable( g_glState, GL_LINE_SMOOTH );
+	}
+	// Input of the last frame into the scene's nodes
+	updateSceneGraph();
+
+	// Whatever the loader has read since the last frame
+	updateLoadedScene();
+
+	// Walk the scene once; every pass below replays it.
+	// The instanced scenes already are a draw list.
+	if (g_bDrawList && sceneNo < STRESS_SCENE)
+		recordDrawList();
+
+	// The light's view, projection and texture matrix, for the whole frame
+	updateLightMatrices();
+
+	// Markers, frustum and axes, drawn into every viewport below
+	buildDebugDraw();
+
+	switch (g_shadowMode)
+	{
+		case SHADOW_VSM:
+		case SHADOW_ESM:
+			createMomentMap();
+			break;
+
+		case SHADOW_CUBE:
+			createCubeShadowMap();
+			break;
+
+		case SHADOW_ATLAS:
+			createShadowAtlas();
+			break;
+
+		case SHADOW_SOFTWARE:
+			rasterizeShadowMap();
+			uploadSoftwareShadowMap();
+			break;
+
+		case SHADOW_VIRTUAL:
+			createVirtualShadowMap();
+			break;
+
+		case SHADOW_RAYTRACE:
+			buildSceneBVH();
+			break;
+
+		default:
+			if (g_bAdaptiveResolution)
+			{
+				chooseAdaptiveLevel();
+				createAdaptiveDepthTexture();
+			}
+			else if (g_bIncrementalShadow)
+			{
+				createIncrementalDepthTexture();
+			}
+			else
+			{
+				createDepthTexture();
+			}
+			break;
+	}
+
+	//ʽ
+	beginViewPassTimer();
+	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+
+	bool bMultiView    = multiViewActive();
+	bool bShaderLookup = shaderLookupActive();
+	bool bPrepass      = g_bDepthPrepass && !bMultiView;
+
+	// The same matrices as below, for the frustum culling
+	float view[4][16];
+	float projection[4][16];
+	buildViewMatrices( view, projection );
+
+	for (int i = 0; i < 4; ++i)
+	{
+		glViewport(nWidth * (i % 2 == 1), nHeight * (i >= 2), nWidth, nHeight);
+
+		if (i == 1)			//ͼ
+		{
+			glMatrixMode( GL_PROJECTION );
+			glLoadIdentity();
+			gluPerspective( fovy, (GLdouble)nWidth / (GLdouble)nHeight, -nearZ, -farZ);
+			// Place the view
+			glMatrixMode( GL_MODELVIEW );
+			glLoadIdentity();
+
+			glTranslatef( 0.0f, -2.0f, -z );						//ӽǱ任, עƹӽǱ任֮ǰ. translateʹԭ仯, .
+			glRotatef( -g_fSpinY_L, 1.0f, 0.0f, 0.0f );
+			glRotatef( -g_fSpinX_L, 0.0f, 1.0f, 0.0f );
+		}
+		else
+		{
+			//ͼ
+			glMatrixMode( GL_PROJECTION );
+			glLoadIdentity();
+			glOrtho(-nWidth / 50, nWidth / 50, -nHeight / 50, nHeight / 50, -40, 40);
+			// Place the view
+			glMatrixMode( GL_MODELVIEW );
+			glLoadIdentity();
+
+			if (i == 2)		//ͼ
+			{
+				glRotatef(90, 1.0f, 0.0f, 0.0f );
+			}
+			else if (i == 3)		//ͼ
+			{
+				glRotatef(90, 0.0f, 1.0f, 0.0f );
+			}
+		}
+
+		glLightfv( GL_LIGHT0, GL_POSITION, g_lightPosition );
+
+		// Set up OpenGL's state machine for a depth comparison using the depth texture...
+		stateEnable( g_glState, GL_LIGHTING );
+
+		// The GLSL lookup and the multi-view pass take the matrix as a uniform instead.
+		if (!bShaderLookup && !bMultiView)
+		{
+			float x[] = { 1.0f, 0.0f, 0.0f, 0.0f };
+			float y[] = { 0.0f, 1.0f, 0.0f, 0.0f };
+			float z[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+			//float w[] = { 0.0f, 0.0f, 0.0f, 1.0f };						//Qȫû, ûϸĵ.
+			glTexGenfv( GL_S, GL_EYE_PLANE, x );
+			glTexGenfv( GL_T, GL_EYE_PLANE, y );
+			glTexGenfv( GL_R, GL_EYE_PLANE, z );
+			//glTexGenfv( GL_Q, GL_EYE_PLANE, w );
+
+			stateTexGenMode( g_glState, GL_S, GL_EYE_LINEAR );
+			stateTexGenMode( g_glState, GL_T, GL_EYE_LINEAR );
+			stateTexGenMode( g_glState, GL_R, GL_EYE_LINEAR );
+			//glTexGeni( GL_Q, GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR );
+
+			stateEnable( g_glState, GL_TEXTURE_GEN_S );
+			stateEnable( g_glState, GL_TEXTURE_GEN_T );
+			stateEnable( g_glState, GL_TEXTURE_GEN_R );
+			//glEnable( GL_TEXTURE_GEN_Q );
+
+			glMatrixMode( GL_TEXTURE );
+			glLoadMatrixf( g_shadowTextureMatrix );
+			//עGL_EYE_LINEARģʽ, OpenGLڲԶԵǰMODELVIEW_MATRIX , ֱӱ任¾, ȻҪƶ.
+		}
+
+		if (!bMultiView)
+		{
+			beginViewCulling( &view[i], &projection[i], 1 );
+		}
+
+		// Depth first; the shading pass below then only touches the pixels
+		// whose nearest surface it is drawing.
+		if (bPrepass)
+		{
+			renderDepthPrepass( view[i], projection[i] );
+
+			glDepthFunc( GL_EQUAL );
+			glDepthMask( GL_FALSE );
+			g_bTriangleGeometry = true;
+		}
+
+		if (bMultiView)
+		{
+			// Only the decorations here, the scene goes to all four viewports after the loop.
+		}
+		else if (bShaderLookup)
+		{
+			// Per-pixel lighting and shadow2DProj() of whichever map the mode made.
+			beginShaderLookup( view[i], projection[i] );
+			renderScene();
+			endShaderLookup();
+		}
+		else if (g_shadowMode == SHADOW_RAYTRACE)
+		{
+			// Lit without any map, then darkened where the shadow rays were blocked.
+			renderScene();
+			traceViewportShadows( nWidth * (i % 2 == 1), nHeight * (i >= 2), view[i], projection[i] );
+		}
+		else if (g_shadowMode == SHADOW_CUBE)
+		{
+			// The texture matrix is replaced so the eye-linear texgen yields
+			// the light-to-fragment vector used to index the cube map.
+			beginCubeShadowLookup();
+			renderScene();
+			endCubeShadowLookup();
+		}
+		else if (g_shadowMode == SHADOW_ATLAS)
+		{
+			// One additive pass per light, each with its own texture matrix.
+			renderAtlasLights();
+		}
+		else if (g_shadowMode == SHADOW_SOFTWARE)
+		{
+			// Same SGIX compare as the p-buffer path, no render texture to bind.
+			stateEnable( g_glState, GL_TEXTURE_2D );
+			glBindTexture( GL_TEXTURE_2D, g_softwareDepthTexture );
+			renderScene();
+		}
+		else if (g_shadowMode == SHADOW_VIRTUAL)
+		{
+			// The shader walks the page table to the finest resident page.
+			beginVirtualShadowLookup();
+			renderScene();
+			endVirtualShadowLookup();
+		}
+		else if (g_shadowMode != SHADOW_DEPTH_COMPARE)
+		{
+			// VSM/ESM: the same texgen and texture matrix feed a fragment
+			// shader that filters the moment map instead of the SGIX compare.
+			beginMomentLookup();
+			renderScene();
+			endMomentLookup();
+		}
+		else if (g_bAdaptiveResolution)
+		{
+			// The pool's targets are ordinary textures, nothing to bind to a p-buffer.
+			stateEnable( g_glState, GL_TEXTURE_2D );
+			glBindTexture( GL_TEXTURE_2D, g_adaptiveShadowMap.texture[g_adaptiveShadowMap.level] );
+			renderScene();
+		}
+		else if (g_bIncrementalShadow)
+		{
+			stateEnable( g_glState, GL_TEXTURE_2D );
+			glBindTexture( GL_TEXTURE_2D, g_incrementalShadowMap.texture[1] );
+			renderScene();
+		}
+		else
+		{
+			// Bind the depth texture so we can use it as the shadow map...
+			stateEnable( g_glState, GL_TEXTURE_2D );
+			glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+			// wglBindTexImageARB ǽpbuffer󶨵Ļ.
+			// ڱӦֻ÷, ȫpbuffer.
+			// pbufferҲҪʽ, ܱȾ, ſΪĸʽ.
+			if( wglBindTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )		//WGL_DEPTH_COMPONENT_NVָ˱ϵPBuffer: Ȼ.
+			{
+				MessageBox(NULL, "Could not bind p-buffer to render texture!",
+						   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+				exit(-1);
+			}
+
+			// õľg_depthTexture:
+			// glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+			// glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
+			// ǽԶɵRͼƬP, QӦȽ, еֵ, , ӦͿ.
+			// ͿڵЧڽӦصȳ0, 1.
+			// ɫΪ, ӰԶ.
+			renderScene();
+
+			if( wglReleaseTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
+			{
+				MessageBox(NULL, "Could not release p-buffer from render texture!",
+						   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+				exit(-1);
+			}
+		}
+
+		if (bPrepass)
+		{
+			g_bTriangleGeometry = false;
+			glDepthMask( GL_TRUE );
+			glDepthFunc( GL_LESS );
+		}
+
+		endViewCulling();
+
+		// Reset some of the states for the next go-around!
+		stateDisable( g_glState, GL_TEXTURE_2D );
+		stateDisable( g_glState, GL_TEXTURE_GEN_S );
+		stateDisable( g_glState, GL_TEXTURE_GEN_T );
+		stateDisable( g_glState, GL_TEXTURE_GEN_R );
+
+		// The frame's debug geometry under this viewport's view
+		renderDebugDraw();
+	}
+
+	if (bMultiView)
+	{
+		renderMultiView();
+	}
+
+	endViewPassTimer();
+
+	if( g_bRenderDepthTexture == true )
+	{
+		displayDepthTexture(); // For debugging...
+	}
+
+	// Input between frames can move things.
+	g_bDrawListValid = false;
+
+	updateWindowTitle();
+
+	// The benchmark's frames aren't shown.
+	if( !g_viewPassTimer.active )
+		SwapBuffers( g_hDC );
+
+	endFrame();
+
+	// Smoothed so a single slow frame doesn't shrink the shadow map.
+	g_frameMs += 0.1f * ((float)(getMilliseconds() - frameStart) - g_frameMs);
+}
+
+//-----------------------------------------------------------------------------
+// Name: initExtensions()
+// Desc: ʼչ
+//-----------------------------------------------------------------------------
+void initExtensions( void )
+{
+	// wglGetExtensionsStringARB
+	wglGetExtensionsStringARB = (PFNWGLGETEXTENSIONSSTRINGARBPROC)wglGetProcAddress("wglGetExtensionsStringARB");
+	char* wgl_ext = NULL;
+
+	if( wglGetExtensionsStringARB )
+	{
+		wgl_ext = (char*)wglGetExtensionsStringARB( wglGetCurrentDC() );
+	}
+	else
+	{
+		MessageBox(NULL, "Unable to get address for wglGetExtensionsStringARB!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	// WGL_ARB_pbuffer
+	if( strstr( wgl_ext, "WGL_ARB_pbuffer" ) == NULL )
+	{
+		MessageBox(NULL, "WGL_ARB_pbuffer extension was not found",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+	else
+	{
+		wglCreatePbufferARB    = (PFNWGLCREATEPBUFFERARBPROC)wglGetProcAddress("wglCreatePbufferARB");
+		wglGetPbufferDCARB     = (PFNWGLGETPBUFFERDCARBPROC)wglGetProcAddress("wglGetPbufferDCARB");
+		wglReleasePbufferDCARB = (PFNWGLRELEASEPBUFFERDCARBPROC)wglGetProcAddress("wglReleasePbufferDCARB");
+		wglDestroyPbufferARB   = (PFNWGLDESTROYPBUFFERARBPROC)wglGetProcAddress("wglDestroyPbufferARB");
+
+		if( !wglCreatePbufferARB || !wglGetPbufferDCARB ||
+				!wglReleasePbufferDCARB || !wglDestroyPbufferARB )
+		{
+			MessageBox(NULL, "One or more WGL_ARB_pbuffer functions were not found",
+					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+			exit(-1);
+		}
+	}
+
+	// WGL_ARB_pixel_format
+	if( strstr( wgl_ext, "WGL_ARB_pixel_format" ) == NULL )
+	{
+		MessageBox(NULL, "WGL_ARB_pixel_format extension was not found",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		return;
+	}
+	else
+	{
+		wglChoosePixelFormatARB  = (PFNWGLCHOOSEPIXELFORMATARBPROC)wglGetProcAddress("wglChoosePixelFormatARB");
+
+		if( !wglCreatePbufferARB || !wglGetPbufferDCARB )
+		{
+			MessageBox(NULL, "One or more WGL_ARB_pixel_format functions were not found",
+					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+			exit(-1);
+		}
+	}
+
+	// WGL_ARB_render_texture
+	if( strstr( wgl_ext, "WGL_ARB_render_texture" ) == NULL )
+	{
+		MessageBox(NULL, "WGL_ARB_render_texture extension was not found",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+	else
+	{
+		wglBindTexImageARB    = (PFNWGLBINDTEXIMAGEARBPROC)wglGetProcAddress("wglBindTexImageARB");
+		wglReleaseTexImageARB = (PFNWGLRELEASETEXIMAGEARBPROC)wglGetProcAddress("wglReleaseTexImageARB");
+
+		if( !wglBindTexImageARB || !wglReleaseTexImageARB )
+		{
+			MessageBox(NULL, "One or more WGL_ARB_render_texture functions were not found",
+					   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+			exit(-1);
+		}
+	}
+
+	// չǿѡ, ȱʱֻǽöӦӰ㷨, ˳.
+	char* gl_ext = (char*)glGetString( GL_EXTENSIONS );
+
+	// GL_ARB_multitexture
+	if( strstr( gl_ext, "GL_ARB_multitexture" ) != NULL )
+	{
+		glActiveTextureARB = (PFNGLACTIVETEXTUREARBPROC)wglGetProcAddress("glActiveTextureARB");
+		g_bMultitexture    = glActiveTextureARB != NULL;
+	}
+
+	// GL_EXT_framebuffer_object
+	if( strstr( gl_ext, "GL_EXT_framebuffer_object" ) != NULL )
+	{
+		glGenFramebuffersEXT         = (PFNGLGENFRAMEBUFFERSEXTPROC)wglGetProcAddress("glGenFramebuffersEXT");
+		glDeleteFramebuffersEXT      = (PFNGLDELETEFRAMEBUFFERSEXTPROC)wglGetProcAddress("glDeleteFramebuffersEXT");
+		glBindFramebufferEXT         = (PFNGLBINDFRAMEBUFFEREXTPROC)wglGetProcAddress("glBindFramebufferEXT");
+		glCheckFramebufferStatusEXT  = (PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC)wglGetProcAddress("glCheckFramebufferStatusEXT");
+		glFramebufferTexture2DEXT    = (PFNGLFRAMEBUFFERTEXTURE2DEXTPROC)wglGetProcAddress("glFramebufferTexture2DEXT");
+		glGenRenderbuffersEXT        = (PFNGLGENRENDERBUFFERSEXTPROC)wglGetProcAddress("glGenRenderbuffersEXT");
+		glDeleteRenderbuffersEXT     = (PFNGLDELETERENDERBUFFERSEXTPROC)wglGetProcAddress("glDeleteRenderbuffersEXT");
+		glBindRenderbufferEXT        = (PFNGLBINDRENDERBUFFEREXTPROC)wglGetProcAddress("glBindRenderbufferEXT");
+		glRenderbufferStorageEXT     = (PFNGLRENDERBUFFERSTORAGEEXTPROC)wglGetProcAddress("glRenderbufferStorageEXT");
+		glFramebufferRenderbufferEXT = (PFNGLFRAMEBUFFERRENDERBUFFEREXTPROC)wglGetProcAddress("glFramebufferRenderbufferEXT");
+		glGenerateMipmapEXT          = (PFNGLGENERATEMIPMAPEXTPROC)wglGetProcAddress("glGenerateMipmapEXT");
+
+		g_bFramebufferObject = glGenFramebuffersEXT && glDeleteFramebuffersEXT && glBindFramebufferEXT &&
+			glCheckFramebufferStatusEXT && glFramebufferTexture2DEXT && glGenRenderbuffersEXT &&
+			glDeleteRenderbuffersEXT && glBindRenderbufferEXT && glRenderbufferStorageEXT &&
+			glFramebufferRenderbufferEXT && glGenerateMipmapEXT;
+	}
+
+	// GL_ARB_shader_objects, GL_ARB_vertex_shader, GL_ARB_fragment_shader
+	if( strstr( gl_ext, "GL_ARB_shader_objects" ) != NULL &&
+		strstr( gl_ext, "GL_ARB_vertex_shader" ) != NULL &&
+		strstr( gl_ext, "GL_ARB_fragment_shader" ) != NULL )
+	{
+		glCreateShaderObjectARB   = (PFNGLCREATESHADEROBJECTARBPROC)wglGetProcAddress("glCreateShaderObjectARB");
+		glShaderSourceARB         = (PFNGLSHADERSOURCEARBPROC)wglGetProcAddress("glShaderSourceARB");
+		glCompileShaderARB        = (PFNGLCOMPILESHADERARBPROC)wglGetProcAddress("glCompileShaderARB");
+		glCreateProgramObjectARB  = (PFNGLCREATEPROGRAMOBJECTARBPROC)wglGetProcAddress("glCreateProgramObjectARB");
+		glAttachObjectARB         = (PFNGLATTACHOBJECTARBPROC)wglGetProcAddress("glAttachObjectARB");
+		glLinkProgramARB          = (PFNGLLINKPROGRAMARBPROC)wglGetProcAddress("glLinkProgramARB");
+		glUseProgramObjectARB     = (PFNGLUSEPROGRAMOBJECTARBPROC)wglGetProcAddress("glUseProgramObjectARB");
+		glDeleteObjectARB         = (PFNGLDELETEOBJECTARBPROC)wglGetProcAddress("glDeleteObjectARB");
+		glGetObjectParameterivARB = (PFNGLGETOBJECTPARAMETERIVARBPROC)wglGetProcAddress("glGetObjectParameterivARB");
+		glGetInfoLogARB           = (PFNGLGETINFOLOGARBPROC)wglGetProcAddress("glGetInfoLogARB");
+		glGetUniformLocationARB   = (PFNGLGETUNIFORMLOCATIONARBPROC)wglGetProcAddress("glGetUniformLocationARB");
+		glUniform1iARB            = (PFNGLUNIFORM1IARBPROC)wglGetProcAddress("glUniform1iARB");
+		glUniform1fARB            = (PFNGLUNIFORM1FARBPROC)wglGetProcAddress("glUniform1fARB");
+		glUniform2fARB            = (PFNGLUNIFORM2FARBPROC)wglGetProcAddress("glUniform2fARB");
+		glUniform4fARB            = (PFNGLUNIFORM4FARBPROC)wglGetProcAddress("glUniform4fARB");
+		glUniform1fvARB           = (PFNGLUNIFORM1FVARBPROC)wglGetProcAddress("glUniform1fvARB");
+		glUniform1ivARB           = (PFNGLUNIFORM1IVARBPROC)wglGetProcAddress("glUniform1ivARB");
+		glUniformMatrix4fvARB     = (PFNGLUNIFORMMATRIX4FVARBPROC)wglGetProcAddress("glUniformMatrix4fvARB");
+
+		// Generic vertex attributes, also part of GL_ARB_vertex_shader
+		glVertexAttribPointerARB      = (PFNGLVERTEXATTRIBPOINTERARBPROC)wglGetProcAddress("glVertexAttribPointerARB");
+		glEnableVertexAttribArrayARB  = (PFNGLENABLEVERTEXATTRIBARRAYARBPROC)wglGetProcAddress("glEnableVertexAttribArrayARB");
+		glDisableVertexAttribArrayARB = (PFNGLDISABLEVERTEXATTRIBARRAYARBPROC)wglGetProcAddress("glDisableVertexAttribArrayARB");
+		glGetAttribLocationARB        = (PFNGLGETATTRIBLOCATIONARBPROC)wglGetProcAddress("glGetAttribLocationARB");
+
+		g_bShaderObjects = glCreateShaderObjectARB && glShaderSourceARB && glCompileShaderARB &&
+			glCreateProgramObjectARB && glAttachObjectARB && glLinkProgramARB && glUseProgramObjectARB &&
+			glDeleteObjectARB && glGetObjectParameterivARB && glGetInfoLogARB && glGetUniformLocationARB &&
+			glUniform1iARB && glUniform1fARB && glUniform2fARB && glUniform4fARB && glUniform1fvARB &&
+			glUniform1ivARB && glUniformMatrix4fvARB && glVertexAttribPointerARB &&
+			glEnableVertexAttribArrayARB && glDisableVertexAttribArrayARB && glGetAttribLocationARB;
+	}
+
+	// GL_EXT_geometry_shader4 / GL_ARB_geometry_shader4, the entry points are
+	// the same apart from the suffix.
+	if( strstr( gl_ext, "GL_EXT_geometry_shader4" ) != NULL )
+	{
+		glProgramParameteriEXT  = (PFNGLPROGRAMPARAMETERIEXTPROC)wglGetProcAddress("glProgramParameteriEXT");
+		glFramebufferTextureEXT = (PFNGLFRAMEBUFFERTEXTUREEXTPROC)wglGetProcAddress("glFramebufferTextureEXT");
+		g_geometryShaderExtension = "#extension GL_EXT_geometry_shader4 : enable\n";
+	}
+	else if( strstr( gl_ext, "GL_ARB_geometry_shader4" ) != NULL )
+	{
+		glProgramParameteriEXT  = (PFNGLPROGRAMPARAMETERIEXTPROC)wglGetProcAddress("glProgramParameteriARB");
+		glFramebufferTextureEXT = (PFNGLFRAMEBUFFERTEXTUREEXTPROC)wglGetProcAddress("glFramebufferTextureARB");
+		g_geometryShaderExtension = "#extension GL_ARB_geometry_shader4 : enable\n";
+	}
+
+	g_bGeometryShader = glProgramParameteriEXT && glFramebufferTextureEXT;
+
+	if( strstr( gl_ext, "GL_ARB_viewport_array" ) != NULL )
+		glViewportIndexedf = (PFNGLVIEWPORTINDEXEDFPROC)wglGetProcAddress("glViewportIndexedf");
+
+	g_bViewportArray = glViewportIndexedf != NULL;
+
+	if( strstr( gl_ext, "GL_ARB_sync" ) != NULL )
+	{
+		glFenceSync      = (PFNGLFENCESYNCPROC)wglGetProcAddress("glFenceSync");
+		glDeleteSync     = (PFNGLDELETESYNCPROC)wglGetProcAddress("glDeleteSync");
+		glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC)wglGetProcAddress("glClientWaitSync");
+	}
+
+	g_bSync = glFenceSync && glDeleteSync && glClientWaitSync;
+
+	// The query objects are core GL 1.5, the ARB names come from GL_ARB_occlusion_query.
+	if( strstr( gl_ext, "GL_ARB_timer_query" ) != NULL )
+	{
+		glGenQueriesARB       = (PFNGLGENQUERIESARBPROC)wglGetProcAddress("glGenQueries");
+		glDeleteQueriesARB    = (PFNGLDELETEQUERIESARBPROC)wglGetProcAddress("glDeleteQueries");
+		glQueryCounter        = (PFNGLQUERYCOUNTERPROC)wglGetProcAddress("glQueryCounter");
+		glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC)wglGetProcAddress("glGetQueryObjectui64v");
+	}
+
+	g_bTimerQuery = glGenQueriesARB && glDeleteQueriesARB && glQueryCounter && glGetQueryObjectui64v;
+
+	if( strstr( gl_ext, "GL_ARB_vertex_buffer_object" ) != NULL )
+	{
+		glGenBuffersARB    = (PFNGLGENBUFFERSARBPROC)wglGetProcAddress("glGenBuffersARB");
+		glDeleteBuffersARB = (PFNGLDELETEBUFFERSARBPROC)wglGetProcAddress("glDeleteBuffersARB");
+		glBindBufferARB    = (PFNGLBINDBUFFERARBPROC)wglGetProcAddress("glBindBufferARB");
+		glBufferDataARB    = (PFNGLBUFFERDATAARBPROC)wglGetProcAddress("glBufferDataARB");
+		glBufferSubDataARB = (PFNGLBUFFERSUBDATAARBPROC)wglGetProcAddress("glBufferSubDataARB");
+		glUnmapBufferARB   = (PFNGLUNMAPBUFFERARBPROC)wglGetProcAddress("glUnmapBufferARB");
+	}
+
+	g_bVertexBuffer = glGenBuffersARB && glDeleteBuffersARB && glBindBufferARB && glBufferDataARB && glBufferSubDataARB &&
+					  glUnmapBufferARB;
+
+	// Persistent mapping also needs GL_ARB_map_buffer_range, which every
+	// driver with GL_ARB_buffer_storage has.
+	if( strstr( gl_ext, "GL_ARB_buffer_storage" ) != NULL &&
+		strstr( gl_ext, "GL_ARB_pixel_buffer_object" ) != NULL )
+	{
+		glMapBufferRange   = (PFNGLMAPBUFFERRANGEPROC)wglGetProcAddress("glMapBufferRange");
+		glBufferStorage    = (PFNGLBUFFERSTORAGEPROC)wglGetProcAddress("glBufferStorage");
+	}
+
+	g_bBufferStorage = g_bVertexBuffer && glMapBufferRange && glBufferStorage;
+
+	// The instance attribute is read by a vertex shader.
+	if( strstr( gl_ext, "GL_ARB_draw_instanced" ) != NULL &&
+		strstr( gl_ext, "GL_ARB_instanced_arrays" ) != NULL )
+	{
+		glDrawElementsInstancedARB    = (PFNGLDRAWELEMENTSINSTANCEDARBPROC)wglGetProcAddress("glDrawElementsInstancedARB");
+		glVertexAttribDivisorARB      = (PFNGLVERTEXATTRIBDIVISORARBPROC)wglGetProcAddress("glVertexAttribDivisorARB");
+		glGetHandleARB                = (PFNGLGETHANDLEARBPROC)wglGetProcAddress("glGetHandleARB");
+	}
+
+	g_bInstancing = g_bVertexBuffer && g_bShaderObjects && glDrawElementsInstancedARB && glVertexAttribDivisorARB &&
+					glVertexAttribPointerARB && glEnableVertexAttribArrayARB && glDisableVertexAttribArrayARB &&
+					glGetAttribLocationARB && glGetHandleARB;
+
+	g_bTextureFloat = strstr( gl_ext, "GL_ARB_texture_float" ) != NULL;
+	g_bTextureRG    = strstr( gl_ext, "GL_ARB_texture_rg" ) != NULL;
+	g_bAnisotropic  = strstr( gl_ext, "GL_EXT_texture_filter_anisotropic" ) != NULL;
+	g_bDepthBufferFloat = strstr( gl_ext, "GL_ARB_depth_buffer_float" ) != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Name: displayDepthTexture()
+// Desc: For debugging purposes
+//-----------------------------------------------------------------------------
+void displayDepthTexture( void )
+{
+	stateDisable( g_glState, GL_LIGHTING );
+
+	glViewport( 0, 0, g_pbuffer.nWidth, g_pbuffer.nHeight);
+
+	glMatrixMode( GL_PROJECTION );
+	glLoadIdentity();
+	gluOrtho2D( -1.0, 1.0, -1.0, 1.0 );
+
+	glMatrixMode( GL_MODELVIEW );
+	glLoadIdentity();
+
+	// reset our texture matrix
+	glMatrixMode( GL_TEXTURE );
+	glLoadIdentity();
+
+	// A depth texture can be treated as a luminance texture
+	// ʱ, Ϊ .
+	stateEnable( g_glState, GL_TEXTURE_2D );
+
+	// The cube map has no single 2D image to show, the ray tracer no image at all.
+	if( g_shadowMode == SHADOW_CUBE || g_shadowMode == SHADOW_RAYTRACE )
+	{
+		stateEnable( g_glState, GL_LIGHTING );
+		stateDisable( g_glState, GL_TEXTURE_2D );
+		return;
+	}
+
+	if( g_shadowMode == SHADOW_SOFTWARE ||
+		(g_shadowMode == SHADOW_DEPTH_COMPARE && (g_bAdaptiveResolution || g_bIncrementalShadow)) )
+	{
+		glBindTexture( GL_TEXTURE_2D, g_shadowMode == SHADOW_SOFTWARE ? g_softwareDepthTexture :
+					   g_bAdaptiveResolution ? g_adaptiveShadowMap.texture[g_adaptiveShadowMap.level] :
+					   g_incrementalShadowMap.texture[1] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_FALSE );
+		drawFullScreenQuad();
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+
+		stateEnable( g_glState, GL_LIGHTING );
+		stateDisable( g_glState, GL_TEXTURE_2D );
+		return;
+	}
+
+	// Show the whole atlas (or page pool) with the compare mode briefly off.
+	if( g_shadowMode == SHADOW_ATLAS || g_shadowMode == SHADOW_VIRTUAL )
+	{
+		glBindTexture( GL_TEXTURE_2D, g_shadowMode == SHADOW_ATLAS ? g_shadowAtlas.texture :
+					   g_virtualShadowMap.poolTexture );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_NONE );
+		drawFullScreenQuad();
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_COMPARE_R_TO_TEXTURE_ARB );
+
+		stateEnable( g_glState, GL_LIGHTING );
+		stateDisable( g_glState, GL_TEXTURE_2D );
+		return;
+	}
+
+	// The moment map is an ordinary colour texture: the first moment (the
+	// light-space depth) shows up in red.
+	if( g_shadowMode != SHADOW_DEPTH_COMPARE )
+	{
+		glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[0] );
+		drawFullScreenQuad();
+
+		stateEnable( g_glState, GL_LIGHTING );
+		stateDisable( g_glState, GL_TEXTURE_2D );
+		return;
+	}
+
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+	// Disable the shadow hardware
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_FALSE );
+
+	if( wglBindTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
+	{
+		MessageBox(NULL, "Could not bind p-buffer to render texture!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	glBegin( GL_QUADS );
+	{
+		glTexCoord2f( 0.0f, 0.0f );
+		glVertex3f( -1.0f, -1.0f, 0.0f );
+
+		glTexCoord2f( 0.0f, 1.0f );
+		glVertex3f( -1.0f, 1.0f, 0.0f );
+
+		glTexCoord2f( 1.0f, 1.0f );
+		glVertex3f( 1.0f, 1.0f, 0.0f );
+
+		glTexCoord2f( 1.0f, 0.0f );
+		glVertex3f( 1.0f, -1.0f, 0.0f );
+	}
+	glEnd();
+
+	stateEnable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+
+	// Enable the shadow mapping hardware
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+
+	if( wglReleaseTexImageARB( g_pbuffer.hPBuffer, WGL_DEPTH_COMPONENT_NV ) == FALSE )
+	{
+		MessageBox(NULL, "Could not release p-buffer from render texture!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: WinMain()
+// Desc: The application's entry point
+//-----------------------------------------------------------------------------
+int WINAPI WinMain(	HINSTANCE hInstance,
+				   HINSTANCE hPrevInstance,
+				   LPSTR     lpCmdLine,
+				   int       nCmdShow )
+{
+	WNDCLASSEX winClass;
+	MSG        uMsg;
+
+	memset(&uMsg, 0, sizeof(uMsg));
+
+	winClass.lpszClassName = "MY_WINDOWS_CLASS";
+	winClass.cbSize        = sizeof(WNDCLASSEX);
+	winClass.style         = CS_HREDRAW | CS_VREDRAW | CS_OWNDC;
+	winClass.lpfnWndProc   = WindowProc;
+	winClass.hInstance     = hInstance;
+	winClass.hIcon	       = LoadIcon(hInstance, (LPCTSTR)IDI_OPENGL_ICON);
+	winClass.hIconSm	   = LoadIcon(hInstance, (LPCTSTR)IDI_OPENGL_ICON);
+	winClass.hCursor       = LoadCursor(NULL, IDC_ARROW);
+	winClass.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
+	winClass.lpszMenuName  = NULL;
+	winClass.cbClsExtra    = 0;
+	winClass.cbWndExtra    = 0;
+
+	if( !RegisterClassEx(&winClass) )
+	{
+		return E_FAIL;
+	}
+
+	g_hWnd = CreateWindowEx( NULL, "MY_WINDOWS_CLASS",
+		"OpenGL - Shadow Mapping",
+		WS_OVERLAPPEDWINDOW | WS_VISIBLE,
+		0, 0, 640, 480, NULL, NULL, hInstance, NULL );
+
+	if( g_hWnd == NULL )
+	{
+		return E_FAIL;
+	}
+
+	ShowWindow( g_hWnd, nCmdShow );
+	UpdateWindow( g_hWnd );
+
+	// Scene 5's file, quotes and all
+	std::string scenePath = lpCmdLine;
+
+	if( scenePath.size() >= 2 && scenePath[0] == '"' && scenePath[scenePath.size() - 1] == '"' )
+		scenePath = scenePath.substr( 1, scenePath.size() - 2 );
+
+	g_sceneLoader.path = scenePath.empty() ? "scene.scn" : scenePath;
+
+	init();
+
+	render();
+
+	while( uMsg.message != WM_QUIT )
+	{
+		if( PeekMessage( &uMsg, NULL, 0, 0, PM_REMOVE ) )
+		{
+			TranslateMessage( &uMsg );
+			DispatchMessage( &uMsg );
+		}
+		else if( g_bRedraw )
+		{
+			// One frame for all the input that has queued up.
+			g_bRedraw = false;
+			render();
+		}
+		else
+		{
+			WaitMessage();			// ûҪľͲռCPU.
+		}
+	}
+
+	shutDown();
+
+	UnregisterClass( "MY_WINDOWS_CLASS", winClass.hInstance );
+
+	return uMsg.wParam;
+}
+//-----------------------------------------------------------------------------
+// Name: initPbuffer()
+// Desc: Create a p-buffer for the off-screen rendering of the depth texture
+//-----------------------------------------------------------------------------
+void initPbuffer( void )
+{
+	g_pbuffer.hPBuffer = NULL;
+	g_pbuffer.nWidth   = PBUFFER_WIDTH;
+	g_pbuffer.nHeight  = PBUFFER_HEIGHT;
+
+	// Define the minimum pixel format requirements we will need for our
+	// p-buffer. A p-buffer is just like a frame buffer, it can have a depth
+	// buffer associated with it and it can be double buffered.
+	int pf_attr[] =
+	{
+		WGL_SUPPORT_OPENGL_ARB, TRUE,       // P-buffer will be used with OpenGL
+		WGL_DRAW_TO_PBUFFER_ARB, TRUE,      // Enable render to p-buffer				//pbuffer, Ķвͬظʽ. ҪҪʱг.
+
+		WGL_BIND_TO_TEXTURE_DEPTH_NV, TRUE, // Ask for depth texture
+		WGL_DEPTH_BITS_ARB, g_depthFormats[g_depthFormat].pbufferBits, // At least this precise, see DEPTHFORMAT
+
+		WGL_BIND_TO_TEXTURE_RGBA_ARB, TRUE, // P-buffer will be used as a texture
+		WGL_DOUBLE_BUFFER_ARB, FALSE,       // We don't require double buffering
+		0                                   // Zero terminates the list
+	};
+
+	unsigned int count = 0;
+	int pixelFormat;
+
+	//typedef BOOL (WINAPI * PFNWGLCHOOSEPIXELFORMATARBPROC) (HDC hdc, const int *piAttribIList, const FLOAT *pfAttribFList, UINT nMaxFormats, int *piFormats, UINT *nNumFormats);
+	// DC, .. , .. , ʽ, ʽ׵ַ, øʽ
+	if( !wglChoosePixelFormatARB( g_hDC, pf_attr, NULL, 1, &pixelFormat, &count ) )
+	{
+		MessageBox(NULL, "pbuffer creation error:  wglChoosePixelFormatARB() failed.",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	if( count <= 0 )
+	{
+		MessageBox(NULL, "pbuffer creation error:  Couldn't find a suitable pixel format.",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	// Set some p-buffer attributes so that we can use this p-buffer as a
+	// 2D RGBA texture target.
+	int pb_attr[] =		//pbuffer, ϱǸظʽ, Ҫ.
+	{
+		WGL_DEPTH_TEXTURE_FORMAT_NV, WGL_TEXTURE_DEPTH_COMPONENT_NV, // We need to render to a depth texture
+		WGL_TEXTURE_FORMAT_ARB, WGL_TEXTURE_RGBA_ARB,                // Our p-buffer will have a texture format of RGBA
+		WGL_TEXTURE_TARGET_ARB, WGL_TEXTURE_2D_ARB,                  // Of texture target will be GL_TEXTURE_2D
+		0                                                            // Zero terminates the list
+	};
+
+	// Create the p-buffer...
+	g_pbuffer.hPBuffer = wglCreatePbufferARB( g_hDC, pixelFormat, g_pbuffer.nWidth, g_pbuffer.nHeight, pb_attr );
+	g_pbuffer.hDC      = wglGetPbufferDCARB( g_pbuffer.hPBuffer );
+	g_pbuffer.hRC      = wglCreateContext( g_pbuffer.hDC );				//wglwindowsOpengl, wglĴľwindowsĴOpenGL.
+
+	if( !g_pbuffer.hPBuffer )
+	{
+		MessageBox(NULL, "pbuffer creation error: wglCreatePbufferARB() failed!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	// Initialize some graphics state for the p-buffer's rendering context.
+	// עǴ, ûҪڳʼ. ΪȾʱҲmakeCurrent. ʵֻΪ˰ܼǲǿʹ, ͳһ.
+	if( wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC) == FALSE )
+	{
+		MessageBox(NULL, "Could not make the p-buffer's context current!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+	else
+	{
+		// עӦøpbufferRCָģͼӿ, Բ⼸.
+		glViewport( 0, 0, PBUFFER_WIDTH, PBUFFER_HEIGHT );					//쵽, Ⱦ, ӿڱ任ģͼ任ͶӰ任ĺ, ֻƽ任Ҫǵô.
+		glMatrixMode( GL_PROJECTION );
+		glLoadIdentity();
+		gluPerspective( LIGHT_FOVY, LIGHT_ASPECT, LIGHT_NEAR, LIGHT_FAR );		//CVV. ΪȾģͼ任ͶӰ任, ԿΪȾϺһ.
+	}
+
+	stateEnable( g_glState, GL_LIGHTING );
+	stateEnable( g_glState, GL_LIGHT0 );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	GLfloat ambient_lightModel[] = { 0.25f, 0.25f, 0.25f, 1.0f };
+	glLightModelfv( GL_LIGHT_MODEL_AMBIENT, ambient_lightModel );
+
+	// WGL_DEPTH_BITS_ARB is only a minimum, keep what we really got.
+	glGetIntegerv( GL_DEPTH_BITS, &g_pbufferDepthBits );
+
+	// Make the window rendering context current again
+	if( wglMakeCurrent( g_hDC, g_hRC ) == FALSE )
+	{
+		MessageBox(NULL, "Could not make the window's context current!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: freePbuffer()
+// Desc:
+//-----------------------------------------------------------------------------
+void freePbuffer( void )
+{
+	// Whatever the scene created in the context goes with it.
+	forgetInstanceGL( g_stressScene.set.gl[1] );
+	forgetInstanceGL( g_sceneLoader.set.gl[1] );
+	memset( &g_instancePrograms[1], 0, sizeof(g_instancePrograms[1]) );
+
+	if( g_pbuffer.hRC != NULL )
+	{
+		wglMakeCurrent( g_pbuffer.hDC, NULL );
+		wglDeleteContext( g_pbuffer.hRC );
+		wglReleasePbufferDCARB( g_pbuffer.hPBuffer, g_pbuffer.hDC );
+		wglDestroyPbufferARB( g_pbuffer.hPBuffer );
+		g_pbuffer.hRC = NULL;
+	}
+
+	if( g_pbuffer.hDC != NULL )
+	{
+		ReleaseDC( g_hWnd, g_pbuffer.hDC );
+		g_pbuffer.hDC = NULL;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: init()
+// Desc:
+//-----------------------------------------------------------------------------
+void init( void )
+{
+	MessageBox(NULL, 
+		"F1 - ֱȾ\nF2 - ǷʾԴָʾ\nF3 - Ƿʾ\nF4 - ģʽл\nF5 - Ƿ΢(ͬ龳òͬ)\nF6 - ǷʾӾ\nF7 - Ƿֱ߿\nF8 - Ƿ\nF9 - лӰ㷨(ȱȽ/VSM/ESM/Դ/Դͼ/CPUդ/ҳ/׷)\nF10 - Ӱͼɺʱ(p-bufferԱCPUդ)\nF11, F12 - һ/һ(4: ʵѹ, 5: ļ)\n1 - Сӽ\n2 - ӽ\n3, 4 - С/Ӱģ뾶\n5, 6 - С/©(VSM)ָ(ESM)\n7, 8 - /ӴӰĹԴ(Դͼ)\n9 - ӦӰͼֱ(ȱȽ)\n0 - лӰͼȸʽ(16λ/24λ/32λ)\nW - ͸ӱӰͼ(TSM)\nI - Ӱͼ(̬/̬Ͷֲ, ȱȽ)\nL - ÿֻ֡һγ, ӿڻطŻб\nV - ύĸӿ(ӿ, ȱȽ/CPUդ)\nC - ӿڵӾ޳\nH - ڵ޳(ӿڼԴӽ, ڵ)\nD - Ի(Դָʾ, Ӿ, )ܿ\nZ - ԤȾ(ӿֻд, GL_EQUALɫһ)\nG - GLSLعӰ(ɺSGIXȽ, ȱȽ/CPUդ)\nP - лGPUͬʱ;֡(1/2/3)\n+, - - /ѹԳ(4)\nR - ѹԳ/ڷ\nO - 볡ļ(5, вscene.scn)\nPageDown, PageUP - ƶԴ\n - Զ",
+		"", MB_OK | MB_ICONEXCLAMATION);
+	GLuint PixelFormat;
+
+	PIXELFORMATDESCRIPTOR pfd;
+	memset(&pfd, 0, sizeof(PIXELFORMATDESCRIPTOR));
+
+	pfd.nSize      = sizeof(PIXELFORMATDESCRIPTOR);
+	pfd.nVersion   = 1;
+	pfd.dwFlags    = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+	pfd.iPixelType = PFD_TYPE_RGBA;
+	pfd.cColorBits = 32;						//3216	//-3Ҳ		//ʵд. ʵڷʱҵOpenGLֵ֧ӽһ. Բֲʹõ.
+	pfd.cDepthBits = 24;
+
+	g_hDC = GetDC( g_hWnd );						//dc豸, ǿԻͼĵط.
+	PixelFormat = ChoosePixelFormat( g_hDC, &pfd );		//õظʽ. ƥ, еĶܽ.	//OpenGLٷĵ˵ûչ, ԲŵwglChoosePixelFormatARB. ָ, 0Ϊ־, չ.
+	SetPixelFormat( g_hDC, PixelFormat, &pfd);				//ظʽ.
+
+	// VC++ - OpenGLͼĻǣ
+	// OpenGLĻͼRendering Context(ΪRC)ͼãٰͨSwapBuffers()WindowĻͼDevice Context(ΪDC)
+	// ҪעǣһжDCֻһRC˵һDCͼҪͷRCԱDCҲʹá
+	g_hRC = wglCreateContext( g_hDC );
+	wglMakeCurrent( g_hDC, g_hRC );				// OpenGL֮ǰҪRCӦDCóɵǰ.
+
+	glClearColor( 0.35f, 0.53f, 0.7f, 1.0f );
+	stateEnable( g_glState, GL_LIGHTING );
+	stateEnable( g_glState, GL_TEXTURE_2D );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	//ʼʱSIZEϢ, һǶ.
+	//glMatrixMode( GL_PROJECTION );
+	//glLoadIdentity();
+	//gluPerspective( 45.0f, 640.0f/480.0f, 0.1f, 100.0f);
+
+	// Enable some dim, gray ambient lighting...
+	GLfloat ambient_lightModel[] = { 0.25f, 0.25f, 0.25f, 1.0f };
+	glLightModelfv( GL_LIGHT_MODEL_AMBIENT, ambient_lightModel );
+
+	// Tessellate the scene's primitives once for the triangle-only passes.
+	buildTeapotMesh( g_teapotMesh, 1.0, 7 );
+	buildSphereMesh( g_sphereMesh, 0.5, 32, 8 );
+	buildTorusMesh( g_torusMesh, TORUS_INNER_RADIUS, TORUS_OUTER_RADIUS, 16, 32 );
+
+	const float floorCorners[4][3] = { { -5.0f, 0.0f, -5.0f }, { -5.0f, 0.0f, 5.0f },
+									   {  5.0f, 0.0f,  5.0f }, {  5.0f, 0.0f, -5.0f } };
+	const float floorNormal[3] = { 0.0f, 1.0f, 0.0f };
+
+	buildQuadMesh( g_floorMesh, floorCorners, floorNormal );
+
+	float tiltedCorners[4][3];
+	memcpy( tiltedCorners, floorCorners, sizeof(tiltedCorners) );
+	tiltedCorners[3][1] = FLOOR_TILT_Y;
+
+	buildQuadMesh( g_tiltedFloorMesh, tiltedCorners, floorNormal );
+
+	buildSceneGraphs();
+
+	// Workers for the CPU-side passes, one per hardware thread.
+	threadPoolCreate( g_threadPool, 0 );
+
+	// Set up a point light source...
+	stateEnable( g_glState, GL_LIGHT0 );
+	GLfloat diffuse_light[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	GLfloat linearAttenuation_light[] = { 0.0f };
+	glLightfv( GL_LIGHT0, GL_DIFFUSE, diffuse_light );
+	glLightfv( GL_LIGHT0, GL_LINEAR_ATTENUATION , linearAttenuation_light );
+
+	// Initialize the p-buffer now that we have a valid context
+	// that we can use during the p-buffer creation process.
+	initExtensions();
+	initPbuffer();
+
+	// Create the depth texture
+	glGenTextures( 1, &g_depthTexture );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
+
+	// Cache the static casters of the depth compare pass where FBOs allow it.
+	g_bIncrementalShadow = g_bFramebufferObject && initIncrementalShadowMap();
+
+	// Look the depth compare maps up in GLSL where the driver has it.
+	g_bShaderLookup = g_bShaderObjects && initShaderLookup();
+
+	initFramePacer();
+	initStreamBuffer();
+
+	g_debugDraw.enabled = true;
+
+	g_stressScene.count = 1000;
+	buildStressScene();
+
+	glLineWidth(3);
+
+	static GLint fogMode = GL_LINEAR;
+
+	stateFogMode( g_glState, fogMode );
+	glFogfv (GL_FOG_COLOR, blue);
+	glFogf (GL_FOG_DENSITY, 0.35);
+	glHint (GL_FOG_HINT, GL_DONT_CARE);
+	glFogf (GL_FOG_START, 1.0);
+	glFogf (GL_FOG_END, 30);
+
+	ini = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: shutDown()
+// Desc:
+//-----------------------------------------------------------------------------
+void shutDown( void )
+{
+	glDeleteTextures( 1, &g_depthTexture );
+	freeMomentMap();
+	freeCubeShadowMap();
+	freeShadowAtlas();
+	freeAdaptiveShadowMap();
+	freeIncrementalShadowMap();
+	freeVirtualShadowMap();
+	freeRayTracedShadows();
+	freeMultiView();
+	freeShaderLookup();
+	freeStreamBuffer();
+	freeFramePacer();
+	stopSceneLoader();
+	freeInstanceGL( g_stressScene.set.gl[0] );
+	freeInstanceGL( g_sceneLoader.set.gl[0] );
+	freeInstanceProgram( g_instancePrograms[0] );
+	threadPoolDestroy( g_threadPool );
+
+	freeSoftwareShadowMap();
+
+	if( g_hRC != NULL )
+	{
+		wglMakeCurrent( g_hDC, NULL );
+		wglDeleteContext( g_hRC );
+		g_hRC = NULL;
+	}
+
+	if( g_hDC != NULL )
+	{
+		ReleaseDC( g_hWnd, g_hDC );
+		g_hDC = NULL;
+	}
+
+	// Don't forget to clean up after our p-buffer...
+	freePbuffer();
+}
+
+//-----------------------------------------------------------------------------
+// Name: createDepthTexture()
+// Desc:
+//-----------------------------------------------------------------------------
+void createDepthTexture( void )
+{
+	// Make the pbuffer rendering context current
+	//makeCurrent˼ֻǰDCRC, ʵҪָǰOpenGLȾĿ.
+	if( wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC) == FALSE )
+	{
+		MessageBox(NULL, "Could not make the p-buffer's context current!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+
+	glClear( GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT );
+
+	glPolygonOffset( g_depthFormats[g_depthFormat].offsetFactor,		//Ҫֵ. ڶòƾΪӰƵ.
+					 g_depthFormats[g_depthFormat].offsetUnits );
+	stateEnable( g_glState, GL_POLYGON_OFFSET_FILL );					//̫, ڻƵʵͼʱöƫ, Ӱƫһ, ֹӰ.
+
+	// The projection can change every frame with the warp.
+	glMatrixMode( GL_PROJECTION );
+	glLoadMatrixf( g_lightProjectionMatrix );
+
+	// ԴԭҲǷ˹۲.
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	float originPosition[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+	glLightfv( GL_LIGHT0, GL_POSITION, originPosition );
+
+	glMatrixMode( GL_MODELVIEW );
+	glMultMatrixf( g_lightsLookAtMatrix);
+
+	//úpbuffer, ֱȾͺ. ʱ{F1}, ֵõĳֵ.
+	// Culled from the light's point of view: hidden casters add nothing to the map.
+	beginViewCulling( &g_lightsLookAtMatrix, &g_lightProjectionMatrix, 1 );
+	renderScene();
+	endViewCulling();
+
+	stateDisable( g_glState, GL_POLYGON_OFFSET_FILL );
+
+	// Make the window rendering context current
+	if( wglMakeCurrent( g_hDC, g_hRC ) == FALSE )
+	{
+		MessageBox(NULL, "Could not make the window's context current!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		exit(-1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: setShadowMode()
+// Desc: Switches the shadow technique. Returns false and keeps the current
+//       one if the driver can't do the requested technique.
+//-----------------------------------------------------------------------------
+bool setShadowMode( int mode )
+{
+	if( mode == SHADOW_VSM || mode == SHADOW_ESM )
+	{
+		if( !g_bFramebufferObject || !g_bShaderObjects || !g_bTextureFloat )
+			return false;
+
+		if( !initMomentMap() )
+			return false;
+	}
+	else if( mode == SHADOW_CUBE )
+	{
+		if( !g_bFramebufferObject || !g_bShaderObjects || !g_bGeometryShader )
+			return false;
+
+		if( !initCubeShadowMap() )
+			return false;
+	}
+	else if( mode == SHADOW_SOFTWARE )
+	{
+		// Only needs depth textures, which the p-buffer path requires anyway.
+		initSoftwareShadowMap();
+	}
+	else if( mode == SHADOW_ATLAS )
+	{
+		if( !g_bFramebufferObject || !g_bShaderObjects )
+			return false;
+
+		if( !initShadowAtlas() )
+			return false;
+	}
+	else if( mode == SHADOW_VIRTUAL )
+	{
+		if( !g_bFramebufferObject || !g_bShaderObjects || !g_bMultitexture )
+			return false;
+
+		if( !initVirtualShadowMap() )
+			return false;
+	}
+	else if( mode == SHADOW_RAYTRACE )
+	{
+		// Only needs a luminance texture.
+		initRayTracedShadows();
+	}
+
+	g_shadowMode = mode;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: nextShadowMode()
+// Desc: F9 - Steps to the next shadow technique the driver supports
+//-----------------------------------------------------------------------------
+void nextShadowMode( void )
+{
+	for( int i = 1; i < SHADOW_MODE_COUNT; ++i )
+	{
+		if( setShadowMode( (g_shadowMode + i) % SHADOW_MODE_COUNT ) )
+			return;
+	}
+
+	MessageBox(NULL, "No other shadow technique is supported by this OpenGL implementation.\n"
+			   "VSM/ESM need GL_EXT_framebuffer_object, GL_ARB_shader_objects and GL_ARB_texture_float.\n"
+			   "Cube shadows need GL_EXT_framebuffer_object, GL_ARB_shader_objects and GL_EXT_geometry_shader4.\n"
+			   "The shadow atlas needs GL_EXT_framebuffer_object and GL_ARB_shader_objects.\n"
+			   "The virtual shadow map needs GL_EXT_framebuffer_object, GL_ARB_shader_objects and GL_ARB_multitexture.",
+			   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+}
+
+//-----------------------------------------------------------------------------
+// Name: appendTitle()
+// Desc: printf() onto the end of title, a buffer of size bytes. What doesn't
+//       fit is cut off, so a long title loses its last segments.
+//-----------------------------------------------------------------------------
+void appendTitle( char* title, size_t size, const char* format, ... )
+{
+	size_t length = strlen( title );
+
+	if( length + 1 >= size )
+		return;
+
+	va_list args;
+	va_start( args, format );
+	_vsnprintf( title + length, size - length - 1, format, args );
+	va_end( args );
+
+	title[size - 1] = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: updateWindowTitle()
+// Desc: Shows the current shadow technique and its parameters
+//-----------------------------------------------------------------------------
+void updateWindowTitle( void )
+{
+	char title[1024] = "";
+
+	switch( g_shadowMode )
+	{
+		case SHADOW_VSM:
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [VSM, blur %d, bleed %.2f]",
+						 g_blurRadius, g_vsmLightBleed );
+			break;
+
+		case SHADOW_ESM:
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [ESM, blur %d, c %.0f]",
+						 g_blurRadius, g_esmExponent );
+			break;
+
+		case SHADOW_CUBE:
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Cube %d, %d faces for %d objects]",
+						 g_cubeShadowMap.nSize, g_cubeShadowMap.facesDrawn, g_cubeShadowMap.objectsDrawn );
+			break;
+
+		case SHADOW_ATLAS:
+		{
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Atlas, %d lights:", g_shadowLightCount );
+
+			for( int i = 0; i < g_shadowLightCount; ++i )
+			{
+				appendTitle( title, sizeof(title), " %d (%d casters)",
+							 g_shadowLights[i].tileSize, g_shadowLights[i].castersDrawn );
+			}
+
+			appendTitle( title, sizeof(title), "]" );
+		}
+		break;
+
+		case SHADOW_SOFTWARE:
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [CPU raster %dx%d %s, %d threads, %.2f ms + %.2f ms upload]",
+						 g_softRasterizer.width, g_softRasterizer.height, g_depthFormats[g_depthFormat].name,
+						 threadPoolSize( g_threadPool ),
+						 g_softRasterMs, g_softUploadMs );
+			break;
+
+		case SHADOW_VIRTUAL:
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Virtual %d, %d/%d pages, %d requested, %d drawn, %d waiting, %d casters moved]",
+						 VIRTUAL_PAGES_PER_SIDE * VIRTUAL_PAGE_SIZE, g_pageCache.residentCount, (int)g_pageCache.pool.size(),
+						 g_pageCache.requestCount, g_virtualShadowMap.pagesRendered, g_pageCache.missingCount,
+						 g_virtualShadowMap.castersMoved );
+			break;
+
+		case SHADOW_RAYTRACE:
+			appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Ray traced, %d triangles, %d nodes (depth %d), %d threads, BVH %.2f ms + %d rays %.2f ms (%.1f Mrays/s)]",
+						 (int)g_sceneBVH.triangles.size(), (int)g_sceneBVH.nodes.size(), g_sceneBVH.depth,
+						 threadPoolSize( g_threadPool ), g_bvhBuildMs, g_rayCount, g_rayTraceMs,
+						 g_rayTraceMs > 0.0 ? g_rayCount / g_rayTraceMs / 1000.0 : 0.0 );
+			break;
+
+		default:
+			if( g_bAdaptiveResolution )
+			{
+				appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Depth compare %s, adaptive %d (receivers want %.0f), %.1f of %.1f ms]",
+							 g_depthFormats[g_depthFormat].name, ADAPTIVE_MIN_SIZE << g_adaptiveShadowMap.level,
+							 g_adaptiveShadowMap.wantedSize, g_frameMs, g_frameBudgetMs );
+			}
+			else if( g_bIncrementalShadow )
+			{
+				const INCREMENTALSHADOWMAP& map = g_incrementalShadowMap;
+				int dynamicCount = 0;
+
+				for( size_t i = 0; i < map.casters.size(); ++i )
+					dynamicCount += map.casters[i].dynamic ? 1 : 0;
+
+				appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Depth compare %s, incremental: %d dynamic casters, %dx%d redrawn, %d static rebuilds]",
+							 g_depthFormats[g_depthFormat].name, dynamicCount, max( map.dirty[2] - map.dirty[0], 0 ),
+							 max( map.dirty[3] - map.dirty[1], 0 ), map.staticRebuilds );
+			}
+			else
+			{
+				appendTitle( title, sizeof(title), "OpenGL - Shadow Mapping [Depth compare, p-buffer %d bits]", g_pbufferDepthBits );
+			}
+			break;
+	}
+
+	if( g_bShadowWarp )
+		appendTitle( title, sizeof(title), g_bShadowWarpActive ? " [TSM]" : " [TSM: no trapezoid, unwarped]" );
+
+	if( !g_bDrawList )
+		appendTitle( title, sizeof(title), " [no draw list]" );
+
+	if( g_bMultiView )
+		appendTitle( title, sizeof(title), multiViewActive() ? " [multi-view]" : " [multi-view: not in this mode]" );
+
+	if( g_bShaderLookup && shaderLookupActive() )
+		appendTitle( title, sizeof(title), " [GLSL lookup]" );
+
+	if( g_bDepthPrepass )
+		appendTitle( title, sizeof(title), multiViewActive() ? " [depth prepass: not with multi-view]" : " [depth prepass]" );
+
+	appendTitle( title, sizeof(title), " [state: %d issued, %d filtered]", g_glState.issued, g_glState.filtered );
+
+	if( g_bSync )
+	{
+		if( g_framePacer.gpuIdleMs >= 0.0f )
+			appendTitle( title, sizeof(title), " [%d in flight, CPU wait %.2f ms, GPU idle %.2f ms]", g_framePacer.framesInFlight,
+						 g_framePacer.cpuWaitMs, g_framePacer.gpuIdleMs );
+		else
+			appendTitle( title, sizeof(title), " [%d in flight, CPU wait %.2f ms]", g_framePacer.framesInFlight, g_framePacer.cpuWaitMs );
+	}
+
+	if( sceneNo == STRESS_SCENE )
+	{
+		appendTitle( title, sizeof(title), " [%d objects (%s): %d instanced draws, %d drawn singly]", g_stressScene.count,
+					 g_stressScene.random ? "random" : "grid", g_instancedDraws, g_singleDraws );
+	}
+
+	if( sceneNo == LOADED_SCENE )
+	{
+		// The path comes from the command line, any length: cut it short.
+		char file[160];
+		_snprintf( file, sizeof(file) - 1, "%s", g_sceneLoader.path.c_str() );
+		file[sizeof(file) - 1] = 0;
+
+		appendTitle( title, sizeof(title), " [%s: %d of %u objects loaded, %d meshes: %d instanced draws, %d drawn singly]",
+					 file, g_sceneLoader.set.count, g_sceneLoader.total,
+					 (int)g_sceneLoader.set.meshes.size(), g_instancedDraws, g_singleDraws );
+	}
+
+	g_instancedDraws = 0;
+	g_singleDraws    = 0;
+
+	if( g_streamBuffer.buffer != 0 )
+	{
+		appendTitle( title, sizeof(title), " [stream: %d KB of %d KB", (int)(g_streamBuffer.offset / 1024),
+					 (int)(g_streamBuffer.regionSize / 1024) );
+
+		if( g_streamBuffer.overflows > 0 )
+			appendTitle( title, sizeof(title), ", %d overflowed", g_streamBuffer.overflows );
+
+		appendTitle( title, sizeof(title), "]" );
+	}
+
+	if( g_bViewCulling )
+		appendTitle( title, sizeof(title), " [culling: %d drawn, %d culled]", g_viewCull.drawn, g_viewCull.culled );
+
+	if( g_bOcclusionCulling )
+		appendTitle( title, sizeof(title), " [occlusion: %d occluders, %d hidden]", g_viewCull.occluders, g_viewCull.occluded );
+
+	SetWindowText( g_hWnd, title );
+}
+
+// The fixed-function fog for the fragment shaders that replace it, set up
+// by u_fogMode = currentFogMode(). compileProgram() puts it between the
+// header and every fragment shader, so applyFog() is always there.
+static const char* g_fogFS =
+	"uniform int u_fogMode;\n"
+	"vec3 applyFog(vec3 color)\n"
+	"{\n"
+	"	if (u_fogMode == 1)\n"
+	"		return mix(gl_Fog.color.rgb, color, clamp((gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale, 0.0, 1.0));\n"
+	"	if (u_fogMode == 2)\n"
+	"		return mix(gl_Fog.color.rgb, color, clamp(exp(-gl_Fog.density * gl_FogFragCoord), 0.0, 1.0));\n"
+	"	return color;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+// Name: currentFogMode()
+// Desc: The fog render() has set up, as g_fogFS's u_fogMode: 0 none, 1 the
+//       GL_LINEAR fog, 2 the GL_EXP fog it uses when adjusting.
+//-----------------------------------------------------------------------------
+int currentFogMode( void )
+{
+	return fog ? (adjust ? 2 : 1) : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: compileProgram()
+// Desc: Builds a GLSL program object. The header is prepended to both stages
+//       so one source can be compiled into several variants with #defines,
+//       and the fragment stage gets g_fogFS after it. A NULL stage is left
+//       to the fixed-function pipeline. A geometry shader takes triangles
+//       and emits up to geometryVerticesOut vertices as triangle strips.
+//       Returns 0 on failure after showing the info log.
+//-----------------------------------------------------------------------------
+GLhandleARB compileProgram( const char* header, const char* vertexSource, const char* fragmentSource,
+							const char* geometrySource, GLint geometryVerticesOut )
+{
+	const GLenum      types[3]   = { GL_VERTEX_SHADER_ARB, GL_FRAGMENT_SHADER_ARB, GL_GEOMETRY_SHADER_EXT };
+	const GLcharARB*  bodies[3]  = { vertexSource, fragmentSource, geometrySource };
+	const GLcharARB*  sources[3] = { header ? header : "", NULL, NULL };
+	GLcharARB         infoLog[4096];
+	GLint             status = 0;
+
+	GLhandleARB program = glCreateProgramObjectARB();
+
+	for( int i = 0; i < 3; ++i )
+	{
+		if( bodies[i] == NULL )
+			continue;
+
+		GLhandleARB shader = glCreateShaderObjectARB( types[i] );
+		sources[1] = types[i] == GL_FRAGMENT_SHADER_ARB ? g_fogFS : "";
+		sources[2] = bodies[i];
+		glShaderSourceARB( shader, 3, sources, NULL );
+		glCompileShaderARB( shader );
+		glGetObjectParameterivARB( shader, GL_OBJECT_COMPILE_STATUS_ARB, &status );
+
+		if( !status )
+		{
+			glGetInfoLogARB( shader, sizeof(infoLog), NULL, infoLog );
+			MessageBox(NULL, infoLog, "GLSL compile error", MB_OK | MB_ICONEXCLAMATION);
+			glDeleteObjectARB( shader );
+			glDeleteObjectARB( program );
+			return 0;
+		}
+
+		// The shader is only flagged for deletion, it lives as long as the program.
+		glAttachObjectARB( program, shader );
+		glDeleteObjectARB( shader );
+	}
+
+	// Geometry shader layout has to be fixed before linking.
+	if( geometrySource != NULL )
+	{
+		glProgramParameteriEXT( program, GL_GEOMETRY_INPUT_TYPE_EXT, GL_TRIANGLES );
+		glProgramParameteriEXT( program, GL_GEOMETRY_OUTPUT_TYPE_EXT, GL_TRIANGLE_STRIP );
+		glProgramParameteriEXT( program, GL_GEOMETRY_VERTICES_OUT_EXT, geometryVerticesOut );
+	}
+
+	glLinkProgramARB( program );
+	glGetObjectParameterivARB( program, GL_OBJECT_LINK_STATUS_ARB, &status );
+
+	if( !status )
+	{
+		glGetInfoLogARB( program, sizeof(infoLog), NULL, infoLog );
+		MessageBox(NULL, infoLog, "GLSL link error", MB_OK | MB_ICONEXCLAMATION);
+		glDeleteObjectARB( program );
+		return 0;
+	}
+
+	return program;
+}
+
+//-----------------------------------------------------------------------------
+// Shaders for the filterable shadow maps. Everything is GLSL 1.10 so it runs
+// wherever GL_ARB_shader_objects does. "#define ESM" selects the exponential
+// variant, otherwise the two VSM moments are used.
+//-----------------------------------------------------------------------------
+
+// Moments pass: store the light-space distance, not the non-linear window depth,
+// so the lookup can compare against the texture coordinate's q.
+static const char* g_momentsVS =
+	"varying float v_depth;\n"
+	"void main()\n"
+	"{\n"
+	"	v_depth = -(gl_ModelViewMatrix * gl_Vertex).z;\n"
+	"	gl_Position = ftransform();\n"
+	"}\n";
+
+static const char* g_momentsFS =
+	"uniform float u_depthRange;\n"
+	"uniform float u_esmExponent;\n"
+	"varying float v_depth;\n"
+	"void main()\n"
+	"{\n"
+	"	float depth = clamp(v_depth / u_depthRange, 0.0, 1.0);\n"
+	"#ifdef ESM\n"
+	"	gl_FragColor = vec4(exp(u_esmExponent * depth), 0.0, 0.0, 1.0);\n"
+	"#else\n"
+	"	// Bias the second moment by the depth slope inside the texel.\n"
+	"	float dx = dFdx(depth);\n"
+	"	float dy = dFdy(depth);\n"
+	"	gl_FragColor = vec4(depth, depth * depth + 0.25 * (dx * dx + dy * dy), 0.0, 1.0);\n"
+	"#endif\n"
+	"}\n";
+
+// Separable Gaussian, one direction per pass. BLUR_RADIUS is defined by the
+// header so the loop has a constant trip count.
+static const char* g_blurFS =
+	"uniform sampler2D u_source;\n"
+	"uniform vec2 u_step;\n"
+	"uniform float u_weights[BLUR_RADIUS + 1];\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 uv = gl_TexCoord[0].st;\n"
+	"	vec4 sum = texture2D(u_source, uv) * u_weights[0];\n"
+	"	for (int i = 1; i <= BLUR_RADIUS; ++i)\n"
+	"	{\n"
+	"		vec2 offset = u_step * float(i);\n"
+	"		sum += (texture2D(u_source, uv + offset) + texture2D(u_source, uv - offset)) * u_weights[i];\n"
+	"	}\n"
+	"	gl_FragColor = sum;\n"
+	"}\n";
+
+// Main pass: the vertex stage stays fixed-function, so lighting, the eye-linear
+// texgen and the texture matrix built in render() are reused unchanged. The
+// shader replaces the SGIX compare and, since a fragment shader disables it,
+// the fixed-function fog.
+static const char* g_lookupFS =
+	"uniform sampler2D u_shadowMap;\n"
+	"uniform float u_depthRange;\n"
+	"uniform float u_minVariance;\n"
+	"uniform float u_lightBleed;\n"
+	"uniform float u_esmExponent;\n"
+	"float visibility(vec4 coord)\n"
+	"{\n"
+	"	if (coord.q <= 0.0)\n"
+	"		return 1.0;\n"
+	"	float depth = clamp(coord.q / u_depthRange, 0.0, 1.0);\n"
+	"	vec4 moments = texture2D(u_shadowMap, coord.st / coord.q);\n"
+	"#ifdef ESM\n"
+	"	return clamp(moments.x * exp(-u_esmExponent * depth), 0.0, 1.0);\n"
+	"#else\n"
+	"	if (depth <= moments.x)\n"
+	"		return 1.0;\n"
+	"	float variance = max(moments.y - moments.x * moments.x, u_minVariance);\n"
+	"	float d = depth - moments.x;\n"
+	"	float pMax = variance / (variance + d * d);\n"
+	"	return clamp((pMax - u_lightBleed) / (1.0 - u_lightBleed), 0.0, 1.0);\n"
+	"#endif\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 color = gl_Color * visibility(gl_TexCoord[0]);\n"
+	"	color.rgb = applyFog(color.rgb);\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+// Name: initMomentMap()
+// Desc: Creates the float render targets and shaders used by VSM/ESM. Does
+//       nothing if they already exist.
+//-----------------------------------------------------------------------------
+bool initMomentMap( void )
+{
+	if( g_momentMap.fbo[0] != 0 )
+		return true;
+
+	g_momentMap.nWidth  = PBUFFER_WIDTH;
+	g_momentMap.nHeight = PBUFFER_HEIGHT;
+
+	// Two channels are enough for both (z, z^2) and exp(c * z).
+	GLenum internalFormat = g_bTextureRG ? GL_RG32F : GL_RGBA32F_ARB;
+	GLenum format         = g_bTextureRG ? GL_RG    : GL_RGBA;
+
+	glGenTextures( 2, g_momentMap.texture );
+
+	for( int i = 0; i < 2; ++i )
+	{
+		glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[i] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, i == 0 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+		glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, g_momentMap.nWidth, g_momentMap.nHeight,
+					  0, format, GL_FLOAT, NULL );
+	}
+
+	// The filtered map is mip-mapped, so grazing receivers get a wider
+	// filter for free. Build the chain once so the texture is complete.
+	glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[0] );
+	if( g_bAnisotropic )
+		glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 8.0f );
+	glGenerateMipmapEXT( GL_TEXTURE_2D );
+
+	glGenRenderbuffersEXT( 1, &g_momentMap.depthBuffer );
+	glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, g_momentMap.depthBuffer );
+	glRenderbufferStorageEXT( GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, g_momentMap.nWidth, g_momentMap.nHeight );
+	glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, 0 );
+
+	glGenFramebuffersEXT( 2, g_momentMap.fbo );
+
+	bool complete = true;
+
+	for( int i = 0; i < 2; ++i )
+	{
+		glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_momentMap.fbo[i] );
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D,
+								   g_momentMap.texture[i], 0 );
+		if( i == 0 )
+			glFramebufferRenderbufferEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT,
+										  g_momentMap.depthBuffer );
+
+		if( glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT ) != GL_FRAMEBUFFER_COMPLETE_EXT )
+			complete = false;
+	}
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	if( !complete )
+	{
+		MessageBox(NULL, "Could not create a float render target for the moment map!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		freeMomentMap();
+		return false;
+	}
+
+	g_momentMap.momentsProgram[0] = compileProgram( NULL, g_momentsVS, g_momentsFS );
+	g_momentMap.momentsProgram[1] = compileProgram( "#define ESM\n", g_momentsVS, g_momentsFS );
+	g_momentMap.lookupProgram[0]  = compileProgram( NULL, NULL, g_lookupFS );
+	g_momentMap.lookupProgram[1]  = compileProgram( "#define ESM\n", NULL, g_lookupFS );
+
+	if( !g_momentMap.momentsProgram[0] || !g_momentMap.momentsProgram[1] ||
+		!g_momentMap.lookupProgram[0]  || !g_momentMap.lookupProgram[1] )
+	{
+		freeMomentMap();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeMomentMap()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeMomentMap( void )
+{
+	if( g_momentMap.fbo[0] != 0 )
+	{
+		glDeleteFramebuffersEXT( 2, g_momentMap.fbo );
+		glDeleteRenderbuffersEXT( 1, &g_momentMap.depthBuffer );
+		glDeleteTextures( 2, g_momentMap.texture );
+	}
+
+	for( int i = 0; i < 2; ++i )
+	{
+		if( g_momentMap.momentsProgram[i] )
+			glDeleteObjectARB( g_momentMap.momentsProgram[i] );
+		if( g_momentMap.lookupProgram[i] )
+			glDeleteObjectARB( g_momentMap.lookupProgram[i] );
+	}
+
+	if( g_momentMap.blurProgram )
+		glDeleteObjectARB( g_momentMap.blurProgram );
+
+	memset( &g_momentMap, 0, sizeof(g_momentMap) );
+}
+
+//-----------------------------------------------------------------------------
+// Name: createMomentMap()
+// Desc: VSM/ESM counterpart of createDepthTexture(). Renders the moments from
+//       the light's point of view, blurs them and rebuilds the mip chain.
+//-----------------------------------------------------------------------------
+void createMomentMap( void )
+{
+	int esm = (g_shadowMode == SHADOW_ESM);
+
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_momentMap.fbo[0] );
+	glViewport( 0, 0, g_momentMap.nWidth, g_momentMap.nHeight );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	// Clear to the moments of the far end of the range so empty texels never shadow.
+	if( esm )
+		glClearColor( exp( g_esmExponent ), 0.0f, 0.0f, 1.0f );
+	else
+		glClearColor( 1.0f, 1.0f, 0.0f, 1.0f );
+	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadMatrixf( g_lightProjectionMatrix );
+
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadMatrixf( g_lightsLookAtMatrix );
+
+	GLhandleARB program = g_momentMap.momentsProgram[esm];
+	glUseProgramObjectARB( program );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_depthRange" ), g_momentDepthRange );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_esmExponent" ), g_esmExponent );
+
+	renderScene();
+
+	glUseProgramObjectARB( 0 );
+
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+
+	blurMomentMap();
+
+	glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[0] );
+	glGenerateMipmapEXT( GL_TEXTURE_2D );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+
+	glMatrixMode( GL_MODELVIEW );
+}
+
+//-----------------------------------------------------------------------------
+// Name: blurMomentMap()
+// Desc: Separable Gaussian over texture[0]: horizontally into texture[1] and
+//       back vertically. Costs 2 * (2 * g_blurRadius + 1) taps per texel.
+//-----------------------------------------------------------------------------
+void blurMomentMap( void )
+{
+	if( g_blurRadius <= 0 )
+		return;
+
+	if( g_momentMap.blurProgram == 0 || g_momentMap.blurRadius != g_blurRadius )
+	{
+		if( g_momentMap.blurProgram )
+			glDeleteObjectARB( g_momentMap.blurProgram );
+
+		char header[64];
+		sprintf( header, "#define BLUR_RADIUS %d\n", g_blurRadius );
+		g_momentMap.blurProgram = compileProgram( header, NULL, g_blurFS );
+		g_momentMap.blurRadius  = g_blurRadius;
+
+		if( g_momentMap.blurProgram == 0 )
+		{
+			g_blurRadius = 0;
+			return;
+		}
+	}
+
+	// Normalised weights, sigma chosen so the kernel ends at about 2 sigma.
+	float weights[MAX_BLUR_RADIUS + 1];
+	float sigma = g_blurRadius * 0.5f + 0.5f;
+	float sum   = 0.0f;
+
+	for( int i = 0; i <= g_blurRadius; ++i )
+	{
+		weights[i] = exp( -(float)(i * i) / (2.0f * sigma * sigma) );
+		sum += (i == 0) ? weights[i] : 2.0f * weights[i];
+	}
+
+	for( int i = 0; i <= g_blurRadius; ++i )
+		weights[i] /= sum;
+
+	stateDisable( g_glState, GL_DEPTH_TEST );
+
+	// The texture matrix still holds last frame's light projection.
+	glMatrixMode( GL_TEXTURE );
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	GLhandleARB program = g_momentMap.blurProgram;
+	glUseProgramObjectARB( program );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_source" ), 0 );
+	glUniform1fvARB( glGetUniformLocationARB( program, "u_weights" ), g_blurRadius + 1, weights );
+
+	// Horizontal: texture[0] -> texture[1]
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_momentMap.fbo[1] );
+	glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[0] );
+	glUniform2fARB( glGetUniformLocationARB( program, "u_step" ), 1.0f / g_momentMap.nWidth, 0.0f );
+	drawFullScreenQuad();
+
+	// Vertical: texture[1] -> texture[0]
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_momentMap.fbo[0] );
+	glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[1] );
+	glUniform2fARB( glGetUniformLocationARB( program, "u_step" ), 0.0f, 1.0f / g_momentMap.nHeight );
+	drawFullScreenQuad();
+
+	glUseProgramObjectARB( 0 );
+
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_TEXTURE );
+	glPopMatrix();
+
+	stateEnable( g_glState, GL_DEPTH_TEST );
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginMomentLookup()
+// Desc: Binds the moment map and the lookup shader for the main pass. The
+//       texgen and texture matrix must already be set up by render().
+//-----------------------------------------------------------------------------
+void beginMomentLookup( void )
+{
+	int esm = (g_shadowMode == SHADOW_ESM);
+
+	glBindTexture( GL_TEXTURE_2D, g_momentMap.texture[0] );
+
+	GLhandleARB program = g_momentMap.lookupProgram[esm];
+	glUseProgramObjectARB( program );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_shadowMap" ), 0 );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_depthRange" ), g_momentDepthRange );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_minVariance" ), g_vsmMinVariance );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_lightBleed" ), g_vsmLightBleed );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_esmExponent" ), g_esmExponent );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_fogMode" ), currentFogMode() );
+}
+
+//-----------------------------------------------------------------------------
+// Name: endMomentLookup()
+// Desc:
+//-----------------------------------------------------------------------------
+void endMomentLookup( void )
+{
+	glUseProgramObjectARB( 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Name: drawFullScreenQuad()
+// Desc: A [-1, 1] quad with [0, 1] texture coordinates. Meant to be drawn
+//       with identity (or gluOrtho2D(-1, 1, -1, 1)) matrices.
+//-----------------------------------------------------------------------------
+void drawFullScreenQuad( void )
+{
+	glBegin( GL_QUADS );
+	{
+		glTexCoord2f( 0.0f, 0.0f );
+		glVertex3f( -1.0f, -1.0f, 0.0f );
+
+		glTexCoord2f( 0.0f, 1.0f );
+		glVertex3f( -1.0f, 1.0f, 0.0f );
+
+		glTexCoord2f( 1.0f, 1.0f );
+		glVertex3f( 1.0f, 1.0f, 0.0f );
+
+		glTexCoord2f( 1.0f, 0.0f );
+		glVertex3f( 1.0f, -1.0f, 0.0f );
+	}
+	glEnd();
+}
+
+//-----------------------------------------------------------------------------
+// Cube shadow map shaders
+//-----------------------------------------------------------------------------
+
+// The modelview only holds the object's own placement, so this is world space.
+static const char* g_cubeDepthVS =
+	"void main()\n"
+	"{\n"
+	"	gl_Position = gl_ModelViewMatrix * gl_Vertex;\n"
+	"}\n";
+
+// Emits each triangle once per visible face, with gl_Layer picking the face.
+static const char* g_cubeDepthGS =
+	"uniform mat4 u_faceMatrix[6];\n"
+	"uniform bool u_faceVisible[6];\n"
+	"void main()\n"
+	"{\n"
+	"	for (int face = 0; face < 6; ++face)\n"
+	"	{\n"
+	"		if (!u_faceVisible[face])\n"
+	"			continue;\n"
+	"		for (int i = 0; i < 3; ++i)\n"
+	"		{\n"
+	"			gl_Layer = face;\n"
+	"			gl_Position = u_faceMatrix[face] * gl_PositionIn[i];\n"
+	"			EmitVertex();\n"
+	"		}\n"
+	"		EndPrimitive();\n"
+	"	}\n"
+	"}\n";
+
+// gl_TexCoord[0].xyz is the light-to-fragment vector. Its major axis is the
+// view-space depth of the face it lands on, which is turned into the same
+// window depth the 90 degree face projection wrote.
+static const char* g_cubeLookupFS =
+	"uniform samplerCube u_shadowMap;\n"
+	"uniform float u_near;\n"
+	"uniform float u_far;\n"
+	"uniform float u_bias;\n"
+	"float visibility(vec3 v)\n"
+	"{\n"
+	"	vec3 a = abs(v);\n"
+	"	float major = max(a.x, max(a.y, a.z));\n"
+	"	if (major >= u_far)\n"
+	"		return 1.0;\n"
+	"	float ndc = (u_far + u_near) / (u_far - u_near) - 2.0 * u_far * u_near / ((u_far - u_near) * major);\n"
+	"	float depth = ndc * 0.5 + 0.5;\n"
+	"	return (depth - u_bias <= textureCube(u_shadowMap, v).r) ? 1.0 : 0.0;\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 color = gl_Color * visibility(gl_TexCoord[0].xyz);\n"
+	"	color.rgb = applyFog(color.rgb);\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+// Look direction and up vector of each face, in GL_TEXTURE_CUBE_MAP_POSITIVE_X
+// order. The ups follow the cube map convention so layer i samples as face i.
+static const float g_cubeFaceDirections[6][3] =
+{
+	{  1.0f,  0.0f,  0.0f }, { -1.0f,  0.0f,  0.0f },
+	{  0.0f,  1.0f,  0.0f }, {  0.0f, -1.0f,  0.0f },
+	{  0.0f,  0.0f,  1.0f }, {  0.0f,  0.0f, -1.0f }
+};
+
+static const float g_cubeFaceUps[6][3] =
+{
+	{  0.0f, -1.0f,  0.0f }, {  0.0f, -1.0f,  0.0f },
+	{  0.0f,  0.0f,  1.0f }, {  0.0f,  0.0f, -1.0f },
+	{  0.0f, -1.0f,  0.0f }, {  0.0f, -1.0f,  0.0f }
+};
+
+//-----------------------------------------------------------------------------
+// Name: initCubeShadowMap()
+// Desc: Creates the depth cube map, its layered FBO and the shaders. Does
+//       nothing if they already exist.
+//-----------------------------------------------------------------------------
+bool initCubeShadowMap( void )
+{
+	if( g_cubeShadowMap.fbo != 0 )
+		return true;
+
+	g_cubeShadowMap.nSize = CUBE_SHADOW_SIZE;
+
+	// The shader does the comparison itself, so leave the compare mode off
+	// and read the raw depth through the red channel.
+	glGenTextures( 1, &g_cubeShadowMap.texture );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARB, g_cubeShadowMap.texture );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARB, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARB, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARB, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARB, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARB, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARB, GL_DEPTH_TEXTURE_MODE_ARB, GL_LUMINANCE );
+
+	for( int i = 0; i < 6; ++i )
+	{
+		glTexImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X_ARB + i, 0, GL_DEPTH_COMPONENT24,
+					  g_cubeShadowMap.nSize, g_cubeShadowMap.nSize, 0,
+					  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL );
+	}
+
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARB, 0 );
+
+	// Attaching the whole cube makes the FBO layered: one layer per face.
+	glGenFramebuffersEXT( 1, &g_cubeShadowMap.fbo );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_cubeShadowMap.fbo );
+	glFramebufferTextureEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, g_cubeShadowMap.texture, 0 );
+	glDrawBuffer( GL_NONE );
+	glReadBuffer( GL_NONE );
+
+	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+
+	if( status != GL_FRAMEBUFFER_COMPLETE_EXT )
+	{
+		MessageBox(NULL, "Could not create the layered depth cube map!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		freeCubeShadowMap();
+		return false;
+	}
+
+	// 6 faces * 3 vertices
+	g_cubeShadowMap.renderProgram = compileProgram( g_geometryShaderExtension, g_cubeDepthVS, NULL,
+													g_cubeDepthGS, 18 );
+	g_cubeShadowMap.lookupProgram = compileProgram( NULL, NULL, g_cubeLookupFS );
+
+	if( !g_cubeShadowMap.renderProgram || !g_cubeShadowMap.lookupProgram )
+	{
+		freeCubeShadowMap();
+		return false;
+	}
+
+	g_cubeShadowMap.faceVisibleLocation =
+		glGetUniformLocationARB( g_cubeShadowMap.renderProgram, "u_faceVisible" );
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeCubeShadowMap()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeCubeShadowMap( void )
+{
+	if( g_cubeShadowMap.fbo != 0 )
+		glDeleteFramebuffersEXT( 1, &g_cubeShadowMap.fbo );
+
+	if( g_cubeShadowMap.texture != 0 )
+		glDeleteTextures( 1, &g_cubeShadowMap.texture );
+
+	if( g_cubeShadowMap.renderProgram )
+		glDeleteObjectARB( g_cubeShadowMap.renderProgram );
+
+	if( g_cubeShadowMap.lookupProgram )
+		glDeleteObjectARB( g_cubeShadowMap.lookupProgram );
+
+	memset( &g_cubeShadowMap, 0, sizeof(g_cubeShadowMap) );
+}
+
+//-----------------------------------------------------------------------------
+// Name: createCubeShadowMap()
+// Desc: SHADOW_CUBE counterpart of createDepthTexture(). Renders all six
+//       faces around g_lightPosition in one pass over the scene. Each object
+//       is only sent to the faces its bounding sphere touches, see
+//       cubeFaceFilter().
+//-----------------------------------------------------------------------------
+void createCubeShadowMap( void )
+{
+	float projection[16];
+	float view[16];
+	float faceMatrices[6 * 16];
+
+	matrixPerspective( projection, 90.0f, 1.0f, LIGHT_NEAR, LIGHT_FAR );
+
+	for( int i = 0; i < 6; ++i )
+	{
+		float center[3] = { g_lightPosition[0] + g_cubeFaceDirections[i][0],
+							g_lightPosition[1] + g_cubeFaceDirections[i][1],
+							g_lightPosition[2] + g_cubeFaceDirections[i][2] };
+
+		matrixLookAt( view, g_lightPosition, center, g_cubeFaceUps[i] );
+		matrixMultiply( &faceMatrices[i * 16], projection, view );
+	}
+
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_POLYGON_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_cubeShadowMap.fbo );
+	glViewport( 0, 0, g_cubeShadowMap.nSize, g_cubeShadowMap.nSize );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	// Clears every layer.
+	glClear( GL_DEPTH_BUFFER_BIT );
+
+	glPolygonOffset( 2.0f, 2.0f );
+	stateEnable( g_glState, GL_POLYGON_OFFSET_FILL );
+
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	GLhandleARB program = g_cubeShadowMap.renderProgram;
+	glUseProgramObjectARB( program );
+	glUniformMatrix4fvARB( glGetUniformLocationARB( program, "u_faceMatrix" ), 6, GL_FALSE, faceMatrices );
+
+	g_cubeShadowMap.objectsDrawn = 0;
+	g_cubeShadowMap.facesDrawn   = 0;
+
+	g_bTriangleGeometry = true;
+	g_pfnObjectFilter   = cubeFaceFilter;
+
+	renderScene();
+
+	g_pfnObjectFilter   = NULL;
+	g_bTriangleGeometry = false;
+
+	glUseProgramObjectARB( 0 );
+
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: cubeFaceFilter()
+// Desc: g_pfnObjectFilter of the cube pass. Tests the bounding sphere against
+//       the four side planes and near/far of each face's 90 degree frustum,
+//       hands the result to the geometry shader and skips the object if no
+//       face wants it.
+//-----------------------------------------------------------------------------
+bool cubeFaceFilter( const float center[3], float radius )
+{
+	const float SQRT2 = 1.41421356f;
+
+	float c[3] = { center[0] - g_lightPosition[0],
+				   center[1] - g_lightPosition[1],
+				   center[2] - g_lightPosition[2] };
+
+	GLint visible[6];
+	int   count = 0;
+
+	for( int face = 0; face < 6; ++face )
+	{
+		int   axis = face / 2;
+		float d    = (face & 1) ? -c[axis] : c[axis];	// Depth along the face's view axis
+
+		bool inside = (d + radius >= LIGHT_NEAR) && (d - radius <= LIGHT_FAR);
+
+		// The side planes of a 90 degree frustum are |c[b]| = d, with unit
+		// normals (d -/+ c[b]) / sqrt(2).
+		for( int b = 0; b < 3 && inside; ++b )
+		{
+			if( b != axis && d - fabs( c[b] ) < -radius * SQRT2 )
+				inside = false;
+		}
+
+		visible[face] = inside ? 1 : 0;
+		count += visible[face];
+	}
+
+	if( count == 0 )
+		return false;
+
+	glUniform1ivARB( g_cubeShadowMap.faceVisibleLocation, 6, visible );
+
+	g_cubeShadowMap.objectsDrawn += 1;
+	g_cubeShadowMap.facesDrawn   += count;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginCubeShadowLookup()
+// Desc: Binds the cube map and its lookup shader for the main pass. The
+//       eye-linear texgen from render() yields world positions, so the
+//       texture matrix only has to move the origin to the light.
+//-----------------------------------------------------------------------------
+void beginCubeShadowLookup( void )
+{
+	glMatrixMode( GL_TEXTURE );
+	glLoadIdentity();
+	glTranslatef( -g_lightPosition[0], -g_lightPosition[1], -g_lightPosition[2] );
+	glMatrixMode( GL_MODELVIEW );
+
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARB, g_cubeShadowMap.texture );
+
+	GLhandleARB program = g_cubeShadowMap.lookupProgram;
+	glUseProgramObjectARB( program );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_shadowMap" ), 0 );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_near" ), LIGHT_NEAR );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_far" ), LIGHT_FAR );
+	glUniform1fARB( glGetUniformLocationARB( program, "u_bias" ), 0.0005f );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_fogMode" ), currentFogMode() );
+}
+
+//-----------------------------------------------------------------------------
+// Name: endCubeShadowLookup()
+// Desc:
+//-----------------------------------------------------------------------------
+void endCubeShadowLookup( void )
+{
+	glUseProgramObjectARB( 0 );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARB, 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Shadow atlas
+//-----------------------------------------------------------------------------
+
+// Fixed-function lighting for one light times that light's shadow test. The
+// texture matrix maps into the light's [0, 1] shadow map, u_tile then moves
+// the lookup into the light's tile of the atlas. Outside its frustum the
+// light is treated as unshadowed.
+static const char* g_atlasLookupFS =
+	"uniform sampler2DShadow u_shadowAtlas;\n"
+	"uniform vec4 u_tile;\n"
+	"uniform vec2 u_tileClamp;\n"
+	"float visibility(vec4 coord)\n"
+	"{\n"
+	"	if (coord.q <= 0.0)\n"
+	"		return 1.0;\n"
+	"	vec3 p = coord.xyz / coord.q;\n"
+	"	if (p.x < 0.0 || p.x > 1.0 || p.y < 0.0 || p.y > 1.0 || p.z >= 1.0)\n"
+	"		return 1.0;\n"
+	"	p.xy = clamp(p.xy, u_tileClamp.x, u_tileClamp.y) * u_tile.zw + u_tile.xy;\n"
+	"	return shadow2D(u_shadowAtlas, p).r;\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 color = gl_Color * visibility(gl_TexCoord[0]);\n"
+	"	color.rgb = applyFog(color.rgb);\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+// Name: initShadowAtlas()
+// Desc: Creates the atlas depth texture, its FBO and the lookup shader. Does
+//       nothing if they already exist.
+//-----------------------------------------------------------------------------
+bool initShadowAtlas( void )
+{
+	if( g_shadowAtlas.fbo != 0 )
+		return true;
+
+	// Unlike the p-buffer path this uses the ARB_shadow compare, so the
+	// lookup shader gets hardware 2x2 PCF through shadow2D().
+	glGenTextures( 1, &g_shadowAtlas.texture );
+	glBindTexture( GL_TEXTURE_2D, g_shadowAtlas.texture );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_COMPARE_R_TO_TEXTURE_ARB );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC_ARB, GL_LEQUAL );
+	glTexParameteri( GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE_ARB, GL_LUMINANCE );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, 0,
+				  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	glGenFramebuffersEXT( 1, &g_shadowAtlas.fbo );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_shadowAtlas.fbo );
+	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, g_shadowAtlas.texture, 0 );
+	glDrawBuffer( GL_NONE );
+	glReadBuffer( GL_NONE );
+
+	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+
+	if( status != GL_FRAMEBUFFER_COMPLETE_EXT )
+	{
+		MessageBox(NULL, "Could not create the shadow atlas!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		freeShadowAtlas();
+		return false;
+	}
+
+	g_shadowAtlas.lookupProgram = compileProgram( NULL, NULL, g_atlasLookupFS );
+
+	if( !g_shadowAtlas.lookupProgram )
+	{
+		freeShadowAtlas();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeShadowAtlas()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeShadowAtlas( void )
+{
+	if( g_shadowAtlas.fbo != 0 )
+		glDeleteFramebuffersEXT( 1, &g_shadowAtlas.fbo );
+
+	if( g_shadowAtlas.texture != 0 )
+		glDeleteTextures( 1, &g_shadowAtlas.texture );
+
+	if( g_shadowAtlas.lookupProgram )
+		glDeleteObjectARB( g_shadowAtlas.lookupProgram );
+
+	g_shadowAtlas.fbo           = 0;
+	g_shadowAtlas.texture       = 0;
+	g_shadowAtlas.lookupProgram = 0;
+	g_shadowAtlas.currentLight  = 0;
+	g_shadowAtlas.objectIndex   = 0;
+	g_shadowAtlas.casterMask.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Name: allocateShadowAtlas()
+// Desc: Sizes and places every light's tile.
+//
+//       A light's importance is the share of the perspective view (the
+//       upper right viewport) covered by the area it lights, approximated by
+//       a sphere around its target, weighted by its brightness. Tiles are
+//       powers of two proportional to the square root of that share, so the
+//       texel density on screen is about the same for all lights.
+//
+//       Sorted from large to small, power-of-two squares never collide when
+//       they are laid out along a Morton (Z-order) curve: each one starts at
+//       the running total of the areas before it, which is always a whole
+//       number of its own size squared.
+//-----------------------------------------------------------------------------
+void allocateShadowAtlas( void )
+{
+	float projection[16];
+	float camera[16];
+
+	buildCameraMatrix( camera, projection );
+
+	float total = 0.0f;
+
+	for( int i = 0; i < g_shadowLightCount; ++i )
+	{
+		SHADOWLIGHT* light = &g_shadowLights[i];
+
+		float dx = light->target[0] - light->position[0];
+		float dy = light->target[1] - light->position[1];
+		float dz = light->target[2] - light->position[2];
+		float radius = (float)(sqrt( dx * dx + dy * dy + dz * dz ) * tan( light->fovy * PI / 360.0 ));
+
+		float clip[4];
+		matrixTransformPoint( clip, camera, light->target );
+
+		// Fraction of the [-1, 1]^2 viewport covered by the projected sphere
+		float coverage = 1.0f;
+
+		if( clip[3] > radius )
+		{
+			float r = radius * projection[5] / clip[3];
+			coverage = (float)(PI * r * r / 4.0);
+
+			if( coverage > 1.0f )
+				coverage = 1.0f;
+		}
+
+		float brightness = 0.3f * light->color[0] + 0.59f * light->color[1] + 0.11f * light->color[2];
+
+		light->importance = (coverage > 0.01f ? coverage : 0.01f) * brightness;
+		total += light->importance;
+	}
+
+	// Sizes, and the lights sorted by size (insertion sort, there are only a few)
+	int order[MAX_SHADOW_LIGHTS];
+	int area = 0;
+
+	for( int i = 0; i < g_shadowLightCount; ++i )
+	{
+		SHADOWLIGHT* light = &g_shadowLights[i];
+
+		float ideal = SHADOW_ATLAS_SIZE * (float)sqrt( light->importance / total );
+
+		light->tileSize = MAX_SHADOW_TILE;
+		while( light->tileSize > MIN_SHADOW_TILE && light->tileSize > ideal )
+			light->tileSize /= 2;
+
+		area += light->tileSize * light->tileSize;
+
+		int j = i;
+		for( ; j > 0 && g_shadowLights[order[j - 1]].tileSize < light->tileSize; --j )
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	// Too many big lights: halve the largest until everything fits.
+	while( area > SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE )
+	{
+		SHADOWLIGHT* largest = &g_shadowLights[order[0]];
+
+		area -= largest->tileSize * largest->tileSize * 3 / 4;
+		largest->tileSize /= 2;
+
+		for( int j = 0; j + 1 < g_shadowLightCount &&
+			 g_shadowLights[order[j]].tileSize < g_shadowLights[order[j + 1]].tileSize; ++j )
+		{
+			int swap = order[j];
+			order[j] = order[j + 1];
+			order[j + 1] = swap;
+		}
+	}
+
+	int offset = 0;
+
+	for( int i = 0; i < g_shadowLightCount; ++i )
+	{
+		SHADOWLIGHT* light = &g_shadowLights[order[i]];
+		int size  = light->tileSize;
+		int index = offset / (size * size);
+
+		// De-interleave the Morton index into tile coordinates.
+		light->tileX = light->tileY = 0;
+
+		for( int bit = 0; (index >> (2 * bit)) != 0; ++bit )
+		{
+			light->tileX |= ((index >> (2 * bit))     & 1) << bit;
+			light->tileY |= ((index >> (2 * bit + 1)) & 1) << bit;
+		}
+
+		light->tileX *= size;
+		light->tileY *= size;
+
+		offset += size * size;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: createShadowAtlas()
+// Desc: SHADOW_ATLAS counterpart of createDepthTexture(). Places the tiles,
+//       culls the casters against all lights in one sweep and renders every
+//       light's depth into its tile of the atlas.
+//-----------------------------------------------------------------------------
+void createShadowAtlas( void )
+{
+	float planes[MAX_SHADOW_LIGHTS][6][4];
+
+	g_shadowLights[0].position[0] = g_lightPosition[0];
+	g_shadowLights[0].position[1] = g_lightPosition[1];
+	g_shadowLights[0].position[2] = g_lightPosition[2];
+
+	for( int i = 0; i < g_shadowLightCount; ++i )
+	{
+		SHADOWLIGHT* light = &g_shadowLights[i];
+		const float  up[3] = { 0.0f, 1.0f, 0.0f };
+		float        m[16];
+
+		matrixLookAt( light->view, light->position, light->target, up );
+		matrixPerspective( light->projection, light->fovy, 1.0f, LIGHT_NEAR, LIGHT_FAR );
+		matrixMultiply( m, light->projection, light->view );
+		matrixFrustumPlanes( planes[i], m );
+
+		light->castersDrawn = 0;
+	}
+
+	allocateShadowAtlas();
+
+	// Shared culling: walk the scene once to collect the casters' bounds,
+	// then test each of them against every light's frustum.
+	collectSceneBounds();
+
+	g_shadowAtlas.casterMask.resize( g_sceneBounds.size() );
+
+	for( size_t o = 0; o < g_sceneBounds.size(); ++o )
+	{
+		const float* bounds = g_sceneBounds[o].sphere;
+
+		g_shadowAtlas.casterMask[o] = 0;
+
+		for( int i = 0; i < g_shadowLightCount; ++i )
+		{
+			if( sphereInFrustum( planes[i], bounds, bounds[3] ) )
+				g_shadowAtlas.casterMask[o] |= 1u << i;
+		}
+	}
+
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_SCISSOR_BIT | GL_POLYGON_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, g_shadowAtlas.fbo );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+	stateEnable( g_glState, GL_SCISSOR_TEST );
+
+	glPolygonOffset( 2.0f, 2.0f );
+	stateEnable( g_glState, GL_POLYGON_OFFSET_FILL );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+
+	g_pfnObjectFilter = atlasCasterFilter;
+
+	for( int i = 0; i < g_shadowLightCount; ++i )
+	{
+		SHADOWLIGHT* light = &g_shadowLights[i];
+
+		// The scissor keeps the clear inside the tile.
+		glViewport( light->tileX, light->tileY, light->tileSize, light->tileSize );
+		glScissor( light->tileX, light->tileY, light->tileSize, light->tileSize );
+		glClear( GL_DEPTH_BUFFER_BIT );
+
+		glMatrixMode( GL_PROJECTION );
+		glLoadMatrixf( light->projection );
+		glMatrixMode( GL_MODELVIEW );
+		glLoadMatrixf( light->view );
+
+		g_shadowAtlas.currentLight = i;
+		g_shadowAtlas.objectIndex  = 0;
+		renderScene();
+	}
+
+	g_pfnObjectFilter = NULL;
+
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: atlasCasterFilter()
+// Desc: g_pfnObjectFilter of the depth passes. renderScene() visits the
+//       objects in the same order every time, so the n-th call answers for
+//       the n-th object of the culling sweep.
+//-----------------------------------------------------------------------------
+bool atlasCasterFilter( const float center[3], float radius )
+{
+	int index = g_shadowAtlas.objectIndex++;
+
+	// Past the end of the table: draw rather than lose a shadow.
+	if( index >= (int)g_shadowAtlas.casterMask.size() )
+		return true;
+
+	if( (g_shadowAtlas.casterMask[index] & (1u << g_shadowAtlas.currentLight)) == 0 )
+		return false;
+
+	++g_shadowLights[g_shadowAtlas.currentLight].castersDrawn;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderAtlasLights()
+// Desc: Main pass of SHADOW_ATLAS. GL_LIGHT0 is reloaded with each light in
+//       turn; the first pass lays down depth, ambient and fog, the others
+//       add their light on top with GL_EQUAL depth testing.
+//-----------------------------------------------------------------------------
+void renderAtlasLights( void )
+{
+	static const float black[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+	glPushAttrib( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_LIGHTING_BIT | GL_FOG_BIT );
+
+	glBindTexture( GL_TEXTURE_2D, g_shadowAtlas.texture );
+
+	GLhandleARB program = g_shadowAtlas.lookupProgram;
+	glUseProgramObjectARB( program );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_shadowAtlas" ), 0 );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_fogMode" ), currentFogMode() );
+
+	GLint tileLocation  = glGetUniformLocationARB( program, "u_tile" );
+	GLint clampLocation = glGetUniformLocationARB( program, "u_tileClamp" );
+
+	for( int i = 0; i < g_shadowLightCount; ++i )
+	{
+		SHADOWLIGHT* light = &g_shadowLights[i];
+
+		if( i == 1 )
+		{
+			stateEnable( g_glState, GL_BLEND );
+			glBlendFunc( GL_ONE, GL_ONE );
+			glDepthFunc( GL_EQUAL );
+			glDepthMask( GL_FALSE );
+			glLightModelfv( GL_LIGHT_MODEL_AMBIENT, black );
+			glFogfv( GL_FOG_COLOR, black );
+		}
+
+		// Positioned with the view matrix render() has just loaded.
+		glLightfv( GL_LIGHT0, GL_POSITION, light->position );
+		glLightfv( GL_LIGHT0, GL_DIFFUSE, light->color );
+
+		glMatrixMode( GL_TEXTURE );
+		glLoadIdentity();
+		glTranslatef( 0.5f, 0.5f, 0.5f );
+		glScalef( 0.5f, 0.5f, 0.5f );
+		glMultMatrixf( light->projection );
+		glMultMatrixf( light->view );
+		glMatrixMode( GL_MODELVIEW );
+
+		// Keep bilinear PCF from reaching into the neighbouring tile.
+		float scale = (float)light->tileSize / SHADOW_ATLAS_SIZE;
+		float inset = 0.5f / light->tileSize;
+
+		glUniform4fARB( tileLocation, (float)light->tileX / SHADOW_ATLAS_SIZE,
+						(float)light->tileY / SHADOW_ATLAS_SIZE, scale, scale );
+		glUniform2fARB( clampLocation, inset, 1.0f - inset );
+
+		renderScene();
+	}
+
+	glUseProgramObjectARB( 0 );
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: initSoftwareShadowMap()
+// Desc: Creates the CPU rasterizer and the depth texture it is uploaded to.
+//       Does nothing if they already exist.
+//-----------------------------------------------------------------------------
+void initSoftwareShadowMap( void )
+{
+	if( g_softwareDepthTexture != 0 )
+		return;
+
+	softRasterizerInit( g_softRasterizer, PBUFFER_WIDTH, PBUFFER_HEIGHT, &g_threadPool );
+	g_softRasterizer.slopeOffset    = g_depthFormats[g_depthFormat].offsetFactor;
+	g_softRasterizer.constantOffset = g_depthFormats[g_depthFormat].offsetUnits * g_depthFormats[g_depthFormat].depthStep;
+
+	// Same sampling state as g_depthTexture, one texture per frame in flight
+	glGenTextures( MAX_FRAMES_IN_FLIGHT, g_softwareDepthTextures );
+
+	for( int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i )
+	{
+		glBindTexture( GL_TEXTURE_2D, g_softwareDepthTextures[i] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
+		glTexImage2D( GL_TEXTURE_2D, 0, g_depthFormats[g_depthFormat].internalFormat,
+					  g_softRasterizer.width, g_softRasterizer.height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
+	}
+
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	g_softwareDepthTexture = g_softwareDepthTextures[0];
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeSoftwareShadowMap()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeSoftwareShadowMap( void )
+{
+	if( g_softwareDepthTexture != 0 )
+		glDeleteTextures( MAX_FRAMES_IN_FLIGHT, g_softwareDepthTextures );
+
+	memset( g_softwareDepthTextures, 0, sizeof(g_softwareDepthTextures) );
+	g_softwareDepthTexture = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: rasterizeShadowMap()
+// Desc: CPU counterpart of createDepthTexture(): the scene's meshes are
+//       rasterized with the light's projection * g_lightsLookAtMatrix into
+//       g_softRasterizer.depth, which can then be uploaded or sampled with
+//       softRasterizerDepthAt().
+//-----------------------------------------------------------------------------
+void rasterizeShadowMap( void )
+{
+	double start = getMilliseconds();
+
+	memcpy( g_softLightMatrix, g_lightViewProjection, sizeof(g_softLightMatrix) );
+
+	softRasterizerBegin( g_softRasterizer );
+
+	// renderScene() still places the objects with the GL matrix stack.
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	g_pfnMeshSink = rasterizeMeshSink;
+	renderScene();
+	g_pfnMeshSink = NULL;
+
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	softRasterizerFlush( g_softRasterizer );
+
+	g_softRasterMs = getMilliseconds() - start;
+}
+
+//-----------------------------------------------------------------------------
+// Name: rasterizeMeshSink()
+// Desc: g_pfnMeshSink of rasterizeShadowMap()
+//-----------------------------------------------------------------------------
+void rasterizeMeshSink( const MESH& mesh )
+{
+	float model[16];
+	float matrix[16];
+
+	getSinkModelMatrix( model );
+	matrixMultiply( matrix, g_softLightMatrix, model );
+
+	softRasterizerAddMesh( g_softRasterizer, mesh, matrix );
+}
+
+//-----------------------------------------------------------------------------
+// Name: uploadSoftwareShadowMap()
+// Desc: Uploads into this frame's texture of the ring, so the upload never
+//       has to wait for a frame still in flight that samples the last one.
+//-----------------------------------------------------------------------------
+void uploadSoftwareShadowMap( void )
+{
+	double start = getMilliseconds();
+
+	g_softwareDepthTexture = g_softwareDepthTextures[g_framePacer.frame % MAX_FRAMES_IN_FLIGHT];
+
+	GLsizeiptr bytes = (GLsizeiptr)g_softRasterizer.width * g_softRasterizer.height * sizeof(float);
+	GLintptr   offset;
+
+	// The rasterizer keeps reading its own depth buffer, so it can't render
+	// into the write-combined stream memory. Copying it in is still the
+	// only copy: the texture is then filled from the buffer on the GPU.
+	void* pixels = streamAlloc( bytes, &offset );
+
+	glBindTexture( GL_TEXTURE_2D, g_softwareDepthTexture );
+
+	if( pixels != NULL )
+	{
+		memcpy( pixels, &g_softRasterizer.depth[0], bytes );
+
+		glBindBufferARB( GL_PIXEL_UNPACK_BUFFER_ARB, g_streamBuffer.buffer );
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, g_softRasterizer.width, g_softRasterizer.height,
+						 GL_DEPTH_COMPONENT, GL_FLOAT, (const GLvoid*)offset );
+		glBindBufferARB( GL_PIXEL_UNPACK_BUFFER_ARB, 0 );
+	}
+	else
+	{
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, g_softRasterizer.width, g_softRasterizer.height,
+						 GL_DEPTH_COMPONENT, GL_FLOAT, &g_softRasterizer.depth[0] );
+	}
+
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	g_softUploadMs = getMilliseconds() - start;
+}
+
+//-----------------------------------------------------------------------------
+// Name: benchmarkShadowMaps()
+// Desc: F10 - Times building the current scene's shadow map with the
+//       p-buffer, with the CPU rasterizer and in every depth format, and
+//       shows the averages.
+//-----------------------------------------------------------------------------
+void benchmarkShadowMaps( void )
+{
+	const int FRAMES = 50;
+
+	initSoftwareShadowMap();
+
+	// p-buffer: start from an idle GPU and wait for the last map, so the
+	// queued work is counted as well.
+	wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC );
+	glFinish();
+	wglMakeCurrent( g_hDC, g_hRC );
+
+	double start = getMilliseconds();
+
+	for( int i = 0; i < FRAMES; ++i )
+		createDepthTexture();
+
+	wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC );
+	glFinish();
+	wglMakeCurrent( g_hDC, g_hRC );
+
+	double pbufferMs = (getMilliseconds() - start) / FRAMES;
+
+	start = getMilliseconds();
+
+	for( int i = 0; i < FRAMES; ++i )
+		rasterizeShadowMap();
+
+	double rasterMs = (getMilliseconds() - start) / FRAMES;
+
+	glFinish();
+	start = getMilliseconds();
+
+	for( int i = 0; i < FRAMES; ++i )
+		uploadSoftwareShadowMap();
+
+	glFinish();
+	double uploadMs = (getMilliseconds() - start) / FRAMES;
+
+	start = getMilliseconds();
+
+	for( int i = 0; i < FRAMES; ++i )
+		buildSceneBVH();
+
+	double bvhMs = (getMilliseconds() - start) / FRAMES;
+
+	// The same pass into an FBO of each depth format. The traffic is at
+	// least the map written once, so size / time is a lower bound of the
+	// depth bandwidth.
+	char   formatReport[256] = "";
+	int    formatLength      = 0;
+	int    currentFormat     = g_depthFormat;
+
+	for( int f = 0; f < DEPTH_FORMAT_COUNT && g_bFramebufferObject; ++f )
+	{
+		if( f == DEPTH_FORMAT_32F && !g_bDepthBufferFloat )
+			continue;
+
+		GLuint texture;
+		GLuint fbo;
+
+		glGenTextures( 1, &texture );
+		glBindTexture( GL_TEXTURE_2D, texture );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+		glTexImage2D( GL_TEXTURE_2D, 0, g_depthFormats[f].internalFormat, PBUFFER_WIDTH, PBUFFER_HEIGHT, 0,
+					  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL );
+		glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+		glGenFramebuffersEXT( 1, &fbo );
+		glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, fbo );
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, texture, 0 );
+		glDrawBuffer( GL_NONE );
+		glReadBuffer( GL_NONE );
+
+		GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+		glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+
+		if( status == GL_FRAMEBUFFER_COMPLETE_EXT )
+		{
+			g_depthFormat = f;
+
+			glFinish();
+			start = getMilliseconds();
+
+			for( int i = 0; i < FRAMES; ++i )
+				renderDepthTarget( fbo, PBUFFER_WIDTH, PBUFFER_HEIGHT );
+
+			glFinish();
+			double passMs = (getMilliseconds() - start) / FRAMES;
+			double mb     = (double)PBUFFER_WIDTH * PBUFFER_HEIGHT * g_depthFormats[f].bytesPerTexel / (1024.0 * 1024.0);
+
+			formatLength += sprintf( formatReport + formatLength, "%s:\t%.3f ms, %.1f MB, %.2f GB/s\n",
+									 g_depthFormats[f].name, passMs, mb, mb / 1024.0 / (passMs / 1000.0) );
+		}
+
+		glDeleteFramebuffersEXT( 1, &fbo );
+		glDeleteTextures( 1, &texture );
+	}
+
+	g_depthFormat = currentFormat;
+
+	// Batched queries: random points over the floor, up to the teapot's height
+	const int POINTS = 1 << 20;
+
+	std::vector<float> x( POINTS ), y( POINTS ), z( POINTS ), visibility( POINTS );
+
+	for( int i = 0; i < POINTS; ++i )
+	{
+		x[i] = rand() * 10.0f / RAND_MAX - 5.0f;
+		y[i] = rand() *  4.0f / RAND_MAX;
+		z[i] = rand() * 10.0f / RAND_MAX - 5.0f;
+	}
+
+	start = getMilliseconds();
+	queryShadowPoints( &x[0], &y[0], &z[0], POINTS, &visibility[0], 0 );
+	double queryMs = getMilliseconds() - start;
+
+	double lit = 0.0;
+	for( int i = 0; i < POINTS; ++i )
+		lit += visibility[i];
+
+	start = getMilliseconds();
+	queryShadowPoints( &x[0], &y[0], &z[0], POINTS, &visibility[0], 1 );
+	double pcfMs = getMilliseconds() - start;
+
+	// The four views of every scene without and with the depth prepass,
+	// timed on their own by render() and not shown.
+	const int SCENE_FRAMES = 20;
+
+	char prepassReport[512] = "";
+	int  prepassLength      = 0;
+	int  currentScene       = sceneNo;
+	bool currentPrepass     = g_bDepthPrepass;
+
+	if( g_bTimerQuery )
+		glGenQueriesARB( 2, g_viewPassTimer.timestamps );
+
+	g_viewPassTimer.active = true;
+
+	for( int scene = 0; scene <= LOADED_SCENE && !multiViewActive(); ++scene )
+	{
+		if( scene == LOADED_SCENE && g_sceneLoader.set.count == 0 )
+			continue;
+
+		double frameMs[2];
+
+		sceneNo = scene;
+
+		for( int prepass = 0; prepass < 2; ++prepass )
+		{
+			g_bDepthPrepass = prepass != 0;
+
+			// The first frame of a scene builds its caches.
+			render();
+
+			double viewsMs = 0.0;
+
+			for( int i = 0; i < SCENE_FRAMES; ++i )
+			{
+				render();
+				viewsMs += g_viewPassTimer.ms;
+			}
+
+			frameMs[prepass] = viewsMs / SCENE_FRAMES;
+		}
+
+		prepassLength += sprintf( prepassReport + prepassLength, "Scene %d:\t%.3f ms, %.3f ms with prepass (%+.1f%%)\n",
+								  scene, frameMs[0], frameMs[1], (frameMs[1] / frameMs[0] - 1.0) * 100.0 );
+	}
+
+	g_viewPassTimer.active = false;
+
+	if( g_bTimerQuery )
+		glDeleteQueriesARB( 2, g_viewPassTimer.timestamps );
+
+	sceneNo         = currentScene;
+	g_bDepthPrepass = currentPrepass;
+
+	char report[2048];
+	sprintf( report,
+			 "Shadow map %d x %d, scene %d, average of %d frames:\n\n"
+			 "p-buffer (GPU):\t%.3f ms (%d bits)\n"
+			 "CPU rasterizer:\t%.3f ms (%d threads, %d triangles)\n"
+			 "Texture upload:\t%.3f ms (%s)\n"
+			 "SAH BVH build:\t%.3f ms (%d nodes, for the ray tracer)\n\n"
+			 "Depth pass per format (FBO):\n%s\n"
+			 "Shadow query, %d points (%.1f%% lit):\n"
+			 "Single texel:\t%.3f ms\n"
+			 "3 x 3 PCF:\t%.3f ms\n\n"
+			 "Four views per scene (%s), depth prepass off/on:\n%s",
+			 g_softRasterizer.width, g_softRasterizer.height, sceneNo, FRAMES,
+			 pbufferMs, g_pbufferDepthBits, rasterMs, threadPoolSize( g_threadPool ), (int)g_softRasterizer.triangles.size(),
+			 uploadMs, g_depthFormats[g_depthFormat].name, bvhMs, (int)g_sceneBVH.nodes.size(), formatLength ? formatReport : "(needs GL_EXT_framebuffer_object)\n",
+			 POINTS, lit * 100.0 / POINTS, queryMs, pcfMs, g_bTimerQuery ? "GPU timestamps" : "glFinish",
+			 prepassLength ? prepassReport : "(not with multi-view)\n" );
+
+	MessageBox( NULL, report, "Benchmark", MB_OK | MB_ICONINFORMATION );
+}
+
+//-----------------------------------------------------------------------------
+// Name: initRayTracedShadows()
+// Desc: Creates the texture the shadow rays' answers are uploaded to. Does
+//       nothing if it exists.
+//-----------------------------------------------------------------------------
+void initRayTracedShadows( void )
+{
+	if( g_rayVisibilityTexture != 0 )
+		return;
+
+	glGenTextures( 1, &g_rayVisibilityTexture );
+	glBindTexture( GL_TEXTURE_2D, g_rayVisibilityTexture );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	g_rayTextureWidth  = 0;
+	g_rayTextureHeight = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeRayTracedShadows()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeRayTracedShadows( void )
+{
+	if( g_rayVisibilityTexture != 0 )
+		glDeleteTextures( 1, &g_rayVisibilityTexture );
+
+	g_rayVisibilityTexture = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildSceneBVH()
+// Desc: SHADOW_RAYTRACE counterpart of createDepthTexture(): collects the
+//       scene's meshes in world space and builds g_sceneBVH over them.
+//-----------------------------------------------------------------------------
+void buildSceneBVH( void )
+{
+	double start = getMilliseconds();
+
+	bvhBegin( g_sceneBVH );
+
+	// renderScene() still places the objects with the GL matrix stack.
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	g_pfnMeshSink = bvhMeshSink;
+	renderScene();
+	g_pfnMeshSink = NULL;
+
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	bvhBuild( g_sceneBVH );
+
+	g_bvhBuildMs = getMilliseconds() - start;
+	g_rayTraceMs = 0.0;
+	g_rayCount   = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name: bvhMeshSink()
+// Desc: g_pfnMeshSink of buildSceneBVH()
+//-----------------------------------------------------------------------------
+void bvhMeshSink( const MESH& mesh )
+{
+	float model[16];
+
+	getSinkModelMatrix( model );
+	bvhAddMesh( g_sceneBVH, mesh, model );
+}
+
+//-----------------------------------------------------------------------------
+// Name: traceViewportShadows()
+// Desc: Shadows the viewport at (x, y) that has just been drawn lit with the
+//       given matrices: one shadow ray per pixel from the position its
+//       depth unprojects to, then the colour is multiplied by the answers.
+//-----------------------------------------------------------------------------
+void traceViewportShadows( int x, int y, const float view[16], const float projection[16] )
+{
+	int width  = nWidth;
+	int height = nHeight;
+
+	if( width <= 0 || height <= 0 )
+		return;
+
+	double start = getMilliseconds();
+
+	g_rayDepth.resize( width * height );
+	g_rayVisibility.resize( width * height );
+
+	glReadPixels( x, y, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, &g_rayDepth[0] );
+
+	SHADOWRAYS rays;
+
+	matrixMultiply( rays.inverse, projection, view );
+
+	if( !matrixInverse( rays.inverse, rays.inverse ) )
+		return;
+
+	rays.depth      = &g_rayDepth[0];
+	rays.width      = width;
+	rays.height     = height;
+	rays.light[0]   = g_lightPosition[0];
+	rays.light[1]   = g_lightPosition[1];
+	rays.light[2]   = g_lightPosition[2];
+	rays.bias       = RAY_SHADOW_BIAS;
+	rays.visibility = &g_rayVisibility[0];
+
+	rayTraceShadows( g_threadPool, g_sceneBVH, rays );
+
+	// Upload into the corner of a power of two texture.
+	glBindTexture( GL_TEXTURE_2D, g_rayVisibilityTexture );
+
+	if( width > g_rayTextureWidth || height > g_rayTextureHeight )
+	{
+		for( g_rayTextureWidth = 1; g_rayTextureWidth < width; g_rayTextureWidth *= 2 );
+		for( g_rayTextureHeight = 1; g_rayTextureHeight < height; g_rayTextureHeight *= 2 );
+
+		glTexImage2D( GL_TEXTURE_2D, 0, GL_LUMINANCE8, g_rayTextureWidth, g_rayTextureHeight, 0,
+					  GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL );
+	}
+
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, width, height, GL_LUMINANCE, GL_UNSIGNED_BYTE, &g_rayVisibility[0] );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+
+	// colour *= visibility over the whole viewport
+	glPushAttrib( GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_CURRENT_BIT );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_DEPTH_TEST );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_TEXTURE_GEN_S );
+	stateDisable( g_glState, GL_TEXTURE_GEN_T );
+	stateDisable( g_glState, GL_TEXTURE_GEN_R );
+	stateEnable( g_glState, GL_TEXTURE_2D );
+	stateEnable( g_glState, GL_BLEND );
+	glBlendFunc( GL_ZERO, GL_SRC_COLOR );
+	glDepthMask( GL_FALSE );
+	glColor3f( 1.0f, 1.0f, 1.0f );
+
+	glMatrixMode( GL_TEXTURE );
+	glPushMatrix();
+	glLoadIdentity();
+	glScalef( (float)width / g_rayTextureWidth, (float)height / g_rayTextureHeight, 1.0f );
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	drawFullScreenQuad();
+
+	glMatrixMode( GL_TEXTURE );
+	glPopMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	statePopAttrib( g_glState );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	g_rayTraceMs += getMilliseconds() - start;
+	g_rayCount   += width * height;
+}
+
+//-----------------------------------------------------------------------------
+// Name: getMilliseconds()
+// Desc: High resolution timer
+//-----------------------------------------------------------------------------
+double getMilliseconds( void )
+{
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER        counter;
+
+	if( frequency.QuadPart == 0 )
+		QueryPerformanceFrequency( &frequency );
+
+	QueryPerformanceCounter( &counter );
+
+	return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+}
+
+//-----------------------------------------------------------------------------
+// Name: updateLightMatrices()
+// Desc: The light matrices of the frame, built once on the CPU and only
+//       ever loaded or uploaded from here on, never read back from GL:
+//       g_lightsLookAtMatrix, g_lightProjectionMatrix (with this frame's
+//       warp), their product, and g_shadowTextureMatrix, which takes world
+//       positions to the shadow map for the texgen, the shaders and the CPU
+//       shadow queries alike.
+//-----------------------------------------------------------------------------
+void updateLightMatrices( void )
+{
+	const float target[3] = { 0.0f, 2.5f, 0.0f };	// Towards the teapot's position
+	const float up[3]     = { 0.0f, 1.0f, 0.0f };
+
+	matrixLookAt( g_lightsLookAtMatrix, g_lightPosition, target, up );
+
+	glMatrixMode( GL_MODELVIEW );
+	glLoadMatrixf( g_lightsLookAtMatrix );
+
+	// The perspective viewport's frustum, needed by the warp before any drawing
+	computeFrustumCorners();
+	updateShadowWarp();
+
+	float bias[16];
+	matrixShadowBias( bias );
+
+	buildLightProjection( g_lightProjectionMatrix );
+	matrixMultiply( g_lightViewProjection, g_lightProjectionMatrix, g_lightsLookAtMatrix );
+	matrixMultiply( g_shadowTextureMatrix, bias, g_lightViewProjection );
+}
+
+//-----------------------------------------------------------------------------
+// Name: queryShadowPoints()
+// Desc: Lit (1) or shadowed (0) for count world-space points, without
+//       rendering a frame. The map is the current p-buffer (or adaptive
+//       target) depth in SHADOW_DEPTH_COMPARE, the CPU rasterizer's buffer in SHADOW_SOFTWARE,
+//       and a fresh CPU-rasterized map for the techniques that don't keep a
+//       plain light-space depth map.
+//-----------------------------------------------------------------------------
+void queryShadowPoints( const float* x, const float* y, const float* z, int count,
+						float* visibility, int pcfRadius )
+{
+	SHADOWQUERY query;
+
+	if( g_shadowMode == SHADOW_DEPTH_COMPARE && g_bAdaptiveResolution )
+	{
+		int size = ADAPTIVE_MIN_SIZE << g_adaptiveShadowMap.level;
+
+		g_shadowReadback.resize( size * size );
+
+		glBindTexture( GL_TEXTURE_2D, g_adaptiveShadowMap.texture[g_adaptiveShadowMap.level] );
+		glGetTexImage( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &g_shadowReadback[0] );
+		glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+		query.depth  = &g_shadowReadback[0];
+		query.width  = size;
+		query.height = size;
+	}
+	else if( g_shadowMode == SHADOW_DEPTH_COMPARE && g_bIncrementalShadow )
+	{
+		int size = g_incrementalShadowMap.nSize;
+
+		g_shadowReadback.resize( size * size );
+
+		glBindTexture( GL_TEXTURE_2D, g_incrementalShadowMap.texture[1] );
+		glGetTexImage( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &g_shadowReadback[0] );
+		glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+		query.depth  = &g_shadowReadback[0];
+		query.width  = size;
+		query.height = size;
+	}
+	else if( g_shadowMode == SHADOW_DEPTH_COMPARE )
+	{
+		g_shadowReadback.resize( g_pbuffer.nWidth * g_pbuffer.nHeight );
+
+		wglMakeCurrent( g_pbuffer.hDC, g_pbuffer.hRC );
+		glReadPixels( 0, 0, g_pbuffer.nWidth, g_pbuffer.nHeight, GL_DEPTH_COMPONENT, GL_FLOAT, &g_shadowReadback[0] );
+		wglMakeCurrent( g_hDC, g_hRC );
+
+		query.depth  = &g_shadowReadback[0];
+		query.width  = g_pbuffer.nWidth;
+		query.height = g_pbuffer.nHeight;
+	}
+	else
+	{
+		initSoftwareShadowMap();
+
+		if( g_shadowMode != SHADOW_SOFTWARE )
+			rasterizeShadowMap();
+
+		query.depth  = &g_softRasterizer.depth[0];
+		query.width  = g_softRasterizer.width;
+		query.height = g_softRasterizer.height;
+	}
+
+	memcpy( query.matrix, g_shadowTextureMatrix, sizeof(query.matrix) );
+	query.pcfRadius = pcfRadius;
+
+	shadowQuery( g_threadPool, query, x, y, z, count, visibility );
+}
+
+//-----------------------------------------------------------------------------
+// Name: collectSceneBounds()
+// Desc: Walks the scene without drawing it and records every object's
+//       bounding sphere in g_sceneBounds.
+//-----------------------------------------------------------------------------
+void collectSceneBounds( void )
+{
+	OBJECTFILTER previous = g_pfnObjectFilter;
+
+	g_sceneBounds.clear();
+	g_pfnObjectFilter  = boundsCollectFilter;
+	renderScene();
+	g_pfnObjectFilter  = previous;
+}
+
+//-----------------------------------------------------------------------------
+// Name: boundsCollectFilter()
+// Desc: g_pfnObjectFilter of collectSceneBounds(). Records the bounds and
+//       draws nothing.
+//-----------------------------------------------------------------------------
+bool boundsCollectFilter( const float center[3], float radius )
+{
+	OBJECTBOUNDS bounds = { { center[0], center[1], center[2], radius } };
+
+	g_sceneBounds.push_back( bounds );
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: collectSceneCasters()
+// Desc: Walks the scene without drawing it and records every object's
+//       bounds and model matrix in g_sceneCasters.
+//-----------------------------------------------------------------------------
+void collectSceneCasters( void )
+{
+	g_sceneCasters.clear();
+
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadIdentity();
+
+	g_pfnObjectFilter = casterCollectFilter;
+	g_pfnMeshSink     = casterCollectSink;
+	renderScene();
+	g_pfnMeshSink     = NULL;
+	g_pfnObjectFilter = NULL;
+
+	glPopMatrix();
+}
+
+//-----------------------------------------------------------------------------
+// Name: casterCollectFilter(), casterCollectSink()
+// Desc: Filter and mesh sink of collectSceneCasters(). The filter records an
+//       object's bounds, the sink the model matrix it is drawn with.
+//-----------------------------------------------------------------------------
+bool casterCollectFilter( const float center[3], float radius )
+{
+	SCENECASTER caster;
+
+	memset( &caster, 0, sizeof(caster) );
+	caster.bounds[0] = center[0];
+	caster.bounds[1] = center[1];
+	caster.bounds[2] = center[2];
+	caster.bounds[3] = radius;
+
+	g_sceneCasters.push_back( caster );
+	return true;
+}
+
+void casterCollectSink( const MESH& mesh )
+{
+	if( !g_sceneCasters.empty() )
+		getSinkModelMatrix( g_sceneCasters.back().model );
+}
+
+//-----------------------------------------------------------------------------
+// Name: lightSpaceRect()
+// Desc: Rectangle (min s, min t, max s, max t) of the [0, 1] shadow map that
+//       a bounding sphere can cover, from the corners of the cube around
+//       it, so it also holds for a warped projection. Returns false when
+//       the cube reaches behind the light and could cover anything.
+//-----------------------------------------------------------------------------
+bool lightSpaceRect( const float light[16], const float bounds[4], float rect[4] )
+{
+	rect[0] = rect[1] =  1.0f;
+	rect[2] = rect[3] = -1.0f;
+
+	for( int i = 0; i < 8; ++i )
+	{
+		float corner[3] = { bounds[0] + ((i & 1) ? bounds[3] : -bounds[3]),
+							bounds[1] + ((i & 2) ? bounds[3] : -bounds[3]),
+							bounds[2] + ((i & 4) ? bounds[3] : -bounds[3]) };
+		float clip[4];
+
+		matrixTransformPoint( clip, light, corner );
+
+		if( clip[3] <= 1e-6f )
+			return false;
+
+		rect[0] = min( rect[0], clip[0] / clip[3] );
+		rect[1] = min( rect[1], clip[1] / clip[3] );
+		rect[2] = max( rect[2], clip[0] / clip[3] );
+		rect[3] = max( rect[3], clip[1] / clip[3] );
+	}
+
+	for( int k = 0; k < 4; ++k )
+		rect[k] = rect[k] * 0.5f + 0.5f;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildCameraMatrix()
+// Desc: World -> clip matrix of the perspective viewport (the upper right
+//       one), as set up in render(), and its projection part.
+//-----------------------------------------------------------------------------
+void buildCameraMatrix( float m[16], float projection[16] )
+{
+	matrixPerspective( projection, fovy, (float)nWidth / (float)nHeight, -nearZ, -farZ );
+	buildCameraView( m );
+	matrixMultiply( m, projection, m );
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildCameraView()
+// Desc: World -> eye matrix of the perspective viewport
+//-----------------------------------------------------------------------------
+void buildCameraView( float m[16] )
+{
+	float r[16];
+
+	matrixTranslate( m, 0.0f, -2.0f, -z );
+	matrixRotate( r, -g_fSpinY_L, 1.0f, 0.0f, 0.0f );
+	matrixMultiply( m, m, r );
+	matrixRotate( r, -g_fSpinX_L, 0.0f, 1.0f, 0.0f );
+	matrixMultiply( m, m, r );
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildCameraInverseView()
+// Desc: Eye -> world, the inverse of buildCameraView()
+//-----------------------------------------------------------------------------
+void buildCameraInverseView( float m[16] )
+{
+	float r[16];
+
+	matrixRotate( m, g_fSpinX_L, 0.0f, 1.0f, 0.0f );
+	matrixRotate( r, g_fSpinY_L, 1.0f, 0.0f, 0.0f );
+	matrixMultiply( m, m, r );
+	matrixTranslate( r, 0.0f, 2.0f, z );
+	matrixMultiply( m, m, r );
+}
+
+//-----------------------------------------------------------------------------
+// Name: initAdaptiveShadowMap()
+// Desc: Creates the whole pool of depth targets for adaptive resolution, so
+//       changing sizes later never allocates. Does nothing if they exist.
+//-----------------------------------------------------------------------------
+bool initAdaptiveShadowMap( void )
+{
+	if( g_adaptiveShadowMap.levelCount != 0 )
+		return true;
+
+	if( !g_bFramebufferObject )
+		return false;
+
+	GLint maxTextureSize;
+	GLint maxViewport[2];
+
+	glGetIntegerv( GL_MAX_TEXTURE_SIZE, &maxTextureSize );
+	glGetIntegerv( GL_MAX_VIEWPORT_DIMS, maxViewport );
+
+	for( int i = 0; i < ADAPTIVE_LEVELS; ++i )
+	{
+		int size = ADAPTIVE_MIN_SIZE << i;
+
+		if( size > maxTextureSize || size > maxViewport[0] || size > maxViewport[1] )
+			break;
+
+		GLuint texture;
+		GLuint fbo;
+
+		glGenTextures( 1, &texture );
+		glBindTexture( GL_TEXTURE_2D, texture );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
+		glTexImage2D( GL_TEXTURE_2D, 0, g_depthFormats[g_depthFormat].internalFormat, size, size, 0,
+					  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL );
+
+		glGenFramebuffersEXT( 1, &fbo );
+		glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, fbo );
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, texture, 0 );
+		glDrawBuffer( GL_NONE );
+		glReadBuffer( GL_NONE );
+
+		GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+		glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+
+		g_adaptiveShadowMap.fbo[i]     = fbo;
+		g_adaptiveShadowMap.texture[i] = texture;
+
+		// Out of memory at this size: keep the smaller ones.
+		if( status != GL_FRAMEBUFFER_COMPLETE_EXT )
+		{
+			glDeleteFramebuffersEXT( 1, &g_adaptiveShadowMap.fbo[i] );
+			glDeleteTextures( 1, &g_adaptiveShadowMap.texture[i] );
+			g_adaptiveShadowMap.fbo[i] = g_adaptiveShadowMap.texture[i] = 0;
+			break;
+		}
+
+		g_adaptiveShadowMap.levelCount = i + 1;
+	}
+
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	if( g_adaptiveShadowMap.levelCount == 0 )
+	{
+		MessageBox(NULL, "Could not create the adaptive shadow map targets!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		return false;
+	}
+
+	// Start at the size closest to the fixed p-buffer.
+	g_adaptiveShadowMap.level = 0;
+	while( g_adaptiveShadowMap.level + 1 < g_adaptiveShadowMap.levelCount &&
+		   (ADAPTIVE_MIN_SIZE << g_adaptiveShadowMap.level) < PBUFFER_WIDTH )
+		++g_adaptiveShadowMap.level;
+
+	g_adaptiveShadowMap.pendingLevel  = g_adaptiveShadowMap.level;
+	g_adaptiveShadowMap.pendingFrames = 0;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeAdaptiveShadowMap()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeAdaptiveShadowMap( void )
+{
+	for( int i = 0; i < g_adaptiveShadowMap.levelCount; ++i )
+	{
+		glDeleteFramebuffersEXT( 1, &g_adaptiveShadowMap.fbo[i] );
+		glDeleteTextures( 1, &g_adaptiveShadowMap.texture[i] );
+	}
+
+	memset( &g_adaptiveShadowMap, 0, sizeof(g_adaptiveShadowMap) );
+	g_bAdaptiveResolution = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: measureReceiverFootprint()
+// Desc: Shadow map size that gives the receivers about one texel per pixel
+//       in the perspective viewport.
+//
+//       The receivers seen by both the camera and the light are projected as
+//       spheres into both views. If they cover A pixels on screen and a
+//       fraction f of the light's image, a map of size n spreads n * n * f
+//       texels over them, so n = sqrt(A / f).
+//-----------------------------------------------------------------------------
+float measureReceiverFootprint( void )
+{
+	float cameraProjection[16];
+	float camera[16];
+	float lightProjection[16];
+	float light[16];
+	float cameraPlanes[6][4];
+	float lightPlanes[6][4];
+
+	buildCameraMatrix( camera, cameraProjection );
+	matrixPerspective( lightProjection, LIGHT_FOVY, LIGHT_ASPECT, LIGHT_NEAR, LIGHT_FAR );
+	matrixMultiply( light, lightProjection, g_lightsLookAtMatrix );
+	matrixFrustumPlanes( cameraPlanes, camera );
+	matrixFrustumPlanes( lightPlanes, light );
+
+	collectSceneBounds();
+
+	// Union of the projected spheres in normalized device coordinates:
+	// min x, min y, max x, max y
+	float screen[4] = { 1.0f, 1.0f, -1.0f, -1.0f };
+	float shadow[4] = { 1.0f, 1.0f, -1.0f, -1.0f };
+
+	const float* matrices[2]    = { camera, light };
+	const float* projections[2] = { cameraProjection, lightProjection };
+	float*       rects[2]       = { screen, shadow };
+
+	for( size_t o = 0; o < g_sceneBounds.size(); ++o )
+	{
+		const float* bounds = g_sceneBounds[o].sphere;
+
+		if( !sphereInFrustum( cameraPlanes, bounds, bounds[3] ) ||
+			!sphereInFrustum( lightPlanes, bounds, bounds[3] ) )
+			continue;
+
+		for( int v = 0; v < 2; ++v )
+		{
+			float  clip[4];
+			float* rect = rects[v];
+
+			matrixTransformPoint( clip, matrices[v], bounds );
+
+			// Reaches behind the eye: covers everything.
+			if( clip[3] <= bounds[3] )
+			{
+				rect[0] = rect[1] = -1.0f;
+				rect[2] = rect[3] =  1.0f;
+				continue;
+			}
+
+			float x  = clip[0] / clip[3];
+			float y  = clip[1] / clip[3];
+			float rx = bounds[3] * projections[v][0] / clip[3];
+			float ry = bounds[3] * projections[v][5] / clip[3];
+
+			rect[0] = min( rect[0], x - rx );
+			rect[1] = min( rect[1], y - ry );
+			rect[2] = max( rect[2], x + rx );
+			rect[3] = max( rect[3], y + ry );
+		}
+	}
+
+	for( int v = 0; v < 2; ++v )
+	{
+		float* rect = rects[v];
+
+		rect[0] = max( rect[0], -1.0f );
+		rect[1] = max( rect[1], -1.0f );
+		rect[2] = min( rect[2],  1.0f );
+		rect[3] = min( rect[3],  1.0f );
+	}
+
+	if( screen[2] <= screen[0] || screen[3] <= screen[1] ||
+		shadow[2] <= shadow[0] || shadow[3] <= shadow[1] )
+		return 0.0f;
+
+	float pixels   = (screen[2] - screen[0]) * 0.5f * nWidth * (screen[3] - screen[1]) * 0.5f * nHeight;
+	float fraction = (shadow[2] - shadow[0]) * 0.5f * (shadow[3] - shadow[1]) * 0.5f;
+
+	return (float)sqrt( pixels / fraction );
+}
+
+//-----------------------------------------------------------------------------
+// Name: chooseAdaptiveLevel()
+// Desc: Picks the pool target for this frame.
+//
+//       The receivers' footprint gives the ideal level; it only counts as a
+//       change once it leaves a dead band around the current level. Over the
+//       frame-time budget the map has to shrink, close to it the map may not
+//       grow. A change is made one level at a time, and only after the same
+//       level has been asked for ADAPTIVE_HYSTERESIS_FRAMES frames in a row.
+//-----------------------------------------------------------------------------
+void chooseAdaptiveLevel( void )
+{
+	ADAPTIVESHADOWMAP& map = g_adaptiveShadowMap;
+
+	map.wantedSize = measureReceiverFootprint();
+
+	int target = map.level;
+
+	if( map.wantedSize > 0.0f )
+	{
+		float ideal = (float)(log( map.wantedSize / ADAPTIVE_MIN_SIZE ) / log( 2.0 ));
+
+		if( ideal > map.level + ADAPTIVE_DEAD_BAND || ideal < map.level - ADAPTIVE_DEAD_BAND )
+			target = (int)floor( ideal + 0.5f );
+	}
+
+	if( g_frameMs > g_frameBudgetMs )
+		target = min( target, map.level - 1 );
+	else if( g_frameMs > 0.75f * g_frameBudgetMs )
+		target = min( target, map.level );
+
+	target = max( 0, min( target, map.levelCount - 1 ) );
+
+	if( target == map.level )
+	{
+		map.pendingFrames = 0;
+		return;
+	}
+
+	if( target != map.pendingLevel )
+	{
+		map.pendingLevel  = target;
+		map.pendingFrames = 0;
+	}
+
+	if( ++map.pendingFrames >= ADAPTIVE_HYSTERESIS_FRAMES )
+	{
+		map.level += target > map.level ? 1 : -1;
+		map.pendingFrames = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: createAdaptiveDepthTexture()
+// Desc: createDepthTexture() into the pool target chosen for this frame
+//       instead of the p-buffer. Same light frustum and polygon offset, so
+//       the texture matrix doesn't change with the size.
+//-----------------------------------------------------------------------------
+void createAdaptiveDepthTexture( void )
+{
+	int size = ADAPTIVE_MIN_SIZE << g_adaptiveShadowMap.level;
+
+	renderDepthTarget( g_adaptiveShadowMap.fbo[g_adaptiveShadowMap.level], size, size );
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderDepthTarget()
+// Desc: The light's depth pass into an FBO with only a depth attachment,
+//       with the current depth format's polygon offset.
+//-----------------------------------------------------------------------------
+void renderDepthTarget( GLuint fbo, int width, int height )
+{
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_POLYGON_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, fbo );
+	glViewport( 0, 0, width, height );
+	glClear( GL_DEPTH_BUFFER_BIT );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	glPolygonOffset( g_depthFormats[g_depthFormat].offsetFactor, g_depthFormats[g_depthFormat].offsetUnits );
+	stateEnable( g_glState, GL_POLYGON_OFFSET_FILL );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadMatrixf( g_lightProjectionMatrix );
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadMatrixf( g_lightsLookAtMatrix );
+
+	renderScene();
+
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: initIncrementalShadowMap()
+// Desc: Creates the static layer and the sampled map of the incremental
+//       depth pass, both PBUFFER_WIDTH square like the p-buffer. Does
+//       nothing if they exist.
+//-----------------------------------------------------------------------------
+bool initIncrementalShadowMap( void )
+{
+	INCREMENTALSHADOWMAP& map = g_incrementalShadowMap;
+
+	if( map.nSize != 0 )
+		return true;
+
+	if( !g_bFramebufferObject )
+		return false;
+
+	bool complete = true;
+
+	glGenTextures( 2, map.texture );
+	glGenFramebuffersEXT( 2, map.fbo );
+
+	for( int i = 0; i < 2; ++i )
+	{
+		glBindTexture( GL_TEXTURE_2D, map.texture[i] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_SGIX, GL_TRUE );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_OPERATOR_SGIX, GL_TEXTURE_LEQUAL_R_SGIX );
+		glTexImage2D( GL_TEXTURE_2D, 0, g_depthFormats[g_depthFormat].internalFormat, PBUFFER_WIDTH, PBUFFER_HEIGHT, 0,
+					  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL );
+
+		glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.fbo[i] );
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, map.texture[i], 0 );
+		glDrawBuffer( GL_NONE );
+		glReadBuffer( GL_NONE );
+
+		if( glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT ) != GL_FRAMEBUFFER_COMPLETE_EXT )
+			complete = false;
+	}
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	if( !complete )
+	{
+		glDeleteFramebuffersEXT( 2, map.fbo );
+		glDeleteTextures( 2, map.texture );
+		freeIncrementalShadowMap();
+
+		MessageBox(NULL, "Could not create the incremental shadow map targets!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		return false;
+	}
+
+	map.nSize       = PBUFFER_WIDTH;
+	map.staticValid = false;
+	map.casters.clear();
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeIncrementalShadowMap()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeIncrementalShadowMap( void )
+{
+	INCREMENTALSHADOWMAP& map = g_incrementalShadowMap;
+
+	if( map.nSize != 0 )
+	{
+		glDeleteFramebuffersEXT( 2, map.fbo );
+		glDeleteTextures( 2, map.texture );
+	}
+
+	memset( map.fbo, 0, sizeof(map.fbo) );
+	memset( map.texture, 0, sizeof(map.texture) );
+	memset( map.lightMatrix, 0, sizeof(map.lightMatrix) );
+	memset( map.dirty, 0, sizeof(map.dirty) );
+	map.nSize              = 0;
+	map.staticValid        = false;
+	map.objectIndex        = 0;
+	map.dynamicPass        = false;
+	map.staticRebuilds     = 0;
+	map.instanceGeneration = 0;
+	map.casters.clear();
+
+	g_bIncrementalShadow = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name: createIncrementalDepthTexture()
+// Desc: createDepthTexture() for the incremental mode. Compares every
+//       caster's bounds and model matrix with last frame's to sort it into
+//       the static or the dynamic layer, then brings texture[1] up to date
+//       with as little drawing as that allows.
+//
+//       The light matrix includes the TSM warp, which follows the camera, so
+//       with 'W' on every camera move costs a full rebuild.
+//-----------------------------------------------------------------------------
+void createIncrementalDepthTexture( void )
+{
+	INCREMENTALSHADOWMAP& map = g_incrementalShadowMap;
+
+	collectSceneCasters();
+
+	const float* light = g_lightViewProjection;
+
+	if( memcmp( light, map.lightMatrix, sizeof(map.lightMatrix) ) != 0 )
+		map.staticValid = false;
+
+	int      casterCount   = (int)g_sceneCasters.size();
+	int      previousCount = (int)map.casters.size();
+	unsigned generation    = sceneInstanceGeneration();
+
+	// Another scene, or instances streamed in or replaced, which shifts the
+	// casters' indices: nothing is known to be dynamic any more.
+	if( casterCount != previousCount || generation != map.instanceGeneration )
+	{
+		for( int i = 0; i < previousCount; ++i )
+		{
+			map.casters[i].dynamic     = false;
+			map.casters[i].stillFrames = 0;
+		}
+
+		INCREMENTALCASTER added;
+		memset( &added, 0, sizeof(added) );
+
+		map.casters.resize( casterCount, added );
+		map.staticValid        = false;
+		map.instanceGeneration = generation;
+	}
+
+	int dirty[4] = { map.nSize, map.nSize, 0, 0 };
+
+	for( int i = 0; i < casterCount; ++i )
+	{
+		INCREMENTALCASTER& entry = map.casters[i];
+
+		float s[4];
+		int   rect[4] = { 0, 0, map.nSize, map.nSize };
+
+		if( lightSpaceRect( light, g_sceneCasters[i].bounds, s ) )
+		{
+			// Texels touched by the rectangle, with one more for the filtering.
+			rect[0] = max( (int)floor( s[0] * map.nSize ) - 1, 0 );
+			rect[1] = max( (int)floor( s[1] * map.nSize ) - 1, 0 );
+			rect[2] = min( (int)ceil( s[2] * map.nSize ) + 1, map.nSize );
+			rect[3] = min( (int)ceil( s[3] * map.nSize ) + 1, map.nSize );
+		}
+
+		bool moved = i >= previousCount ||
+					 memcmp( &entry.caster, &g_sceneCasters[i], sizeof(entry.caster) ) != 0;
+
+		if( moved && map.staticValid )
+		{
+			if( !entry.dynamic )
+				map.staticValid = false;
+
+			// Where it was and where it is now
+			for( int k = 0; k < 2; ++k )
+			{
+				const int* r = k == 0 ? entry.rect : rect;
+
+				dirty[0] = min( dirty[0], r[0] );
+				dirty[1] = min( dirty[1], r[1] );
+				dirty[2] = max( dirty[2], r[2] );
+				dirty[3] = max( dirty[3], r[3] );
+			}
+		}
+
+		if( moved && i < previousCount )
+		{
+			entry.dynamic     = true;
+			entry.stillFrames = 0;
+		}
+		else if( entry.dynamic && ++entry.stillFrames >= INCREMENTAL_SETTLE_FRAMES )
+		{
+			entry.dynamic   = false;
+			map.staticValid = false;
+		}
+
+		entry.caster = g_sceneCasters[i];
+		memcpy( entry.rect, rect, sizeof(rect) );
+	}
+
+	memcpy( map.lightMatrix, light, sizeof(map.lightMatrix) );
+
+	// A rebuild redraws the static layer and then all of the sampled map.
+	if( !map.staticValid )
+	{
+		dirty[0] = dirty[1] = 0;
+		dirty[2] = dirty[3] = map.nSize;
+
+		renderIncrementalLayer( 0, dirty );
+
+		map.staticValid = true;
+		++map.staticRebuilds;
+	}
+
+	memcpy( map.dirty, dirty, sizeof(dirty) );
+
+	if( dirty[2] <= dirty[0] || dirty[3] <= dirty[1] )
+		return;
+
+	// Static depth under the dirty rectangle, then the dynamic casters on top
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.fbo[0] );
+	glBindTexture( GL_TEXTURE_2D, map.texture[1] );
+	glCopyTexSubImage2D( GL_TEXTURE_2D, 0, dirty[0], dirty[1], dirty[0], dirty[1],
+						 dirty[2] - dirty[0], dirty[3] - dirty[1] );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+
+	renderIncrementalLayer( 1, dirty );
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderIncrementalLayer()
+// Desc: Draws the static casters (layer 0, cleared first) or the dynamic
+//       ones (layer 1, on top of what is there) of the incremental map,
+//       scissored to rect: x0, y0, x1, y1 in texels.
+//-----------------------------------------------------------------------------
+void renderIncrementalLayer( int layer, const int rect[4] )
+{
+	INCREMENTALSHADOWMAP& map = g_incrementalShadowMap;
+
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_SCISSOR_BIT | GL_POLYGON_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.fbo[layer] );
+	glViewport( 0, 0, map.nSize, map.nSize );
+	glScissor( rect[0], rect[1], rect[2] - rect[0], rect[3] - rect[1] );
+	stateEnable( g_glState, GL_SCISSOR_TEST );
+
+	if( layer == 0 )
+		glClear( GL_DEPTH_BUFFER_BIT );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	glPolygonOffset( g_depthFormats[g_depthFormat].offsetFactor, g_depthFormats[g_depthFormat].offsetUnits );
+	stateEnable( g_glState, GL_POLYGON_OFFSET_FILL );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadMatrixf( map.lightMatrix );
+
+	map.objectIndex = 0;
+	map.dynamicPass = layer == 1;
+	g_pfnObjectFilter = incrementalCasterFilter;
+	renderScene();
+	g_pfnObjectFilter = NULL;
+
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: incrementalCasterFilter()
+// Desc: g_pfnObjectFilter of renderIncrementalLayer(). renderScene() visits
+//       the objects in the order collectSceneCasters() saw them, so the
+//       visit count is the caster's index.
+//-----------------------------------------------------------------------------
+bool incrementalCasterFilter( const float center[3], float radius )
+{
+	INCREMENTALSHADOWMAP& map = g_incrementalShadowMap;
+
+	int index = map.objectIndex++;
+
+	// Past the end of the table: draw rather than lose a shadow.
+	if( index >= (int)map.casters.size() )
+		return true;
+
+	const INCREMENTALCASTER& entry = map.casters[index];
+
+	if( !map.dynamicPass )
+		return !entry.dynamic;
+
+	const int* r = entry.rect;
+
+	return entry.dynamic && r[0] < map.dirty[2] && r[2] > map.dirty[0] &&
+		   r[1] < map.dirty[3] && r[3] > map.dirty[1];
+}
+
+//-----------------------------------------------------------------------------
+// Name: setDepthFormat()
+// Desc: Switches the depth format of the shadow targets. The p-buffer, the
+//       adaptive pool, the incremental layers and the CPU rasterizer's
+//       texture are recreated with it. Returns false and keeps the current format if the driver can't
+//       render it.
+//-----------------------------------------------------------------------------
+bool setDepthFormat( int format )
+{
+	if( format == DEPTH_FORMAT_32F && (!g_bDepthBufferFloat || !g_bFramebufferObject) )
+		return false;
+
+	int previous = g_depthFormat;
+	g_depthFormat = format;
+
+	// Only a different number of bits needs a new p-buffer.
+	if( g_depthFormats[format].pbufferBits != g_depthFormats[previous].pbufferBits )
+	{
+		freePbuffer();
+		initPbuffer();
+	}
+
+	if( g_adaptiveShadowMap.levelCount != 0 )
+	{
+		bool adaptive = g_bAdaptiveResolution;
+
+		freeAdaptiveShadowMap();
+		g_bAdaptiveResolution = adaptive && initAdaptiveShadowMap();
+	}
+
+	if( g_incrementalShadowMap.nSize != 0 )
+	{
+		bool incremental = g_bIncrementalShadow;
+
+		freeIncrementalShadowMap();
+		g_bIncrementalShadow = incremental && initIncrementalShadowMap();
+	}
+
+	if( g_softwareDepthTexture != 0 )
+	{
+		freeSoftwareShadowMap();
+		initSoftwareShadowMap();
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: nextDepthFormat()
+// Desc: '0' - Steps to the next depth format the driver supports
+//-----------------------------------------------------------------------------
+void nextDepthFormat( void )
+{
+	for( int i = 1; i < DEPTH_FORMAT_COUNT; ++i )
+	{
+		if( setDepthFormat( (g_depthFormat + i) % DEPTH_FORMAT_COUNT ) )
+			return;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: buildLightProjection()
+// Desc: The light's projection: LIGHT_FOVY etc., followed by this frame's
+//       trapezoidal warp when there is one.
+//-----------------------------------------------------------------------------
+void buildLightProjection( float m[16] )
+{
+	matrixPerspective( m, LIGHT_FOVY, LIGHT_ASPECT, LIGHT_NEAR, LIGHT_FAR );
+
+	if( g_bShadowWarpActive )
+		matrixMultiply( m, g_shadowWarp, m );
+}
+
+//-----------------------------------------------------------------------------
+// Name: computeFrustumCorners()
+// Desc: point[0..3] and point[4..7]: the near and far corners of the
+//       perspective viewport's frustum in eye space, as drawn with F6.
+//-----------------------------------------------------------------------------
+void computeFrustumCorners( void )
+{
+	for (int i=0;i<4;++i)
+	{
+		point[i][0] = rescale*nearZ*tan(fovy/180*PI/2)*((i==0||i==3)?-1:1);
+		point[i][1] = rescale*nearZ*tan(fovy/180*PI/2)*(i&2?1:-1)*(GLdouble)nHeight/(GLdouble)nWidth;
+		point[i][2] =  nearZ;
+
+		point[i+4][0] = (adjust?0.95:1)*rescale*farZ*tan(fovy/180*PI/2)*((i==0||i==3)?-1:1);
+		point[i+4][1] = (adjust?0.95:1)*rescale*farZ*tan(fovy/180*PI/2)*(i&2?1:-1)*(GLdouble)nHeight/(GLdouble)nWidth;
+		point[i+4][2] =  farZ;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: updateShadowWarp()
+// Desc: Fits this frame's trapezoid. The frustum in point[8] reaches 100
+//       units deep, far past the scene, so its edges are first cut down to
+//       the depth range the scene's bounding spheres occupy; otherwise the
+//       empty far part would take most of the map.
+//-----------------------------------------------------------------------------
+void updateShadowWarp( void )
+{
+	g_bShadowWarpActive = false;
+
+	if( !g_bShadowWarp || g_shadowMode == SHADOW_CUBE || g_shadowMode == SHADOW_ATLAS ||
+		g_shadowMode == SHADOW_VIRTUAL || g_shadowMode == SHADOW_RAYTRACE )
+		return;
+
+	float view[16];
+	buildCameraView( view );
+
+	// Eye-space depth range of the scene, positive into the screen
+	float nearDepth = -farZ;
+	float farDepth  = -nearZ;
+
+	collectSceneBounds();
+
+	for( size_t o = 0; o < g_sceneBounds.size(); ++o )
+	{
+		const float* bounds = g_sceneBounds[o].sphere;
+
+		float eye[4];
+		matrixTransformPoint( eye, view, bounds );
+
+		nearDepth = min( nearDepth, -eye[2] - bounds[3] );
+		farDepth  = max( farDepth,  -eye[2] + bounds[3] );
+	}
+
+	nearDepth = max( nearDepth, -nearZ );
+	farDepth  = min( farDepth,  -farZ );
+
+	if( farDepth <= nearDepth )
+		return;
+
+	float inverse[16];
+	buildCameraInverseView( inverse );
+
+	float corners[8][3];
+
+	for( int i = 0; i < 8; ++i )
+	{
+		float depth = i < 4 ? nearDepth : farDepth;
+		float t     = (depth + nearZ) / (nearZ - farZ);
+		float eye[3];
+		float world[4];
+
+		for( int k = 0; k < 3; ++k )
+			eye[k] = point[i % 4][k] + t * (point[i % 4 + 4][k] - point[i % 4][k]);
+
+		matrixTransformPoint( world, inverse, eye );
+
+		for( int k = 0; k < 3; ++k )
+			corners[i][k] = world[k];
+	}
+
+	float focusEye[3] = { 0.0f, 0.0f, -(nearDepth + SHADOW_WARP_FOCUS * (farDepth - nearDepth)) };
+	float focus[4];
+	matrixTransformPoint( focus, inverse, focusEye );
+
+	float light[16];
+	matrixPerspective( light, LIGHT_FOVY, LIGHT_ASPECT, LIGHT_NEAR, LIGHT_FAR );
+	matrixMultiply( light, light, g_lightsLookAtMatrix );
+
+	g_bShadowWarpActive = trapezoidWarp( g_shadowWarp, light, corners, focus );
+}
+
+//-----------------------------------------------------------------------------
+// Virtual shadow map
+//-----------------------------------------------------------------------------
+
+// Picks the level the same way findVisiblePages() does, from how many level
+// 0 texels one pixel spans, and walks up the packed page table until it
+// finds a resident page. The coarsest level's single page is always there.
+// PAGE_SIZE, PAGES_PER_SIDE, POOL_PAGES and LEVEL_COUNT come from the header.
+static const char* g_virtualLookupFS =
+	"uniform sampler2DShadow u_pagePool;\n"
+	"uniform sampler2D u_pageTable;\n"
+	"uniform vec2 u_pageClamp;\n"
+	"float visibility(vec4 coord)\n"
+	"{\n"
+	"	vec3 p = coord.xyz / coord.q;\n"
+	"	vec2 texel = p.xy * (PAGES_PER_SIDE * PAGE_SIZE);\n"
+	"	float footprint = max(length(dFdx(texel)), length(dFdy(texel)));\n"
+	"	if (coord.q <= 0.0 || p.x < 0.0 || p.x > 1.0 || p.y < 0.0 || p.y > 1.0 || p.z >= 1.0)\n"
+	"		return 1.0;\n"
+	"	float level = min(floor(log2(max(footprint, 1.0))), float(LEVEL_COUNT - 1));\n"
+	"	for (int i = 0; i < LEVEL_COUNT; ++i)\n"
+	"	{\n"
+	"		float side = PAGES_PER_SIDE / exp2(level);\n"
+	"		vec2 page = min(floor(p.xy * side), side - 1.0);\n"
+	"		vec2 origin = level == 0.0 ? vec2(0.0) : vec2(PAGES_PER_SIDE, PAGES_PER_SIDE - 2.0 * side);\n"
+	"		vec4 entry = texture2D(u_pageTable, (origin + page + 0.5) / vec2(2.0 * PAGES_PER_SIDE, PAGES_PER_SIDE));\n"
+	"		if (entry.b > 0.5)\n"
+	"		{\n"
+	"			vec2 uv = floor(entry.rg * 255.0 + 0.5) + clamp(p.xy * side - page, u_pageClamp.x, u_pageClamp.y);\n"
+	"			return shadow2D(u_pagePool, vec3(uv / POOL_PAGES, p.z)).r;\n"
+	"		}\n"
+	"		level = min(level + 1.0, float(LEVEL_COUNT - 1));\n"
+	"	}\n"
+	"	return 1.0;\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 color = gl_Color * visibility(gl_TexCoord[0]);\n"
+	"	color.rgb = applyFog(color.rgb);\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+// Name: initVirtualShadowMap()
+// Desc: Creates the page pool, the page table texture, the prepass target
+//       and the lookup shader. Does nothing if they already exist.
+//-----------------------------------------------------------------------------
+bool initVirtualShadowMap( void )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	if( map.poolFbo != 0 )
+		return true;
+
+	glGenTextures( 1, &map.poolTexture );
+	glBindTexture( GL_TEXTURE_2D, map.poolTexture );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_COMPARE_R_TO_TEXTURE_ARB );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC_ARB, GL_LEQUAL );
+	glTexParameteri( GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE_ARB, GL_LUMINANCE );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, VIRTUAL_POOL_SIZE, VIRTUAL_POOL_SIZE, 0,
+				  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL );
+
+	// One texel per virtual page, looked up with exact texel centres.
+	glGenTextures( 1, &map.tableTexture );
+	glBindTexture( GL_TEXTURE_2D, map.tableTexture );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, 2 * VIRTUAL_PAGES_PER_SIDE, VIRTUAL_PAGES_PER_SIDE, 0,
+				  GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+
+	glGenFramebuffersEXT( 1, &map.poolFbo );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.poolFbo );
+	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, map.poolTexture, 0 );
+	glDrawBuffer( GL_NONE );
+	glReadBuffer( GL_NONE );
+
+	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+
+	// The prepass renderbuffer is sized to the viewport later, see findVisiblePages().
+	map.prepassWidth  = 1;
+	map.prepassHeight = 1;
+
+	glGenRenderbuffersEXT( 1, &map.prepassDepth );
+	glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, map.prepassDepth );
+	glRenderbufferStorageEXT( GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, map.prepassWidth, map.prepassHeight );
+	glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, 0 );
+
+	glGenFramebuffersEXT( 1, &map.prepassFbo );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.prepassFbo );
+	glFramebufferRenderbufferEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, map.prepassDepth );
+	glDrawBuffer( GL_NONE );
+	glReadBuffer( GL_NONE );
+
+	if( status == GL_FRAMEBUFFER_COMPLETE_EXT )
+		status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+
+	if( status != GL_FRAMEBUFFER_COMPLETE_EXT )
+	{
+		MessageBox(NULL, "Could not create the virtual shadow map!",
+				   "ERROR", MB_OK | MB_ICONEXCLAMATION);
+		freeVirtualShadowMap();
+		return false;
+	}
+
+	char header[256];
+	sprintf( header, "#define PAGE_SIZE %d.0\n#define PAGES_PER_SIDE %d.0\n#define POOL_PAGES %d.0\n#define LEVEL_COUNT %d\n",
+			 VIRTUAL_PAGE_SIZE, VIRTUAL_PAGES_PER_SIDE, VIRTUAL_POOL_SIZE / VIRTUAL_PAGE_SIZE,
+			 (int)(log( (double)VIRTUAL_PAGES_PER_SIDE ) / log( 2.0 ) + 1.5) );
+
+	map.lookupProgram = compileProgram( header, NULL, g_virtualLookupFS );
+
+	if( !map.lookupProgram )
+	{
+		freeVirtualShadowMap();
+		return false;
+	}
+
+	pageCacheInit( g_pageCache, VIRTUAL_PAGES_PER_SIDE, VIRTUAL_POOL_SIZE / VIRTUAL_PAGE_SIZE );
+	g_pageTable.resize( 2 * VIRTUAL_PAGES_PER_SIDE * VIRTUAL_PAGES_PER_SIDE * 4 );
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name: freeVirtualShadowMap()
+// Desc:
+//-----------------------------------------------------------------------------
+void freeVirtualShadowMap( void )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	if( map.poolFbo != 0 )
+		glDeleteFramebuffersEXT( 1, &map.poolFbo );
+
+	if( map.prepassFbo != 0 )
+		glDeleteFramebuffersEXT( 1, &map.prepassFbo );
+
+	if( map.prepassDepth != 0 )
+		glDeleteRenderbuffersEXT( 1, &map.prepassDepth );
+
+	if( map.poolTexture != 0 )
+		glDeleteTextures( 1, &map.poolTexture );
+
+	if( map.tableTexture != 0 )
+		glDeleteTextures( 1, &map.tableTexture );
+
+	if( map.lookupProgram )
+		glDeleteObjectARB( map.lookupProgram );
+
+	map.poolFbo            = 0;
+	map.poolTexture        = 0;
+	map.tableTexture       = 0;
+	map.prepassFbo         = 0;
+	map.prepassDepth       = 0;
+	map.prepassWidth       = 0;
+	map.prepassHeight      = 0;
+	map.lookupProgram      = 0;
+	map.objectIndex        = 0;
+	map.pagesRendered      = 0;
+	map.castersMoved       = 0;
+	map.instanceGeneration = 0;
+	memset( map.lightView, 0, sizeof(map.lightView) );
+	map.casters.clear();
+	map.casterVisible.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Name: createVirtualShadowMap()
+// Desc: SHADOW_VIRTUAL counterpart of createDepthTexture(). Drops the pages
+//       that went stale, finds the pages the receivers need this frame,
+//       renders the missing ones into the pool and uploads the page table.
+//-----------------------------------------------------------------------------
+void createVirtualShadowMap( void )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	// A moved light changes every page.
+	if( memcmp( map.lightView, g_lightsLookAtMatrix, sizeof(map.lightView) ) != 0 )
+	{
+		pageCacheInvalidateAll( g_pageCache );
+		memcpy( map.lightView, g_lightsLookAtMatrix, sizeof(map.lightView) );
+	}
+
+	invalidateMovedCasters();
+
+	pageCacheBeginFrame( g_pageCache );
+	findVisiblePages();
+
+	// The coarsest level's single page is every lookup's last resort.
+	pageCacheRequest( g_pageCache, g_pageCache.levelCount - 1, 0, 0 );
+
+	static std::vector<int> pages;
+	pages.clear();
+
+	pageCacheUpdate( g_pageCache, VIRTUAL_PAGE_BUDGET, pages );
+	renderVirtualPages( pages );
+	map.pagesRendered = (int)pages.size();
+
+	pageCacheBuildTable( g_pageCache, &g_pageTable[0] );
+
+	glBindTexture( GL_TEXTURE_2D, map.tableTexture );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, 2 * VIRTUAL_PAGES_PER_SIDE, VIRTUAL_PAGES_PER_SIDE,
+					 GL_RGBA, GL_UNSIGNED_BYTE, &g_pageTable[0] );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+}
+
+//-----------------------------------------------------------------------------
+// Name: invalidateMovedCasters()
+// Desc: Compares every object's bounds and model matrix with the ones its
+//       pages were rendered with. Where they differ, the pages under the
+//       object's old and new position in the light's view are invalidated;
+//       the rest of the map is kept.
+//-----------------------------------------------------------------------------
+void invalidateMovedCasters( void )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	collectSceneCasters();
+
+	float light[16];
+	matrixPerspective( light, LIGHT_FOVY, LIGHT_ASPECT, LIGHT_NEAR, LIGHT_FAR );
+	matrixMultiply( light, light, g_lightsLookAtMatrix );
+
+	map.castersMoved = 0;
+
+	// Instances streamed in or replaced: the indices no longer name the same
+	// objects, so the comparison below means nothing. Start over.
+	unsigned generation = sceneInstanceGeneration();
+
+	if( generation != map.instanceGeneration )
+	{
+		pageCacheInvalidateAll( g_pageCache );
+
+		map.castersMoved       = (int)g_sceneCasters.size();
+		map.casters            = g_sceneCasters;
+		map.instanceGeneration = generation;
+		return;
+	}
+
+	size_t count = max( map.casters.size(), g_sceneCasters.size() );
+
+	for( size_t i = 0; i < count; ++i )
+	{
+		bool before = i < map.casters.size();
+		bool now    = i < g_sceneCasters.size();
+
+		if( before && now && memcmp( &map.casters[i], &g_sceneCasters[i], sizeof(SCENECASTER) ) == 0 )
+			continue;
+
+		++map.castersMoved;
+
+		if( before )
+			invalidateCasterBounds( light, map.casters[i].bounds );
+
+		if( now )
+			invalidateCasterBounds( light, g_sceneCasters[i].bounds );
+	}
+
+	map.casters = g_sceneCasters;
+}
+
+//-----------------------------------------------------------------------------
+// Name: invalidateCasterBounds()
+// Desc: Invalidates the pages a bounding sphere covers in the light's view.
+//-----------------------------------------------------------------------------
+void invalidateCasterBounds( const float light[16], const float bounds[4] )
+{
+	float rect[4];
+
+	// Reaches behind the light: could be anywhere.
+	if( !lightSpaceRect( light, bounds, rect ) )
+		pageCacheInvalidateAll( g_pageCache );
+	else
+		pageCacheInvalidateRect( g_pageCache, rect[0], rect[1], rect[2], rect[3] );
+}
+
+//-----------------------------------------------------------------------------
+// Name: findVisiblePages()
+// Desc: The visibility prepass. Renders the perspective viewport's depth at
+//       1 / VIRTUAL_PREPASS_SCALE of its size, reads it back and takes every
+//       sample back to world space and into the light's map.
+//
+//       Neighbouring samples give the number of level 0 texels a screen
+//       pixel spans; its log2 is the level the lookup shader will pick. That
+//       page is requested, along with the one above it that the shader falls
+//       back on, and, to cover the gaps between samples, the pages within
+//       one sample spacing of it.
+//-----------------------------------------------------------------------------
+void findVisiblePages( void )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	if( nWidth <= 0 || nHeight <= 0 )
+		return;
+
+	int width  = max( nWidth / VIRTUAL_PREPASS_SCALE, 1 );
+	int height = max( nHeight / VIRTUAL_PREPASS_SCALE, 1 );
+
+	if( width != map.prepassWidth || height != map.prepassHeight ||
+		(int)g_prepassDepth.size() != width * height )
+	{
+		glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, map.prepassDepth );
+		glRenderbufferStorageEXT( GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, width, height );
+		glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, 0 );
+
+		map.prepassWidth  = width;
+		map.prepassHeight = height;
+		g_prepassDepth.resize( width * height );
+		g_prepassTexels.resize( width * height * 2 );
+	}
+
+	float projection[16];
+	float view[16];
+
+	matrixPerspective( projection, fovy, (float)nWidth / (float)nHeight, -nearZ, -farZ );
+	buildCameraView( view );
+
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.prepassFbo );
+	glViewport( 0, 0, width, height );
+	glClear( GL_DEPTH_BUFFER_BIT );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateDisable( g_glState, GL_POLYGON_OFFSET_FILL );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glLoadMatrixf( projection );
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glLoadMatrixf( view );
+
+	g_bTriangleGeometry = true;
+	renderScene();
+	g_bTriangleGeometry = false;
+
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glReadPixels( 0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, &g_prepassDepth[0] );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+
+	// Window depth -> eye -> world -> level 0 texel of the virtual map
+	float inverse[16];
+	float virtualSize = (float)(VIRTUAL_PAGES_PER_SIDE * VIRTUAL_PAGE_SIZE);
+
+	buildCameraInverseView( inverse );
+
+	for( int y = 0; y < height; ++y )
+	{
+		for( int x = 0; x < width; ++x )
+		{
+			int    i     = y * width + x;
+			float* texel = &g_prepassTexels[2 * i];
+
+			texel[0] = -1.0f;
+
+			// Background
+			if( g_prepassDepth[i] >= 1.0f )
+				continue;
+
+			float ndcX = (x + 0.5f) / width * 2.0f - 1.0f;
+			float ndcY = (y + 0.5f) / height * 2.0f - 1.0f;
+			float ndcZ = g_prepassDepth[i] * 2.0f - 1.0f;
+
+			float eye[3];
+			eye[2] = -projection[14] / (ndcZ + projection[10]);
+			eye[0] = -ndcX * eye[2] / projection[0];
+			eye[1] = -ndcY * eye[2] / projection[5];
+
+			float world[4];
+			float coord[4];
+			matrixTransformPoint( world, inverse, eye );
+			matrixTransformPoint( coord, g_shadowTextureMatrix, world );
+
+			if( coord[3] <= 0.0f )
+				continue;
+
+			float s = coord[0] / coord[3];
+			float t = coord[1] / coord[3];
+
+			if( s < 0.0f || s > 1.0f || t < 0.0f || t > 1.0f )
+				continue;
+
+			texel[0] = s * virtualSize;
+			texel[1] = t * virtualSize;
+		}
+	}
+
+	const int steps[2][2] = { { 1, 0 }, { 0, 1 } };
+
+	for( int y = 0; y < height; ++y )
+	{
+		for( int x = 0; x < width; ++x )
+		{
+			const float* texel = &g_prepassTexels[2 * (y * width + x)];
+
+			if( texel[0] < 0.0f )
+				continue;
+
+			// Per axis the smaller of the two differences, so a silhouette
+			// doesn't make its neighbour look minified.
+			float footprint = 0.0f;
+
+			for( int axis = 0; axis < 2; ++axis )
+			{
+				float best = -1.0f;
+
+				for( int sign = -1; sign <= 1; sign += 2 )
+				{
+					int nx = x + sign * steps[axis][0];
+					int ny = y + sign * steps[axis][1];
+
+					if( nx < 0 || ny < 0 || nx >= width || ny >= height )
+						continue;
+
+					const float* other = &g_prepassTexels[2 * (ny * width + nx)];
+
+					if( other[0] < 0.0f )
+						continue;
+
+					float du = other[0] - texel[0];
+					float dv = other[1] - texel[1];
+					float d  = (float)sqrt( du * du + dv * dv );
+
+					if( best < 0.0f || d < best )
+						best = d;
+				}
+
+				footprint = max( footprint, best );
+			}
+
+			float spacing = footprint;
+			footprint /= VIRTUAL_PREPASS_SCALE;
+
+			int level = footprint > 1.0f ? (int)floor( log( footprint ) / log( 2.0 ) ) : 0;
+			level = min( level, g_pageCache.levelCount - 1 );
+
+			for( int l = level; l <= level + 1 && l < g_pageCache.levelCount; ++l )
+			{
+				float pageTexels = (float)(VIRTUAL_PAGE_SIZE << l);
+
+				int x0 = (int)floor( (texel[0] - spacing) / pageTexels );
+				int x1 = (int)floor( (texel[0] + spacing) / pageTexels );
+				int y0 = (int)floor( (texel[1] - spacing) / pageTexels );
+				int y1 = (int)floor( (texel[1] + spacing) / pageTexels );
+
+				for( int py = y0; py <= y1; ++py )
+				{
+					for( int px = x0; px <= x1; ++px )
+						pageCacheRequest( g_pageCache, l, px, py );
+				}
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Name: renderVirtualPages()
+// Desc: Renders the given pool pages. Each page is the light's frustum
+//       cropped to the page's square of its level, so depth is the same as
+//       in an unpaged map; the casters are culled against that small
+//       frustum first.
+//-----------------------------------------------------------------------------
+void renderVirtualPages( const std::vector<int>& pages )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	if( pages.empty() )
+		return;
+
+	float projection[16];
+	matrixPerspective( projection, LIGHT_FOVY, LIGHT_ASPECT, LIGHT_NEAR, LIGHT_FAR );
+
+	glPushAttrib( GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_SCISSOR_BIT | GL_POLYGON_BIT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, map.poolFbo );
+
+	stateDisable( g_glState, GL_LIGHTING );
+	stateDisable( g_glState, GL_TEXTURE_2D );
+	stateDisable( g_glState, GL_FOG );
+	stateDisable( g_glState, GL_BLEND );
+	stateEnable( g_glState, GL_DEPTH_TEST );
+	stateEnable( g_glState, GL_SCISSOR_TEST );
+
+	glPolygonOffset( 2.0f, 2.0f );
+	stateEnable( g_glState, GL_POLYGON_OFFSET_FILL );
+
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+
+	g_bTriangleGeometry = true;
+	g_pfnObjectFilter   = pageCasterFilter;
+
+	for( size_t i = 0; i < pages.size(); ++i )
+	{
+		const PHYSICALPAGE& page = g_pageCache.pool[pages[i]];
+		int side = g_pageCache.pagesPerSide >> page.level;
+
+		// Scales the page's square of clip space up to [-1, 1].
+		float crop[16];
+		matrixIdentity( crop );
+		crop[0]  = crop[5] = (float)side;
+		crop[12] = (float)(side - 2 * page.x - 1);
+		crop[13] = (float)(side - 2 * page.y - 1);
+
+		float pageProjection[16];
+		float m[16];
+		float planes[6][4];
+
+		matrixMultiply( pageProjection, crop, projection );
+		matrixMultiply( m, pageProjection, g_lightsLookAtMatrix );
+		matrixFrustumPlanes( planes, m );
+
+		map.casterVisible.resize( map.casters.size() );
+
+		for( size_t o = 0; o < map.casters.size(); ++o )
+		{
+			const float* bounds = map.casters[o].bounds;
+			map.casterVisible[o] = sphereInFrustum( planes, bounds, bounds[3] );
+		}
+
+		int x = pages[i] % g_pageCache.poolPagesPerSide * VIRTUAL_PAGE_SIZE;
+		int y = pages[i] / g_pageCache.poolPagesPerSide * VIRTUAL_PAGE_SIZE;
+
+		glViewport( x, y, VIRTUAL_PAGE_SIZE, VIRTUAL_PAGE_SIZE );
+		glScissor( x, y, VIRTUAL_PAGE_SIZE, VIRTUAL_PAGE_SIZE );
+		glClear( GL_DEPTH_BUFFER_BIT );
+
+		glMatrixMode( GL_PROJECTION );
+		glLoadMatrixf( pageProjection );
+		glMatrixMode( GL_MODELVIEW );
+		glLoadMatrixf( g_lightsLookAtMatrix );
+
+		map.objectIndex = 0;
+		renderScene();
+	}
+
+	g_pfnObjectFilter   = NULL;
+	g_bTriangleGeometry = false;
+
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	statePopAttrib( g_glState );
+}
+
+//-----------------------------------------------------------------------------
+// Name: pageCasterFilter()
+// Desc: g_pfnObjectFilter of renderVirtualPages(), answers from the culling
+//       done for the current page like atlasCasterFilter().
+//-----------------------------------------------------------------------------
+bool pageCasterFilter( const float center[3], float radius )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	int index = map.objectIndex++;
+
+	// Past the end of the table: draw rather than lose a shadow.
+	if( index >= (int)map.casterVisible.size() )
+		return true;
+
+	return map.casterVisible[index];
+}
+
+//-----------------------------------------------------------------------------
+// Name: beginVirtualShadowLookup()
+// Desc: Binds the pool to unit 0, the page table to unit 1 and the lookup
+//       shader for the main pass. The texture matrix from render() already
+//       maps into the virtual map's [0, 1] square.
+//-----------------------------------------------------------------------------
+void beginVirtualShadowLookup( void )
+{
+	VIRTUALSHADOWMAP& map = g_virtualShadowMap;
+
+	glActiveTextureARB( GL_TEXTURE1_ARB );
+	glBindTexture( GL_TEXTURE_2D, map.tableTexture );
+	glActiveTextureARB( GL_TEXTURE0_ARB );
+	glBindTexture( GL_TEXTURE_2D, map.poolTexture );
+
+	// Keep bilinear PCF inside the page.
+	float inset = 0.5f / VIRTUAL_PAGE_SIZE;
+
+	GLhandleARB program = map.lookupProgram;
+	glUseProgramObjectARB( program );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_pagePool" ), 0 );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_pageTable" ), 1 );
+	glUniform2fARB( glGetUniformLocationARB( program, "u_pageClamp" ), inset, 1.0f - inset );
+	glUniform1iARB( glGetUniformLocationARB( program, "u_fogMode" ), currentFogMode() );
+}
+
+//-----------------------------------------------------------------------------
+// Name: endVirtualShadowLookup()
+// Desc:
+//-----------------------------------------------------------------------------
+void endVirtualShadowLookup( void )
+{
+	glUseProgramObjectARB( 0 );
+
+	glActiveTextureARB( GL_TEXTURE1_ARB );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+	glActiveTextureARB( GL_TEXTURE0_ARB );
+	glBindTexture( GL_TEXTURE_2D, g_depthTexture );
+}
@@ -0,0 +1,387 @@
+//-----------------------------------------------------------------------------
+//           Name: rasterizer.h
+//    Description: Multithreaded SSE depth-only rasterizer for shadow maps.
+//
+//                 Builds a shadow map on the CPU from the cached meshes in
+//                 mesh.h, for machines where the only OpenGL is a software
+//                 implementation anyway. The result uses the same depth
+//                 convention as the GL depth buffer ([0, 1], 1 = far), so it
+//                 can be uploaded as the depth texture or sampled directly.
+//
+//                 softRasterizerAddMesh() transforms, near-clips and sets up
+//                 the triangles and bins them into 64 x 64 tiles.
+//                 softRasterizerFlush() then hands the tiles to the thread
+//                 pool; every tile is owned by exactly one thread, which
+//                 clears it and walks its bin with SSE edge functions, four
+//                 pixels at a time, so no locking is needed.
+//
+//                 Shared edges are drawn by both triangles. For a depth-only
+//                 min() pass that is harmless and saves the fill rule.
+//
+// The following functions are defined here:
+//
+// void  softRasterizerInit(SOFTRASTERIZER& r, int width, int height, THREADPOOL* pool);
+// void  softRasterizerBegin(SOFTRASTERIZER& r);
+// void  softRasterizerAddMesh(SOFTRASTERIZER& r, const MESH& mesh, const float matrix[16]);
+// void  softRasterizerFlush(SOFTRASTERIZER& r);
+// float softRasterizerDepthAt(const SOFTRASTERIZER& r, float s, float t);
+//-----------------------------------------------------------------------------
+
+#ifndef _RASTERIZER_H_
+#define _RASTERIZER_H_
+
+#include <vector>
+#include <math.h>
+#include <string.h>
+#include <emmintrin.h>
+#include "mesh.h"
+#include "threadpool.h"
+
+const int SOFT_TILE_SIZE = 64;			// Multiple of 4 (one SSE register)
+
+struct SOFTTRIANGLE
+{
+	float originX, originY;				// Vertex 0, the planes below are relative to it
+	float edgeA[3], edgeB[3], edgeC[3];	// Edge functions A * x + B * y + C, >= 0 inside
+	float depthA, depthB, depthC;		// Window depth plane
+	int   minX, minY, maxX, maxY;		// Pixel bounds, inclusive
+};
+
+struct SOFTRASTERIZER
+{
+	int   width;						// Multiple of 4
+	int   height;
+	int   tilesX;
+	int   tilesY;
+	float slopeOffset;					// Same meaning as glPolygonOffset( factor, units )
+	float constantOffset;
+
+	std::vector<float>                      depth;	// width * height, bottom row first like GL
+	std::vector<SOFTTRIANGLE>               triangles;
+	std::vector< std::vector<unsigned int> > bins;	// Triangle indices per tile
+	std::vector<float>                      clip;	// Clip-space positions of the current mesh
+
+	THREADPOOL* pool;
+};
+
+/*
+ * Depth is given the same bias as glPolygonOffset( 2.0f, 2.0f ) on a 24 bit
+ * depth buffer, the setting createDepthTexture() uses.
+ */
+void softRasterizerInit( SOFTRASTERIZER& r, int width, int height, THREADPOOL* pool )
+{
+	r.width          = (width + 3) & ~3;
+	r.height         = height;
+	r.tilesX         = (r.width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+	r.tilesY         = (r.height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+	r.slopeOffset    = 2.0f;
+	r.constantOffset = 2.0f / 16777216.0f;
+	r.pool           = pool;
+
+	r.depth.assign( r.width * r.height, 1.0f );
+	r.bins.resize( r.tilesX * r.tilesY );
+}
+
+void softRasterizerBegin( SOFTRASTERIZER& r )
+{
+	r.triangles.clear();
+
+	for( size_t i = 0; i < r.bins.size(); ++i )
+		r.bins[i].clear();
+}
+
+/*
+ * Window-space triangle setup and binning. v are (x, y, z) in pixels and
+ * [0, 1] depth.
+ */
+static void softRasterizerSetup( SOFTRASTERIZER& r, const float v0[3], const float v1[3], const float v2[3] )
+{
+	const float* v[3] = { v0, v1, v2 };
+
+	float area = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) - (v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+
+	if( area == 0.0f )
+		return;
+
+	// Shadow casters are two-sided, turn clockwise triangles around.
+	if( area < 0.0f )
+	{
+		const float* swap = v[1];
+		v[1] = v[2];
+		v[2] = swap;
+		area = -area;
+	}
+
+	SOFTTRIANGLE tri;
+
+	float minX = v[0][0], maxX = v[0][0], minY = v[0][1], maxY = v[0][1];
+
+	for( int i = 1; i < 3; ++i )
+	{
+		if( v[i][0] < minX ) minX = v[i][0];
+		if( v[i][0] > maxX ) maxX = v[i][0];
+		if( v[i][1] < minY ) minY = v[i][1];
+		if( v[i][1] > maxY ) maxY = v[i][1];
+	}
+
+	// Keep far off-screen vertices out of the int conversion.
+	if( minX < 0.0f ) minX = 0.0f;
+	if( minY < 0.0f ) minY = 0.0f;
+	if( maxX > (float)r.width )  maxX = (float)r.width;
+	if( maxY > (float)r.height ) maxY = (float)r.height;
+
+	// Pixel centres are at + 0.5
+	tri.minX = (int)ceil( minX - 0.5f );
+	tri.minY = (int)ceil( minY - 0.5f );
+	tri.maxX = (int)floor( maxX - 0.5f );
+	tri.maxY = (int)floor( maxY - 0.5f );
+
+	if( tri.minX < 0 ) tri.minX = 0;
+	if( tri.minY < 0 ) tri.minY = 0;
+	if( tri.maxX > r.width - 1 ) tri.maxX = r.width - 1;
+	if( tri.maxY > r.height - 1 ) tri.maxY = r.height - 1;
+
+	if( tri.minX > tri.maxX || tri.minY > tri.maxY )
+		return;
+
+	// Edge i is opposite vertex i, so it is that vertex's barycentric weight.
+	// Everything is relative to vertex 0 rather than the window origin, which
+	// keeps the float error of thin triangles far from the origin small:
+	// edges 1 and 2 pass through vertex 0 and edge 0 is the full area there.
+	tri.originX = v[0][0];
+	tri.originY = v[0][1];
+
+	for( int i = 0; i < 3; ++i )
+	{
+		const float* a = v[(i + 1) % 3];
+		const float* b = v[(i + 2) % 3];
+
+		tri.edgeA[i] = a[1] - b[1];
+		tri.edgeB[i] = b[0] - a[0];
+		tri.edgeC[i] = (i == 0) ? area : 0.0f;
+	}
+
+	tri.depthA = (tri.edgeA[0] * v[0][2] + tri.edgeA[1] * v[1][2] + tri.edgeA[2] * v[2][2]) / area;
+	tri.depthB = (tri.edgeB[0] * v[0][2] + tri.edgeB[1] * v[1][2] + tri.edgeB[2] * v[2][2]) / area;
+	tri.depthC = v[0][2];
+
+	// glPolygonOffset: factor * max slope + units * smallest depth step
+	float slope = fabs( tri.depthA ) > fabs( tri.depthB ) ? fabs( tri.depthA ) : fabs( tri.depthB );
+	tri.depthC += r.slopeOffset * slope + r.constantOffset;
+
+	unsigned int index = (unsigned int)r.triangles.size();
+	r.triangles.push_back( tri );
+
+	for( int ty = tri.minY / SOFT_TILE_SIZE; ty <= tri.maxY / SOFT_TILE_SIZE; ++ty )
+	{
+		for( int tx = tri.minX / SOFT_TILE_SIZE; tx <= tri.maxX / SOFT_TILE_SIZE; ++tx )
+			r.bins[ty * r.tilesX + tx].push_back( index );
+	}
+}
+
+/*
+ * Clips a clip-space triangle against the near plane (z >= -w) and w > 0,
+ * projects it and sets up the resulting fan of triangles. x, y and the far
+ * plane are left to the bounds clamp and the depth test. With a plain
+ * perspective projection the near plane implies w > 0, but a warped one
+ * (see shadowwarp.h) can have w <= 0 in front of the near plane.
+ */
+static void softRasterizerClip( SOFTRASTERIZER& r, const float* c0, const float* c1, const float* c2 )
+{
+	float polygon[5][4];
+	float out[5][4];
+	int   count = 3;
+
+	for( int k = 0; k < 4; ++k )
+	{
+		polygon[0][k] = c0[k];
+		polygon[1][k] = c1[k];
+		polygon[2][k] = c2[k];
+	}
+
+	for( int plane = 0; plane < 2; ++plane )
+	{
+		int n = 0;
+
+		for( int i = 0; i < count; ++i )
+		{
+			const float* a = polygon[i];
+			const float* b = polygon[(i + 1) % count];
+			float da = plane == 0 ? a[2] + a[3] : a[3] - 1e-6f;
+			float db = plane == 0 ? b[2] + b[3] : b[3] - 1e-6f;
+
+			if( da >= 0.0f )
+			{
+				for( int k = 0; k < 4; ++k )
+					out[n][k] = a[k];
+				++n;
+			}
+
+			if( (da >= 0.0f) != (db >= 0.0f) )
+			{
+				float t = da / (da - db);
+
+				for( int k = 0; k < 4; ++k )
+					out[n][k] = a[k] + t * (b[k] - a[k]);
+				++n;
+			}
+		}
+
+		count = n;
+		memcpy( polygon, out, sizeof(out) );
+	}
+
+	if( count < 3 )
+		return;
+
+	float window[5][3];
+
+	for( int i = 0; i < count; ++i )
+	{
+		float w = polygon[i][3];
+
+		window[i][0] = (polygon[i][0] / w * 0.5f + 0.5f) * r.width;
+		window[i][1] = (polygon[i][1] / w * 0.5f + 0.5f) * r.height;
+		window[i][2] =  polygon[i][2] / w * 0.5f + 0.5f;
+	}
+
+	for( int i = 2; i < count; ++i )
+		softRasterizerSetup( r, window[0], window[i - 1], window[i] );
+}
+
+/*
+ * matrix maps the mesh into the light's clip space, i.e. light projection
+ * * light view * model.
+ */
+void softRasterizerAddMesh( SOFTRASTERIZER& r, const MESH& mesh, const float matrix[16] )
+{
+	size_t vertexCount = mesh.positions.size() / 3;
+
+	r.clip.resize( vertexCount * 4 );
+
+	__m128 col0 = _mm_loadu_ps( matrix + 0 );
+	__m128 col1 = _mm_loadu_ps( matrix + 4 );
+	__m128 col2 = _mm_loadu_ps( matrix + 8 );
+	__m128 col3 = _mm_loadu_ps( matrix + 12 );
+
+	for( size_t i = 0; i < vertexCount; ++i )
+	{
+		const float* p = &mesh.positions[i * 3];
+
+		__m128 c = _mm_add_ps( _mm_add_ps( _mm_mul_ps( col0, _mm_set1_ps( p[0] ) ),
+										   _mm_mul_ps( col1, _mm_set1_ps( p[1] ) ) ),
+							   _mm_add_ps( _mm_mul_ps( col2, _mm_set1_ps( p[2] ) ), col3 ) );
+
+		_mm_storeu_ps( &r.clip[i * 4], c );
+	}
+
+	for( size_t i = 0; i + 2 < mesh.indices.size(); i += 3 )
+	{
+		softRasterizerClip( r, &r.clip[mesh.indices[i + 0] * 4],
+							   &r.clip[mesh.indices[i + 1] * 4],
+							   &r.clip[mesh.indices[i + 2] * 4] );
+	}
+}
+
+/*
+ * One tile: clear, then every binned triangle four pixels at a time.
+ */
+static void softRasterizerTile( void* context, int tile )
+{
+	SOFTRASTERIZER& r = *(SOFTRASTERIZER*)context;
+
+	int x0 = (tile % r.tilesX) * SOFT_TILE_SIZE;
+	int y0 = (tile / r.tilesX) * SOFT_TILE_SIZE;
+	int x1 = x0 + SOFT_TILE_SIZE < r.width  ? x0 + SOFT_TILE_SIZE : r.width;
+	int y1 = y0 + SOFT_TILE_SIZE < r.height ? y0 + SOFT_TILE_SIZE : r.height;
+
+	const __m128 one  = _mm_set1_ps( 1.0f );
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 ramp = _mm_set_ps( 3.5f, 2.5f, 1.5f, 0.5f );
+
+	for( int y = y0; y < y1; ++y )
+	{
+		for( int x = x0; x < x1; x += 4 )
+			_mm_storeu_ps( &r.depth[y * r.width + x], one );
+	}
+
+	const std::vector<unsigned int>& bin = r.bins[tile];
+
+	for( size_t b = 0; b < bin.size(); ++b )
+	{
+		const SOFTTRIANGLE& tri = r.triangles[bin[b]];
+
+		int minX = (tri.minX > x0 ? tri.minX : x0) & ~3;
+		int maxX = tri.maxX < x1 - 1 ? tri.maxX : x1 - 1;
+		int minY = tri.minY > y0 ? tri.minY : y0;
+		int maxY = tri.maxY < y1 - 1 ? tri.maxY : y1 - 1;
+
+		__m128 a0 = _mm_set1_ps( tri.edgeA[0] ), b0 = _mm_set1_ps( tri.edgeB[0] ), c0 = _mm_set1_ps( tri.edgeC[0] );
+		__m128 a1 = _mm_set1_ps( tri.edgeA[1] ), b1 = _mm_set1_ps( tri.edgeB[1] ), c1 = _mm_set1_ps( tri.edgeC[1] );
+		__m128 a2 = _mm_set1_ps( tri.edgeA[2] ), b2 = _mm_set1_ps( tri.edgeB[2] ), c2 = _mm_set1_ps( tri.edgeC[2] );
+		__m128 za = _mm_set1_ps( tri.depthA ),   zb = _mm_set1_ps( tri.depthB ),   zc = _mm_set1_ps( tri.depthC );
+
+		__m128 stepX0 = _mm_mul_ps( a0, _mm_set1_ps( 4.0f ) );
+		__m128 stepX1 = _mm_mul_ps( a1, _mm_set1_ps( 4.0f ) );
+		__m128 stepX2 = _mm_mul_ps( a2, _mm_set1_ps( 4.0f ) );
+		__m128 stepZ  = _mm_mul_ps( za, _mm_set1_ps( 4.0f ) );
+
+		__m128 px = _mm_add_ps( _mm_set1_ps( (float)minX - tri.originX ), ramp );
+
+		for( int y = minY; y <= maxY; ++y )
+		{
+			__m128 py = _mm_set1_ps( y + 0.5f - tri.originY );
+
+			// Edge and depth values at the first four pixels of the row
+			__m128 w0 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a0, px ), _mm_mul_ps( b0, py ) ), c0 );
+			__m128 w1 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a1, px ), _mm_mul_ps( b1, py ) ), c1 );
+			__m128 w2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a2, px ), _mm_mul_ps( b2, py ) ), c2 );
+			__m128 z  = _mm_add_ps( _mm_add_ps( _mm_mul_ps( za, px ), _mm_mul_ps( zb, py ) ), zc );
+
+			float* row = &r.depth[y * r.width];
+
+			for( int x = minX; x <= maxX; x += 4 )
+			{
+				__m128 inside = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( w0, zero ), _mm_cmpge_ps( w1, zero ) ),
+											_mm_cmpge_ps( w2, zero ) );
+
+				if( _mm_movemask_ps( inside ) )
+				{
+					__m128 old   = _mm_loadu_ps( row + x );
+					__m128 depth = _mm_min_ps( old, z );
+
+					_mm_storeu_ps( row + x, _mm_or_ps( _mm_and_ps( inside, depth ), _mm_andnot_ps( inside, old ) ) );
+				}
+
+				w0 = _mm_add_ps( w0, stepX0 );
+				w1 = _mm_add_ps( w1, stepX1 );
+				w2 = _mm_add_ps( w2, stepX2 );
+				z  = _mm_add_ps( z, stepZ );
+			}
+		}
+	}
+}
+
+/*
+ * Rasterizes everything added since softRasterizerBegin() into depth.
+ */
+void softRasterizerFlush( SOFTRASTERIZER& r )
+{
+	threadPoolRun( *r.pool, r.tilesX * r.tilesY, softRasterizerTile, &r );
+}
+
+/*
+ * Nearest-texel lookup with [0, 1] texture coordinates, clamped to the edge.
+ */
+float softRasterizerDepthAt( const SOFTRASTERIZER& r, float s, float t )
+{
+	int x = (int)(s * r.width);
+	int y = (int)(t * r.height);
+
+	x = x < 0 ? 0 : (x >= r.width  ? r.width  - 1 : x);
+	y = y < 0 ? 0 : (y >= r.height ? r.height - 1 : y);
+
+	return r.depth[y * r.width + x];
+}
+
+#endif // _RASTERIZER_H_
@@ -0,0 +1,575 @@
+//-----------------------------------------------------------------------------
+//           Name: raytracer.h
+//    Description: Multithreaded SSE shadow rays over a SAH bounding volume
+//                 hierarchy.
+//
+//                 An exact, alias-free reference for the shadow maps, and a
+//                 way to shadow the scene without a GPU depth pass at all.
+//                 bvhAddMesh() puts the cached meshes of mesh.h into world
+//                 space, bvhBuild() splits them top-down with the surface
+//                 area heuristic over BVH_BINS centroid bins per axis, and
+//                 rayTraceShadows() tests, for every pixel of a depth
+//                 buffer, whether the segment from the surface to the light
+//                 hits anything.
+//
+//                 Rays travel in packets of 2 x 2 pixels, one SSE lane each.
+//                 A node is entered if any live ray hits its box, and a lane
+//                 retires at its first hit, since a shadow ray doesn't need
+//                 the closest one. Bands of rows run on the thread pool and
+//                 only read the tree, so no locking is needed.
+//
+// The following functions are defined here:
+//
+// void bvhBegin(BVH& bvh);
+// void bvhAddMesh(BVH& bvh, const MESH& mesh, const float matrix[16]);
+// void bvhBuild(BVH& bvh);
+// void rayTraceShadows(THREADPOOL& pool, const BVH& bvh, const SHADOWRAYS& rays);
+//-----------------------------------------------------------------------------
+
+#ifndef _RAYTRACER_H_
+#define _RAYTRACER_H_
+
+#include <vector>
+#include <float.h>
+#include <emmintrin.h>
+#include "mesh.h"
+#include "matrix.h"
+#include "threadpool.h"
+
+const int BVH_BINS        = 16;
+const int BVH_LEAF_SIZE   = 4;		// Ranges this small are never split
+const int BVH_MAX_LEAF    = 16;		// Ranges this large are always split
+const int BVH_STACK_SIZE  = 64;
+const int SHADOW_RAY_ROWS = 16;		// Pixel rows per thread pool job, even
+
+struct BVHTRIANGLE
+{
+	float v0[3];					// Vertex 0 and the two edges leaving it
+	float e1[3];
+	float e2[3];
+};
+
+struct BVHNODE
+{
+	float bounds[2][3];				// Min, max
+	int   first;					// Leaf: first triangle, otherwise the left child
+	int   count;					// Triangles, 0 for an inner node with children first, first + 1
+};
+
+struct BVH
+{
+	std::vector<BVHTRIANGLE> triangles;		// In leaf order after bvhBuild()
+	std::vector<BVHNODE>     nodes;			// nodes[0] is the root
+	int                      depth;
+
+	// Scratch of bvhBuild(), kept to avoid reallocating every frame
+	std::vector<BVHTRIANGLE> input;
+	std::vector<float>       boxes;			// Min, max per input triangle
+	std::vector<float>       centroids;
+	std::vector<int>         order;
+};
+
+struct SHADOWRAYS
+{
+	const float*   depth;			// width * height window depth, bottom row first, 1 = background
+	int            width;
+	int            height;
+	float          inverse[16];		// Normalized device coordinates -> world
+	float          light[3];
+	float          bias;			// World distance left free at the surface end of a ray
+	unsigned char* visibility;		// width * height, 255 lit, 0 shadowed
+};
+
+void bvhBegin( BVH& bvh )
+{
+	bvh.input.clear();
+	bvh.triangles.clear();
+	bvh.nodes.clear();
+	bvh.depth = 0;
+}
+
+/*
+ * matrix takes the mesh's positions to world space.
+ */
+void bvhAddMesh( BVH& bvh, const MESH& mesh, const float matrix[16] )
+{
+	const float* m = matrix;
+
+	for( size_t i = 0; i + 2 < mesh.indices.size(); i += 3 )
+	{
+		float v[3][3];
+
+		for( int k = 0; k < 3; ++k )
+		{
+			const float* p = &mesh.positions[3 * mesh.indices[i + k]];
+
+			for( int row = 0; row < 3; ++row )
+				v[k][row] = m[row] * p[0] + m[4 + row] * p[1] + m[8 + row] * p[2] + m[12 + row];
+		}
+
+		BVHTRIANGLE triangle;
+
+		for( int a = 0; a < 3; ++a )
+		{
+			triangle.v0[a] = v[0][a];
+			triangle.e1[a] = v[1][a] - v[0][a];
+			triangle.e2[a] = v[2][a] - v[0][a];
+		}
+
+		bvh.input.push_back( triangle );
+	}
+}
+
+static float bvhArea( const float bounds[2][3] )
+{
+	float dx = bounds[1][0] - bounds[0][0];
+	float dy = bounds[1][1] - bounds[0][1];
+	float dz = bounds[1][2] - bounds[0][2];
+
+	if( dx < 0.0f || dy < 0.0f || dz < 0.0f )
+		return 0.0f;
+
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static void bvhEmpty( float bounds[2][3] )
+{
+	for( int a = 0; a < 3; ++a )
+	{
+		bounds[0][a] =  FLT_MAX;
+		bounds[1][a] = -FLT_MAX;
+	}
+}
+
+static void bvhGrow( float bounds[2][3], const float* box )
+{
+	for( int a = 0; a < 3; ++a )
+	{
+		bounds[0][a] = box[a] < bounds[0][a] ? box[a] : bounds[0][a];
+		bounds[1][a] = box[3 + a] > bounds[1][a] ? box[3 + a] : bounds[1][a];
+	}
+}
+
+/*
+ * Fills node index with the triangles order[begin, end) and splits it where
+ * the surface area heuristic is lowest.
+ */
+static void bvhSplit( BVH& bvh, int index, int begin, int end, int depth )
+{
+	float bounds[2][3];
+	float centroidBounds[2][3];
+
+	bvhEmpty( bounds );
+	bvhEmpty( centroidBounds );
+
+	for( int i = begin; i < end; ++i )
+	{
+		const float* c = &bvh.centroids[3 * bvh.order[i]];
+		float        point[6] = { c[0], c[1], c[2], c[0], c[1], c[2] };
+
+		bvhGrow( bounds, &bvh.boxes[6 * bvh.order[i]] );
+		bvhGrow( centroidBounds, point );
+	}
+
+	memcpy( bvh.nodes[index].bounds, bounds, sizeof(bounds) );
+	bvh.nodes[index].first = begin;
+	bvh.nodes[index].count = end - begin;
+
+	if( depth > bvh.depth )
+		bvh.depth = depth;
+
+	int count = end - begin;
+
+	if( count <= BVH_LEAF_SIZE || depth + 1 >= BVH_STACK_SIZE )
+		return;
+
+	// Cheapest split over all axes: area * triangles on either side
+	float bestCost = FLT_MAX;
+	int   bestAxis = -1;
+	int   bestBin  = 0;
+
+	for( int axis = 0; axis < 3; ++axis )
+	{
+		float lo     = centroidBounds[0][axis];
+		float extent = centroidBounds[1][axis] - lo;
+
+		if( extent <= 0.0f )
+			continue;
+
+		float binBounds[BVH_BINS][2][3];
+		int   binCount[BVH_BINS] = { 0 };
+		float scale = BVH_BINS / extent * 0.9999f;
+
+		for( int b = 0; b < BVH_BINS; ++b )
+			bvhEmpty( binBounds[b] );
+
+		for( int i = begin; i < end; ++i )
+		{
+			int b = (int)((bvh.centroids[3 * bvh.order[i] + axis] - lo) * scale);
+
+			++binCount[b];
+			bvhGrow( binBounds[b], &bvh.boxes[6 * bvh.order[i]] );
+		}
+
+		// Area and count left of each plane, from both sides
+		float leftArea[BVH_BINS];
+		int   leftCount[BVH_BINS];
+		float sweep[2][3];
+		int   swept = 0;
+
+		bvhEmpty( sweep );
+
+		for( int b = 0; b < BVH_BINS - 1; ++b )
+		{
+			swept += binCount[b];
+			bvhGrow( sweep, &binBounds[b][0][0] );
+			leftArea[b]  = bvhArea( sweep );
+			leftCount[b] = swept;
+		}
+
+		bvhEmpty( sweep );
+		swept = 0;
+
+		for( int b = BVH_BINS - 1; b > 0; --b )
+		{
+			swept += binCount[b];
+			bvhGrow( sweep, &binBounds[b][0][0] );
+
+			if( leftCount[b - 1] == 0 || swept == 0 )
+				continue;
+
+			float cost = leftArea[b - 1] * leftCount[b - 1] + bvhArea( sweep ) * swept;
+
+			if( cost < bestCost )
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin  = b;
+			}
+		}
+	}
+
+	// All centroids in one spot, or splitting costs more than testing them all
+	if( bestAxis < 0 || (count <= BVH_MAX_LEAF && bestCost >= bvhArea( bounds ) * count) )
+		return;
+
+	float lo    = centroidBounds[0][bestAxis];
+	float scale = BVH_BINS / (centroidBounds[1][bestAxis] - lo) * 0.9999f;
+	int   mid   = begin;
+
+	for( int i = begin; i < end; ++i )
+	{
+		if( (int)((bvh.centroids[3 * bvh.order[i] + bestAxis] - lo) * scale) < bestBin )
+		{
+			int swap       = bvh.order[i];
+			bvh.order[i]   = bvh.order[mid];
+			bvh.order[mid] = swap;
+			++mid;
+		}
+	}
+
+	int left = (int)bvh.nodes.size();
+
+	bvh.nodes[index].first = left;
+	bvh.nodes[index].count = 0;
+	bvh.nodes.resize( left + 2 );
+
+	bvhSplit( bvh, left, begin, mid, depth + 1 );
+	bvhSplit( bvh, left + 1, mid, end, depth + 1 );
+}
+
+/*
+ * Builds the tree over everything added since bvhBegin().
+ */
+void bvhBuild( BVH& bvh )
+{
+	int count = (int)bvh.input.size();
+
+	bvh.nodes.clear();
+	bvh.triangles.clear();
+	bvh.depth = 0;
+
+	if( count == 0 )
+		return;
+
+	bvh.boxes.resize( 6 * count );
+	bvh.centroids.resize( 3 * count );
+	bvh.order.resize( count );
+
+	for( int i = 0; i < count; ++i )
+	{
+		const BVHTRIANGLE& t   = bvh.input[i];
+		float*             box = &bvh.boxes[6 * i];
+
+		for( int a = 0; a < 3; ++a )
+		{
+			float v1 = t.v0[a] + t.e1[a];
+			float v2 = t.v0[a] + t.e2[a];
+
+			box[a]     = t.v0[a] < v1 ? (t.v0[a] < v2 ? t.v0[a] : v2) : (v1 < v2 ? v1 : v2);
+			box[3 + a] = t.v0[a] > v1 ? (t.v0[a] > v2 ? t.v0[a] : v2) : (v1 > v2 ? v1 : v2);
+			bvh.centroids[3 * i + a] = 0.5f * (box[a] + box[3 + a]);
+		}
+
+		bvh.order[i] = i;
+	}
+
+	bvh.nodes.reserve( 2 * count );
+	bvh.nodes.resize( 1 );
+	bvhSplit( bvh, 0, 0, count, 0 );
+
+	bvh.triangles.resize( count );
+
+	for( int i = 0; i < count; ++i )
+		bvh.triangles[i] = bvh.input[bvh.order[i]];
+}
+
+/*
+ * Lanes whose segment [tMin, tMax] passes through the node's box. Lanes
+ * with tMax < tMin never do.
+ */
+static inline int bvhPacketHitsBox( const BVHNODE& node, const __m128 origin[3], const __m128 inverse[3],
+									__m128 tMin, __m128 tMax )
+{
+	for( int a = 0; a < 3; ++a )
+	{
+		__m128 t0 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.bounds[0][a] ), origin[a] ), inverse[a] );
+		__m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.bounds[1][a] ), origin[a] ), inverse[a] );
+
+		tMin = _mm_max_ps( tMin, _mm_min_ps( t0, t1 ) );
+		tMax = _mm_min_ps( tMax, _mm_max_ps( t0, t1 ) );
+	}
+
+	return _mm_movemask_ps( _mm_cmple_ps( tMin, tMax ) );
+}
+
+/*
+ * Moller-Trumbore for one triangle against four rays. Returns the lanes
+ * that hit it inside (tMin, tMax).
+ */
+static inline __m128 bvhPacketHitsTriangle( const BVHTRIANGLE& t, const __m128 origin[3], const __m128 direction[3],
+											__m128 tMin, __m128 tMax )
+{
+	__m128 e1[3] = { _mm_set1_ps( t.e1[0] ), _mm_set1_ps( t.e1[1] ), _mm_set1_ps( t.e1[2] ) };
+	__m128 e2[3] = { _mm_set1_ps( t.e2[0] ), _mm_set1_ps( t.e2[1] ), _mm_set1_ps( t.e2[2] ) };
+
+	// p = d x e2
+	__m128 p[3] = { _mm_sub_ps( _mm_mul_ps( direction[1], e2[2] ), _mm_mul_ps( direction[2], e2[1] ) ),
+					_mm_sub_ps( _mm_mul_ps( direction[2], e2[0] ), _mm_mul_ps( direction[0], e2[2] ) ),
+					_mm_sub_ps( _mm_mul_ps( direction[0], e2[1] ), _mm_mul_ps( direction[1], e2[0] ) ) };
+
+	__m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1[0], p[0] ), _mm_mul_ps( e1[1], p[1] ) ), _mm_mul_ps( e1[2], p[2] ) );
+	__m128 inv = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+	__m128 s[3] = { _mm_sub_ps( origin[0], _mm_set1_ps( t.v0[0] ) ),
+					_mm_sub_ps( origin[1], _mm_set1_ps( t.v0[1] ) ),
+					_mm_sub_ps( origin[2], _mm_set1_ps( t.v0[2] ) ) };
+
+	__m128 u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( s[0], p[0] ), _mm_mul_ps( s[1], p[1] ) ),
+									   _mm_mul_ps( s[2], p[2] ) ), inv );
+
+	// q = s x e1
+	__m128 q[3] = { _mm_sub_ps( _mm_mul_ps( s[1], e1[2] ), _mm_mul_ps( s[2], e1[1] ) ),
+					_mm_sub_ps( _mm_mul_ps( s[2], e1[0] ), _mm_mul_ps( s[0], e1[2] ) ),
+					_mm_sub_ps( _mm_mul_ps( s[0], e1[1] ), _mm_mul_ps( s[1], e1[0] ) ) };
+
+	__m128 v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( direction[0], q[0] ), _mm_mul_ps( direction[1], q[1] ) ),
+									   _mm_mul_ps( direction[2], q[2] ) ), inv );
+	__m128 d = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2[0], q[0] ), _mm_mul_ps( e2[1], q[1] ) ),
+									   _mm_mul_ps( e2[2], q[2] ) ), inv );
+
+	// |det| > 0 also throws out the NaNs of rays parallel to the plane.
+	__m128 zero = _mm_setzero_ps();
+	__m128 hit  = _mm_cmpgt_ps( _mm_mul_ps( det, det ), _mm_set1_ps( 1e-20f ) );
+
+	hit = _mm_and_ps( hit, _mm_cmpge_ps( u, zero ) );
+	hit = _mm_and_ps( hit, _mm_cmpge_ps( v, zero ) );
+	hit = _mm_and_ps( hit, _mm_cmple_ps( _mm_add_ps( u, v ), _mm_set1_ps( 1.0f ) ) );
+	hit = _mm_and_ps( hit, _mm_cmpgt_ps( d, tMin ) );
+	hit = _mm_and_ps( hit, _mm_cmplt_ps( d, tMax ) );
+
+	return hit;
+}
+
+/*
+ * Any-hit traversal of four segments origin + t * direction, t in
+ * (tMin, tMax). Returns the mask of lanes that were blocked.
+ */
+static int bvhOccluded4( const BVH& bvh, const __m128 origin[3], const __m128 direction[3], __m128 tMin, __m128 tMax )
+{
+	__m128 inverse[3];
+
+	for( int a = 0; a < 3; ++a )
+		inverse[a] = _mm_div_ps( _mm_set1_ps( 1.0f ), direction[a] );
+
+	// A lane that has been blocked gets tMax = -1, which no box or triangle
+	// passes again.
+	__m128 retired = _mm_set1_ps( -1.0f );
+	int    live    = _mm_movemask_ps( _mm_cmplt_ps( tMin, tMax ) );
+	int    blocked = 0;
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+
+	stack[top++] = 0;
+
+	while( top > 0 && blocked != live )
+	{
+		const BVHNODE& node = bvh.nodes[stack[--top]];
+
+		if( !bvhPacketHitsBox( node, origin, inverse, tMin, tMax ) )
+			continue;
+
+		if( node.count == 0 )
+		{
+			stack[top++] = node.first;
+			stack[top++] = node.first + 1;
+			continue;
+		}
+
+		for( int i = 0; i < node.count; ++i )
+		{
+			__m128 hit = bvhPacketHitsTriangle( bvh.triangles[node.first + i], origin, direction, tMin, tMax );
+			int    mask = _mm_movemask_ps( hit );
+
+			if( mask == 0 )
+				continue;
+
+			blocked |= mask;
+			tMax     = _mm_or_ps( _mm_and_ps( hit, retired ), _mm_andnot_ps( hit, tMax ) );
+
+			if( blocked == live )
+				break;
+		}
+	}
+
+	return blocked & live;
+}
+
+struct SHADOWRAYJOB
+{
+	const BVH*        bvh;
+	const SHADOWRAYS* rays;
+};
+
+/*
+ * World position of pixel (x, y) and whether something was drawn there.
+ */
+static inline bool shadowRayUnproject( const SHADOWRAYS& rays, int x, int y, float world[3] )
+{
+	float depth = rays.depth[y * rays.width + x];
+
+	if( depth >= 1.0f )
+		return false;
+
+	float ndc[3] = { (x + 0.5f) / rays.width * 2.0f - 1.0f,
+					 (y + 0.5f) / rays.height * 2.0f - 1.0f,
+					 depth * 2.0f - 1.0f };
+	float clip[4];
+
+	matrixTransformPoint( clip, rays.inverse, ndc );
+
+	if( clip[3] == 0.0f )
+		return false;
+
+	world[0] = clip[0] / clip[3];
+	world[1] = clip[1] / clip[3];
+	world[2] = clip[2] / clip[3];
+
+	return true;
+}
+
+static void shadowRayBand( void* context, int band )
+{
+	const SHADOWRAYJOB& job  = *(const SHADOWRAYJOB*)context;
+	const SHADOWRAYS&   rays = *job.rays;
+
+	int y0 = band * SHADOW_RAY_ROWS;
+	int y1 = y0 + SHADOW_RAY_ROWS < rays.height ? y0 + SHADOW_RAY_ROWS : rays.height;
+
+	for( int y = y0; y < y1; y += 2 )
+	{
+		for( int x = 0; x < rays.width; x += 2 )
+		{
+			// 2 x 2 pixels; lanes past the right or top edge stay dead.
+			float origin[3][4];
+			float direction[3][4];
+			float tMin[4];
+			float tMax[4];
+			int   index[4];
+
+			for( int k = 0; k < 4; ++k )
+			{
+				int px = x + (k & 1);
+				int py = y + (k >> 1);
+				float world[3] = { 0.0f, 0.0f, 0.0f };
+
+				index[k] = -1;
+				tMin[k]  = 1.0f;
+				tMax[k]  = 0.0f;
+
+				if( px < rays.width && py < y1 )
+				{
+					index[k] = py * rays.width + px;
+
+					if( shadowRayUnproject( rays, px, py, world ) )
+					{
+						// t runs from the surface (0) to the light (1).
+						float length = 0.0f;
+
+						for( int a = 0; a < 3; ++a )
+						{
+							float d = rays.light[a] - world[a];
+
+							// Keeps 1 / d finite for the slab test.
+							if( d > -1e-12f && d < 1e-12f )
+								d = 1e-12f;
+
+							direction[a][k] = d;
+							length += d * d;
+						}
+
+						length  = (float)sqrt( length );
+						tMin[k] = length > rays.bias ? rays.bias / length : 1.0f;
+						tMax[k] = 1.0f;
+					}
+				}
+
+				for( int a = 0; a < 3; ++a )
+				{
+					origin[a][k] = world[a];
+
+					if( tMax[k] == 0.0f )
+						direction[a][k] = 1.0f;
+				}
+			}
+
+			__m128 o[3] = { _mm_loadu_ps( origin[0] ), _mm_loadu_ps( origin[1] ), _mm_loadu_ps( origin[2] ) };
+			__m128 d[3] = { _mm_loadu_ps( direction[0] ), _mm_loadu_ps( direction[1] ), _mm_loadu_ps( direction[2] ) };
+
+			int blocked = job.bvh->nodes.empty() ? 0 :
+						  bvhOccluded4( *job.bvh, o, d, _mm_loadu_ps( tMin ), _mm_loadu_ps( tMax ) );
+
+			for( int k = 0; k < 4; ++k )
+			{
+				if( index[k] >= 0 )
+					rays.visibility[index[k]] = (blocked & (1 << k)) ? 0 : 255;
+			}
+		}
+	}
+}
+
+/*
+ * One shadow ray per pixel of rays.depth; background pixels count as lit.
+ */
+void rayTraceShadows( THREADPOOL& pool, const BVH& bvh, const SHADOWRAYS& rays )
+{
+	SHADOWRAYJOB job;
+
+	job.bvh  = &bvh;
+	job.rays = &rays;
+
+	threadPoolRun( pool, (rays.height + SHADOW_RAY_ROWS - 1) / SHADOW_RAY_ROWS, shadowRayBand, &job );
+}
+
+#endif // _RAYTRACER_H_
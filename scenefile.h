@@ -0,0 +1,648 @@
+//-----------------------------------------------------------------------------
+//           Name: scenefile.h
+//    Description: Scene description files, for scenes far too big to be
+//                 written into renderScene().
+//
+//                 A scene is a list of meshes, a list of materials and a
+//                 list of instances, each placing one mesh with one
+//                 material at a position, a turn about Y and a scale.
+//                 Meshes 0 - 3 are always the built-in teapot, sphere,
+//                 torus and floor; the rest are imported Wavefront OBJ
+//                 files. Material 0 is always white.
+//
+//                 Scenes are authored as text (.scn) and streamed from the
+//                 compact binary form (.scb). sceneFileParseText() reads
+//                 the text, sceneFileWriteBinary() compiles it, and the
+//                 binary file is memory-mapped by sceneFileOpen(), which
+//                 reads the small mesh and material tables up front, after
+//                 which sceneFileRead() hands out the instances a chunk at
+//                 a time, so a loader can publish them as they come.
+//
+//                 Text format, one statement per line, '#' starts a comment:
+//
+//                   mesh     <name> <file.obj>
+//                   material <name> <r> <g> <b>
+//                   object   <mesh> <material> <x> <y> <z> [<yaw> [<scale>]]
+//                   grid     <mesh> <material> <columns> <rows> <spacing> <y> [<scale>]
+//
+//                 Names are teapot, sphere, torus, floor and white, or any
+//                 mesh or material declared above. Angles are in degrees,
+//                 paths relative to the .scn file. A grid is centred on the
+//                 origin with every instance turned a bit further, so a few
+//                 lines can describe hundreds of thousands of instances.
+//
+//                 Binary format, little endian:
+//
+//                   SCENEFILEHEADER
+//                   meshCount     x SCENEFILEMESH, each imported one followed
+//                                   by its positions, normals and indices
+//                   materialCount x float r, g, b
+//                   instanceCount x SCENEFILEINSTANCE
+//
+// The following functions are defined here:
+//
+// bool loadObjMesh(MESH& mesh, const char* path, char* error, int errorSize);
+// bool sceneFileParseText(SCENEDESCRIPTION& scene, const char* path, char* error, int errorSize);
+// bool sceneFileWriteBinary(const SCENEDESCRIPTION& scene, const char* path, char* error, int errorSize);
+// bool sceneFileOpen(SCENEFILE& file, const char* path, char* error, int errorSize);
+// unsigned sceneFilePrimitive(const SCENEFILE& file, unsigned index);
+// void sceneFileMesh(const SCENEFILE& file, unsigned index, MESH& mesh);
+// int sceneFileRead(SCENEFILE& file, SCENEFILEINSTANCE* instances, int maxCount);
+// void sceneFileClose(SCENEFILE& file);
+//-----------------------------------------------------------------------------
+
+#ifndef _SCENEFILE_H_
+#define _SCENEFILE_H_
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "mesh.h"
+
+//-----------------------------------------------------------------------------
+// Binary records
+//-----------------------------------------------------------------------------
+
+const char     SCENE_FILE_MAGIC[8]  = { 'O', 'G', 'L', 'S', 'C', 'E', 'N', 'E' };
+const unsigned SCENE_FILE_VERSION   = 1;
+const unsigned SCENE_FILE_MAX_INDEX = 0xFFFF;	// Meshes and materials per scene
+
+enum SCENEPRIMITIVE
+{
+	SCENE_PRIMITIVE_TEAPOT,
+	SCENE_PRIMITIVE_SPHERE,
+	SCENE_PRIMITIVE_TORUS,
+	SCENE_PRIMITIVE_FLOOR,
+	SCENE_PRIMITIVE_COUNT,
+	SCENE_PRIMITIVE_IMPORTED = SCENE_PRIMITIVE_COUNT
+};
+
+struct SCENEFILEHEADER
+{
+	char     magic[8];
+	unsigned version;
+	unsigned meshCount;
+	unsigned materialCount;
+	unsigned instanceCount;
+};
+
+struct SCENEFILEMESH
+{
+	unsigned primitive;					// SCENEPRIMITIVE
+	unsigned vertexCount;				// Imported meshes only
+	unsigned indexCount;
+};
+
+struct SCENEFILEINSTANCE
+{
+	unsigned short mesh;
+	unsigned short material;
+	float          position[3];
+	float          yaw;					// Radians
+	float          scale;
+};
+
+//-----------------------------------------------------------------------------
+// SCENEDESCRIPTION: a whole scene in memory, as parsed from text
+//-----------------------------------------------------------------------------
+
+struct SCENEDESCRIPTION
+{
+	std::vector<unsigned>          primitives;	// Per mesh
+	std::vector<MESH>              meshes;		// Empty for the built-in ones
+	std::vector<float>             materials;	// r, g, b each
+	std::vector<SCENEFILEINSTANCE> instances;
+};
+
+/*
+ * Wavefront OBJ: v, vn and f with any number of corners (fanned), other
+ * statements ignored. Every corner becomes its own vertex, and faces
+ * without normals get their face normal.
+ */
+inline bool loadObjMesh( MESH& mesh, const char* path, char* error, int errorSize )
+{
+	FILE* file = fopen( path, "r" );
+
+	if( file == NULL )
+	{
+		_snprintf( error, errorSize, "Can't open %s", path );
+		return false;
+	}
+
+	std::vector<float> positions;
+	std::vector<float> normals;
+	char               line[1024];
+
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	while( fgets( line, sizeof(line), file ) )
+	{
+		float x, y, z;
+
+		if( sscanf( line, "v %f %f %f", &x, &y, &z ) == 3 )
+		{
+			positions.push_back( x ); positions.push_back( y ); positions.push_back( z );
+		}
+		else if( sscanf( line, "vn %f %f %f", &x, &y, &z ) == 3 )
+		{
+			normals.push_back( x ); normals.push_back( y ); normals.push_back( z );
+		}
+		else if( line[0] == 'f' && line[1] == ' ' )
+		{
+			// v, v/t, v//n or v/t/n per corner, 1-based or negative
+			int   corners[64][2];
+			int   count = 0;
+			char* token = strtok( line + 2, " \t\r\n" );
+
+			while( token != NULL && count < 64 )
+			{
+				int v = 0, t = 0, n = 0;
+
+				if( sscanf( token, "%d/%d/%d", &v, &t, &n ) != 3 && sscanf( token, "%d//%d", &v, &n ) != 2 )
+				{
+					n = 0;
+					sscanf( token, "%d", &v );
+				}
+
+				corners[count][0] = v < 0 ? (int)positions.size() / 3 + v : v - 1;
+				corners[count][1] = n < 0 ? (int)normals.size() / 3 + n : n - 1;
+				++count;
+
+				token = strtok( NULL, " \t\r\n" );
+			}
+
+			for( int i = 1; i + 1 < count; ++i )
+			{
+				const int triangle[3] = { 0, i, i + 1 };
+				const float* p[3];
+
+				for( int c = 0; c < 3; ++c )
+				{
+					int v = corners[triangle[c]][0];
+
+					if( v < 0 || 3 * v + 2 >= (int)positions.size() )
+					{
+						fclose( file );
+						_snprintf( error, errorSize, "%s: face uses a vertex that doesn't exist", path );
+						return false;
+					}
+
+					p[c] = &positions[3 * v];
+				}
+
+				// Face normal for the corners that have none
+				float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+				float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+				float face[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+				float length = (float)sqrt( face[0] * face[0] + face[1] * face[1] + face[2] * face[2] );
+
+				if( length > 0.0f )
+				{
+					face[0] /= length; face[1] /= length; face[2] /= length;
+				}
+
+				for( int c = 0; c < 3; ++c )
+				{
+					int n = corners[triangle[c]][1];
+					const float* normal = (n >= 0 && 3 * n + 2 < (int)normals.size()) ? &normals[3 * n] : face;
+
+					mesh.indices.push_back( (unsigned int)(mesh.positions.size() / 3) );
+					mesh.positions.insert( mesh.positions.end(), p[c], p[c] + 3 );
+					mesh.normals.insert( mesh.normals.end(), normal, normal + 3 );
+				}
+			}
+		}
+	}
+
+	fclose( file );
+
+	if( mesh.indices.empty() )
+	{
+		_snprintf( error, errorSize, "%s has no faces", path );
+		return false;
+	}
+
+	computeMeshRadius( mesh );
+
+	return true;
+}
+
+/*
+ * Index of name in names, or -1.
+ */
+inline int sceneFileFindName( const std::vector<std::string>& names, const char* name )
+{
+	for( size_t i = 0; i < names.size(); ++i )
+	{
+		if( names[i] == name )
+			return (int)i;
+	}
+
+	return -1;
+}
+
+/*
+ * Reads a text scene. Errors name the file and line.
+ */
+inline bool sceneFileParseText( SCENEDESCRIPTION& scene, const char* path, char* error, int errorSize )
+{
+	FILE* file = fopen( path, "r" );
+
+	if( file == NULL )
+	{
+		_snprintf( error, errorSize, "Can't open %s", path );
+		return false;
+	}
+
+	// Imported meshes are found next to the scene file.
+	std::string directory = path;
+	size_t      slash     = directory.find_last_of( "/\\" );
+	directory = slash == std::string::npos ? "" : directory.substr( 0, slash + 1 );
+
+	static const char* primitiveNames[SCENE_PRIMITIVE_COUNT] = { "teapot", "sphere", "torus", "floor" };
+
+	std::vector<std::string> meshNames( primitiveNames, primitiveNames + SCENE_PRIMITIVE_COUNT );
+	std::vector<std::string> materialNames( 1, "white" );
+
+	scene.primitives.clear();
+	scene.meshes.clear();
+	scene.instances.clear();
+	scene.materials.assign( 3, 1.0f );
+
+	for( unsigned i = 0; i < SCENE_PRIMITIVE_COUNT; ++i )
+	{
+		scene.primitives.push_back( i );
+		scene.meshes.push_back( MESH() );
+	}
+
+	char line[1024];
+	int  lineNumber = 0;
+	bool ok = true;
+
+	while( ok && fgets( line, sizeof(line), file ) )
+	{
+		++lineNumber;
+
+		char* comment = strchr( line, '#' );
+
+		if( comment != NULL )
+			*comment = '\0';
+
+		char  keyword[32], name[256], other[256];
+		float v[5];
+		int   columns, rows;
+
+		if( sscanf( line, "%31s", keyword ) != 1 )
+			continue;
+
+		if( strcmp( keyword, "mesh" ) == 0 && sscanf( line, "%*s %255s %255s", name, other ) == 2 )
+		{
+			if( meshNames.size() > SCENE_FILE_MAX_INDEX )
+			{
+				_snprintf( error, errorSize, "%s(%d): too many meshes", path, lineNumber );
+				ok = false;
+				break;
+			}
+
+			scene.primitives.push_back( SCENE_PRIMITIVE_IMPORTED );
+			scene.meshes.push_back( MESH() );
+			meshNames.push_back( name );
+
+			ok = loadObjMesh( scene.meshes.back(), (directory + other).c_str(), error, errorSize );
+		}
+		else if( strcmp( keyword, "material" ) == 0 && sscanf( line, "%*s %255s %f %f %f", name, &v[0], &v[1], &v[2] ) == 4 )
+		{
+			if( materialNames.size() > SCENE_FILE_MAX_INDEX )
+			{
+				_snprintf( error, errorSize, "%s(%d): too many materials", path, lineNumber );
+				ok = false;
+				break;
+			}
+
+			scene.materials.insert( scene.materials.end(), v, v + 3 );
+			materialNames.push_back( name );
+		}
+		else if( strcmp( keyword, "object" ) == 0 || strcmp( keyword, "grid" ) == 0 )
+		{
+			bool grid = keyword[0] == 'g';
+
+			// Defaults of the optional last values
+			v[3] = 0.0f;
+			v[4] = 1.0f;
+
+			int count = grid ? sscanf( line, "%*s %255s %255s %d %d %f %f %f", name, other, &columns, &rows, &v[0], &v[1], &v[4] ) :
+							   sscanf( line, "%*s %255s %255s %f %f %f %f %f", name, other, &v[0], &v[1], &v[2], &v[3], &v[4] );
+
+			int mesh     = sceneFileFindName( meshNames, name );
+			int material = sceneFileFindName( materialNames, other );
+
+			if( count < (grid ? 6 : 5) || mesh < 0 || material < 0 || (grid && (columns <= 0 || rows <= 0)) )
+			{
+				_snprintf( error, errorSize, "%s(%d): bad %s, or unknown mesh or material", path, lineNumber, keyword );
+				ok = false;
+				break;
+			}
+
+			SCENEFILEINSTANCE instance;
+			instance.mesh     = (unsigned short)mesh;
+			instance.material = (unsigned short)material;
+			instance.scale    = v[4];
+
+			if( !grid )
+			{
+				memcpy( instance.position, v, sizeof(instance.position) );
+				instance.yaw = v[3] * 3.14159265f / 180.0f;
+				scene.instances.push_back( instance );
+				continue;
+			}
+
+			for( int row = 0; row < rows; ++row )
+			{
+				for( int column = 0; column < columns; ++column )
+				{
+					instance.position[0] = (column - 0.5f * (columns - 1)) * v[0];
+					instance.position[1] = v[1];
+					instance.position[2] = (row - 0.5f * (rows - 1)) * v[0];
+					instance.yaw         = (float)((row * columns + column) % 8) * 0.25f * 3.14159265f;
+					scene.instances.push_back( instance );
+				}
+			}
+		}
+		else
+		{
+			_snprintf( error, errorSize, "%s(%d): can't read \"%s\"", path, lineNumber, keyword );
+			ok = false;
+		}
+	}
+
+	fclose( file );
+
+	return ok;
+}
+
+/*
+ * Compiles a parsed scene to the binary form.
+ */
+inline bool sceneFileWriteBinary( const SCENEDESCRIPTION& scene, const char* path, char* error, int errorSize )
+{
+	FILE* file = fopen( path, "wb" );
+
+	if( file == NULL )
+	{
+		_snprintf( error, errorSize, "Can't write %s", path );
+		return false;
+	}
+
+	SCENEFILEHEADER header;
+	memcpy( header.magic, SCENE_FILE_MAGIC, sizeof(header.magic) );
+	header.version       = SCENE_FILE_VERSION;
+	header.meshCount     = (unsigned)scene.primitives.size();
+	header.materialCount = (unsigned)scene.materials.size() / 3;
+	header.instanceCount = (unsigned)scene.instances.size();
+
+	fwrite( &header, sizeof(header), 1, file );
+
+	for( size_t i = 0; i < scene.primitives.size(); ++i )
+	{
+		const MESH& mesh = scene.meshes[i];
+
+		SCENEFILEMESH record;
+		record.primitive   = scene.primitives[i];
+		record.vertexCount = (unsigned)mesh.positions.size() / 3;
+		record.indexCount  = (unsigned)mesh.indices.size();
+
+		fwrite( &record, sizeof(record), 1, file );
+
+		if( record.primitive == SCENE_PRIMITIVE_IMPORTED )
+		{
+			fwrite( &mesh.positions[0], sizeof(float), mesh.positions.size(), file );
+			fwrite( &mesh.normals[0], sizeof(float), mesh.normals.size(), file );
+			fwrite( &mesh.indices[0], sizeof(unsigned int), mesh.indices.size(), file );
+		}
+	}
+
+	fwrite( &scene.materials[0], sizeof(float), scene.materials.size(), file );
+
+	if( !scene.instances.empty() )
+		fwrite( &scene.instances[0], sizeof(SCENEFILEINSTANCE), scene.instances.size(), file );
+
+	bool ok = ferror( file ) == 0;
+
+	if( fclose( file ) != 0 || !ok )
+	{
+		_snprintf( error, errorSize, "Can't write %s", path );
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// SCENEFILE: a binary scene, memory-mapped
+//-----------------------------------------------------------------------------
+
+struct SCENEFILE
+{
+	HANDLE                file;
+	HANDLE                mapping;
+	const char*           data;
+	ULONGLONG             size;
+	SCENEFILEHEADER       header;
+	std::vector<size_t>   meshOffsets;	// Of each SCENEFILEMESH
+	std::vector<float>    materials;	// r, g, b each
+	size_t                instanceOffset;
+	unsigned              nextInstance;
+};
+
+inline void sceneFileClose( SCENEFILE& file )
+{
+	if( file.data != NULL )
+		UnmapViewOfFile( file.data );
+
+	if( file.mapping != NULL )
+		CloseHandle( file.mapping );
+
+	if( file.file != NULL && file.file != INVALID_HANDLE_VALUE )
+		CloseHandle( file.file );
+
+	file.file    = NULL;
+	file.mapping = NULL;
+	file.data    = NULL;
+}
+
+/*
+ * Maps the file and checks that every table fits in it. Only the tables
+ * are touched, the instances are paged in as sceneFileRead() gets there.
+ */
+inline bool sceneFileOpen( SCENEFILE& file, const char* path, char* error, int errorSize )
+{
+	file.file    = CreateFile( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	file.mapping = NULL;
+	file.data    = NULL;
+
+	LARGE_INTEGER size;
+
+	if( file.file == INVALID_HANDLE_VALUE || !GetFileSizeEx( file.file, &size ) )
+	{
+		_snprintf( error, errorSize, "Can't open %s", path );
+		sceneFileClose( file );
+		return false;
+	}
+
+	file.size = size.QuadPart;
+
+	if( file.size >= sizeof(SCENEFILEHEADER) )
+	{
+		file.mapping = CreateFileMapping( file.file, NULL, PAGE_READONLY, 0, 0, NULL );
+
+		if( file.mapping != NULL )
+			file.data = (const char*)MapViewOfFile( file.mapping, FILE_MAP_READ, 0, 0, 0 );
+	}
+
+	if( file.data == NULL )
+	{
+		_snprintf( error, errorSize, "Can't map %s", path );
+		sceneFileClose( file );
+		return false;
+	}
+
+	memcpy( &file.header, file.data, sizeof(file.header) );
+
+	const SCENEFILEHEADER& header = file.header;
+
+	if( memcmp( header.magic, SCENE_FILE_MAGIC, sizeof(header.magic) ) != 0 || header.version != SCENE_FILE_VERSION ||
+		header.meshCount < SCENE_PRIMITIVE_COUNT || header.meshCount > SCENE_FILE_MAX_INDEX + 1 ||
+		header.materialCount < 1 || header.materialCount > SCENE_FILE_MAX_INDEX + 1 )
+	{
+		_snprintf( error, errorSize, "%s is not a version %u scene file", path, SCENE_FILE_VERSION );
+		sceneFileClose( file );
+		return false;
+	}
+
+	ULONGLONG offset = sizeof(SCENEFILEHEADER);
+
+	file.meshOffsets.resize( header.meshCount );
+
+	for( unsigned i = 0; i < header.meshCount && offset <= file.size; ++i )
+	{
+		SCENEFILEMESH record;
+
+		if( offset + sizeof(record) > file.size )
+		{
+			offset = file.size + 1;
+			break;
+		}
+
+		memcpy( &record, file.data + offset, sizeof(record) );
+		file.meshOffsets[i] = (size_t)offset;
+		offset += sizeof(record);
+
+		if( record.primitive > SCENE_PRIMITIVE_IMPORTED )
+		{
+			offset = file.size + 1;
+		}
+		else if( record.primitive == SCENE_PRIMITIVE_IMPORTED )
+		{
+			// The renderers index the vertices and walk whole triangles.
+			if( record.vertexCount == 0 || record.indexCount == 0 || record.indexCount % 3 != 0 )
+			{
+				_snprintf( error, errorSize, "%s: mesh %u has no vertices or a partial triangle", path, i );
+				sceneFileClose( file );
+				return false;
+			}
+
+			offset += (ULONGLONG)record.vertexCount * 6 * sizeof(float) + (ULONGLONG)record.indexCount * sizeof(unsigned int);
+		}
+	}
+
+	ULONGLONG materialBytes = (ULONGLONG)header.materialCount * 3 * sizeof(float);
+	ULONGLONG instanceBytes = (ULONGLONG)header.instanceCount * sizeof(SCENEFILEINSTANCE);
+
+	if( offset + materialBytes + instanceBytes > file.size )
+	{
+		_snprintf( error, errorSize, "%s is truncated", path );
+		sceneFileClose( file );
+		return false;
+	}
+
+	file.materials.resize( header.materialCount * 3 );
+	memcpy( &file.materials[0], file.data + offset, (size_t)materialBytes );
+
+	file.instanceOffset = (size_t)(offset + materialBytes);
+	file.nextInstance   = 0;
+
+	return true;
+}
+
+/*
+ * Copies out the mesh data of an imported mesh (index's primitive is
+ * SCENE_PRIMITIVE_IMPORTED). sceneFileOpen() has made sure it has
+ * vertices and whole triangles.
+ */
+inline void sceneFileMesh( const SCENEFILE& file, unsigned index, MESH& mesh )
+{
+	SCENEFILEMESH record;
+	memcpy( &record, file.data + file.meshOffsets[index], sizeof(record) );
+
+	const float*        positions = (const float*)(file.data + file.meshOffsets[index] + sizeof(record));
+	const float*        normals   = positions + 3 * record.vertexCount;
+	const unsigned int* indices   = (const unsigned int*)(normals + 3 * record.vertexCount);
+
+	mesh.positions.assign( positions, positions + 3 * record.vertexCount );
+	mesh.normals.assign( normals, normals + 3 * record.vertexCount );
+	mesh.indices.assign( indices, indices + record.indexCount );
+
+	// Indices past the vertices would take the renderers out of bounds.
+	for( size_t i = 0; i < mesh.indices.size(); ++i )
+	{
+		if( mesh.indices[i] >= record.vertexCount )
+			mesh.indices[i] = 0;
+	}
+
+	computeMeshRadius( mesh );
+}
+
+/*
+ * The primitive of a mesh.
+ */
+inline unsigned sceneFilePrimitive( const SCENEFILE& file, unsigned index )
+{
+	SCENEFILEMESH record;
+	memcpy( &record, file.data + file.meshOffsets[index], sizeof(record) );
+
+	return record.primitive;
+}
+
+/*
+ * Copies up to maxCount of the next instances, 0 at the end. Out of range
+ * mesh and material indices are replaced by 0.
+ */
+inline int sceneFileRead( SCENEFILE& file, SCENEFILEINSTANCE* instances, int maxCount )
+{
+	unsigned left  = file.header.instanceCount - file.nextInstance;
+	int      count = left < (unsigned)maxCount ? (int)left : maxCount;
+
+	memcpy( instances, file.data + file.instanceOffset + (size_t)file.nextInstance * sizeof(SCENEFILEINSTANCE),
+			count * sizeof(SCENEFILEINSTANCE) );
+
+	file.nextInstance += count;
+
+	for( int i = 0; i < count; ++i )
+	{
+		if( instances[i].mesh >= file.header.meshCount )
+			instances[i].mesh = 0;
+
+		if( instances[i].material >= file.header.materialCount )
+			instances[i].material = 0;
+	}
+
+	return count;
+}
+
+#endif // _SCENEFILE_H_
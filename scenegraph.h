@@ -0,0 +1,311 @@
+//-----------------------------------------------------------------------------
+//           Name: scenegraph.h
+//    Description: The scenes as data: a tree of nodes, each with a transform
+//                 relative to its parent and optionally a mesh and a
+//                 material to draw at it.
+//
+//                 World matrices are cached. Changing a node's transform or
+//                 bounds only marks it dirty, and sceneGraphUpdate() redoes
+//                 the dirty nodes, everything below them and the bounds of
+//                 everything above them. Every node's bounds enclose its
+//                 whole subtree, so a culled node culls all its children.
+//
+//                 The graph knows nothing about what the mesh and material
+//                 IDs mean. sceneGraphCollect() only returns the drawable
+//                 nodes below the inner nodes that survive the hierarchical
+//                 cull, in an order sorted by mesh and material, for the
+//                 caller to draw. Leaves are left to the caller's own
+//                 per-object test.
+//
+//                 Children are kept as linked lists in the node array, and
+//                 the root is node 0.
+//
+// The following functions are defined here:
+//
+// void sceneGraphClear(SCENEGRAPH& graph);
+// int sceneGraphAddNode(SCENEGRAPH& graph, int parent, const float local[16], int mesh, int material, float radius);
+// void sceneGraphSetLocal(SCENEGRAPH& graph, int node, const float local[16]);
+// void sceneGraphSetRadius(SCENEGRAPH& graph, int node, float radius);
+// void sceneGraphUpdate(SCENEGRAPH& graph);
+// void sceneGraphCollect(SCENEGRAPH& graph, SCENECULL cull, std::vector<int>& draws);
+//-----------------------------------------------------------------------------
+
+#ifndef _SCENEGRAPH_H_
+#define _SCENEGRAPH_H_
+
+#include <vector>
+#include <algorithm>
+#include "matrix.h"
+
+//-----------------------------------------------------------------------------
+// SCENEGRAPH
+//-----------------------------------------------------------------------------
+
+const int SCENE_NO_MESH = -1;			// A group: transform and bounds only
+
+struct SCENENODE
+{
+	int      parent;					// -1 for the root
+	int      firstChild;
+	int      nextSibling;
+	float    local[16];					// Relative to the parent
+	float    world[16];					// Cached parent world * local
+	float    radius;					// Of the mesh, about the node's origin
+	float    bounds[4];					// World sphere of the node's own mesh
+	float    subtreeBounds[4];			// World sphere of the whole subtree
+	int      mesh;						// SCENE_NO_MESH or the caller's ID
+	int      material;					// The caller's ID
+	unsigned flags;						// The caller's
+	bool     dirty;						// local changed since sceneGraphUpdate()
+};
+
+struct SCENEGRAPH
+{
+	std::vector<SCENENODE> nodes;
+	std::vector<int>       order;		// Drawable nodes by mesh, then material
+	bool                   orderValid;
+	std::vector<unsigned char> visible;	// Scratch of sceneGraphCollect()
+};
+
+// Hierarchical cull: false if the sphere is certainly invisible.
+typedef bool (*SCENECULL)( const float center[3], float radius );
+
+/*
+ * Removes every node.
+ */
+inline void sceneGraphClear( SCENEGRAPH& graph )
+{
+	graph.nodes.clear();
+	graph.order.clear();
+	graph.orderValid = false;
+}
+
+/*
+ * Appends a node under parent (-1 only for the root) and returns its index.
+ * Children are drawn in the order they were added, all else being equal.
+ */
+inline int sceneGraphAddNode( SCENEGRAPH& graph, int parent, const float local[16], int mesh, int material, float radius )
+{
+	SCENENODE node;
+
+	memset( &node, 0, sizeof(node) );
+	memcpy( node.local, local, sizeof(node.local) );
+	node.parent      = parent;
+	node.firstChild  = -1;
+	node.nextSibling = -1;
+	node.mesh        = mesh;
+	node.material    = material;
+	node.radius      = radius;
+	node.dirty       = true;
+
+	int index = (int)graph.nodes.size();
+	graph.nodes.push_back( node );
+
+	// Appended at the end of the parent's list.
+	if( parent >= 0 )
+	{
+		int* link = &graph.nodes[parent].firstChild;
+
+		while( *link >= 0 )
+			link = &graph.nodes[*link].nextSibling;
+
+		*link = index;
+	}
+
+	graph.orderValid = false;
+
+	return index;
+}
+
+inline void sceneGraphSetLocal( SCENEGRAPH& graph, int node, const float local[16] )
+{
+	memcpy( graph.nodes[node].local, local, sizeof(graph.nodes[node].local) );
+	graph.nodes[node].dirty = true;
+}
+
+inline void sceneGraphSetRadius( SCENEGRAPH& graph, int node, float radius )
+{
+	if( graph.nodes[node].radius == radius )
+		return;
+
+	graph.nodes[node].radius = radius;
+	graph.nodes[node].dirty  = true;
+}
+
+/*
+ * out = the smallest sphere around the spheres a and b.
+ */
+inline void sceneMergeSpheres( float out[4], const float a[4], const float b[4] )
+{
+	float d[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	float distance = (float)sqrt( d[0] * d[0] + d[1] * d[1] + d[2] * d[2] );
+
+	if( distance + b[3] <= a[3] )
+	{
+		memcpy( out, a, 4 * sizeof(float) );
+		return;
+	}
+
+	if( distance + a[3] <= b[3] )
+	{
+		memcpy( out, b, 4 * sizeof(float) );
+		return;
+	}
+
+	float radius = 0.5f * (distance + a[3] + b[3]);
+	float t      = (radius - a[3]) / distance;
+
+	out[0] = a[0] + d[0] * t;
+	out[1] = a[1] + d[1] * t;
+	out[2] = a[2] + d[2] * t;
+	out[3] = radius;
+}
+
+/*
+ * Brings the subtree at index up to date. Returns whether anything in it
+ * changed, in which case its subtree bounds were recomputed.
+ */
+inline bool sceneGraphUpdateNode( SCENEGRAPH& graph, int index, bool parentMoved )
+{
+	SCENENODE& node = graph.nodes[index];
+
+	bool moved = node.dirty || parentMoved;
+
+	if( moved )
+	{
+		if( node.parent >= 0 )
+			matrixMultiply( node.world, graph.nodes[node.parent].world, node.local );
+		else
+			memcpy( node.world, node.local, sizeof(node.world) );
+
+		// The largest axis scale keeps the sphere conservative under scaling.
+		float scale = 0.0f;
+
+		for( int c = 0; c < 3; ++c )
+		{
+			const float* axis   = node.world + 4 * c;
+			float        length = (float)sqrt( axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2] );
+
+			if( length > scale )
+				scale = length;
+		}
+
+		node.bounds[0] = node.world[12];
+		node.bounds[1] = node.world[13];
+		node.bounds[2] = node.world[14];
+		node.bounds[3] = node.radius * scale;
+		node.dirty     = false;
+	}
+
+	bool changed = moved;
+
+	for( int child = node.firstChild; child >= 0; child = graph.nodes[child].nextSibling )
+		changed |= sceneGraphUpdateNode( graph, child, moved );
+
+	if( changed )
+	{
+		// A group has no extent of its own, it is just its children.
+		bool any = node.mesh != SCENE_NO_MESH;
+
+		memcpy( node.subtreeBounds, node.bounds, sizeof(node.subtreeBounds) );
+
+		for( int child = node.firstChild; child >= 0; child = graph.nodes[child].nextSibling )
+		{
+			const float* bounds = graph.nodes[child].subtreeBounds;
+
+			if( any )
+				sceneMergeSpheres( node.subtreeBounds, node.subtreeBounds, bounds );
+			else
+				memcpy( node.subtreeBounds, bounds, sizeof(node.subtreeBounds) );
+
+			any = true;
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Sort predicate of SCENEGRAPH::order.
+ */
+struct SCENEDRAWORDER
+{
+	const SCENEGRAPH* graph;
+
+	bool operator()( int a, int b ) const
+	{
+		const SCENENODE& na = graph->nodes[a];
+		const SCENENODE& nb = graph->nodes[b];
+
+		return na.mesh != nb.mesh ? na.mesh < nb.mesh : na.material < nb.material;
+	}
+};
+
+/*
+ * Recomputes the world matrices and bounds invalidated since the last call,
+ * and the draw order if nodes were added.
+ */
+inline void sceneGraphUpdate( SCENEGRAPH& graph )
+{
+	if( graph.nodes.empty() )
+		return;
+
+	sceneGraphUpdateNode( graph, 0, false );
+
+	if( graph.orderValid )
+		return;
+
+	graph.order.clear();
+
+	for( int i = 0; i < (int)graph.nodes.size(); ++i )
+	{
+		if( graph.nodes[i].mesh != SCENE_NO_MESH )
+			graph.order.push_back( i );
+	}
+
+	// Stable, so equal nodes keep the order they were added in.
+	SCENEDRAWORDER less = { &graph };
+	std::stable_sort( graph.order.begin(), graph.order.end(), less );
+
+	graph.orderValid = true;
+}
+
+/*
+ * Marks the nodes of the subtree at index that no inner node above them
+ * or at index culled.
+ */
+inline void sceneGraphCullNode( const SCENEGRAPH& graph, int index, SCENECULL cull, std::vector<unsigned char>& visible )
+{
+	const SCENENODE& node = graph.nodes[index];
+
+	if( cull != NULL && node.firstChild >= 0 && !cull( node.subtreeBounds, node.subtreeBounds[3] ) )
+		return;
+
+	visible[index] = 1;
+
+	for( int child = node.firstChild; child >= 0; child = graph.nodes[child].nextSibling )
+		sceneGraphCullNode( graph, child, cull, visible );
+}
+
+/*
+ * draws = the drawable nodes not culled with an inner node, sorted by mesh
+ * and material. The graph must be up to date. cull may be NULL.
+ */
+inline void sceneGraphCollect( SCENEGRAPH& graph, SCENECULL cull, std::vector<int>& draws )
+{
+	draws.clear();
+
+	if( graph.nodes.empty() )
+		return;
+
+	graph.visible.assign( graph.nodes.size(), 0 );
+	sceneGraphCullNode( graph, 0, cull, graph.visible );
+
+	for( size_t i = 0; i < graph.order.size(); ++i )
+	{
+		if( graph.visible[graph.order[i]] )
+			draws.push_back( graph.order[i] );
+	}
+}
+
+#endif // _SCENEGRAPH_H_
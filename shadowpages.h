@@ -0,0 +1,318 @@
+//-----------------------------------------------------------------------------
+//           Name: shadowpages.h
+//    Description: Page table and page cache of a virtual shadow map.
+//
+//                 The virtual map is a mip chain of square levels made of
+//                 pages of VIRTUAL_PAGE_SIZE texels: level 0 has
+//                 pagesPerSide^2 pages, every further level half as many on
+//                 each side, down to a single page. Only the pages some
+//                 receiver needs this frame are backed by one of the pages of
+//                 a fixed physical pool, so memory is bounded by the pool no
+//                 matter how large level 0 is.
+//
+//                 A frame goes pageCacheBeginFrame(), pageCacheRequest() for
+//                 every page the visibility prepass found, then
+//                 pageCacheUpdate(), which maps the requests to pool pages
+//                 and lists the ones that have to be rendered. A page keeps
+//                 its depth across frames until pageCacheInvalidate*() says
+//                 something inside it changed; the least recently used pages
+//                 are recycled when the pool runs out.
+//
+//                 pageCacheBuildTable() packs every level's table into one
+//                 2 * pagesPerSide x pagesPerSide RGBA8 image for the lookup
+//                 shader: level 0 on the left, the others stacked on the
+//                 right like a mip atlas, level l >= 1 starting at
+//                 (pagesPerSide, pagesPerSide - 2 * pagesPerSide / 2^l).
+//                 A texel holds the pool page's x and y and 255 in blue when
+//                 the page can be sampled.
+//
+// The following functions are defined here:
+//
+// void pageCacheInit(PAGECACHE& cache, int pagesPerSide, int poolPagesPerSide);
+// void pageCacheBeginFrame(PAGECACHE& cache);
+// void pageCacheRequest(PAGECACHE& cache, int level, int x, int y);
+// void pageCacheInvalidateAll(PAGECACHE& cache);
+// void pageCacheInvalidateRect(PAGECACHE& cache, float s0, float t0, float s1, float t1);
+// int  pageCacheUpdate(PAGECACHE& cache, int budget, std::vector<int>& render);
+// void pageCacheBuildTable(const PAGECACHE& cache, unsigned char* rgba);
+//-----------------------------------------------------------------------------
+
+#ifndef _SHADOWPAGES_H_
+#define _SHADOWPAGES_H_
+
+#include <vector>
+#include <string.h>
+
+const int VIRTUAL_PAGE_SIZE = 128;	// Texels on each side of a page
+
+struct PHYSICALPAGE
+{
+	int      page;		// Virtual page index (see pageCacheIndex()), -1 when free
+	int      level;
+	int      x;			// Virtual page coordinates at that level
+	int      y;
+	unsigned lastUsed;	// Frame the page was last requested in
+	bool     valid;		// Holds up-to-date depth
+};
+
+struct PAGECACHE
+{
+	int                        pagesPerSide;		// Level 0
+	int                        levelCount;
+	int                        poolPagesPerSide;
+	std::vector<int>           levelStart;			// First virtual page index of each level
+	std::vector<short>         table;				// Virtual page -> pool page, -1 when not resident
+	std::vector<unsigned char> requested;			// Virtual page was requested this frame
+	std::vector<PHYSICALPAGE>  pool;
+	unsigned                   frame;
+
+	// Statistics of the last pageCacheUpdate()
+	int                        requestCount;
+	int                        residentCount;
+	int                        missingCount;		// Requested, but no page or no budget left
+};
+
+/*
+ * Index of page (x, y) of a level in the table and request arrays.
+ */
+inline int pageCacheIndex( const PAGECACHE& cache, int level, int x, int y )
+{
+	return cache.levelStart[level] + y * (cache.pagesPerSide >> level) + x;
+}
+
+/*
+ * pagesPerSide must be a power of two. The pool has poolPagesPerSide^2 pages.
+ */
+void pageCacheInit( PAGECACHE& cache, int pagesPerSide, int poolPagesPerSide )
+{
+	cache.pagesPerSide     = pagesPerSide;
+	cache.poolPagesPerSide = poolPagesPerSide;
+	cache.levelCount       = 0;
+	cache.levelStart.clear();
+
+	int total = 0;
+
+	for( int side = pagesPerSide; side >= 1; side /= 2 )
+	{
+		cache.levelStart.push_back( total );
+		total += side * side;
+		++cache.levelCount;
+	}
+
+	cache.table.assign( total, (short)-1 );
+	cache.requested.assign( total, 0 );
+
+	PHYSICALPAGE empty = { -1, 0, 0, 0, 0, false };
+	cache.pool.assign( poolPagesPerSide * poolPagesPerSide, empty );
+
+	cache.frame         = 0;
+	cache.requestCount  = 0;
+	cache.residentCount = 0;
+	cache.missingCount  = 0;
+}
+
+void pageCacheBeginFrame( PAGECACHE& cache )
+{
+	++cache.frame;
+	cache.requested.assign( cache.requested.size(), 0 );
+}
+
+/*
+ * Coordinates outside the level are ignored.
+ */
+void pageCacheRequest( PAGECACHE& cache, int level, int x, int y )
+{
+	if( level < 0 || level >= cache.levelCount )
+		return;
+
+	int side = cache.pagesPerSide >> level;
+
+	if( x < 0 || y < 0 || x >= side || y >= side )
+		return;
+
+	cache.requested[pageCacheIndex( cache, level, x, y )] = 1;
+}
+
+/*
+ * Everything has to be rendered again, e.g. because the light moved. The
+ * pages stay allocated so they don't have to be found again.
+ */
+void pageCacheInvalidateAll( PAGECACHE& cache )
+{
+	for( size_t i = 0; i < cache.pool.size(); ++i )
+		cache.pool[i].valid = false;
+}
+
+/*
+ * Invalidates every resident page, at every level, that overlaps the
+ * rectangle [s0, s1] x [t0, t1] of the [0, 1]^2 map.
+ */
+void pageCacheInvalidateRect( PAGECACHE& cache, float s0, float t0, float s1, float t1 )
+{
+	for( size_t i = 0; i < cache.pool.size(); ++i )
+	{
+		PHYSICALPAGE& page = cache.pool[i];
+
+		if( page.page < 0 || !page.valid )
+			continue;
+
+		float size = 1.0f / (float)(cache.pagesPerSide >> page.level);
+		float x0   = page.x * size;
+		float y0   = page.y * size;
+
+		if( x0 <= s1 && x0 + size >= s0 && y0 <= t1 && y0 + size >= t0 )
+			page.valid = false;
+	}
+}
+
+/*
+ * Least recently used pool page that nobody asked for this frame, or -1.
+ * Free pages count as used in frame 0.
+ */
+static int pageCacheVictim( const PAGECACHE& cache )
+{
+	int      victim = -1;
+	unsigned oldest = 0;
+
+	for( size_t i = 0; i < cache.pool.size(); ++i )
+	{
+		const PHYSICALPAGE& page = cache.pool[i];
+
+		if( page.page >= 0 && cache.requested[page.page] )
+			continue;
+
+		unsigned used = page.page >= 0 ? page.lastUsed : 0;
+
+		if( victim < 0 || used < oldest )
+		{
+			victim = (int)i;
+			oldest = used;
+		}
+	}
+
+	return victim;
+}
+
+/*
+ * Maps this frame's requests to pool pages and appends the pool pages that
+ * need rendering to render, at most budget of them. Coarse levels go first,
+ * so a page that doesn't make it this frame can fall back on a coarser one
+ * that did. Returns how many pages were added.
+ */
+int pageCacheUpdate( PAGECACHE& cache, int budget, std::vector<int>& render )
+{
+	int added = 0;
+
+	cache.requestCount  = 0;
+	cache.residentCount = 0;
+	cache.missingCount  = 0;
+
+	// Touch what is already resident first, so none of it gets evicted for
+	// a page that is requested too.
+	for( size_t i = 0; i < cache.table.size(); ++i )
+	{
+		if( cache.requested[i] && cache.table[i] >= 0 )
+			cache.pool[cache.table[i]].lastUsed = cache.frame;
+	}
+
+	for( int level = cache.levelCount - 1; level >= 0; --level )
+	{
+		int side = cache.pagesPerSide >> level;
+
+		for( int y = 0; y < side; ++y )
+		{
+			for( int x = 0; x < side; ++x )
+			{
+				int index = pageCacheIndex( cache, level, x, y );
+
+				if( !cache.requested[index] )
+					continue;
+
+				++cache.requestCount;
+
+				int physical = cache.table[index];
+
+				if( physical >= 0 && cache.pool[physical].valid )
+					continue;
+
+				if( added >= budget )
+				{
+					++cache.missingCount;
+					continue;
+				}
+
+				if( physical < 0 )
+				{
+					physical = pageCacheVictim( cache );
+
+					if( physical < 0 )
+					{
+						++cache.missingCount;
+						continue;
+					}
+
+					PHYSICALPAGE& page = cache.pool[physical];
+
+					if( page.page >= 0 )
+						cache.table[page.page] = -1;
+
+					page.page     = index;
+					page.level    = level;
+					page.x        = x;
+					page.y        = y;
+					page.lastUsed = cache.frame;
+					cache.table[index] = (short)physical;
+				}
+
+				// Valid as soon as the caller has rendered it.
+				cache.pool[physical].valid = true;
+				render.push_back( physical );
+				++added;
+			}
+		}
+	}
+
+	for( size_t i = 0; i < cache.pool.size(); ++i )
+	{
+		if( cache.pool[i].page >= 0 )
+			++cache.residentCount;
+	}
+
+	return added;
+}
+
+/*
+ * rgba must hold 2 * pagesPerSide * pagesPerSide texels, bottom row first.
+ */
+void pageCacheBuildTable( const PAGECACHE& cache, unsigned char* rgba )
+{
+	int width = 2 * cache.pagesPerSide;
+
+	memset( rgba, 0, width * cache.pagesPerSide * 4 );
+
+	for( int level = 0; level < cache.levelCount; ++level )
+	{
+		int side    = cache.pagesPerSide >> level;
+		int offsetX = level == 0 ? 0 : cache.pagesPerSide;
+		int offsetY = level == 0 ? 0 : cache.pagesPerSide - 2 * side;
+
+		for( int y = 0; y < side; ++y )
+		{
+			for( int x = 0; x < side; ++x )
+			{
+				int physical = cache.table[pageCacheIndex( cache, level, x, y )];
+
+				if( physical < 0 || !cache.pool[physical].valid )
+					continue;
+
+				unsigned char* texel = rgba + ((offsetY + y) * width + offsetX + x) * 4;
+
+				texel[0] = (unsigned char)(physical % cache.poolPagesPerSide);
+				texel[1] = (unsigned char)(physical / cache.poolPagesPerSide);
+				texel[2] = 255;
+			}
+		}
+	}
+}
+
+#endif // _SHADOWPAGES_H_
@@ -0,0 +1,170 @@
+//-----------------------------------------------------------------------------
+//           Name: shadowquery.h
+//    Description: Batched lit/shadowed queries for world-space points,
+//                 answered on the CPU from a shadow map without rendering.
+//
+//                 The points come as separate x, y and z arrays (SoA) so
+//                 four of them at a time can be pushed through the shadow
+//                 texture matrix with SSE. That matrix must be the same
+//                 bias * scale * light projection * light view chain that
+//                 render() loads into GL_TEXTURE, and the test is the same
+//                 as GL_TEXTURE_LEQUAL_R_SGIX: lit when r/q <= map depth,
+//                 with the coordinates clamped to the edge like the texture.
+//
+//                 With pcfRadius > 0 each point averages the compares of the
+//                 (2 * pcfRadius + 1)^2 texels around it, giving fractional
+//                 visibility. The batch is split into chunks that run on the
+//                 thread pool.
+//
+// The following functions are defined here:
+//
+// void shadowQuery(THREADPOOL& pool, const SHADOWQUERY& query,
+//                  const float* x, const float* y, const float* z, int count, float* visibility);
+//-----------------------------------------------------------------------------
+
+#ifndef _SHADOWQUERY_H_
+#define _SHADOWQUERY_H_
+
+#include <emmintrin.h>
+#include "threadpool.h"
+
+const int SHADOW_QUERY_CHUNK = 16384;	// Points per thread pool job, a multiple of 4
+
+struct SHADOWQUERY
+{
+	const float* depth;		// width * height, bottom row first, [0, 1]
+	int          width;
+	int          height;
+	float        matrix[16];	// World position -> (s, t, r, q), column-major
+	int          pcfRadius;		// 0 = single texel
+};
+
+struct SHADOWQUERYJOB
+{
+	const SHADOWQUERY* query;
+	const float*       x;
+	const float*       y;
+	const float*       z;
+	int                count;
+	float*             visibility;
+};
+
+/*
+ * Four points: project, then compare against one or more texels each.
+ */
+static inline __m128 shadowQuery4( const SHADOWQUERY& q, __m128 px, __m128 py, __m128 pz )
+{
+	const float* m = q.matrix;
+
+	__m128 s = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[0] ), px ), _mm_mul_ps( _mm_set1_ps( m[4] ), py ) ),
+						   _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[8] ), pz ), _mm_set1_ps( m[12] ) ) );
+	__m128 t = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[1] ), px ), _mm_mul_ps( _mm_set1_ps( m[5] ), py ) ),
+						   _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[9] ), pz ), _mm_set1_ps( m[13] ) ) );
+	__m128 r = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[2] ), px ), _mm_mul_ps( _mm_set1_ps( m[6] ), py ) ),
+						   _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[10] ), pz ), _mm_set1_ps( m[14] ) ) );
+	__m128 w = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[3] ), px ), _mm_mul_ps( _mm_set1_ps( m[7] ), py ) ),
+						   _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[11] ), pz ), _mm_set1_ps( m[15] ) ) );
+
+	// Behind the light the projection flips; call those points lit.
+	__m128 front = _mm_cmpgt_ps( w, _mm_setzero_ps() );
+	__m128 one   = _mm_set1_ps( 1.0f );
+	__m128 rcp   = _mm_div_ps( one, _mm_or_ps( _mm_and_ps( front, w ), _mm_andnot_ps( front, one ) ) );
+
+	s = _mm_mul_ps( s, rcp );
+	t = _mm_mul_ps( t, rcp );
+	r = _mm_mul_ps( r, rcp );
+
+	// Texel coordinates, clamped to the edge
+	__m128 maxX = _mm_set1_ps( (float)(q.width - 1) );
+	__m128 maxY = _mm_set1_ps( (float)(q.height - 1) );
+	__m128 tx   = _mm_min_ps( _mm_max_ps( _mm_mul_ps( s, _mm_set1_ps( (float)q.width ) ), _mm_setzero_ps() ), maxX );
+	__m128 ty   = _mm_min_ps( _mm_max_ps( _mm_mul_ps( t, _mm_set1_ps( (float)q.height ) ), _mm_setzero_ps() ), maxY );
+
+	int   ix[4], iy[4];
+	float depth[4];
+
+	_mm_storeu_si128( (__m128i*)ix, _mm_cvttps_epi32( tx ) );
+	_mm_storeu_si128( (__m128i*)iy, _mm_cvttps_epi32( ty ) );
+
+	int   radius = q.pcfRadius;
+	float taps   = (float)((2 * radius + 1) * (2 * radius + 1));
+	__m128 sum   = _mm_setzero_ps();
+
+	for( int dy = -radius; dy <= radius; ++dy )
+	{
+		for( int dx = -radius; dx <= radius; ++dx )
+		{
+			for( int i = 0; i < 4; ++i )
+			{
+				int x = ix[i] + dx;
+				int y = iy[i] + dy;
+
+				x = x < 0 ? 0 : (x >= q.width  ? q.width  - 1 : x);
+				y = y < 0 ? 0 : (y >= q.height ? q.height - 1 : y);
+
+				depth[i] = q.depth[y * q.width + x];
+			}
+
+			sum = _mm_add_ps( sum, _mm_and_ps( _mm_cmple_ps( r, _mm_loadu_ps( depth ) ), one ) );
+		}
+	}
+
+	__m128 visibility = _mm_div_ps( sum, _mm_set1_ps( taps ) );
+	visibility = _mm_or_ps( _mm_and_ps( front, visibility ), _mm_andnot_ps( front, one ) );
+
+	return visibility;
+}
+
+static void shadowQueryChunk( void* context, int chunk )
+{
+	const SHADOWQUERYJOB& job = *(const SHADOWQUERYJOB*)context;
+
+	int begin = chunk * SHADOW_QUERY_CHUNK;
+	int end   = begin + SHADOW_QUERY_CHUNK < job.count ? begin + SHADOW_QUERY_CHUNK : job.count;
+	int i     = begin;
+
+	for( ; i + 4 <= end; i += 4 )
+	{
+		__m128 v = shadowQuery4( *job.query, _mm_loadu_ps( job.x + i ), _mm_loadu_ps( job.y + i ), _mm_loadu_ps( job.z + i ) );
+		_mm_storeu_ps( job.visibility + i, v );
+	}
+
+	// Tail: pad the last few points to a full register.
+	if( i < end )
+	{
+		float x[4] = { 0.0f }, y[4] = { 0.0f }, z[4] = { 0.0f }, v[4];
+
+		for( int k = 0; i + k < end; ++k )
+		{
+			x[k] = job.x[i + k];
+			y[k] = job.y[i + k];
+			z[k] = job.z[i + k];
+		}
+
+		_mm_storeu_ps( v, shadowQuery4( *job.query, _mm_loadu_ps( x ), _mm_loadu_ps( y ), _mm_loadu_ps( z ) ) );
+
+		for( int k = 0; i + k < end; ++k )
+			job.visibility[i + k] = v[k];
+	}
+}
+
+/*
+ * visibility[i] = 1 when point i is lit, 0 when it is in shadow, in between
+ * at PCF-filtered edges.
+ */
+void shadowQuery( THREADPOOL& pool, const SHADOWQUERY& query,
+				  const float* x, const float* y, const float* z, int count, float* visibility )
+{
+	SHADOWQUERYJOB job;
+
+	job.query      = &query;
+	job.x          = x;
+	job.y          = y;
+	job.z          = z;
+	job.count      = count;
+	job.visibility = visibility;
+
+	threadPoolRun( pool, (count + SHADOW_QUERY_CHUNK - 1) / SHADOW_QUERY_CHUNK, shadowQueryChunk, &job );
+}
+
+#endif // _SHADOWQUERY_H_
@@ -0,0 +1,391 @@
+//-----------------------------------------------------------------------------
+//           Name: shadowwarp.h
+//    Description: Trapezoidal shadow map (TSM) warp of the light's
+//                 post-perspective space.
+//
+//                 A plain shadow map spends as many texels on the far end of
+//                 the view frustum as on the part right in front of the
+//                 eye. Seen from the light, the view frustum projects to a
+//                 shape that is narrow at the eye and wide far away; TSM
+//                 bounds it with a trapezoid whose top edge is on the eye's
+//                 side and maps that trapezoid onto the whole map with a 2D
+//                 perspective transform. The texels then get denser towards
+//                 the eye, and a focus point chosen along the view direction
+//                 lands at 80% of the map's height.
+//
+//                 Because the warp is applied after the light's perspective
+//                 divide, it works for the spot-like point light as well as
+//                 for a directional one. It is returned as a 4x4 matrix to
+//                 multiply onto the light projection, so the depth pass and
+//                 the texture matrix only need the product. x, y and w get
+//                 the 2D transform; z is only scaled, which keeps r/q in
+//                 [-1, 1] and monotonic along every light ray, which is all
+//                 a depth comparison needs.
+//
+// The following functions are defined here:
+//
+// bool trapezoidWarp(float warp[16], const float lightMatrix[16],
+//                    const float corners[8][3], const float focus[3]);
+//-----------------------------------------------------------------------------
+
+#ifndef _SHADOWWARP_H_
+#define _SHADOWWARP_H_
+
+#include <math.h>
+#include "matrix.h"
+
+const float TSM_FOCUS_LINE = -0.6f;	// xi of the paper: the focus point ends up at 80%
+const int   TSM_MAX_POINTS = 32;	// Hull of up to 24 points, plus what the clip adds
+
+/*
+ * Light clip space -> NDC x, y
+ */
+static void warpProject( const float clip[4], float out[2] )
+{
+	out[0] = clip[0] / clip[3];
+	out[1] = clip[1] / clip[3];
+}
+
+/*
+ * Clips the clip-space segment a-b to the light's near plane (z >= -w) and
+ * returns its ends in NDC. False if it lies completely behind.
+ */
+static bool warpProjectSegment( const float a[4], const float b[4], float outA[2], float outB[2] )
+{
+	float da = a[2] + a[3];
+	float db = b[2] + b[3];
+
+	if( da < 0.0f && db < 0.0f )
+		return false;
+
+	float p[4], q[4];
+
+	for( int k = 0; k < 4; ++k )
+	{
+		p[k] = da >= 0.0f ? a[k] : a[k] + da / (da - db) * (b[k] - a[k]);
+		q[k] = db >= 0.0f ? b[k] : a[k] + da / (da - db) * (b[k] - a[k]);
+	}
+
+	warpProject( p, outA );
+	warpProject( q, outB );
+	return true;
+}
+
+static float warpCross( const float o[2], const float a[2], const float b[2] )
+{
+	return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+}
+
+/*
+ * Convex hull of count points (monotone chain), counter-clockwise.
+ */
+static int warpConvexHull( float points[][2], int count, float hull[][2] )
+{
+	// Insertion sort by x, then y
+	for( int i = 1; i < count; ++i )
+	{
+		float p[2] = { points[i][0], points[i][1] };
+		int   j    = i;
+
+		for( ; j > 0 && (points[j - 1][0] > p[0] || (points[j - 1][0] == p[0] && points[j - 1][1] > p[1])); --j )
+		{
+			points[j][0] = points[j - 1][0];
+			points[j][1] = points[j - 1][1];
+		}
+
+		points[j][0] = p[0];
+		points[j][1] = p[1];
+	}
+
+	int n = 0;
+
+	// Lower hull, then upper hull
+	for( int i = 0; i < count; ++i )
+	{
+		while( n >= 2 && warpCross( hull[n - 2], hull[n - 1], points[i] ) <= 0.0f )
+			--n;
+		hull[n][0] = points[i][0];
+		hull[n][1] = points[i][1];
+		++n;
+	}
+
+	for( int i = count - 2, lower = n + 1; i >= 0; --i )
+	{
+		while( n >= lower && warpCross( hull[n - 2], hull[n - 1], points[i] ) <= 0.0f )
+			--n;
+		hull[n][0] = points[i][0];
+		hull[n][1] = points[i][1];
+		++n;
+	}
+
+	return n - 1;	// The last point repeats the first
+}
+
+/*
+ * Clips a convex polygon to the light's [-1, 1]^2 (Sutherland-Hodgman).
+ */
+static int warpClipToSquare( float polygon[][2], int count )
+{
+	for( int edge = 0; edge < 4 && count > 0; ++edge )
+	{
+		int   axis = edge / 2;
+		float sign = (edge & 1) ? -1.0f : 1.0f;	// x >= -1, x <= 1, y >= -1, y <= 1
+		float in[TSM_MAX_POINTS + 8][2];
+		int   n = count;
+
+		for( int i = 0; i < n; ++i )
+		{
+			in[i][0] = polygon[i][0];
+			in[i][1] = polygon[i][1];
+		}
+
+		count = 0;
+
+		for( int i = 0; i < n; ++i )
+		{
+			const float* a = in[i];
+			const float* b = in[(i + 1) % n];
+			float da = 1.0f + sign * a[axis];
+			float db = 1.0f + sign * b[axis];
+
+			if( da >= 0.0f && count < TSM_MAX_POINTS + 8 )
+			{
+				polygon[count][0] = a[0];
+				polygon[count][1] = a[1];
+				++count;
+			}
+
+			if( (da >= 0.0f) != (db >= 0.0f) && count < TSM_MAX_POINTS + 8 )
+			{
+				float t = da / (da - db);
+
+				polygon[count][0] = a[0] + t * (b[0] - a[0]);
+				polygon[count][1] = a[1] + t * (b[1] - a[1]);
+				++count;
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+ * 3x3 (row-major) perspective transform taking the unit square's corners
+ * (0,0), (1,0), (1,1), (0,1) to quad[0..3] (Heckbert). False if degenerate.
+ */
+static bool warpSquareToQuad( const float quad[4][2], float m[9] )
+{
+	float sx  = quad[0][0] - quad[1][0] + quad[2][0] - quad[3][0];
+	float sy  = quad[0][1] - quad[1][1] + quad[2][1] - quad[3][1];
+	float dx1 = quad[1][0] - quad[2][0];
+	float dx2 = quad[3][0] - quad[2][0];
+	float dy1 = quad[1][1] - quad[2][1];
+	float dy2 = quad[3][1] - quad[2][1];
+	float det = dx1 * dy2 - dx2 * dy1;
+
+	if( fabs( det ) < 1e-12f )
+		return false;
+
+	float g = (sx * dy2 - dx2 * sy) / det;
+	float h = (dx1 * sy - sx * dy1) / det;
+
+	m[0] = quad[1][0] - quad[0][0] + g * quad[1][0];
+	m[1] = quad[3][0] - quad[0][0] + h * quad[3][0];
+	m[2] = quad[0][0];
+	m[3] = quad[1][1] - quad[0][1] + g * quad[1][1];
+	m[4] = quad[3][1] - quad[0][1] + h * quad[3][1];
+	m[5] = quad[0][1];
+	m[6] = g;
+	m[7] = h;
+	m[8] = 1.0f;
+
+	return true;
+}
+
+/*
+ * Computes the warp for the world-space view frustum corners (0-3 on the
+ * near plane, 4-7 on the far plane) seen through lightMatrix (light
+ * projection * light view). focus is a world-space point on the view axis
+ * that should get 80% of the map between itself and the near plane.
+ *
+ * Only the part of the frustum in front of the light counts. Returns
+ * false, leaving warp alone, when no useful trapezoid exists: nothing of
+ * the frustum is in front of the light, the light looks along the view
+ * direction, or the focus point is already far enough down the map.
+ */
+bool trapezoidWarp( float warp[16], const float lightMatrix[16],
+					const float corners[8][3], const float focus[3] )
+{
+	static const int edges[12][2] =
+	{
+		{ 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 },
+		{ 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 },
+		{ 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+	};
+
+	float clip[8][4];
+	float center[2][4];		// Near and far plane centres
+	float focusClip[4];
+
+	memset( center, 0, sizeof(center) );
+
+	for( int i = 0; i < 8; ++i )
+	{
+		matrixTransformPoint( clip[i], lightMatrix, corners[i] );
+
+		for( int k = 0; k < 4; ++k )
+			center[i / 4][k] += 0.25f * clip[i][k];
+	}
+
+	matrixTransformPoint( focusClip, lightMatrix, focus );
+
+	// The part of the frustum in front of the light: its edges clipped to
+	// the light's near plane, projected. Each edge adds at most two points.
+	float points[24][2];
+	int   pointCount = 0;
+
+	for( int e = 0; e < 12; ++e )
+	{
+		if( warpProjectSegment( clip[edges[e][0]], clip[edges[e][1]], points[pointCount], points[pointCount + 1] ) )
+			pointCount += 2;
+	}
+
+	float nearCenter[2];
+	float farCenter[2];
+
+	if( pointCount < 3 || focusClip[2] + focusClip[3] < 0.0f ||
+		!warpProjectSegment( center[0], center[1], nearCenter, farCenter ) )
+		return false;
+
+	float focusPoint[2];
+	warpProject( focusClip, focusPoint );
+
+	// Its outline in the light's image, limited to what the map covers
+	float polygon[TSM_MAX_POINTS + 8][2];
+	int   count = warpConvexHull( points, pointCount, polygon );
+	count = warpClipToSquare( polygon, count );
+
+	if( count < 3 )
+		return false;
+
+	// Centre line from the eye's side to the far side, and its normal
+	float u[2] = { farCenter[0] - nearCenter[0], farCenter[1] - nearCenter[1] };
+	float length = (float)sqrt( u[0] * u[0] + u[1] * u[1] );
+
+	if( length < 1e-3f )
+		return false;
+
+	u[0] /= length;
+	u[1] /= length;
+
+	float v[2] = { -u[1], u[0] };
+
+	// Top and base lines: perpendicular to the centre line, touching the outline
+	float top  =  1e30f;
+	float base = -1e30f;
+
+	for( int i = 0; i < count; ++i )
+	{
+		float t = (polygon[i][0] - nearCenter[0]) * u[0] + (polygon[i][1] - nearCenter[1]) * u[1];
+		top  = t < top  ? t : top;
+		base = t > base ? t : base;
+	}
+
+	float lambda = base - top;
+	float delta  = (focusPoint[0] - nearCenter[0]) * u[0] + (focusPoint[1] - nearCenter[1]) * u[1] - top;
+
+	if( lambda < 1e-4f )
+		return false;
+
+	if( delta < 0.01f * lambda )
+		delta = 0.01f * lambda;
+
+	// Distance from the top line back to the vanishing point q that sends
+	// the focus point to TSM_FOCUS_LINE.
+	float xi          = TSM_FOCUS_LINE;
+	float denominator = lambda - 2.0f * delta - lambda * xi;
+
+	if( denominator <= 1e-6f )
+		return false;
+
+	float eta = (lambda * delta + lambda * delta * xi) / denominator;
+	float q[2] = { nearCenter[0] + (top - eta) * u[0], nearCenter[1] + (top - eta) * u[1] };
+
+	// Side lines: through q, tangent to the outline
+	float slopeMin =  1e30f;
+	float slopeMax = -1e30f;
+
+	for( int i = 0; i < count; ++i )
+	{
+		float du = (polygon[i][0] - q[0]) * u[0] + (polygon[i][1] - q[1]) * u[1];
+		float dv = (polygon[i][0] - q[0]) * v[0] + (polygon[i][1] - q[1]) * v[1];
+		float slope = dv / du;
+
+		slopeMin = slope < slopeMin ? slope : slopeMin;
+		slopeMax = slope > slopeMax ? slope : slopeMax;
+	}
+
+	// Trapezoid: top edge on the eye's side, then the base edge
+	float trapezoid[4][2];
+	float distance[4] = { eta, eta, eta + lambda, eta + lambda };
+	float slope[4]    = { slopeMin, slopeMax, slopeMax, slopeMin };
+
+	for( int i = 0; i < 4; ++i )
+	{
+		trapezoid[i][0] = q[0] + distance[i] * (u[0] + slope[i] * v[0]);
+		trapezoid[i][1] = q[1] + distance[i] * (u[1] + slope[i] * v[1]);
+	}
+
+	// Trapezoid -> unit square is the inverse (adjugate) of square -> trapezoid.
+	float s[9];
+
+	if( !warpSquareToQuad( trapezoid, s ) )
+		return false;
+
+	float h[9] =
+	{
+		s[4] * s[8] - s[5] * s[7], s[2] * s[7] - s[1] * s[8], s[1] * s[5] - s[2] * s[4],
+		s[5] * s[6] - s[3] * s[8], s[0] * s[8] - s[2] * s[6], s[2] * s[3] - s[0] * s[5],
+		s[3] * s[7] - s[4] * s[6], s[1] * s[6] - s[0] * s[7], s[0] * s[4] - s[1] * s[3]
+	};
+
+	// Unit square -> [-1, 1]^2
+	for( int column = 0; column < 3; ++column )
+	{
+		h[column]     = 2.0f * h[column]     - h[6 + column];
+		h[3 + column] = 2.0f * h[3 + column] - h[6 + column];
+	}
+
+	// Keep w' positive inside the trapezoid, and find its smallest w'/w there.
+	float centerW = 0.0f;
+
+	for( int i = 0; i < 4; ++i )
+		centerW += h[6] * trapezoid[i][0] + h[7] * trapezoid[i][1] + h[8];
+
+	float sign  = centerW < 0.0f ? -1.0f : 1.0f;
+	float minW  = 1e30f;
+
+	for( int i = 0; i < 9; ++i )
+		h[i] *= sign;
+
+	for( int i = 0; i < 4; ++i )
+	{
+		float w = h[6] * trapezoid[i][0] + h[7] * trapezoid[i][1] + h[8];
+		minW = w < minW ? w : minW;
+	}
+
+	if( minW <= 0.0f )
+		return false;
+
+	// Embed into 4x4 acting on clip-space (x, y, z, w), column-major.
+	// z' = minW * z keeps |z' / w'| <= |z / w| everywhere in the trapezoid.
+	memset( warp, 0, 16 * sizeof(float) );
+	warp[0] = h[0]; warp[4] = h[1]; warp[12] = h[2];
+	warp[1] = h[3]; warp[5] = h[4]; warp[13] = h[5];
+	warp[10] = minW;
+	warp[3] = h[6]; warp[7] = h[7]; warp[15] = h[8];
+
+	return true;
+}
+
+#endif // _SHADOWWARP_H_
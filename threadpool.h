@@ -0,0 +1,164 @@
+//-----------------------------------------------------------------------------
+//           Name: threadpool.h
+//    Description: A minimal fork/join thread pool for the CPU-side passes.
+//
+//                 The workers are created once and sleep between runs.
+//                 threadPoolRun() hands out job indices [0, jobCount) one at
+//                 a time through an atomic counter, helps with the work on
+//                 the calling thread and returns when every job is done, so
+//                 callers never see the threads.
+//
+// The following functions are defined here:
+//
+// void threadPoolCreate(THREADPOOL& pool, int threadCount);
+// void threadPoolRun(THREADPOOL& pool, int jobCount, THREADJOB job, void* context);
+// void threadPoolDestroy(THREADPOOL& pool);
+// int  threadPoolSize(const THREADPOOL& pool);
+//-----------------------------------------------------------------------------
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+typedef void (*THREADJOB)( void* context, int index );
+
+struct THREADPOOL
+{
+	std::vector<std::thread*> threads;     // Workers, the caller is one more
+	std::mutex                mutex;
+	std::condition_variable   wake;        // Signalled when a run starts
+	std::condition_variable   done;        // Signalled when the last worker finishes
+	THREADJOB                 job;
+	void*                     context;
+	int                       jobCount;
+	std::atomic<int>          nextJob;
+	int                       busyWorkers; // Workers still inside the current run
+	unsigned int              generation;  // Bumped by every run
+	bool                      quit;
+};
+
+/*
+ * Runs jobs of the current generation until none are left.
+ */
+static void threadPoolDrain( THREADPOOL* pool )
+{
+	for( int i = pool->nextJob++; i < pool->jobCount; i = pool->nextJob++ )
+		pool->job( pool->context, i );
+}
+
+static void threadPoolWorker( THREADPOOL* pool )
+{
+	unsigned int seen = 0;
+
+	for( ;; )
+	{
+		{
+			std::unique_lock<std::mutex> lock( pool->mutex );
+
+			while( !pool->quit && pool->generation == seen )
+				pool->wake.wait( lock );
+
+			if( pool->quit )
+				return;
+
+			seen = pool->generation;
+		}
+
+		threadPoolDrain( pool );
+
+		{
+			std::lock_guard<std::mutex> lock( pool->mutex );
+
+			if( --pool->busyWorkers == 0 )
+				pool->done.notify_all();
+		}
+	}
+}
+
+/*
+ * threadCount <= 0 uses one thread per hardware thread. The calling thread
+ * counts as one of them.
+ */
+void threadPoolCreate( THREADPOOL& pool, int threadCount )
+{
+	if( threadCount <= 0 )
+		threadCount = (int)std::thread::hardware_concurrency();
+
+	pool.job         = NULL;
+	pool.context     = NULL;
+	pool.jobCount    = 0;
+	pool.nextJob     = 0;
+	pool.busyWorkers = 0;
+	pool.generation  = 0;
+	pool.quit        = false;
+
+	for( int i = 1; i < threadCount; ++i )
+		pool.threads.push_back( new std::thread( threadPoolWorker, &pool ) );
+}
+
+/*
+ * Calls job(context, i) for every i in [0, jobCount), spread over the
+ * workers and the calling thread, and waits for all of them.
+ */
+void threadPoolRun( THREADPOOL& pool, int jobCount, THREADJOB job, void* context )
+{
+	if( pool.threads.empty() || jobCount <= 1 )
+	{
+		for( int i = 0; i < jobCount; ++i )
+			job( context, i );
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( pool.mutex );
+
+		pool.job         = job;
+		pool.context     = context;
+		pool.jobCount    = jobCount;
+		pool.nextJob     = 0;
+		pool.busyWorkers = (int)pool.threads.size();
+		++pool.generation;
+	}
+
+	pool.wake.notify_all();
+
+	threadPoolDrain( &pool );
+
+	std::unique_lock<std::mutex> lock( pool.mutex );
+
+	while( pool.busyWorkers > 0 )
+		pool.done.wait( lock );
+}
+
+void threadPoolDestroy( THREADPOOL& pool )
+{
+	{
+		std::lock_guard<std::mutex> lock( pool.mutex );
+		pool.quit = true;
+	}
+
+	pool.wake.notify_all();
+
+	for( size_t i = 0; i < pool.threads.size(); ++i )
+	{
+		pool.threads[i]->join();
+		delete pool.threads[i];
+	}
+
+	pool.threads.clear();
+}
+
+/*
+ * Number of threads a run is spread over, including the caller.
+ */
+int threadPoolSize( const THREADPOOL& pool )
+{
+	return (int)pool.threads.size() + 1;
+}
+
+#endif // _THREADPOOL_H_